@@ -0,0 +1,60 @@
+//
+// Copyright: (c) 2015 by Petr Zemek <s3rvac@gmail.com>
+// License:   BSD, see LICENSE for more details
+//
+
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "flat_map.h"
+
+class Person {
+public:
+    Person(): age(0) {} // Because of m[3] below.
+
+    Person(const std::string &name, int age):
+        name(name), age(age) {}
+
+    // Unlike in std::map, persons are moved around when other persons are
+    // inserted before them, so these cannot be deleted.
+    // Person(Person &&) = delete;
+    // Person &operator=(Person &&) = delete;
+
+    // ...
+
+private:
+    std::string name;
+    int age;
+};
+
+int main() {
+    flat_map<int, Person> m;
+
+    // Needs Person::Person(const Person &) or Person::Person(Person &&).
+    m.insert({1, Person("Fred Astaire", 88)});
+
+    // Needs Person::Person(const Person &) or Person::Person(Person &&).
+    m.emplace(2, Person("Ginger Rogers", 83));
+
+    // Constructs the person from the arguments, but just like the other
+    // persons, it may be moved later.
+    m.emplace(
+        std::piecewise_construct,
+        std::forward_as_tuple(4),
+        std::forward_as_tuple("Gene Kelly", 83)
+    );
+
+    // Needs Person::Person().
+    m[3] = Person("Cyd Charisse", 86);
+
+    // A map that is read constantly and rarely updated can be filled at once
+    // (which is much faster than inserting the persons one by one) and then
+    // frozen (any later insertion or erasure throws std::logic_error).
+    std::vector<std::pair<int, Person>> persons;
+    persons.emplace_back(5, Person("Debbie Reynolds", 84));
+    persons.emplace_back(6, Person("Donald O'Connor", 78));
+    flat_map<int, Person> registry(persons.begin(), persons.end());
+    registry.freeze();
+}
@@ -0,0 +1,284 @@
+//
+// Copyright: (c) 2015 by Petr Zemek <s3rvac@gmail.com>
+// License:   BSD, see LICENSE for more details
+//
+
+#ifndef FLAT_MAP_H
+#define FLAT_MAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// A map that keeps its key-value pairs in a sorted std::vector instead of in
+// nodes of a tree (like std::map does).
+//
+// Lookups are binary searches over contiguous memory, and iteration walks the
+// vector, so both are much friendlier to the cache than following pointers
+// between nodes. The price is insertion and erasure in the middle, which have
+// to shift all the following pairs (linear time instead of logarithmic). This
+// suits maps that are read constantly and rarely updated, especially when
+// they are filled all at once (see load()) and then frozen (see freeze()).
+//
+// The interface mimics std::map, including what the insertion idioms need
+// from the mapped type:
+//
+//  - insert({1, Person("Fred Astaire", 88)}) copies or moves the given pair,
+//  - emplace(1, Person("Fred Astaire", 88)) moves (or copies) the person,
+//  - emplace(std::piecewise_construct, std::forward_as_tuple(1),
+//    std::forward_as_tuple("Fred Astaire", 88)) constructs the person from
+//    the given arguments,
+//  - m[1] default-constructs a person when there is none with the key.
+//
+// Unlike std::map, however, the pairs live in a vector, so inserting or
+// erasing a pair in the middle moves the pairs after it. The mapped type thus
+// always has to be move-constructible and move-assignable (or copyable), even
+// with the piecewise construction.
+//
+// Another difference is that value_type is std::pair<Key, T> (not
+// std::pair<const Key, T>) so that the pairs can be moved around. Changing
+// the key of a pair via an iterator breaks the order of the map, so don't.
+// Iterators (and references) are invalidated by every insertion and erasure.
+template <typename Key, typename T, typename Compare = std::less<Key>>
+class flat_map {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<Key, T>;
+    using key_compare = Compare;
+    using size_type = std::size_t;
+    using container_type = std::vector<value_type>;
+    using iterator = typename container_type::iterator;
+    using const_iterator = typename container_type::const_iterator;
+
+    flat_map() = default;
+
+    explicit flat_map(const Compare &comp): comp(comp) {}
+
+    // Creates a map with pairs from the given range (see load()).
+    template <typename InputIterator>
+    flat_map(InputIterator first, InputIterator last,
+            const Compare &comp = Compare()): comp(comp) {
+        load(first, last);
+    }
+
+    flat_map(std::initializer_list<value_type> values,
+            const Compare &comp = Compare()): comp(comp) {
+        load(values.begin(), values.end());
+    }
+
+    iterator begin() { return pairs.begin(); }
+    const_iterator begin() const { return pairs.begin(); }
+    const_iterator cbegin() const { return pairs.cbegin(); }
+    iterator end() { return pairs.end(); }
+    const_iterator end() const { return pairs.end(); }
+    const_iterator cend() const { return pairs.cend(); }
+
+    bool empty() const { return pairs.empty(); }
+    size_type size() const { return pairs.size(); }
+    size_type capacity() const { return pairs.capacity(); }
+    void reserve(size_type n) { pairs.reserve(n); }
+
+    key_compare key_comp() const { return comp; }
+
+    iterator find(const Key &key) {
+        auto it = lower_bound(key);
+        return it != end() && !comp(key, it->first) ? it : end();
+    }
+
+    const_iterator find(const Key &key) const {
+        auto it = lower_bound(key);
+        return it != end() && !comp(key, it->first) ? it : end();
+    }
+
+    size_type count(const Key &key) const {
+        return find(key) != end() ? 1 : 0;
+    }
+
+    iterator lower_bound(const Key &key) {
+        return std::lower_bound(begin(), end(), key, KeyComp{comp});
+    }
+
+    const_iterator lower_bound(const Key &key) const {
+        return std::lower_bound(begin(), end(), key, KeyComp{comp});
+    }
+
+    iterator upper_bound(const Key &key) {
+        return std::upper_bound(begin(), end(), key, KeyComp{comp});
+    }
+
+    const_iterator upper_bound(const Key &key) const {
+        return std::upper_bound(begin(), end(), key, KeyComp{comp});
+    }
+
+    T &at(const Key &key) {
+        auto it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("flat_map::at");
+        }
+        return it->second;
+    }
+
+    const T &at(const Key &key) const {
+        auto it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("flat_map::at");
+        }
+        return it->second;
+    }
+
+    // Needs T::T() when there is no pair with the key (just like std::map).
+    T &operator[](const Key &key) {
+        return try_emplace(key)->second;
+    }
+
+    T &operator[](Key &&key) {
+        return try_emplace(std::move(key))->second;
+    }
+
+    std::pair<iterator, bool> insert(const value_type &value) {
+        auto it = lower_bound(value.first);
+        if (it != end() && !comp(value.first, it->first)) {
+            return {it, false};
+        }
+        check_not_frozen();
+        return {pairs.insert(it, value), true};
+    }
+
+    std::pair<iterator, bool> insert(value_type &&value) {
+        auto it = lower_bound(value.first);
+        if (it != end() && !comp(value.first, it->first)) {
+            return {it, false};
+        }
+        check_not_frozen();
+        return {pairs.insert(it, std::move(value)), true};
+    }
+
+    // Inserts pairs from the given range. Pairs whose keys are already in
+    // the map are skipped. For more than a few pairs, this is much faster
+    // than inserting them one by one (see load()).
+    template <typename InputIterator>
+    void insert(InputIterator first, InputIterator last) {
+        load(first, last);
+    }
+
+    // Constructs a pair from the given arguments and inserts it when its key
+    // is not in the map yet. Just like std::map::emplace(), the pair is
+    // constructed before its key can be looked up.
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&... args) {
+        return insert(value_type(std::forward<Args>(args)...));
+    }
+
+    // Erases the pair with the given key. Returns the number of erased pairs.
+    size_type erase(const Key &key) {
+        auto it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    iterator erase(const_iterator pos) {
+        check_not_frozen();
+        return pairs.erase(pos);
+    }
+
+    void clear() {
+        check_not_frozen();
+        pairs.clear();
+    }
+
+    // Inserts pairs from the given range at once: they are appended, sorted,
+    // and merged with the pairs that are already in the map, which takes
+    // O(n log n) time instead of the O(n^2) of inserting them one by one.
+    // Just like with insert(), a pair whose key is already in the map (or
+    // earlier in the range) is skipped.
+    template <typename InputIterator>
+    void load(InputIterator first, InputIterator last) {
+        check_not_frozen();
+        auto old_size = pairs.size();
+        pairs.insert(pairs.end(), first, last);
+        auto middle = pairs.begin() + old_size;
+        // The sort is stable, so from pairs with equal keys, the first one
+        // stays first and the others are removed below.
+        std::stable_sort(middle, pairs.end(), KeyComp{comp});
+        std::inplace_merge(pairs.begin(), middle, pairs.end(), KeyComp{comp});
+        pairs.erase(
+            std::unique(pairs.begin(), pairs.end(), KeyEqual{comp}),
+            pairs.end()
+        );
+    }
+
+    // Makes the map read-only: its storage is shrunk to its size, and any
+    // later attempt to insert or erase a pair throws std::logic_error.
+    // Mapped values can still be modified in place (e.g. via at()).
+    void freeze() {
+        pairs.shrink_to_fit();
+        is_frozen = true;
+    }
+
+    bool frozen() const {
+        return is_frozen;
+    }
+
+private:
+    // Compares pairs and keys by keys.
+    struct KeyComp {
+        bool operator()(const value_type &a, const value_type &b) const {
+            return comp(a.first, b.first);
+        }
+        bool operator()(const value_type &a, const Key &b) const {
+            return comp(a.first, b);
+        }
+        bool operator()(const Key &a, const value_type &b) const {
+            return comp(a, b.first);
+        }
+
+        Compare comp;
+    };
+
+    struct KeyEqual {
+        bool operator()(const value_type &a, const value_type &b) const {
+            return !comp(a.first, b.first) && !comp(b.first, a.first);
+        }
+
+        Compare comp;
+    };
+
+    // Returns the pair with the given key. When there is none, a pair with a
+    // default-constructed mapped value is inserted.
+    template <typename K>
+    iterator try_emplace(K &&key) {
+        auto it = lower_bound(key);
+        if (it != end() && !comp(key, it->first)) {
+            return it;
+        }
+        check_not_frozen();
+        return pairs.emplace(
+            it,
+            std::piecewise_construct,
+            std::forward_as_tuple(std::forward<K>(key)),
+            std::forward_as_tuple()
+        );
+    }
+
+    void check_not_frozen() const {
+        if (is_frozen) {
+            throw std::logic_error("flat_map is frozen");
+        }
+    }
+
+    container_type pairs;
+    Compare comp;
+    bool is_frozen = false;
+};
+
+#endif
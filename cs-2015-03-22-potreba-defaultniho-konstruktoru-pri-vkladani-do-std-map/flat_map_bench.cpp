@@ -0,0 +1,179 @@
+//
+// Copyright: (c) 2015 by Petr Zemek <s3rvac@gmail.com>
+// License:   BSD, see LICENSE for more details
+//
+// Compares std::map<int, Person> with flat_map<int, Person> (see flat_map.h):
+// inserting persons one by one, loading them all at once, looking them up,
+// and iterating over them. Prints the time per person (in nanoseconds).
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "flat_map.h"
+
+class Person {
+public:
+    Person(): age(0) {}
+
+    Person(const std::string &name, int age):
+        name(name), age(age) {}
+
+    int getAge() const { return age; }
+
+private:
+    std::string name;
+    int age;
+};
+
+namespace {
+
+// Inserting persons one by one into a flat_map takes quadratic time, so it is
+// measured only up to this size.
+const std::size_t MaxOneByOneFlatMapSize = 10000;
+
+// Prevents the compiler from optimizing away the benchmarked code.
+volatile long sink = 0;
+
+// Runs the given function (which processes `n` persons) repeatedly for at
+// least a tenth of a second and returns the time per person.
+template <typename F>
+double nsPerPerson(std::size_t n, F f) {
+    using Clock = std::chrono::steady_clock;
+    std::size_t runs = 0;
+    auto start = Clock::now();
+    auto end = start;
+    do {
+        f();
+        ++runs;
+        end = Clock::now();
+    } while (end - start < std::chrono::milliseconds(100));
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+        (runs * n);
+}
+
+void printResult(std::size_t n, const char *operation, double map,
+        double flatMap) {
+    std::printf("%8zu  %-12s %12.1f %12.1f %9.1fx\n",
+        n, operation, map, flatMap, map / flatMap);
+}
+
+void printSkipped(std::size_t n, const char *operation, double map) {
+    std::printf("%8zu  %-12s %12.1f %12s %10s\n",
+        n, operation, map, "-", "-");
+}
+
+void bench(std::size_t n, std::mt19937 &random) {
+    // Persons with distinct keys in a random order, as they would come from
+    // e.g. a database.
+    std::vector<int> keys(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        keys[i] = static_cast<int>(i * 7);
+    }
+    std::shuffle(keys.begin(), keys.end(), random);
+    std::vector<std::pair<int, Person>> persons;
+    persons.reserve(n);
+    for (auto key : keys) {
+        persons.emplace_back(key, Person("Person " + std::to_string(key), key % 100));
+    }
+
+    // Insertion one by one (via the piecewise construction).
+    auto mapInsert = nsPerPerson(n, [&]() {
+        std::map<int, Person> m;
+        for (auto key : keys) {
+            m.emplace(
+                std::piecewise_construct,
+                std::forward_as_tuple(key),
+                std::forward_as_tuple("Fred Astaire", 88)
+            );
+        }
+        sink = sink + m.size();
+    });
+    if (n <= MaxOneByOneFlatMapSize) {
+        auto flatMapInsert = nsPerPerson(n, [&]() {
+            flat_map<int, Person> m;
+            for (auto key : keys) {
+                m.emplace(
+                    std::piecewise_construct,
+                    std::forward_as_tuple(key),
+                    std::forward_as_tuple("Fred Astaire", 88)
+                );
+            }
+            sink = sink + m.size();
+        });
+        printResult(n, "insert", mapInsert, flatMapInsert);
+    } else {
+        printSkipped(n, "insert", mapInsert);
+    }
+
+    // Loading of all persons at once.
+    printResult(n, "load",
+        nsPerPerson(n, [&]() {
+            std::map<int, Person> m(persons.begin(), persons.end());
+            sink = sink + m.size();
+        }),
+        nsPerPerson(n, [&]() {
+            flat_map<int, Person> m(persons.begin(), persons.end());
+            sink = sink + m.size();
+        })
+    );
+
+    // Lookups and iteration over loaded and frozen maps. The keys are looked
+    // up in a different random order than the one in which they were
+    // inserted (for std::map, that order determines where its nodes are in
+    // memory).
+    std::map<int, Person> map(persons.begin(), persons.end());
+    flat_map<int, Person> flatMap(persons.begin(), persons.end());
+    flatMap.freeze();
+    std::shuffle(keys.begin(), keys.end(), random);
+    printResult(n, "lookup",
+        nsPerPerson(n, [&]() {
+            long sum = 0;
+            for (auto key : keys) {
+                sum += map.find(key)->second.getAge();
+            }
+            sink = sink + sum;
+        }),
+        nsPerPerson(n, [&]() {
+            long sum = 0;
+            for (auto key : keys) {
+                sum += flatMap.find(key)->second.getAge();
+            }
+            sink = sink + sum;
+        })
+    );
+    printResult(n, "iteration",
+        nsPerPerson(n, [&]() {
+            long sum = 0;
+            for (const auto &p : map) {
+                sum += p.second.getAge();
+            }
+            sink = sink + sum;
+        }),
+        nsPerPerson(n, [&]() {
+            long sum = 0;
+            for (const auto &p : flatMap) {
+                sum += p.second.getAge();
+            }
+            sink = sink + sum;
+        })
+    );
+}
+
+}
+
+int main() {
+    std::mt19937 random(42);
+    std::printf(" persons  operation    std::map/ns  flat_map/ns   speedup\n");
+    for (std::size_t n : {100, 1000, 10000, 100000, 1000000}) {
+        bench(n, random);
+    }
+}
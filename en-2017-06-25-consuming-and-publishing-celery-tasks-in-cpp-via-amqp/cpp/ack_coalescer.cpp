@@ -0,0 +1,217 @@
+//
+// Coalescing of message acknowledgements.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <utility>
+
+#include "ack_coalescer.h"
+
+namespace {
+
+// Statistics shared by all coalescers (i.e. all consumer threads).
+std::atomic<std::uint64_t> total_acked_messages(0);
+std::atomic<std::uint64_t> total_ack_frames(0);
+
+}
+
+AckCoalescer::AckCoalescer(Channel& channel,
+		unsigned max_pending, std::chrono::milliseconds max_delay):
+	channel(channel),
+	max_pending(std::max(max_pending, 1u)),
+	max_delay(max_delay) {}
+
+void AckCoalescer::delivered(const DeliveryInfo& info) {
+	out_of_order = true;
+	outstanding[info.delivery_channel].push_back(
+		{info.delivery_tag, Outstanding::State::Processing, {}}
+	);
+}
+
+void AckCoalescer::ack(const DeliveryInfo& info) {
+	if (out_of_order) {
+		// Delivery tags increase, so the message can be found via a binary
+		// search.
+		auto& messages = outstanding[info.delivery_channel];
+		auto it = std::lower_bound(messages.begin(), messages.end(),
+			info.delivery_tag,
+			[](const Outstanding& message, std::uint64_t tag) {
+				return message.delivery_tag < tag;
+			}
+		);
+		if (it == messages.end() || it->delivery_tag != info.delivery_tag) {
+			// Not reported via delivered(), so just acknowledge it.
+			channel.ack(info, /*multiple*/false);
+			count_acked(1);
+			return;
+		}
+		if (max_pending == 1 && it != messages.begin()) {
+			// Without batching, a message that overtook another one is
+			// acknowledged right away instead of waiting for the run to reach
+			// it. Otherwise, its prefetch slot would stay taken until the
+			// slower message finishes.
+			channel.ack(info, /*multiple*/false);
+			count_acked(1);
+			it->state = Outstanding::State::Acked;
+			return;
+		}
+		it->state = Outstanding::State::Processed;
+		it->processed = Clock::now();
+		if (pending++ == 0) {
+			oldest_pending = it->processed;
+		}
+		if (pending >= max_pending) {
+			flush_out_of_order(/*all*/false);
+		}
+		return;
+	}
+
+	if (pending > 0 && info.delivery_channel != last_delivery.delivery_channel) {
+		flush();
+	}
+	last_delivery = info;
+	if (pending++ == 0) {
+		oldest_pending = Clock::now();
+	}
+	if (pending >= max_pending) {
+		flush();
+	}
+}
+
+void AckCoalescer::ack_all(std::span<const DeliveryInfo> infos) {
+	// Without a limit, ack() does not send anything (except when the messages
+	// come from different channels), so the whole run can then be
+	// acknowledged with a single frame.
+	auto saved_max_pending = std::exchange(max_pending,
+		std::numeric_limits<unsigned>::max());
+	for (const auto& info : infos) {
+		ack(info);
+	}
+	max_pending = saved_max_pending;
+
+	if (!out_of_order) {
+		flush();
+		return;
+	}
+	// Messages that overtook a message that is still being processed are
+	// left outside of the run. Just like in ack(), they wait for the run
+	// unless there is no batching.
+	flush_out_of_order(/*all*/max_pending == 1);
+}
+
+void AckCoalescer::flush() {
+	if (pending == 0) {
+		return;
+	}
+
+	if (out_of_order) {
+		flush_out_of_order(/*all*/true);
+		return;
+	}
+
+	// A single frame acknowledges all messages up to the last one.
+	channel.ack(last_delivery, /*multiple*/pending > 1);
+	count_acked(pending);
+	pending = 0;
+}
+
+void AckCoalescer::flush_out_of_order(bool all) {
+	// Looking for processed messages outside of the runs means going through
+	// all outstanding messages, which may be many (e.g. parked tasks with an
+	// ETA, see consumer.cpp). Do it only when some of them may be due.
+	auto now = Clock::now();
+	auto scan = all || (pending > 0 && now - oldest_pending >= max_delay);
+	for (auto& [delivery_channel, messages] : outstanding) {
+		// The run of processed messages from the oldest delivered one can be
+		// acknowledged with a single frame. Messages in the run that have
+		// already been acknowledged individually are skipped (acknowledging
+		// them again with the 'multiple' flag is fine).
+		std::uint64_t run_length = 0;
+		std::uint64_t last_tag = 0;
+		while (!messages.empty() &&
+				messages.front().state != Outstanding::State::Processing) {
+			if (messages.front().state == Outstanding::State::Processed) {
+				last_tag = messages.front().delivery_tag;
+				++run_length;
+			}
+			messages.pop_front();
+		}
+		if (run_length > 0) {
+			channel.ack({last_tag, delivery_channel}, /*multiple*/run_length > 1);
+			count_acked(run_length);
+			pending -= static_cast<unsigned>(run_length);
+		}
+	}
+	if (!scan) {
+		return;
+	}
+
+	pending = 0;
+	for (auto& [delivery_channel, messages] : outstanding) {
+		// The remaining processed messages overtook a message that is still
+		// being processed, so they would have to be acknowledged
+		// individually. Unless they have waited for too long, give the run a
+		// chance to reach them. They stay in the queue until the run reaches
+		// them.
+		for (auto& message : messages) {
+			if (message.state != Outstanding::State::Processed) {
+				continue;
+			}
+			if (all || now - message.processed >= max_delay) {
+				channel.ack({message.delivery_tag, delivery_channel}, /*multiple*/false);
+				count_acked(1);
+				message.state = Outstanding::State::Acked;
+			} else if (pending++ == 0 || message.processed < oldest_pending) {
+				oldest_pending = message.processed;
+			}
+		}
+	}
+}
+
+void AckCoalescer::count_acked(std::uint64_t messages) {
+	total_acked_messages.fetch_add(messages, std::memory_order_relaxed);
+	total_ack_frames.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AckCoalescer::flush_if_due() {
+	if (pending > 0 && Clock::now() - oldest_pending >= max_delay) {
+		if (out_of_order) {
+			flush_out_of_order(/*all*/false);
+		} else {
+			flush();
+		}
+	}
+}
+
+void AckCoalescer::set_max_pending(unsigned new_max_pending) {
+	max_pending = std::max(new_max_pending, 1u);
+	if (pending >= max_pending) {
+		if (out_of_order) {
+			flush_out_of_order(/*all*/false);
+		} else {
+			flush();
+		}
+	}
+}
+
+int AckCoalescer::flush_timeout() const {
+	if (pending == 0) {
+		return -1;
+	}
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		Clock::now() - oldest_pending
+	);
+	return static_cast<int>(std::max(max_delay - elapsed,
+		std::chrono::milliseconds::zero()).count());
+}
+
+std::uint64_t AckCoalescer::acked_messages() {
+	return total_acked_messages.load(std::memory_order_relaxed);
+}
+
+std::uint64_t AckCoalescer::ack_frames() {
+	return total_ack_frames.load(std::memory_order_relaxed);
+}
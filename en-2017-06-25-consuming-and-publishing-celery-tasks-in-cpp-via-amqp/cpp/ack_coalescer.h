@@ -0,0 +1,173 @@
+//
+// Coalescing of message acknowledgements.
+//
+
+#ifndef ACK_COALESCER_H
+#define ACK_COALESCER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <vector>
+
+#include "broker.h"
+
+// Acknowledges messages received over a single channel in batches.
+//
+// Instead of sending one basic.ack frame per message, the coalescer remembers
+// the last processed message and acknowledges it with the 'multiple' flag set,
+// which acknowledges all messages up to (and including) it in a single frame.
+// This is correct because messages on a channel are delivered and processed in
+// order, so all messages with a lower delivery tag have already been
+// processed. Messages delivered over different AMQP channels (see
+// DeliveryInfo) are never acknowledged together.
+//
+// When messages may be processed out of order (e.g. by asynchronous tasks, see
+// async.h), the owner has to report every delivered message via delivered().
+// The coalescer then acknowledges the longest run of processed messages
+// from the oldest delivered one with a single frame. The remaining processed
+// messages (the ones that overtook a message that is still being processed)
+// wait until the run reaches them, but at most `max_delay`, after which they
+// are acknowledged individually. When `max_pending` is 1 (no batching), they
+// are acknowledged individually right away.
+//
+// Pending acknowledgements are sent when either `max_pending` messages have
+// been processed or `max_delay` has elapsed since the oldest pending one,
+// whichever comes first. The coalescer does not have its own thread, so the
+// owner has to call flush_if_due() periodically (see flush_timeout()).
+//
+// Just like the channel, the coalescer is not thread-safe.
+class AckCoalescer {
+public:
+	AckCoalescer(Channel& channel, unsigned max_pending,
+		std::chrono::milliseconds max_delay);
+
+	AckCoalescer(const AckCoalescer&) = delete;
+	AckCoalescer& operator=(const AckCoalescer&) = delete;
+
+	// Records that the given message has been delivered. It has to be called
+	// for all messages when they may be processed out of order (see above).
+	void delivered(const DeliveryInfo& info);
+
+	// Records that the given message has been successfully processed. It may
+	// or may not be acknowledged right away.
+	void ack(const DeliveryInfo& info);
+
+	// Records that the given messages (in the order of their delivery) have
+	// been processed together (see TaskRegistry::add_batch()) and
+	// acknowledges them right away, regardless of `max_pending`. When they
+	// follow the already processed messages, all of them are acknowledged
+	// with a single frame.
+	void ack_all(std::span<const DeliveryInfo> infos);
+
+	// Acknowledges all pending messages (if any).
+	void flush();
+
+	// Acknowledges all pending messages when the oldest of them has been
+	// waiting for at least `max_delay`.
+	void flush_if_due();
+
+	// Returns the number of milliseconds after which flush_if_due() should
+	// be called, or -1 when there is nothing to acknowledge. The result is
+	// suitable as a timeout for Channel::consume_message().
+	int flush_timeout() const;
+
+	// Changes the maximal number of pending acknowledgements (e.g. after the
+	// prefetch count has changed). Sends them when there are more pending.
+	void set_max_pending(unsigned max_pending);
+
+	// Returns the number of messages acknowledged by all coalescers so far.
+	static std::uint64_t acked_messages();
+
+	// Returns the number of basic.ack frames sent by all coalescers so far.
+	static std::uint64_t ack_frames();
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	// A delivered message when messages may be processed out of order.
+	struct Outstanding {
+		std::uint64_t delivery_tag;
+
+		enum class State {
+			Processing,
+			Processed,
+			Acked
+		} state;
+
+		// When the message was processed.
+		Clock::time_point processed;
+	};
+
+	// Delivered messages of a single AMQP channel (in the order of their
+	// delivery). It works like std::deque, except that its memory is reused:
+	// popping a message only moves `first`, and the vector is compacted when
+	// the popped messages take up half of it. A std::deque would allocate
+	// and free a block every few dozen messages.
+	class OutstandingQueue {
+	public:
+		bool empty() const {
+			return first == messages.size();
+		}
+
+		Outstanding& front() {
+			return messages[first];
+		}
+
+		auto begin() {
+			return messages.begin() + static_cast<std::ptrdiff_t>(first);
+		}
+
+		auto end() {
+			return messages.end();
+		}
+
+		void push_back(const Outstanding& message) {
+			messages.push_back(message);
+		}
+
+		void pop_front() {
+			if (++first == messages.size()) {
+				messages.clear();
+				first = 0;
+			} else if (first >= 64 && 2 * first >= messages.size()) {
+				messages.erase(messages.begin(), begin());
+				first = 0;
+			}
+		}
+
+	private:
+		std::vector<Outstanding> messages;
+		std::size_t first = 0;
+	};
+
+	// Acknowledges processed messages when messages may be processed out of
+	// order. Messages outside of the runs are acknowledged only when they have
+	// been waiting for at least `max_delay` or when `all` is true.
+	void flush_out_of_order(bool all);
+
+	void count_acked(std::uint64_t messages);
+
+	Channel& channel;
+	unsigned max_pending;
+	std::chrono::milliseconds max_delay;
+
+	// The last processed message, which has not been acknowledged yet.
+	DeliveryInfo last_delivery;
+
+	// The number of processed messages that have not been acknowledged yet.
+	unsigned pending = 0;
+
+	// When the oldest pending message was processed.
+	Clock::time_point oldest_pending;
+
+	// Delivered messages that have not been acknowledged yet (in the order of
+	// their delivery), per AMQP channel. Only used when messages may be
+	// processed out of order.
+	bool out_of_order = false;
+	std::map<std::uint16_t, OutstandingQueue> outstanding;
+};
+
+#endif
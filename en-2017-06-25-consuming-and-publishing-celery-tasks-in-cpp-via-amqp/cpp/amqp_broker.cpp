@@ -0,0 +1,364 @@
+//
+// A broker accessed over AMQP (via SimpleAmqpClient).
+//
+
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+// Access to https://github.com/alanxz/SimpleAmqpClient
+#include <SimpleAmqpClient/SimpleAmqpClient.h>
+
+#include "amqp_broker.h"
+
+namespace {
+
+// Stores a header value of a received message into `value`. Values of types
+// that Celery does not use (e.g. arrays or nested tables) are skipped.
+bool assign_table_value(HeaderValue& value, const AmqpClient::TableValue& from) {
+	switch (from.GetType()) {
+		case AmqpClient::TableValue::VT_string:
+			assign_header_value(value, from.GetString());
+			return true;
+		case AmqpClient::TableValue::VT_bool:
+			assign_header_value(value, from.GetBool());
+			return true;
+		case AmqpClient::TableValue::VT_int8:
+		case AmqpClient::TableValue::VT_int16:
+		case AmqpClient::TableValue::VT_int32:
+		case AmqpClient::TableValue::VT_int64:
+		case AmqpClient::TableValue::VT_uint8:
+		case AmqpClient::TableValue::VT_uint16:
+		case AmqpClient::TableValue::VT_uint32:
+			assign_header_value(value, static_cast<std::int64_t>(from.GetInteger()));
+			return true;
+		case AmqpClient::TableValue::VT_float:
+		case AmqpClient::TableValue::VT_double:
+			assign_header_value(value, from.GetReal());
+			return true;
+		default:
+			return false;
+	}
+}
+
+AmqpClient::Channel::ptr_t create_channel(const AmqpBroker::ConnectionParams& params) {
+	// Technically, in AMQP, a single connection can contain multiple channels,
+	// where channels that can be thought of as "lightweight connections that
+	// share a single TCP connection"
+	// (https://www.rabbitmq.com/tutorials/amqp-concepts.html).
+	// However, the used AMQP library only allows creation of channels, not
+	// connections, so every channel has its own connection.
+	return AmqpClient::Channel::Create(
+		params.host,
+		params.port,
+		params.username,
+		params.password,
+		params.vhost
+	);
+}
+
+AmqpClient::Table to_table(const Headers& headers) {
+	AmqpClient::Table table;
+	for (const auto& [name, value] : headers) {
+		std::visit([&, &name = name](const auto& v) {
+			table.emplace(name, AmqpClient::TableValue(v));
+		}, value);
+	}
+	return table;
+}
+
+}
+
+// Publishes messages that interrupt waiting on channels.
+//
+// The used AMQP library does not give us access to the socket of a channel,
+// so we cannot wait for both the socket and a pipe (or an eventfd) to wake up
+// a consumer waiting for a message. Instead, every channel that consumes
+// messages also consumes from its own private control queue, and to
+// interrupt the waiting, we simply publish a message into that queue. The
+// message wakes the consumer up just like any other message would, so
+// consumers can wait without a timeout and idle consumers do not wake up at
+// all.
+//
+// Since channels are not thread-safe, the control messages are published over
+// a separate channel (and connection), which is opened on demand and shared
+// by all channels. Every channel publishes at most one control message at a
+// time (see AmqpChannel::interrupt()), so consumers that complete tasks
+// quickly do not line up behind each other on the shared connection.
+class AmqpBroker::ControlPublisher {
+public:
+	explicit ControlPublisher(const AmqpBroker::ConnectionParams& params):
+		params(params) {}
+
+	void wake(const std::string& control_queue) {
+		std::lock_guard<std::mutex> lock(mutex);
+		try {
+			publish(control_queue);
+		} catch (const std::exception&) {
+			// The connection may have been closed since the last time, so
+			// try once more with a new one.
+			channel.reset();
+			publish(control_queue);
+		}
+	}
+
+private:
+	void publish(const std::string& control_queue) {
+		if (!channel) {
+			channel = create_channel(params);
+		}
+		// The default exchange ("") routes messages to the queue whose name
+		// is equal to the routing key.
+		channel->BasicPublish("", control_queue, AmqpClient::BasicMessage::Create(""));
+	}
+
+	AmqpBroker::ConnectionParams params;
+	std::mutex mutex;
+	AmqpClient::Channel::ptr_t channel;
+};
+
+namespace {
+
+// A channel over AMQP.
+class AmqpChannel: public Channel {
+public:
+	AmqpChannel(AmqpClient::Channel::ptr_t channel,
+			std::shared_ptr<AmqpBroker::ControlPublisher> control):
+		channel(std::move(channel)),
+		control(std::move(control)),
+		outgoing(AmqpClient::BasicMessage::Create()) {}
+
+	void publish(const std::string& exchange, const std::string& routing_key,
+			const Message& message) override {
+		// The outgoing message is reused between calls. Its header table is
+		// rebuilt every time: task messages carry a unique `id` header, so
+		// the headers never repeat.
+		outgoing->Body(message.body);
+		outgoing->ContentType(message.content_type);
+		outgoing->ContentEncoding(message.content_encoding);
+		if (message.correlation_id.empty()) {
+			outgoing->CorrelationIdClear();
+		} else {
+			outgoing->CorrelationId(message.correlation_id);
+		}
+		if (message.reply_to.empty()) {
+			outgoing->ReplyToClear();
+		} else {
+			outgoing->ReplyTo(message.reply_to);
+		}
+		if (message.priority == 0) {
+			outgoing->PriorityClear();
+		} else {
+			outgoing->Priority(message.priority);
+		}
+		outgoing->HeaderTable(to_table(message.headers));
+		channel->BasicPublish(exchange, routing_key, outgoing);
+	}
+
+	void declare_queue(const std::string& queue, bool temporary) override {
+		channel->DeclareQueue(
+			/*queue_name*/queue,
+			/*passive*/false,
+			/*durable*/!temporary,
+			/*exclusive*/temporary,
+			/*auto_delete*/temporary
+		);
+	}
+
+	std::string consume(const std::string& queue, std::uint16_t prefetch) override {
+		start_control_consumer();
+
+		// See the description of parameters in consumer.cpp.
+		return channel->BasicConsume(
+			/*queue*/queue,
+			/*consumer_tag*/"",
+			/*no_local*/true,
+			/*no_ack*/false,
+			/*exclusive*/false,
+			/*message_prefetch_count*/prefetch
+		);
+	}
+
+	bool consume_message(Delivery& delivery, int timeout) override {
+		if (interrupt_requested.exchange(false)) {
+			return false;
+		}
+
+		AmqpClient::Envelope::ptr_t envelope;
+		if (!channel->BasicConsumeMessage(envelope, timeout)) {
+			return false;
+		}
+		if (envelope->ConsumerTag() == control_tag) {
+			// Interrupted via interrupt(). From now on, interrupting needs
+			// another control message. The flag is cleared before the caller
+			// gets to check why it has been interrupted, so whatever made
+			// another thread skip its control message (see interrupt()) is
+			// seen by that check.
+			wake_pending.store(false);
+			return false;
+		}
+
+		// The message is stored into the delivery in place (strings are
+		// assigned instead of being replaced with temporaries, and headers
+		// are updated, see assign_headers()), so the buffers of the previous
+		// message are reused.
+		auto message = envelope->Message();
+		delivery.message.body = message->Body();
+		if (message->ContentTypeIsSet()) {
+			delivery.message.content_type.assign(message->ContentType());
+		} else {
+			delivery.message.content_type.clear();
+		}
+		if (message->ContentEncodingIsSet()) {
+			delivery.message.content_encoding.assign(message->ContentEncoding());
+		} else {
+			delivery.message.content_encoding.clear();
+		}
+		if (message->CorrelationIdIsSet()) {
+			delivery.message.correlation_id.assign(message->CorrelationId());
+		} else {
+			delivery.message.correlation_id.clear();
+		}
+		if (message->ReplyToIsSet()) {
+			delivery.message.reply_to.assign(message->ReplyTo());
+		} else {
+			delivery.message.reply_to.clear();
+		}
+		delivery.message.priority = message->PriorityIsSet()
+			? message->Priority() : 0;
+		if (message->HeaderTableIsSet()) {
+			assign_headers(delivery.message.headers, message->HeaderTable(),
+				assign_table_value);
+		} else {
+			delivery.message.headers.clear();
+		}
+		delivery.consumer_tag = envelope->ConsumerTag();
+		delivery.info.delivery_tag = envelope->DeliveryTag();
+		delivery.info.delivery_channel = envelope->GetDeliveryInfo().delivery_channel;
+		delivery.redelivered = envelope->Redelivered();
+		return true;
+	}
+
+	void ack(const DeliveryInfo& info, bool multiple) override {
+		AmqpClient::Envelope::DeliveryInfo amqp_info;
+		amqp_info.delivery_tag = info.delivery_tag;
+		amqp_info.delivery_channel = info.delivery_channel;
+		channel->BasicAck(amqp_info, multiple);
+	}
+
+	void qos(const std::string& consumer_tag, std::uint16_t prefetch) override {
+		// The used AMQP library opens a separate AMQP channel for every
+		// consumer, and on RabbitMQ 3.3 and newer, it sets the prefetch count
+		// for the whole AMQP channel ('global' QoS), so the change also
+		// applies to the already running consumer.
+		channel->BasicQos(consumer_tag, prefetch);
+	}
+
+	void cancel(const std::string& consumer_tag) override {
+		channel->BasicCancel(consumer_tag);
+	}
+
+	void interrupt() override {
+		std::string queue;
+		{
+			// Without a control queue, nobody can be waiting yet, so the
+			// request is only recorded. It is recorded under the lock, so
+			// start_control_consumer() either sees it or has already set the
+			// queue (and we publish a control message below).
+			std::lock_guard<std::mutex> lock(control_mutex);
+			if (control_queue.empty()) {
+				interrupt_requested = true;
+				return;
+			}
+			queue = control_queue;
+		}
+
+		// Publishing a control message is a round trip over the shared
+		// control connection, so interrupts are coalesced: while a control
+		// message is on its way (the consumer has not received it yet), the
+		// consumer is going to wake up anyway, and another message would
+		// only wake it up once more.
+		if (wake_pending.exchange(true)) {
+			return;
+		}
+		try {
+			control->wake(queue);
+		} catch (...) {
+			wake_pending.store(false);
+			throw;
+		}
+	}
+
+private:
+	void start_control_consumer() {
+		if (!control_tag.empty()) {
+			return;
+		}
+
+		// An exclusive, auto-deleted queue with a generated name, which
+		// disappears when the connection is closed. Control messages do not
+		// need to be acknowledged.
+		auto queue = channel->DeclareQueue(
+			/*queue_name*/"",
+			/*passive*/false,
+			/*durable*/false,
+			/*exclusive*/true,
+			/*auto_delete*/true
+		);
+		control_tag = channel->BasicConsume(
+			/*queue*/queue,
+			/*consumer_tag*/"",
+			/*no_local*/true,
+			/*no_ack*/true,
+			/*exclusive*/true,
+			/*message_prefetch_count*/1
+		);
+		bool requested;
+		{
+			std::lock_guard<std::mutex> lock(control_mutex);
+			control_queue = queue;
+			requested = interrupt_requested.exchange(false);
+		}
+
+		// An interrupt that came before the queue existed is turned into a
+		// control message, so the first waiting returns right away. We are
+		// in the thread that owns the channel, so we can publish it ourselves.
+		if (requested) {
+			wake_pending.store(true);
+			channel->BasicPublish("", queue,
+				AmqpClient::BasicMessage::Create(""));
+		}
+	}
+
+	AmqpClient::Channel::ptr_t channel;
+	std::shared_ptr<AmqpBroker::ControlPublisher> control;
+	AmqpClient::BasicMessage::ptr_t outgoing;
+
+	// The private control queue and our consumer of it. The name of the
+	// queue is read by interrupt() from other threads.
+	std::mutex control_mutex;
+	std::string control_queue;
+	std::string control_tag;
+
+	// Whether an interrupt came before the control queue existed (set and
+	// cleared under `control_mutex`, see interrupt()).
+	std::atomic<bool> interrupt_requested{false};
+
+	// Whether a control message has been published but not received yet.
+	std::atomic<bool> wake_pending{false};
+};
+
+}
+
+AmqpBroker::AmqpBroker(std::string host, int port, std::string username,
+		std::string password, std::string vhost):
+	params{std::move(host), port, std::move(username), std::move(password),
+		std::move(vhost)},
+	control(std::make_shared<ControlPublisher>(params)) {}
+
+AmqpBroker::~AmqpBroker() = default;
+
+std::unique_ptr<Channel> AmqpBroker::open_channel() {
+	return std::make_unique<AmqpChannel>(create_channel(params), control);
+}
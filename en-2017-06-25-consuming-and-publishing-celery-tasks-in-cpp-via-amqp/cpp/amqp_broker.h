@@ -0,0 +1,43 @@
+//
+// A broker accessed over AMQP (via SimpleAmqpClient).
+//
+
+#ifndef AMQP_BROKER_H
+#define AMQP_BROKER_H
+
+#include <memory>
+#include <string>
+
+#include "broker.h"
+
+// An AMQP server (e.g. RabbitMQ).
+//
+// Uses SimpleAmqpClient (https://github.com/alanxz/SimpleAmqpClient).
+class AmqpBroker: public Broker {
+public:
+	AmqpBroker(std::string host, int port, std::string username,
+		std::string password, std::string vhost);
+	~AmqpBroker() override;
+
+	std::unique_ptr<Channel> open_channel() override;
+
+	// Parameters of the connection.
+	struct ConnectionParams {
+		std::string host;
+		int port;
+		std::string username;
+		std::string password;
+		std::string vhost;
+	};
+
+	class ControlPublisher;
+
+private:
+	ConnectionParams params;
+
+	// Publishes messages that interrupt waiting on channels (see
+	// Channel::interrupt()). Shared by all channels.
+	std::shared_ptr<ControlPublisher> control;
+};
+
+#endif
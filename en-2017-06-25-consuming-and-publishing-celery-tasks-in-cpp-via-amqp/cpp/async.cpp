@@ -0,0 +1,239 @@
+//
+// Asynchronous tasks (C++20 coroutines) and an event loop that runs them.
+//
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+#include "async.h"
+
+namespace {
+
+// The current event loop of each thread.
+thread_local EventLoop* current_loop = nullptr;
+
+// A pool of threads for blocking operations (see run_blocking()).
+//
+// The threads are started when the first job is submitted. Blocking
+// operations are expected to be rare and short compared to tasks (e.g. file
+// reads), so a few threads suffice for all event loops.
+class BlockingPool {
+public:
+	static constexpr unsigned ThreadCount = 4;
+
+	~BlockingPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		job_submitted.notify_all();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+
+	void submit(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (threads.empty()) {
+				for (unsigned i = 0; i < ThreadCount; ++i) {
+					threads.emplace_back([this]() { run(); });
+				}
+			}
+			jobs.push_back(std::move(job));
+		}
+		job_submitted.notify_one();
+	}
+
+private:
+	void run() {
+		for (;;) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				job_submitted.wait(lock, [this]() { return stopping || !jobs.empty(); });
+				if (jobs.empty()) {
+					return;
+				}
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable job_submitted;
+	std::deque<std::function<void()>> jobs;
+	std::vector<std::thread> threads;
+	bool stopping = false;
+};
+
+BlockingPool& blocking_pool() {
+	static BlockingPool pool;
+	return pool;
+}
+
+}
+
+void detail::submit_blocking(std::function<void()> job) {
+	blocking_pool().submit(std::move(job));
+}
+
+std::coroutine_handle<> Async::FinalAwaiter::await_suspend(Handle finished) noexcept {
+	auto& promise = finished.promise();
+	if (promise.continuation) {
+		return promise.continuation;
+	}
+	if (promise.loop) {
+		promise.loop->finished.push_back(finished.address());
+	}
+	return std::noop_coroutine();
+}
+
+void EventLoop::Remote::post(std::coroutine_handle<> handle) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (closed) {
+		return;
+	}
+	handles.push_back(handle);
+	posted.notify_one();
+}
+
+EventLoop::EventLoop():
+	previous(current_loop),
+	remote_queue(std::make_shared<Remote>()) {
+	current_loop = this;
+}
+
+EventLoop::~EventLoop() {
+	{
+		std::lock_guard<std::mutex> lock(remote_queue->mutex);
+		remote_queue->closed = true;
+		remote_queue->handles.clear();
+	}
+	// Destroying a spawned coroutine destroys all coroutines that it awaits
+	// (they are owned by Async objects in its frame).
+	spawned.clear();
+	current_loop = previous;
+}
+
+EventLoop& EventLoop::current() {
+	if (!current_loop) {
+		throw std::logic_error("there is no event loop in the current thread");
+	}
+	return *current_loop;
+}
+
+void EventLoop::spawn(Async task) {
+	auto handle = task.handle;
+	handle.promise().loop = this;
+	spawned.emplace(handle.address(), std::move(task));
+	handle.resume();
+}
+
+std::size_t EventLoop::active() const {
+	return spawned.size() - finished.size();
+}
+
+void EventLoop::run_ready() {
+	{
+		std::lock_guard<std::mutex> lock(remote_queue->mutex);
+		ready.swap(remote_queue->handles);
+	}
+	remote_count -= ready.size();
+	for (auto handle : ready) {
+		handle.resume();
+	}
+	ready.clear();
+
+	auto now = Clock::now();
+	while (!timers.empty() && timers.top().when <= now) {
+		auto handle = timers.top().handle;
+		timers.pop();
+		handle.resume();
+	}
+
+	reap_finished();
+}
+
+int EventLoop::next_timeout() const {
+	if (!finished.empty()) {
+		return 0;
+	}
+	{
+		std::lock_guard<std::mutex> lock(remote_queue->mutex);
+		if (!remote_queue->handles.empty()) {
+			return 0;
+		}
+	}
+	if (timers.empty()) {
+		return -1;
+	}
+
+	// Round up so that the timer has expired when we wake up.
+	auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+		timers.top().when - Clock::now()
+	);
+	return static_cast<int>(std::max<std::chrono::milliseconds::rep>(
+		remaining.count(), 0));
+}
+
+void EventLoop::run(Async task) {
+	auto address = task.handle.address();
+	spawn(std::move(task));
+	for (;;) {
+		run_ready();
+		if (spawned.find(address) == spawned.end()) {
+			return;
+		}
+		wait_for_remote(next_timeout());
+	}
+}
+
+void EventLoop::resume_at(Clock::time_point when, std::coroutine_handle<> handle) {
+	timers.push({when, timer_sequence++, handle});
+}
+
+void EventLoop::wait_for_remote(int timeout) {
+	std::unique_lock<std::mutex> lock(remote_queue->mutex);
+	auto posted = [this]() { return !remote_queue->handles.empty(); };
+	if (timeout < 0) {
+		remote_queue->posted.wait(lock, posted);
+	} else {
+		remote_queue->posted.wait_for(lock, std::chrono::milliseconds(timeout), posted);
+	}
+}
+
+void EventLoop::reap_finished() {
+	// Destroy all finished coroutines first, and then re-throw the first
+	// exception (if any).
+	std::exception_ptr error;
+	for (auto address : finished) {
+		auto it = spawned.find(address);
+		if (!error) {
+			error = it->second.handle.promise().error;
+		}
+		spawned.erase(it);
+	}
+	finished.clear();
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+RunBlocking<std::function<std::string()>> read_file(std::string path) {
+	return run_blocking(std::function<std::string()>([path = std::move(path)]() {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			throw std::runtime_error("cannot open " + path);
+		}
+		return std::string(
+			std::istreambuf_iterator<char>(file),
+			std::istreambuf_iterator<char>()
+		);
+	}));
+}
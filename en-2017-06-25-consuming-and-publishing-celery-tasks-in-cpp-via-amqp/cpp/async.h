@@ -0,0 +1,387 @@
+//
+// Asynchronous tasks (C++20 coroutines) and an event loop that runs them.
+//
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class EventLoop;
+
+// A coroutine that executes an asynchronous task (or a part of it), e.g.
+//
+//     Async slow_hello(std::string_view name, int age) {
+//         co_await sleep_for(std::chrono::seconds(1));
+//         hello(name, age);
+//     }
+//
+// The coroutine is lazy: it starts when it is awaited (co_await) from another
+// coroutine or when it is spawned on an event loop (see EventLoop::spawn()).
+// An exception thrown from the coroutine is re-thrown to the awaiter.
+//
+// The object owns the coroutine, so destroying it destroys the coroutine,
+// even when it has not finished yet.
+class [[nodiscard]] Async {
+public:
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	Async(Async&& other) noexcept: handle(std::exchange(other.handle, {})) {}
+
+	Async& operator=(Async&& other) noexcept {
+		if (this != &other) {
+			destroy();
+			handle = std::exchange(other.handle, {});
+		}
+		return *this;
+	}
+
+	~Async() {
+		destroy();
+	}
+
+	// Makes the coroutine awaitable. The awaiter is suspended, the coroutine
+	// runs, and when it finishes, the awaiter is resumed.
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+		handle.promise().continuation = awaiter;
+		return handle;
+	}
+
+	void await_resume() const {
+		if (handle.promise().error) {
+			std::rethrow_exception(handle.promise().error);
+		}
+	}
+
+private:
+	friend class EventLoop;
+
+	// Resumes the awaiter (if any) when the coroutine finishes. Otherwise,
+	// tells the event loop that spawned the coroutine that it has finished.
+	struct FinalAwaiter {
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		std::coroutine_handle<> await_suspend(Handle finished) noexcept;
+
+		void await_resume() const noexcept {}
+	};
+
+public:
+	struct promise_type {
+		Async get_return_object() noexcept {
+			return Async(Handle::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() const noexcept {
+			return {};
+		}
+
+		FinalAwaiter final_suspend() const noexcept {
+			return {};
+		}
+
+		void return_void() const noexcept {}
+
+		void unhandled_exception() noexcept {
+			error = std::current_exception();
+		}
+
+		// The coroutine that awaits this one.
+		std::coroutine_handle<> continuation;
+
+		// The event loop that spawned this coroutine (when it is not
+		// awaited).
+		EventLoop* loop = nullptr;
+
+		// An exception thrown from the coroutine.
+		std::exception_ptr error;
+	};
+
+private:
+	explicit Async(Handle handle) noexcept: handle(handle) {}
+
+	void destroy() noexcept {
+		if (handle) {
+			handle.destroy();
+			handle = {};
+		}
+	}
+
+	Handle handle;
+};
+
+// A loop that runs coroutines of a single thread.
+//
+// Coroutines suspend themselves while they wait for something (a timer or an
+// operation running in another thread). The loop does not wait on its own:
+// its owner calls run_ready() whenever something may be ready, and waits (up
+// to next_timeout() milliseconds) for other events in between. This lets the
+// consumer wait for messages and for coroutines at the same time (see
+// consumer.cpp). Operations in other threads do not interrupt the owner's
+// waiting, so while there are some (see remote_operations()), the owner
+// should wait only for a short time. To run a coroutine to completion in a
+// thread without other events, use run().
+//
+// Except for Remote::post(), the loop is not thread-safe, so all coroutines
+// on it run in the thread that owns it. While it exists, the loop is the
+// current loop of the thread (see current()), which is used by awaitables
+// like sleep_for().
+class EventLoop {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// A thread-safe queue of coroutines that are ready to continue after
+	// their operation in another thread has finished.
+	//
+	// Operations hold it via a shared pointer, so an operation that finishes
+	// after the loop has been destroyed does not touch the loop. Coroutines
+	// posted after that are ignored (they have already been destroyed).
+	class Remote {
+	public:
+		// Schedules the given coroutine to be resumed in the thread of the
+		// loop and wakes up run() waiting for it.
+		void post(std::coroutine_handle<> handle);
+
+	private:
+		friend class EventLoop;
+
+		std::mutex mutex;
+		std::condition_variable posted;
+		std::vector<std::coroutine_handle<>> handles;
+		bool closed = false;
+	};
+
+	// Creates a loop for the current thread.
+	EventLoop();
+
+	// Destroys all coroutines that have not finished yet.
+	~EventLoop();
+
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	// Returns the current loop of the calling thread. Throws std::logic_error
+	// when there is none.
+	static EventLoop& current();
+
+	// Starts the given coroutine. It runs until it suspends itself for the
+	// first time, and then it continues from run_ready(). An exception
+	// thrown from a spawned coroutine is re-thrown from run_ready().
+	void spawn(Async task);
+
+	// Returns the number of spawned coroutines that have not finished yet.
+	std::size_t active() const;
+
+	// Resumes all coroutines that are ready to continue: the ones whose
+	// timers have expired and the ones whose operations in other threads
+	// have finished.
+	void run_ready();
+
+	// Returns the number of milliseconds after which run_ready() should be
+	// called, 0 when it should be called right away, or -1 when there are
+	// no timers. The result is suitable as a timeout for
+	// Channel::consume_message().
+	int next_timeout() const;
+
+	// Runs the given coroutine (and other coroutines on the loop) until it
+	// finishes. Re-throws its exception.
+	void run(Async task);
+
+	// Resumes the given coroutine from run_ready() at the given time.
+	void resume_at(Clock::time_point when, std::coroutine_handle<> handle);
+
+	// Registers an operation in another thread and returns the queue to
+	// which the operation posts its coroutine when it has finished.
+	const std::shared_ptr<Remote>& start_remote() {
+		++remote_count;
+		return remote_queue;
+	}
+
+	// Returns the number of operations in other threads whose coroutines
+	// have not been resumed yet.
+	std::size_t remote_operations() const {
+		return remote_count;
+	}
+
+private:
+	friend struct Async::FinalAwaiter;
+
+	struct Timer {
+		Clock::time_point when;
+		std::uint64_t sequence;
+		std::coroutine_handle<> handle;
+
+		// Orders timers in a min-heap (the earliest on the top). Timers with
+		// the same time are resumed in the order in which they were added.
+		bool operator<(const Timer& other) const {
+			return when != other.when ? when > other.when : sequence > other.sequence;
+		}
+	};
+
+	// Waits until a coroutine is posted to the remote queue, at most
+	// `timeout` milliseconds (-1 means forever).
+	void wait_for_remote(int timeout);
+
+	void reap_finished();
+
+	EventLoop* previous;
+	std::shared_ptr<Remote> remote_queue;
+	std::size_t remote_count = 0;
+	std::priority_queue<Timer> timers;
+	std::uint64_t timer_sequence = 0;
+
+	// Spawned coroutines (by their addresses) and the ones that have
+	// finished but have not been destroyed yet.
+	std::unordered_map<void*, Async> spawned;
+	std::vector<void*> finished;
+
+	// A buffer for coroutines taken from the remote queue (reused to avoid
+	// allocations).
+	std::vector<std::coroutine_handle<>> ready;
+};
+
+// An awaitable that suspends the awaiting coroutine until the given time.
+class SleepUntil {
+public:
+	explicit SleepUntil(EventLoop::Clock::time_point when): when(when) {}
+
+	bool await_ready() const {
+		return when <= EventLoop::Clock::now();
+	}
+
+	void await_suspend(std::coroutine_handle<> handle) const {
+		EventLoop::current().resume_at(when, handle);
+	}
+
+	void await_resume() const noexcept {}
+
+private:
+	EventLoop::Clock::time_point when;
+};
+
+// Suspends the awaiting coroutine until the given time, e.g.
+//
+//     co_await sleep_until(deadline);
+//
+inline SleepUntil sleep_until(EventLoop::Clock::time_point when) {
+	return SleepUntil(when);
+}
+
+// Suspends the awaiting coroutine for the given duration, e.g.
+//
+//     co_await sleep_for(std::chrono::milliseconds(100));
+//
+template<typename Rep, typename Period>
+SleepUntil sleep_for(std::chrono::duration<Rep, Period> duration) {
+	return SleepUntil(EventLoop::Clock::now() +
+		std::chrono::duration_cast<EventLoop::Clock::duration>(duration));
+}
+
+namespace detail {
+
+// Runs the given job in a pool of threads for blocking operations.
+void submit_blocking(std::function<void()> job);
+
+// The result of a blocking operation.
+template<typename R>
+struct BlockingResult {
+	std::optional<R> value;
+	std::exception_ptr error;
+};
+
+template<>
+struct BlockingResult<void> {
+	std::exception_ptr error;
+};
+
+}
+
+// An awaitable that runs a blocking function in another thread (see
+// run_blocking()).
+template<typename F>
+class RunBlocking {
+public:
+	using Result = std::invoke_result_t<F&>;
+
+	explicit RunBlocking(F f): f(std::move(f)) {}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle) {
+		// The result is shared with the job so that it stays valid even when
+		// the awaiting coroutine is destroyed before the job finishes.
+		result = std::make_shared<detail::BlockingResult<Result>>();
+		detail::submit_blocking(
+			[f = std::move(f), result = result, handle,
+				remote = EventLoop::current().start_remote()]() mutable {
+				try {
+					if constexpr (std::is_void_v<Result>) {
+						f();
+					} else {
+						result->value.emplace(f());
+					}
+				} catch (...) {
+					result->error = std::current_exception();
+				}
+				remote->post(handle);
+			}
+		);
+	}
+
+	Result await_resume() {
+		if (result->error) {
+			std::rethrow_exception(result->error);
+		}
+		if constexpr (!std::is_void_v<Result>) {
+			return std::move(*result->value);
+		}
+	}
+
+private:
+	F f;
+	std::shared_ptr<detail::BlockingResult<Result>> result;
+};
+
+// Runs the given function in a pool of threads for blocking operations and
+// suspends the awaiting coroutine until the function finishes. Returns the
+// result of the function (or re-throws its exception), e.g.
+//
+//     auto size = co_await run_blocking([]() { return compute(); });
+//
+// Use it for operations that would otherwise block the whole event loop, like
+// file I/O. The function has to be copyable.
+template<typename F>
+RunBlocking<F> run_blocking(F f) {
+	return RunBlocking<F>(std::move(f));
+}
+
+// Reads the whole file at the given path without blocking the event loop.
+// Throws std::runtime_error when the file cannot be read.
+RunBlocking<std::function<std::string()>> read_file(std::string path);
+
+#endif
@@ -0,0 +1,130 @@
+//
+// Results of tasks sent by a Celery client.
+//
+
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+#include "async_result.h"
+#include "celery_body.h"
+#include "task_id.h"
+
+namespace {
+
+// The maximal number of unacknowledged results delivered to the receiver.
+constexpr std::uint16_t ReplyPrefetch = 256;
+
+// Strips quotes from a JSON string (task IDs and states do not contain
+// characters that would have to be escaped).
+std::string_view unquote(std::string_view value) {
+	if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+		return value.substr(1, value.size() - 2);
+	}
+	return value;
+}
+
+// Is the given state final (the task has finished)?
+bool is_ready_state(std::string_view status) {
+	return status == "SUCCESS" || status == "FAILURE" || status == "REVOKED";
+}
+
+}
+
+ResultReceiver::ResultReceiver(Broker& broker):
+		channel(broker.open_channel()),
+		reply_queue("celery.reply." + generate_task_id()) {
+	// Celery clients name their reply queues by a UUID, too. The queue only
+	// lives as long as our connection, so results published after the
+	// receiver has gone do not pile up on the server.
+	channel->declare_queue(reply_queue, /*temporary*/true);
+	channel->consume(reply_queue, ReplyPrefetch);
+	receiver = std::thread(&ResultReceiver::receive, this);
+}
+
+ResultReceiver::~ResultReceiver() {
+	stopping = true;
+	channel->interrupt();
+	receiver.join();
+	fail_all(std::make_exception_ptr(
+		std::runtime_error("the result receiver has been destroyed")));
+}
+
+AsyncResult ResultReceiver::expect(const std::string& task_id) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::promise<TaskResult> promise;
+	auto future = promise.get_future().share();
+	if (error) {
+		promise.set_exception(error);
+	} else {
+		pending.insert_or_assign(task_id, std::move(promise));
+	}
+	return AsyncResult(task_id, std::move(future));
+}
+
+void ResultReceiver::forget(const std::string& task_id) {
+	std::lock_guard<std::mutex> lock(mutex);
+	pending.erase(task_id);
+}
+
+void ResultReceiver::receive() {
+	Delivery delivery;
+	DeliveryInfo last;
+	bool unacked = false;
+	try {
+		while (!stopping) {
+			// Block until a result arrives. Then, take the results that are
+			// already waiting without blocking, and acknowledge all of them
+			// at once when there are no more.
+			if (!channel->consume_message(delivery, unacked ? 0 : -1)) {
+				if (unacked) {
+					channel->ack(last, /*multiple*/true);
+					unacked = false;
+				}
+				continue;
+			}
+			deliver(delivery.message);
+			last = delivery.info;
+			unacked = true;
+		}
+	} catch (...) {
+		// The channel is broken, so no further results can arrive.
+		fail_all(std::current_exception());
+	}
+}
+
+void ResultReceiver::deliver(const Message& message) {
+	TaskResult result;
+	std::string_view task_id = message.correlation_id;
+	try {
+		if (task_id.empty()) {
+			task_id = unquote(find_json_member(message.body, "task_id"));
+		}
+		result.status = unquote(find_json_member(message.body, "status"));
+		result.result = find_json_member(message.body, "result");
+	} catch (const CeleryBodyError&) {
+		// Not a result message, so there is nobody to give it to.
+		return;
+	}
+	if (!is_ready_state(result.status)) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = pending.find(std::string(task_id));
+	if (it == pending.end()) {
+		return;
+	}
+	it->second.set_value(std::move(result));
+	pending.erase(it);
+}
+
+void ResultReceiver::fail_all(std::exception_ptr failure) {
+	std::lock_guard<std::mutex> lock(mutex);
+	error = failure;
+	for (auto& [task_id, promise] : pending) {
+		promise.set_exception(failure);
+	}
+	pending.clear();
+}
@@ -0,0 +1,135 @@
+//
+// Results of tasks sent by a Celery client.
+//
+
+#ifndef ASYNC_RESULT_H
+#define ASYNC_RESULT_H
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "broker.h"
+
+// The result of a finished task.
+struct TaskResult {
+	// The state of the task: "SUCCESS", "FAILURE", or "REVOKED".
+	std::string status;
+
+	// The result encoded in JSON: the return value of the task, or a
+	// description of the exception when the task has failed, e.g.
+	// {"exc_type": "RuntimeError", "exc_message": ["..."], ...}.
+	std::string result;
+
+	bool successful() const {
+		return status == "SUCCESS";
+	}
+};
+
+// A handle of the result of a sent task, similar to AsyncResult in Celery
+// (see CeleryClient::send_task_with_result()).
+//
+// The result is delivered to the handle as soon as the worker publishes it,
+// so there is no polling. Copies of a handle share the same result.
+class AsyncResult {
+public:
+	AsyncResult() = default;
+
+	// Returns the ID of the task.
+	const std::string& id() const {
+		return task_id;
+	}
+
+	// Has the result arrived?
+	bool ready() const {
+		return wait_for(std::chrono::milliseconds(0)) != nullptr;
+	}
+
+	// Waits until the result arrives and returns it. Throws an exception
+	// when the result cannot arrive anymore (e.g. the connection to the
+	// server has been lost or the client has been destroyed).
+	const TaskResult& get() const {
+		return future.get();
+	}
+
+	// Waits at most `timeout` for the result. Returns nullptr when it has not
+	// arrived in time. Throws like get().
+	const TaskResult* wait_for(std::chrono::milliseconds timeout) const {
+		if (future.wait_for(timeout) != std::future_status::ready) {
+			return nullptr;
+		}
+		return &future.get();
+	}
+
+private:
+	friend class ResultReceiver;
+
+	AsyncResult(std::string task_id, std::shared_future<TaskResult> future):
+		task_id(std::move(task_id)), future(std::move(future)) {}
+
+	std::string task_id;
+	std::shared_future<TaskResult> future;
+};
+
+// Receives results of tasks from a reply queue of a client (the RPC result
+// backend of Celery, see result_publisher.h).
+//
+// The receiver declares a temporary queue with a unique name, which is
+// deleted when the connection of the receiver is closed, and a thread of the
+// receiver consumes results from it. Every result is matched with the
+// handle of its task by the correlation ID (the ID of the task), so a single
+// queue serves all tasks sent by the client. The thread blocks until a result
+// arrives (there is no timeout), takes all the results that have arrived in
+// the meantime, and acknowledges them with a single frame.
+//
+// Only results in JSON are supported, which is what the C++ worker publishes
+// (and the default result serializer of Celery). Results of unknown tasks
+// (e.g. of tasks sent by a previous client) are ignored, and so are
+// intermediate states (e.g. STARTED or RETRY).
+//
+// All methods are thread-safe.
+class ResultReceiver {
+public:
+	// Throws an exception when the reply queue cannot be set up.
+	explicit ResultReceiver(Broker& broker);
+	~ResultReceiver();
+
+	ResultReceiver(const ResultReceiver&) = delete;
+	ResultReceiver& operator=(const ResultReceiver&) = delete;
+
+	// Returns the name of the reply queue.
+	const std::string& queue() const {
+		return reply_queue;
+	}
+
+	// Returns a handle of the result of the given task. Has to be called
+	// before the task is sent, so that its result cannot arrive before the
+	// receiver knows about it.
+	AsyncResult expect(const std::string& task_id);
+
+	// Forgets the given task (e.g. when it could not be sent after all).
+	void forget(const std::string& task_id);
+
+private:
+	void receive();
+	void deliver(const Message& message);
+	void fail_all(std::exception_ptr error);
+
+	std::unique_ptr<Channel> channel;
+	std::string reply_queue;
+
+	std::mutex mutex;
+	std::unordered_map<std::string, std::promise<TaskResult>> pending;
+	std::exception_ptr error;
+
+	std::atomic<bool> stopping{false};
+	std::thread receiver;
+};
+
+#endif
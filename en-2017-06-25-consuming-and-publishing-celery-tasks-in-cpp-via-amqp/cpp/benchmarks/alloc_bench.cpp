@@ -0,0 +1,148 @@
+//
+// A benchmark of heap allocations on the hot path of a consumer.
+//
+// Every iteration does what a consumer does with a message (see consumer.cpp):
+// it stores a received message into a reused delivery, finds its task, decodes
+// the arguments from the body, executes the task, and acknowledges the
+// message. The message has the headers of a real Celery message. Receiving
+// the message is done in three ways:
+//
+//  - rebuild: the headers are built into a new map (like AmqpBroker did),
+//  - copy: the message is copied via its copy assignment (like FakeBroker
+//    did),
+//  - in place: the message is stored into the delivery in place (see
+//    assign_message()), which is what both brokers do now.
+//
+// Allocations are counted via replaced global allocation functions (see
+// allocation_counter.h).
+//
+// Usage: alloc-bench [MESSAGES]
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include "../ack_coalescer.h"
+#include "../broker.h"
+#include "../celery_body.h"
+#include "../task_registry.h"
+#include "allocation_counter.h"
+
+namespace {
+
+// A channel that only counts acknowledgements.
+class NullChannel: public Channel {
+public:
+	void publish(const std::string&, const std::string&, const Message&) override {}
+	void declare_queue(const std::string&, bool) override {}
+	std::string consume(const std::string&, std::uint16_t) override { return {}; }
+	bool consume_message(Delivery&, int) override { return false; }
+	void interrupt() override {}
+	void ack(const DeliveryInfo&, bool) override { ++acks; }
+	void qos(const std::string&, std::uint16_t) override {}
+	void cancel(const std::string&) override {}
+
+	std::uint64_t acks = 0;
+};
+
+// Prevents the compiler from optimizing away the task.
+std::atomic<std::size_t> sink(0);
+
+void hello(std::string_view name, int age) {
+	sink.fetch_add(name.size() + age, std::memory_order_relaxed);
+}
+
+enum class Receive {
+	Rebuild,
+	Copy,
+	InPlace
+};
+
+void receive(Receive how, Delivery& delivery, const Message& message) {
+	switch (how) {
+		case Receive::Rebuild: {
+			delivery.message.body = message.body;
+			delivery.message.content_type = message.content_type;
+			delivery.message.content_encoding = message.content_encoding;
+			Headers headers;
+			for (const auto& [name, value] : message.headers) {
+				headers.emplace(name, value);
+			}
+			delivery.message.headers = std::move(headers);
+			break;
+		}
+		case Receive::Copy:
+			delivery.message = message;
+			break;
+		case Receive::InPlace:
+			assign_message(delivery.message, message);
+			break;
+	}
+}
+
+void run(const char* name, Receive how, std::uint64_t messages,
+		const TaskRegistry& registry) {
+	Message message;
+	message.content_type = "application/json";
+	message.content_encoding = "utf-8";
+	message.headers = {
+		{"lang", std::string("py")},
+		{"task", std::string("tasks.hello")},
+		{"id", std::string("4a1ec5b4-0f3b-4bd4-97b0-bd1f0d6fdc1b")},
+		{"root_id", std::string("4a1ec5b4-0f3b-4bd4-97b0-bd1f0d6fdc1b")},
+		{"parent_id", std::string()},
+		{"group", std::string()},
+		{"retries", std::int64_t(0)},
+		{"argsrepr", std::string("('Fred Astaire', 42)")},
+		{"kwargsrepr", std::string("{}")},
+		{"origin", std::string("gen1234@worker-host.example.com")}
+	};
+	encode_celery_body(message.body, "Fred Astaire", 42);
+
+	NullChannel channel;
+	AckCoalescer acks(channel, 1, std::chrono::milliseconds(100));
+	Delivery delivery;
+
+	// The first message fills the buffers of the delivery.
+	std::uint64_t before = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (std::uint64_t i = 0; i <= messages; ++i) {
+		if (i == 1) {
+			before = allocations;
+			start = std::chrono::steady_clock::now();
+		}
+		receive(how, delivery, message);
+		delivery.info.delivery_tag = i + 1;
+		acks.delivered(delivery.info);
+
+		auto task_name = find_string_header(delivery.message.headers, "task");
+		auto task = registry.find(*task_name);
+		task->invoke(CeleryBody(delivery.message.body));
+		acks.ack(delivery.info);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	std::printf("%-9s %14.2f %12.0f\n", name,
+		static_cast<double>(allocations - before) / messages,
+		messages / std::chrono::duration<double>(end - start).count());
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 2000000ull;
+
+	TaskRegistry registry;
+	registry.add("tasks.hello", hello);
+
+	std::printf("%llu messages\n\n", static_cast<unsigned long long>(messages));
+	std::printf("receive   allocs/message     msgs/sec\n");
+	run("rebuild", Receive::Rebuild, messages, registry);
+	run("copy", Receive::Copy, messages, registry);
+	run("in place", Receive::InPlace, messages, registry);
+	return 0;
+}
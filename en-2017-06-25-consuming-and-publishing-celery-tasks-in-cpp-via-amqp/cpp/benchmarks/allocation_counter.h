@@ -0,0 +1,58 @@
+//
+// Counting of heap allocations in benchmarks.
+//
+// The header replaces the global allocation and deallocation functions, so it
+// has to be included by exactly one source file of a benchmark. All forms
+// that a program can use are replaced (single objects and arrays, with and
+// without sizes), so every allocation is counted and every deallocation
+// matches its allocation.
+//
+
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// The number of heap allocations made by the whole program.
+std::uint64_t allocations = 0;
+
+void* counted_allocate(std::size_t size) {
+	++allocations;
+	if (auto p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+}
+
+void* operator new(std::size_t size) {
+	return counted_allocate(size);
+}
+
+void* operator new[](std::size_t size) {
+	return counted_allocate(size);
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+#endif
@@ -0,0 +1,108 @@
+//
+// A benchmark of the asynchronous mode of the consumer (see consumer.h) with
+// slow (I/O-bound) tasks.
+//
+// Every task waits for a given time, either by blocking the thread
+// (synchronous mode) or by suspending its coroutine (asynchronous mode). A
+// single consumer is used, so the benchmark shows how many tasks a single
+// thread can have in flight. Instead of RabbitMQ, the consumer uses an
+// in-process fake broker (see fake_broker.h).
+//
+// Usage: async-bench [MESSAGES] [TASK_DURATION_MS]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "../async.h"
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../histogram.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+
+namespace {
+
+void sleep_sync(int ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+Async sleep_async(int ms) {
+	co_await sleep_for(std::chrono::milliseconds(ms));
+}
+
+void run(bool async, std::uint16_t prefetch, std::uint64_t messages,
+		int task_ms, const TaskRegistry& registry) {
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	ConsumerOptions options;
+	options.prefetch = prefetch;
+	options.ack_batch = 16;
+	options.ack_interval = 10;
+	options.async = async;
+
+	{
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string(async ? "tasks.sleep_async" : "tasks.sleep")}};
+		encode_celery_body(message.body, task_ms);
+		for (std::uint64_t i = 0; i < messages; ++i) {
+			channel->publish("celery", "celery", message);
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto& consumer_metrics = metrics.add_consumer();
+	std::thread consumer([&]() {
+		consume(broker, options, registry, consumer_metrics, shutdown);
+	});
+	auto all_acked = broker.wait_for_acks(messages, std::chrono::minutes(10));
+	auto end = std::chrono::steady_clock::now();
+	shutdown.request();
+	consumer.join();
+
+	auto latencies = std::make_unique<Histogram>();
+	broker.collect_ack_latencies(*latencies);
+	auto seconds = std::chrono::duration<double>(end - start).count();
+	std::printf("%5s %8u %12.0f %10.1f %10.1f%s\n",
+		async ? "async" : "sync", prefetch,
+		broker.acked() / seconds,
+		latencies->percentile(50) / 1e6,
+		latencies->percentile(99) / 1e6,
+		all_acked ? "" : " (timed out)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 2000ull;
+	auto task_ms = argc > 2 ? std::stoi(argv[2]) : 10;
+
+	TaskRegistry registry;
+	registry.add("tasks.sleep", sleep_sync);
+	registry.add_async("tasks.sleep_async", sleep_async);
+
+	std::printf("%llu messages, every task takes %d ms, 1 consumer\n\n",
+		static_cast<unsigned long long>(messages), task_ms);
+	std::printf(" mode prefetch     msgs/sec   p50 (ms)   p99 (ms)\n");
+
+	// The synchronous mode executes one task at a time, whatever the prefetch
+	// count, so it is run with fewer messages to keep the benchmark short.
+	run(false, 16, std::min(messages, 200ull), task_ms, registry);
+	for (std::uint16_t prefetch : {16, 128, 512}) {
+		run(true, prefetch, messages, task_ms, registry);
+	}
+	return 0;
+}
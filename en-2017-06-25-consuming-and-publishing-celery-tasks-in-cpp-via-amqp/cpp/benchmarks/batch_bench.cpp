@@ -0,0 +1,127 @@
+//
+// A benchmark of executing tiny tasks one by one and in batches (see
+// TaskRegistry::add_batch()).
+//
+// A single consumer executes tasks.hello (see tasks.cpp), either via hello()
+// or via hello_batch(), with the output written into /dev/null through an
+// output sink (see output_sink.h). The messages are already waiting in a
+// queue of an in-process fake broker (see fake_broker.h), whose ack() takes
+// the given time, just like sending a frame to RabbitMQ does.
+//
+// Usage: batch-bench [MESSAGES] [ACK_LATENCY_US]
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../ack_coalescer.h"
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../metrics.h"
+#include "../output_sink.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+#include "../tasks.h"
+
+namespace {
+
+struct Config {
+	const char* name;
+
+	// The size of batches (0 means that every call is executed on its own).
+	std::size_t batch;
+
+	// The number of acknowledgements sent together by the coalescer.
+	unsigned ack_batch;
+};
+
+void run(const Config& config, std::uint64_t messages,
+		const FakeBrokerOptions& broker_options, OutputSink& output) {
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	TaskRegistry registry;
+	if (config.batch > 0) {
+		register_tasks(registry, BatchOptions{config.batch,
+			std::chrono::milliseconds(10)});
+	} else {
+		register_tasks(registry);
+	}
+
+	ConsumerOptions options;
+	options.prefetch = 256;
+	options.ack_batch = config.ack_batch;
+
+	{
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.hello")}};
+		for (std::uint64_t i = 0; i < messages; ++i) {
+			encode_celery_body(message.body, "Fred Astaire", static_cast<int>(i % 100));
+			channel->publish("celery", "celery", message);
+		}
+	}
+
+	auto frames_before = AckCoalescer::ack_frames();
+	auto start = std::chrono::steady_clock::now();
+	auto& consumer_metrics = metrics.add_consumer();
+	std::thread consumer([&]() {
+		consume(broker, options, registry, consumer_metrics, shutdown);
+	});
+	auto all_acked = broker.wait_for_acks(messages, std::chrono::minutes(10));
+	auto end = std::chrono::steady_clock::now();
+	shutdown.request();
+	consumer.join();
+	output.flush();
+
+	std::printf("%-14s %12.0f %14.3f%s\n",
+		config.name,
+		messages / std::chrono::duration<double>(end - start).count(),
+		static_cast<double>(AckCoalescer::ack_frames() - frames_before) / messages,
+		all_acked ? "" : " (timed out)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 200000ull;
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	broker_options.ack_latency = std::chrono::microseconds(
+		argc > 2 ? std::stoul(argv[2]) : 5ul
+	);
+
+	auto null = open("/dev/null", O_WRONLY);
+	if (null < 0) {
+		std::perror("/dev/null");
+		return 1;
+	}
+	OutputSink output(null);
+	set_task_output(&output);
+
+	std::printf("%llu messages, prefetch 256, ack latency %lld us\n\n",
+		static_cast<unsigned long long>(messages),
+		static_cast<long long>(broker_options.ack_latency.count()));
+	std::printf("mode               msgs/sec  frames/message\n");
+	for (const auto& config : {
+			Config{"single", 0, 1},
+			Config{"single, ack 64", 0, 64},
+			Config{"batch 16", 16, 1},
+			Config{"batch 64", 64, 1},
+			Config{"batch 256", 256, 1}}) {
+		run(config, messages, broker_options, output);
+	}
+
+	set_task_output(nullptr);
+	return 0;
+}
@@ -0,0 +1,88 @@
+//
+// A micro-benchmark that compares decoding of task arguments from a body of a
+// message via json::parse() (a full DOM) and via CeleryBody (lazy decoding).
+//
+// Usage: celery-body-bench [ITERATIONS]
+//
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+// Access to https://github.com/nlohmann/json
+#include <json.hpp>
+
+#include "../celery_body.h"
+#include "allocation_counter.h"
+
+// A convenience type alias.
+using json = nlohmann::json;
+
+namespace {
+
+// Prevents the compiler from optimizing away the benchmarked code.
+volatile std::size_t sink = 0;
+
+// Runs the given function `iterations` times and prints the time and the
+// number of heap allocations per iteration.
+template<typename F>
+void run(const char* name, std::size_t iterations, F f) {
+	auto start_allocations = allocations;
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < iterations; ++i) {
+		f();
+	}
+	auto end = std::chrono::steady_clock::now();
+	auto ns = std::chrono::duration<double, std::nano>(end - start).count();
+	std::cout << "  " << name << ": " << ns / iterations << " ns/msg, "
+		<< static_cast<double>(allocations - start_allocations) / iterations
+		<< " allocs/msg\n";
+}
+
+void bench_body(const char* description, const std::string& body,
+		std::size_t iterations) {
+	std::cout << description << " (" << body.size() << " bytes):\n";
+	run("json::parse", iterations, [&]() {
+		auto parsed = json::parse(body);
+		auto name = parsed[0][0].get<std::string>();
+		auto age = parsed[0][1].get<int>();
+		sink = sink + name.size() + age;
+	});
+	run("CeleryBody ", iterations, [&]() {
+		auto parsed = CeleryBody(body);
+		auto name = parsed.arg<std::string_view>(0);
+		auto age = parsed.arg<int>(1);
+		sink = sink + name.size() + age;
+	});
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto iterations = argc > 1 ? std::stoul(argv[1]) : 1000000ul;
+
+	// The body that hello.cpp sends.
+	bench_body(
+		"hello",
+		R"([["Fred Astaire", 88], {}, {}])",
+		iterations
+	);
+
+	// A body similar to what Celery itself sends (with the embed part filled).
+	bench_body(
+		"hello with embed",
+		R"([["Fred Astaire", 88], {}, {"callbacks": null, "errbacks": null, )"
+		R"("chain": null, "chord": null}])",
+		iterations
+	);
+
+	// A body with a longer name containing escape sequences.
+	bench_body(
+		"escaped name",
+		R"([["Fred \"The Dancer\" Astaire\u00e9 from Omaha, Nebraska", 88], {}, {}])",
+		iterations
+	);
+
+	return 0;
+}
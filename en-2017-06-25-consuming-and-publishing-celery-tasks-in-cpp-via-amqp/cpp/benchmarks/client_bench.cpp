@@ -0,0 +1,112 @@
+//
+// A benchmark of sending tasks from several threads via the client from
+// celery_client.h.
+//
+// Compares opening a new channel (and connection) for every task, which is
+// what running hello for every task amounts to, with sharing a pool of
+// channels of various sizes. Instead of RabbitMQ, it uses an in-process fake
+// broker (see fake_broker.h) with injected latencies of opening a connection
+// and of waiting for a publisher confirm.
+//
+// Usage: client-bench [TASKS_PER_THREAD] [THREADS]
+//
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../celery_client.h"
+#include "../fake_broker.h"
+#include "../histogram.h"
+#include "../task_id.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Sends `tasks` tasks from every thread via `send`, and prints the throughput
+// and the latency of sending a task.
+template<typename Send>
+void run(const char* name, unsigned threads, unsigned tasks, Send send) {
+	std::vector<Histogram> latencies(threads);
+	std::vector<std::thread> senders;
+	auto start = Clock::now();
+	for (unsigned i = 0; i < threads; ++i) {
+		senders.emplace_back([&, i]() {
+			for (unsigned j = 0; j < tasks; ++j) {
+				auto send_start = Clock::now();
+				send(static_cast<int>(j % 100));
+				latencies[i].record(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(
+						Clock::now() - send_start
+					).count()
+				);
+			}
+		});
+	}
+	for (auto& sender : senders) {
+		sender.join();
+	}
+	auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	auto all = std::make_unique<Histogram>();
+	for (const auto& latency : latencies) {
+		all->add(latency);
+	}
+	std::printf("%-20s %12.0f %10.1f %10.1f\n", name,
+		all->count() / seconds,
+		all->percentile(50) / 1000.0,
+		all->percentile(99) / 1000.0);
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto tasks = argc > 1 ? static_cast<unsigned>(std::stoul(argv[1])) : 500u;
+	auto threads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 8u;
+
+	FakeBrokerOptions broker_options;
+	broker_options.connect_latency = std::chrono::microseconds(2000);
+	broker_options.publish_latency = std::chrono::microseconds(100);
+
+	std::printf("%u threads, %u tasks per thread, connect latency %lld us, "
+		"publish latency %lld us\n\n", threads, tasks,
+		static_cast<long long>(broker_options.connect_latency.count()),
+		static_cast<long long>(broker_options.publish_latency.count()));
+	std::printf("sender                   msgs/sec   p50 (us)   p99 (us)\n");
+
+	{
+		FakeBroker broker(broker_options);
+		run("channel per task", threads, tasks, [&](int age) {
+			auto channel = broker.open_channel();
+			Message message;
+			message.content_type = "application/json";
+			message.content_encoding = "utf-8";
+			message.headers = {
+				{"id", generate_task_id()},
+				{"task", std::string("tasks.hello")}
+			};
+			encode_celery_body(message.body, "Fred Astaire", age);
+			channel->publish("celery", "celery", message);
+		});
+	}
+
+	for (auto pool_size : {1u, threads / 2, threads}) {
+		if (pool_size == 0) {
+			continue;
+		}
+		FakeBroker broker(broker_options);
+		CeleryClientOptions options;
+		options.pool_size = pool_size;
+		CeleryClient client(broker, options);
+		auto name = "client, pool " + std::to_string(pool_size);
+		run(name.c_str(), threads, tasks, [&](int age) {
+			client.send_task("tasks.hello", "Fred Astaire", age);
+		});
+	}
+	return 0;
+}
@@ -0,0 +1,131 @@
+//
+// A micro-benchmark of compression of message bodies (see compression.h) on
+// bodies of various sizes: how much smaller they get, how long compressing
+// (in the client) and decompressing (in the worker) takes, and how many heap
+// allocations decompressing needs.
+//
+// The bodies have a single argument with JSON records (e.g. a batch of
+// customers to import), which is what large task arguments usually look like.
+//
+// Usage: compression-bench [MEGABYTES]
+//
+// Every measurement processes about MEGABYTES (64 by default) of bodies. The
+// last column is the bandwidth of the network below which compression pays
+// off: sending the saved bytes over a slower network would take longer than
+// compressing and decompressing the body.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../compression.h"
+#include "allocation_counter.h"
+
+namespace {
+
+// Prevents the compiler from optimizing away the benchmarked code.
+volatile std::size_t sink = 0;
+
+// Returns a body with JSON records of about the given size in its argument.
+std::string make_body(std::size_t size, std::minstd_rand& random) {
+	static const char* const countries[] = {"CZ", "DE", "US", "GB", "FR"};
+	std::uniform_int_distribution<int> id(1, 999999);
+	std::uniform_int_distribution<int> cents(0, 9999999);
+	std::string records = "[";
+	char record[256];
+	while (records.size() < size) {
+		auto customer = id(random);
+		auto balance = cents(random);
+		std::snprintf(record, sizeof(record),
+			"%s{\"id\": %d, \"name\": \"customer-%d\", "
+			"\"email\": \"customer-%d@example.com\", \"balance\": %d.%02d, "
+			"\"country\": \"%s\", \"active\": %s}",
+			records.size() > 1 ? ", " : "", customer, customer, customer,
+			balance / 100, balance % 100, countries[customer % 5],
+			customer % 3 ? "true" : "false");
+		records += record;
+	}
+	records += ']';
+	std::string body;
+	encode_celery_body(body, records);
+	return body;
+}
+
+// Runs the given function `iterations` times and returns the time per
+// iteration (in microseconds).
+template<typename F>
+double run(std::size_t iterations, F f) {
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < iterations; ++i) {
+		f();
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count() /
+		iterations;
+}
+
+void bench(const char* name, Compression compression, const std::string& body,
+		std::size_t megabytes) {
+	auto iterations = std::max<std::size_t>(megabytes * 1024 * 1024 /
+		body.size(), 10);
+	std::string compressed;
+	std::string decompressed;
+	auto compress_us = run(iterations, [&]() {
+		compress(compression, body, compressed);
+		sink = sink + compressed.size();
+	});
+	// The first decompression allocates the buffer, the others reuse it.
+	decompress(compression, compressed, decompressed, body.size());
+	auto before = allocations;
+	auto decompress_us = run(iterations, [&]() {
+		decompress(compression, compressed, decompressed, body.size());
+		sink = sink + decompressed.size();
+	});
+	auto decompress_allocations = allocations - before;
+	if (decompressed != body) {
+		std::printf("%s: the decompressed body differs!\n", name);
+		std::exit(1);
+	}
+
+	// Bytes per microsecond are megabytes per second.
+	auto saved = static_cast<double>(body.size() - compressed.size());
+	std::printf("%9zu %-5s %10zu %7.1f%% %12.1f %12.1f %12.2f %14.0f\n",
+		body.size(), name, compressed.size(),
+		100.0 * compressed.size() / body.size(), compress_us, decompress_us,
+		static_cast<double>(decompress_allocations) / iterations,
+		saved / (compress_us + decompress_us));
+}
+
+}
+
+int main(int argc, char** argv) {
+	std::size_t megabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 64;
+
+	std::vector<std::pair<const char*, Compression>> compressions = {
+		{"zlib", Compression::Zlib}};
+	if (compression_from_name("zstd")) {
+		compressions.push_back({"zstd", Compression::Zstd});
+	} else {
+		std::printf("(zstd is not supported by this build)\n\n");
+	}
+
+	std::printf("     body       compressed    ratio  compress/us"
+		" decompress/us allocs/body break-even MB/s\n");
+	std::minstd_rand random(42);
+	for (std::size_t size : {256, 1024, 4096, 16384, 65536, 262144, 1048576,
+			4194304}) {
+		auto body = make_body(size, random);
+		for (const auto& [name, compression] : compressions) {
+			bench(name, compression, body, megabytes);
+		}
+	}
+	return 0;
+}
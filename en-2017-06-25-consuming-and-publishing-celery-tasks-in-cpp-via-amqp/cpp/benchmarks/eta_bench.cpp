@@ -0,0 +1,205 @@
+//
+// A benchmark of tasks with an ETA (see DelayedTasks in consumer.cpp).
+//
+// The first part compares the timing wheel from timing_wheel.h with a
+// std::multimap (a balanced tree, i.e. O(log n) per operation) on scheduling
+// and expiring many items.
+//
+// The second part runs a consumer on an in-process fake broker (see
+// fake_broker.h). The queue starts with many delayed tasks, followed by tasks
+// to be executed right away. It shows how late the delayed tasks are executed
+// and that the tasks to be executed right away are not stuck behind the
+// delayed ones, although the prefetch count is much lower than the number of
+// delayed tasks.
+//
+// Usage: eta-bench [DELAYED_TASKS] [IMMEDIATE_TASKS]
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../eta.h"
+#include "../fake_broker.h"
+#include "../histogram.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+#include "../timing_wheel.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double ns_per_item(Clock::duration duration, std::size_t items) {
+	return std::chrono::duration<double, std::nano>(duration).count() / items;
+}
+
+// Schedules the given items (expirations in milliseconds) and then advances
+// the time by one millisecond until all of them expire.
+void compare_structures(const std::vector<std::uint64_t>& expirations) {
+	std::uint64_t last = 0;
+	for (auto expiration : expirations) {
+		last = std::max(last, expiration);
+	}
+
+	std::size_t expired = 0;
+	auto start = Clock::now();
+	TimingWheel<std::size_t> wheel;
+	for (std::size_t i = 0; i < expirations.size(); ++i) {
+		wheel.insert(expirations[i], i);
+	}
+	auto inserted = Clock::now();
+	for (std::uint64_t now = 0; now <= last; ++now) {
+		wheel.advance(now, [&](std::size_t) { ++expired; });
+	}
+	auto end = Clock::now();
+	std::printf("%-14s %12.1f %12.1f %10zu\n", "timing wheel",
+		ns_per_item(inserted - start, expirations.size()),
+		ns_per_item(end - inserted, expirations.size()), expired);
+
+	expired = 0;
+	start = Clock::now();
+	std::multimap<std::uint64_t, std::size_t> tree;
+	for (std::size_t i = 0; i < expirations.size(); ++i) {
+		tree.emplace(expirations[i], i);
+	}
+	inserted = Clock::now();
+	for (std::uint64_t now = 0; now <= last; ++now) {
+		while (!tree.empty() && tree.begin()->first <= now) {
+			tree.erase(tree.begin());
+			++expired;
+		}
+	}
+	end = Clock::now();
+	std::printf("%-14s %12.1f %12.1f %10zu\n", "std::multimap",
+		ns_per_item(inserted - start, expirations.size()),
+		ns_per_item(end - inserted, expirations.size()), expired);
+}
+
+// How late the delayed tasks are executed (in nanoseconds).
+Histogram* lateness;
+
+// How long the immediate tasks wait since they were published (in
+// nanoseconds).
+Histogram* waiting;
+
+void delayed_task(std::string_view eta) {
+	auto due = parse_eta(eta);
+	auto late = std::chrono::system_clock::now() - *due;
+	lateness->record(std::max<std::int64_t>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(late).count(), 0));
+}
+
+void immediate_task(std::int64_t published) {
+	waiting->record(Clock::now().time_since_epoch().count() - published);
+}
+
+void run_consumer(bool async, std::uint64_t delayed, std::uint64_t immediate,
+		const TaskRegistry& registry) {
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	ConsumerOptions options;
+	options.prefetch = 16;
+	options.ack_batch = 16;
+	options.ack_interval = 10;
+	options.async = async;
+
+	auto late = std::make_unique<Histogram>();
+	auto wait = std::make_unique<Histogram>();
+	lateness = late.get();
+	waiting = wait.get();
+
+	// The delayed tasks are due within two seconds.
+	{
+		std::mt19937 random(42);
+		std::uniform_int_distribution<int> delay_ms(100, 2000);
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		for (std::uint64_t i = 0; i < delayed; ++i) {
+			auto eta = format_eta(std::chrono::system_clock::now() +
+				std::chrono::milliseconds(delay_ms(random)));
+			message.headers = {
+				{"task", std::string("tasks.delayed")},
+				{"eta", eta}
+			};
+			encode_celery_body(message.body, std::string_view(eta));
+			channel->publish("celery", "celery", message);
+		}
+	}
+
+	auto& consumer_metrics = metrics.add_consumer();
+	std::thread consumer([&]() {
+		consume(broker, options, registry, consumer_metrics, shutdown);
+	});
+
+	{
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.immediate")}};
+		for (std::uint64_t i = 0; i < immediate; ++i) {
+			encode_celery_body(message.body,
+				static_cast<std::int64_t>(Clock::now().time_since_epoch().count()));
+			channel->publish("celery", "celery", message);
+		}
+	}
+
+	auto all_acked = broker.wait_for_acks(delayed + immediate,
+		std::chrono::minutes(1));
+	shutdown.request();
+	consumer.join();
+
+	std::printf("%5s %12.2f %12.2f %12.2f %12.2f%s\n",
+		async ? "async" : "sync",
+		late->percentile(50) / 1e6, late->percentile(99) / 1e6,
+		wait->percentile(50) / 1e6, wait->percentile(99) / 1e6,
+		all_acked ? "" : " (timed out)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto delayed = argc > 1 ? std::stoull(argv[1]) : 20000ull;
+	auto immediate = argc > 2 ? std::stoull(argv[2]) : 20000ull;
+
+	std::printf("%llu items due within 60 s (1 ms ticks)\n\n",
+		static_cast<unsigned long long>(delayed));
+	std::printf("structure       insert (ns)  expire (ns)    expired\n");
+	std::mt19937_64 random(42);
+	std::uniform_int_distribution<std::uint64_t> expiration(0, 60000);
+	std::vector<std::uint64_t> expirations(delayed);
+	for (auto& e : expirations) {
+		e = expiration(random);
+	}
+	compare_structures(expirations);
+
+	TaskRegistry registry;
+	registry.add("tasks.delayed", delayed_task);
+	registry.add("tasks.immediate", immediate_task);
+
+	std::printf("\n%llu delayed tasks (due within 2 s) followed by %llu "
+		"immediate tasks, prefetch 16\n\n",
+		static_cast<unsigned long long>(delayed),
+		static_cast<unsigned long long>(immediate));
+	std::printf(" mode   late p50 (ms) late p99 (ms) wait p50 (ms) wait p99 (ms)\n");
+	run_consumer(false, delayed, immediate, registry);
+	run_consumer(true, delayed, immediate, registry);
+	return 0;
+}
@@ -0,0 +1,149 @@
+//
+// A benchmark of caching results of tasks (see memo_cache.h).
+//
+// A single consumer executes tasks.fib, a pure function that takes tens of
+// microseconds, from an in-process fake broker (see fake_broker.h). Messages
+// arrive in bursts of duplicates (the same arguments several times in a row),
+// or all of them are distinct. Every run is done with and without caching of
+// the results of the task. The clock stops when all messages have been
+// acknowledged.
+//
+// The second part measures lookups in the cache alone from several threads
+// at once, with a hit rate of about 90%.
+//
+// Usage: memo-bench [MESSAGES]
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../memo_cache.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+
+namespace {
+
+// A deliberately slow (exponential) Fibonacci number.
+std::int64_t slow_fib(int n) {
+	return n < 2 ? n : slow_fib(n - 1) + slow_fib(n - 2);
+}
+
+// The n-th Fibonacci number modulo m.
+std::int64_t fib(int n, std::int64_t m) {
+	return slow_fib(n) % m;
+}
+
+void run_consumer(const char* name, unsigned burst, bool memoize,
+		std::uint64_t messages) {
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	TaskRegistry registry;
+	registry.add("tasks.fib", fib);
+	if (memoize) {
+		registry.memoize("tasks.fib");
+	}
+
+	ConsumerOptions options;
+	options.prefetch = 64;
+	options.ack_batch = 64;
+
+	{
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.fib")}};
+		for (std::uint64_t i = 0; i < messages; ++i) {
+			// Every burst has different arguments.
+			encode_celery_body(message.body, 20,
+				static_cast<std::int64_t>(i / burst + 1));
+			channel->publish("celery", "celery", message);
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto& consumer_metrics = metrics.add_consumer();
+	std::thread consumer([&]() {
+		consume(broker, options, registry, consumer_metrics, shutdown);
+	});
+	auto all_acked = broker.wait_for_acks(messages, std::chrono::minutes(10));
+	auto end = std::chrono::steady_clock::now();
+	shutdown.request();
+	consumer.join();
+
+	auto hits = consumer_metrics.memo_hits.get();
+	auto lookups = hits + consumer_metrics.memo_misses.get();
+	std::printf("%-24s %-6s %12.0f %9.1f%%%s\n",
+		name,
+		memoize ? "yes" : "no",
+		messages / std::chrono::duration<double>(end - start).count(),
+		lookups > 0 ? 100.0 * hits / lookups : 0.0,
+		all_acked ? "" : " (timed out)");
+}
+
+void run_lookups(unsigned threads, std::uint64_t lookups) {
+	MemoOptions options;
+	options.capacity = 100000;
+	MemoCache cache(options);
+
+	// Keys look like bodies of messages. A tenth of the lookups is for keys
+	// that are not cached.
+	std::vector<std::string> keys;
+	for (int i = 0; i < 10000; ++i) {
+		keys.emplace_back();
+		encode_celery_body(keys.back(), "user-" + std::to_string(i), i);
+		if (i % 10 != 0) {
+			cache.insert(keys.back(), std::to_string(i));
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t]() {
+			std::string result;
+			for (std::uint64_t i = t; i < lookups; i += threads) {
+				cache.find(keys[(i * 7919) % keys.size()], result);
+			}
+		});
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+	std::printf("%7u %14.0f\n", threads,
+		lookups / std::chrono::duration<double>(end - start).count());
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 50000ull;
+
+	std::printf("%llu messages of tasks.fib, prefetch 64, ack batch 64\n\n",
+		static_cast<unsigned long long>(messages));
+	std::printf("arguments                memo       msgs/sec  hit rate\n");
+	for (auto memoize : {false, true}) {
+		run_consumer("distinct", 1, memoize, messages);
+		run_consumer("bursts of 10 duplicates", 10, memoize, messages);
+	}
+
+	std::printf("\nlookups in the cache (10000 keys, 90%% hits)\n\n");
+	std::printf("threads  lookups/sec\n");
+	for (auto threads : {1u, 2u, 4u, 8u}) {
+		run_lookups(threads, 4000000);
+	}
+	return 0;
+}
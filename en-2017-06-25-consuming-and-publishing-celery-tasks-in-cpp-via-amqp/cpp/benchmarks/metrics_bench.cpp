@@ -0,0 +1,83 @@
+//
+// A benchmark that shows the overhead of metrics (see metrics.h) by running
+// the processing part of the consume loop of the worker with and without
+// instrumentation.
+//
+// Usage: metrics-bench [ITERATIONS]
+//
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "../celery_body.h"
+#include "../metrics.h"
+#include "../task_registry.h"
+
+namespace {
+
+// Prevents the compiler from optimizing away the benchmarked code.
+volatile std::size_t sink = 0;
+
+// A task that is as cheap as possible, so the overhead of instrumentation is
+// as visible as possible.
+void noop(std::string_view name, int age) {
+	sink = sink + name.size() + age;
+}
+
+// Processes the given body in the same way as the worker does (finds the
+// task, decodes its arguments, and executes it) `iterations` times. When
+// `metrics` is non-null, the stages are recorded in the same way as in the
+// worker. Returns the number of nanoseconds per message.
+double run(const TaskRegistry& registry, const std::string& body,
+		std::size_t iterations, ConsumerMetrics* metrics) {
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < iterations; ++i) {
+		if (metrics) {
+			auto decode_start = ConsumerMetrics::Clock::now();
+			metrics->messages.increment();
+			auto task = registry.find("tasks.hello");
+			auto parsed = CeleryBody(body);
+			auto execute_start = ConsumerMetrics::Clock::now();
+			metrics->record(Stage::Decode, decode_start, execute_start);
+			task->invoke(parsed);
+			auto ack_start = ConsumerMetrics::Clock::now();
+			metrics->record(Stage::Execute, execute_start, ack_start);
+			metrics->record(Stage::Ack, ack_start, ConsumerMetrics::Clock::now());
+		} else {
+			auto task = registry.find("tasks.hello");
+			auto parsed = CeleryBody(body);
+			task->invoke(parsed);
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto iterations = argc > 1 ? std::stoul(argv[1]) : 5000000ul;
+
+	TaskRegistry registry;
+	registry.add("tasks.hello", noop);
+	std::string body = R"([["Fred Astaire", 88], {}, {}])";
+	auto metrics = std::make_unique<ConsumerMetrics>();
+
+	// Warm up caches and the CPU frequency.
+	run(registry, body, iterations / 10, nullptr);
+
+	auto plain = run(registry, body, iterations, nullptr);
+	auto instrumented = run(registry, body, iterations, metrics.get());
+	std::cout << "uninstrumented: " << plain << " ns/msg\n"
+		<< "instrumented:   " << instrumented << " ns/msg\n"
+		<< "overhead:       " << instrumented - plain << " ns/msg\n";
+	std::cout << "recorded decode stage: p50 = "
+		<< metrics->stages[static_cast<std::size_t>(Stage::Decode)].percentile(50)
+		<< " ns, p99 = "
+		<< metrics->stages[static_cast<std::size_t>(Stage::Decode)].percentile(99)
+		<< " ns\n";
+	return 0;
+}
@@ -0,0 +1,143 @@
+//
+// A benchmark of writing lines of output from several threads: directly (a
+// locked write() per line, which is what `std::cout << line << std::flush`
+// does) and via OutputSink (see output_sink.h).
+//
+// The output goes into a pipe. Its reader either reads as fast as it can or
+// simulates a slow consumer of the output (it pauses after every read).
+//
+// Usage: output-sink-bench [LINES_PER_THREAD] [THREADS]
+//
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../histogram.h"
+#include "../output_sink.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Reads everything from the given file descriptor until the end of the pipe.
+// When `pause` is non-zero, it pauses after every read.
+void read_all(int fd, std::chrono::microseconds pause) {
+	std::vector<char> buffer(64 * 1024);
+	while (::read(fd, buffer.data(), buffer.size()) > 0) {
+		if (pause.count() > 0) {
+			std::this_thread::sleep_for(pause);
+		}
+	}
+}
+
+// Runs `threads` threads that write `lines` lines each via the given
+// function, and prints the throughput and the latency of writing a line.
+template<typename Write>
+void run(const char* name, unsigned threads, unsigned lines, Write write) {
+	std::vector<Histogram> latencies(threads);
+	std::vector<std::thread> writers;
+	auto start = Clock::now();
+	for (unsigned t = 0; t < threads; ++t) {
+		writers.emplace_back([&, t]() {
+			auto prefix = "Hello Consumer " + std::to_string(t) + ". You are ";
+			char line[128];
+			for (unsigned i = 0; i < lines; ++i) {
+				auto size = std::snprintf(line, sizeof(line), "%s%u years old.\n",
+					prefix.c_str(), i % 100);
+				auto write_start = Clock::now();
+				write(std::string_view(line, size));
+				latencies[t].record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					Clock::now() - write_start).count());
+			}
+		});
+	}
+	for (auto& writer : writers) {
+		writer.join();
+	}
+	auto end = Clock::now();
+
+	Histogram all;
+	for (const auto& latency : latencies) {
+		all.add(latency);
+	}
+	auto seconds = std::chrono::duration<double>(end - start).count();
+	std::printf("  %-12s %12.0f %10.2f %10.2f %10.2f\n", name,
+		all.count() / seconds,
+		all.percentile(50) / 1000.0,
+		all.percentile(99) / 1000.0,
+		all.percentile(100) / 1000.0);
+}
+
+void bench(const char* description, unsigned threads, unsigned lines,
+		std::chrono::microseconds pause) {
+	std::printf("%s:\n  %-12s %12s %10s %10s %10s\n", description,
+		"", "lines/sec", "p50 (us)", "p99 (us)", "max (us)");
+
+	// Writes a line per write() under a lock.
+	{
+		int fds[2];
+		if (::pipe(fds) != 0) {
+			std::perror("pipe");
+			return;
+		}
+		std::thread reader(read_all, fds[0], pause);
+		std::mutex mutex;
+		run("locked write", threads, lines, [&](std::string_view line) {
+			std::lock_guard<std::mutex> lock(mutex);
+			[[maybe_unused]] auto written = ::write(fds[1], line.data(), line.size());
+		});
+		::close(fds[1]);
+		reader.join();
+		::close(fds[0]);
+	}
+
+	// Writes lines via the output sink (with the given overflow policies).
+	// The time includes the final flush.
+	for (auto [sink_name, overflow] : {
+			std::pair("sink (block)", OverflowPolicy::Block),
+			std::pair("sink (drop)", OverflowPolicy::Drop)}) {
+		int fds[2];
+		if (::pipe(fds) != 0) {
+			std::perror("pipe");
+			return;
+		}
+		std::thread reader(read_all, fds[0], pause);
+		std::uint64_t dropped;
+		{
+			OutputSinkOptions options;
+			options.overflow = overflow;
+			OutputSink sink(fds[1], options);
+			run(sink_name, threads, lines, [&](std::string_view line) {
+				sink.write(line);
+			});
+			dropped = sink.dropped();
+		}
+		::close(fds[1]);
+		reader.join();
+		::close(fds[0]);
+		if (dropped > 0) {
+			std::printf("  (%llu lines dropped)\n",
+				static_cast<unsigned long long>(dropped));
+		}
+	}
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto lines = argc > 1 ? static_cast<unsigned>(std::stoul(argv[1])) : 200000u;
+	auto threads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 4u;
+
+	bench("fast reader", threads, lines, std::chrono::microseconds(0));
+	bench("slow reader (pauses 1 ms after every read)", threads, lines,
+		std::chrono::microseconds(1000));
+	return 0;
+}
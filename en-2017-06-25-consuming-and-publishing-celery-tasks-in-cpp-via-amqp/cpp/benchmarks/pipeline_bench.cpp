@@ -0,0 +1,132 @@
+//
+// A benchmark of the whole publish -> consume -> ack pipeline with various
+// concurrency, prefetch, and ack-batch settings.
+//
+// The consumers are the same as in the worker (see consumer.cpp), but instead
+// of RabbitMQ, they use an in-process fake broker with injected latencies
+// (see fake_broker.h), so no network is needed and the results are
+// repeatable.
+//
+// Usage: pipeline-bench [MESSAGES] [DELIVERY_LATENCY_US] [ACK_LATENCY_US]
+//
+// Latencies are measured from publishing a message until its acknowledgement
+// reaches the broker. Since all messages are published as fast as possible,
+// they include the time spent waiting in the queue.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../histogram.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+
+namespace {
+
+// Prevents the compiler from optimizing away the task.
+std::atomic<std::size_t> sink(0);
+
+void noop(std::string_view name, int age) {
+	sink.fetch_add(name.size() + age, std::memory_order_relaxed);
+}
+
+struct Config {
+	unsigned concurrency;
+	std::uint16_t prefetch;
+	unsigned ack_batch;
+};
+
+void run(const Config& config, std::uint64_t messages,
+		const FakeBrokerOptions& broker_options, const TaskRegistry& registry) {
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	ConsumerOptions options;
+	options.prefetch = config.prefetch;
+	options.ack_batch = config.ack_batch;
+	options.ack_interval = 10;
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> consumers;
+	for (unsigned i = 0; i < config.concurrency; ++i) {
+		auto consumer_metrics = &metrics.add_consumer();
+		consumers.emplace_back([&, consumer_metrics]() {
+			consume(broker, options, registry, *consumer_metrics, shutdown);
+		});
+	}
+
+	std::thread publisher([&]() {
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.noop")}};
+		for (std::uint64_t i = 0; i < messages; ++i) {
+			encode_celery_body(message.body, "Fred Astaire", static_cast<int>(i % 100));
+			channel->publish("celery", "celery", message);
+		}
+	});
+
+	auto all_acked = broker.wait_for_acks(messages, std::chrono::minutes(10));
+	auto end = std::chrono::steady_clock::now();
+	shutdown.request();
+	publisher.join();
+	for (auto& consumer : consumers) {
+		consumer.join();
+	}
+
+	auto latencies = std::make_unique<Histogram>();
+	broker.collect_ack_latencies(*latencies);
+	auto seconds = std::chrono::duration<double>(end - start).count();
+	std::printf("%11u %8u %9u %12.0f %10.1f %10.1f%s\n",
+		config.concurrency, config.prefetch, config.ack_batch,
+		broker.acked() / seconds,
+		latencies->percentile(50) / 1000.0,
+		latencies->percentile(99) / 1000.0,
+		all_acked ? "" : " (timed out)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 100000ull;
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(
+		argc > 2 ? std::stoul(argv[2]) : 50ul
+	);
+	broker_options.ack_latency = std::chrono::microseconds(
+		argc > 3 ? std::stoul(argv[3]) : 0ul
+	);
+
+	TaskRegistry registry;
+	registry.add("tasks.noop", noop);
+
+	std::printf("%llu messages, delivery latency %lld us, ack latency %lld us\n\n",
+		static_cast<unsigned long long>(messages),
+		static_cast<long long>(broker_options.delivery_latency.count()),
+		static_cast<long long>(broker_options.ack_latency.count()));
+	std::printf("concurrency prefetch ack-batch     msgs/sec   p50 (us)   p99 (us)\n");
+	for (unsigned concurrency : {1u, 2u, 4u}) {
+		for (std::uint16_t prefetch : {1, 16, 128}) {
+			for (unsigned ack_batch : {1u, 16u}) {
+				if (ack_batch > prefetch) {
+					continue;
+				}
+				run({concurrency, prefetch, ack_batch}, messages,
+					broker_options, registry);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,164 @@
+//
+// A benchmark of fixed prefetch counts and the adaptive one (see
+// prefetch_controller.h).
+//
+// Two workloads run on an in-process fake broker that pushes messages to
+// consumers like RabbitMQ (see fake_broker.h):
+//
+//  - Fast tasks (50 us of computation) already waiting in the queue, executed
+//    by a single consumer. The throughput is limited by the round trips to the
+//    broker unless the prefetch count is high.
+//  - Slow tasks (2 ms, every 10th 20 ms, spent sleeping) published at a steady
+//    rate and executed by four consumers. With a high prefetch count, tasks
+//    wait behind the slow ones in one consumer while the others are idle.
+//
+// No fixed count suits both. The adaptive one should get close to the best
+// fixed count in both.
+//
+// Usage: prefetch-bench [FAST_TASKS] [SLOW_TASKS] [DELIVERY_LATENCY_US]
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../histogram.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void compute(int microseconds) {
+	auto end = Clock::now() + std::chrono::microseconds(microseconds);
+	while (Clock::now() < end) {}
+}
+
+void wait(int microseconds) {
+	std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+}
+
+struct Workload {
+	const char* task;
+	std::uint64_t messages;
+	unsigned consumers;
+
+	// Messages per second (0 means that all of them are published before
+	// the consumers start).
+	double rate;
+
+	// The duration of the i-th task (in microseconds).
+	int (*duration)(std::uint64_t i);
+};
+
+// Runs the workload with the given prefetch count (0 means adaptive).
+void run(const Workload& workload, std::uint16_t prefetch,
+		std::chrono::microseconds delivery_latency, const TaskRegistry& registry) {
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = delivery_latency;
+	broker_options.push = true;
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	ConsumerOptions options;
+	options.prefetch = prefetch == 0 ? 1 : prefetch;
+	options.adaptive_prefetch = prefetch == 0;
+
+	auto publish = [&]() {
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string(workload.task)}};
+		auto start = Clock::now();
+		auto interval = std::chrono::duration<double>(
+			workload.rate > 0 ? 1 / workload.rate : 0);
+		for (std::uint64_t i = 0; i < workload.messages; ++i) {
+			std::this_thread::sleep_until(start +
+				std::chrono::duration_cast<std::chrono::nanoseconds>(i * interval));
+			encode_celery_body(message.body, workload.duration(i));
+			channel->publish("celery", "celery", message);
+		}
+	};
+	if (workload.rate == 0) {
+		publish();
+	}
+
+	std::vector<ConsumerMetrics*> consumer_metrics;
+	std::vector<std::thread> consumers;
+	auto start = Clock::now();
+	for (unsigned i = 0; i < workload.consumers; ++i) {
+		auto metrics_of_consumer = &metrics.add_consumer();
+		consumer_metrics.push_back(metrics_of_consumer);
+		consumers.emplace_back([&, metrics_of_consumer]() {
+			consume(broker, options, registry, *metrics_of_consumer, shutdown);
+		});
+	}
+	std::thread publisher;
+	if (workload.rate > 0) {
+		publisher = std::thread(publish);
+	}
+
+	auto all_acked = broker.wait_for_acks(workload.messages, std::chrono::minutes(10));
+	auto end = Clock::now();
+	shutdown.request();
+	if (publisher.joinable()) {
+		publisher.join();
+	}
+	for (auto& consumer : consumers) {
+		consumer.join();
+	}
+
+	std::int64_t final_prefetch = 0;
+	for (auto consumer : consumer_metrics) {
+		final_prefetch += consumer->prefetch.get();
+	}
+	auto latencies = std::make_unique<Histogram>();
+	broker.collect_ack_latencies(*latencies);
+	auto name = prefetch == 0 ? std::string("adaptive") : std::to_string(prefetch);
+	std::printf("%-6s %-9s %12.0f %10.1f %10.1f %14.1f%s\n",
+		workload.task + 6, name.c_str(),
+		workload.messages / std::chrono::duration<double>(end - start).count(),
+		latencies->percentile(90) / 1e6,
+		latencies->percentile(99) / 1e6,
+		static_cast<double>(final_prefetch) / workload.consumers,
+		all_acked ? "" : " (timed out)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto fast_tasks = argc > 1 ? std::stoull(argv[1]) : 50000ull;
+	auto slow_tasks = argc > 2 ? std::stoull(argv[2]) : 1000ull;
+	auto delivery_latency = std::chrono::microseconds(
+		argc > 3 ? std::stoul(argv[3]) : 200ul);
+
+	TaskRegistry registry;
+	registry.add("tasks.fast", compute);
+	registry.add("tasks.slow", wait);
+
+	Workload fast{"tasks.fast", fast_tasks, 1, 0,
+		[](std::uint64_t) { return 50; }};
+	Workload slow{"tasks.slow", slow_tasks, 4, 400,
+		[](std::uint64_t i) { return i % 10 == 0 ? 20000 : 2000; }};
+
+	std::printf("delivery latency %lld us\n\n",
+		static_cast<long long>(delivery_latency.count()));
+	std::printf("tasks  prefetch      msgs/sec   p90 (ms)   p99 (ms)  final prefetch\n");
+	for (const auto& workload : {fast, slow}) {
+		for (std::uint16_t prefetch : {1, 16, 256, 0}) {
+			run(workload, prefetch, delivery_latency, registry);
+		}
+	}
+	return 0;
+}
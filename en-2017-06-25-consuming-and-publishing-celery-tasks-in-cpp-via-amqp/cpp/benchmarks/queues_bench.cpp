@@ -0,0 +1,168 @@
+//
+// A benchmark of consuming from several queues with weighted-fair scheduling
+// (see fair_queue.h).
+//
+// A single consumer gets a backlog of bulk tasks (2 ms each) and, at the same
+// time, a steady stream of short interactive tasks (100 us each). With a
+// single queue for both of them, every interactive task waits behind the
+// whole backlog. With a queue for each of them, the consumer takes turns
+// between the queues, and the interactive queue only waits behind a bulk
+// task that is being executed (and behind its own tasks). The runs with two
+// queues differ in the weight of the interactive queue. Tasks sleep instead of
+// computing, so the results do not depend on the number of cores.
+//
+// Usage: queues-bench [BULK_MESSAGES] [INTERACTIVE_MESSAGES] [PREFETCH]
+//
+// Latencies of interactive tasks are measured from publishing their messages
+// until the start of their execution. The run ends when all interactive tasks
+// have been executed, and the throughput of bulk tasks is measured until
+// then.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../histogram.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+
+namespace {
+
+// The rate at which interactive tasks are published.
+constexpr double InteractiveRate = 500;
+
+// Latencies of interactive tasks (in nanoseconds), recorded by the consumer.
+Histogram* interactive_latencies = nullptr;
+
+std::atomic<std::uint64_t> bulk_done(0);
+std::atomic<std::uint64_t> interactive_done(0);
+
+std::int64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void bulk(int microseconds) {
+	std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+	bulk_done.fetch_add(1, std::memory_order_relaxed);
+}
+
+void interactive(std::int64_t published_ns, int microseconds) {
+	interactive_latencies->record(
+		static_cast<std::uint64_t>(now_ns() - published_ns));
+	std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+	interactive_done.fetch_add(1, std::memory_order_release);
+}
+
+void run(const char* name, std::vector<QueueOptions> queues,
+		std::uint64_t bulk_messages, std::uint64_t interactive_messages,
+		std::uint16_t prefetch, const TaskRegistry& registry) {
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	auto latencies = std::make_unique<Histogram>();
+	interactive_latencies = latencies.get();
+	bulk_done = 0;
+	interactive_done = 0;
+
+	// With a single queue, both kinds of tasks go into it.
+	const auto& bulk_queue = queues.front().name;
+	const auto& interactive_queue = queues.back().name;
+
+	ConsumerOptions options;
+	options.queues = queues;
+	options.prefetch = prefetch;
+	options.ack_batch = prefetch;
+
+	{
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.bulk")}};
+		encode_celery_body(message.body, 2000);
+		for (std::uint64_t i = 0; i < bulk_messages; ++i) {
+			channel->publish("celery", bulk_queue, message);
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto& consumer_metrics = metrics.add_consumer();
+	std::thread consumer([&]() {
+		consume(broker, options, registry, consumer_metrics, shutdown);
+	});
+	std::thread publisher([&]() {
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.interactive")}};
+		auto interval = std::chrono::duration<double>(1 / InteractiveRate);
+		for (std::uint64_t i = 0; i < interactive_messages; ++i) {
+			std::this_thread::sleep_until(start +
+				std::chrono::duration_cast<std::chrono::nanoseconds>(i * interval));
+			encode_celery_body(message.body, now_ns(), 100);
+			channel->publish("celery", interactive_queue, message);
+		}
+	});
+
+	auto deadline = start + std::chrono::minutes(10);
+	while (interactive_done.load(std::memory_order_acquire) < interactive_messages &&
+			std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	auto end = std::chrono::steady_clock::now();
+	auto bulk_executed = bulk_done.load();
+	shutdown.request();
+	publisher.join();
+	consumer.join();
+
+	std::printf("%-26s %10.2f %10.2f %10.2f %14.0f%s\n",
+		name,
+		latencies->percentile(50) / 1e6,
+		latencies->percentile(99) / 1e6,
+		latencies->percentile(100) / 1e6,
+		bulk_executed / std::chrono::duration<double>(end - start).count(),
+		interactive_done.load() < interactive_messages ? " (timed out)" : "");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto bulk_messages = argc > 1 ? std::stoull(argv[1]) : 1000ull;
+	auto interactive_messages = argc > 2 ? std::stoull(argv[2]) : 500ull;
+	auto prefetch = argc > 3 ? static_cast<std::uint16_t>(std::stoul(argv[3])) : 16;
+
+	TaskRegistry registry;
+	registry.add("tasks.bulk", bulk);
+	registry.add("tasks.interactive", interactive);
+
+	std::printf("%llu bulk messages (2 ms), %llu interactive messages (100 us) "
+		"at %.0f msgs/sec, prefetch %u\n\n",
+		static_cast<unsigned long long>(bulk_messages),
+		static_cast<unsigned long long>(interactive_messages),
+		InteractiveRate, static_cast<unsigned>(prefetch));
+	std::printf("queues (interactive weight)  p50 (ms)   p99 (ms)   max (ms)"
+		"  bulk msgs/sec\n");
+	run("one queue", {{"celery", 1}}, bulk_messages, interactive_messages,
+		prefetch, registry);
+	for (auto weight : {1u, 4u}) {
+		auto name = "two queues (" + std::to_string(weight) + ")";
+		run(name.c_str(), {{"bulk", 1}, {"interactive", weight}}, bulk_messages,
+			interactive_messages, prefetch, registry);
+	}
+	return 0;
+}
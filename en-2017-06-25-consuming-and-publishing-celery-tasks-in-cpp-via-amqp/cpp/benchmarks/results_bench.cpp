@@ -0,0 +1,143 @@
+//
+// A benchmark of publishing results of tasks (see result_publisher.h).
+//
+// A single consumer executes tasks.add from an in-process fake broker (see
+// fake_broker.h) whose publishes wait for a simulated confirm. Every message
+// has a reply queue, from which the results are received by a ResultReceiver
+// (see async_result.h), just like in a client. The clock stops when all
+// messages have been acknowledged and the results of all tasks have arrived.
+// The runs with results differ in the number of results that can wait for
+// their confirms at once (--result-window of the worker).
+//
+// Usage: results-bench [MESSAGES] [CONFIRM_LATENCY_US]
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../async_result.h"
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../metrics.h"
+#include "../result_publisher.h"
+#include "../shutdown.h"
+#include "../task_id.h"
+#include "../task_registry.h"
+
+namespace {
+
+// The number of threads that publish the messages before the consumer starts
+// (every publish waits for a confirm).
+constexpr unsigned Publishers = 32;
+
+std::int64_t add(std::int64_t x, std::int64_t y) {
+	return x + y;
+}
+
+void run(const char* name, bool results, unsigned window,
+		std::uint64_t messages, std::chrono::microseconds confirm_latency) {
+	FakeBrokerOptions broker_options;
+	broker_options.publish_latency = confirm_latency;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	TaskRegistry registry;
+	registry.add("tasks.add", add);
+
+	ConsumerOptions options;
+	options.prefetch = 64;
+	options.ack_batch = 64;
+
+	// Register the tasks with the receiver before their messages are
+	// published, like CeleryClient does.
+	std::optional<ResultReceiver> receiver;
+	std::optional<ResultPublisher> publisher;
+	std::vector<AsyncResult> handles;
+	std::vector<std::string> ids;
+	if (results) {
+		receiver.emplace(broker);
+		publisher.emplace(broker, window);
+		handles.reserve(messages);
+	}
+	for (std::uint64_t i = 0; i < messages; ++i) {
+		ids.push_back(generate_task_id());
+		if (receiver) {
+			handles.push_back(receiver->expect(ids.back()));
+		}
+	}
+
+	std::vector<std::thread> publishers;
+	for (unsigned p = 0; p < Publishers; ++p) {
+		publishers.emplace_back([&, p]() {
+			auto channel = broker.open_channel();
+			Message message;
+			message.content_type = "application/json";
+			message.content_encoding = "utf-8";
+			message.headers = {{"task", std::string("tasks.add")}};
+			if (receiver) {
+				message.reply_to = receiver->queue();
+			}
+			for (auto i = p; i < messages; i += Publishers) {
+				encode_celery_body(message.body, static_cast<std::int64_t>(i), 1);
+				message.headers["id"] = ids[i];
+				message.correlation_id = receiver ? ids[i] : std::string();
+				channel->publish("celery", "celery", message);
+			}
+		});
+	}
+	for (auto& publisher : publishers) {
+		publisher.join();
+	}
+
+	auto published_before = ResultPublisher::published_results();
+	auto batches_before = ResultPublisher::result_batches();
+	auto start = std::chrono::steady_clock::now();
+	auto& consumer_metrics = metrics.add_consumer();
+	std::thread consumer([&]() {
+		consume(broker, options, registry, consumer_metrics, shutdown,
+			publisher ? &*publisher : nullptr);
+	});
+	auto complete = broker.wait_for_acks(messages, std::chrono::minutes(10));
+	for (std::uint64_t i = 0; complete && i < handles.size(); ++i) {
+		auto result = handles[i].wait_for(std::chrono::minutes(10));
+		complete = result && result->result == std::to_string(i + 1);
+	}
+	auto end = std::chrono::steady_clock::now();
+	shutdown.request();
+	consumer.join();
+
+	auto published = ResultPublisher::published_results() - published_before;
+	auto batches = ResultPublisher::result_batches() - batches_before;
+	std::printf("%-18s %12.0f %18.1f%s\n",
+		name,
+		messages / std::chrono::duration<double>(end - start).count(),
+		batches > 0 ? static_cast<double>(published) / batches : 0.0,
+		complete ? "" : " (incomplete)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 20000ull;
+	auto confirm_latency = std::chrono::microseconds(
+		argc > 2 ? std::stoul(argv[2]) : 100);
+
+	std::printf("%llu messages, prefetch 64, ack batch 64, confirm latency %lld us\n\n",
+		static_cast<unsigned long long>(messages),
+		static_cast<long long>(confirm_latency.count()));
+	std::printf("results              msgs/sec  results per batch\n");
+	run("none", false, 0, messages, confirm_latency);
+	for (auto window : {1u, 4u, 16u}) {
+		auto name = "window " + std::to_string(window);
+		run(name.c_str(), true, window, messages, confirm_latency);
+	}
+	return 0;
+}
@@ -0,0 +1,128 @@
+//
+// A benchmark of the throughput of a consumer with bad messages among good
+// ones (see FailedTasks in consumer.cpp).
+//
+// A single consumer executes tasks.check, which fails for negative numbers,
+// from an in-process fake broker (see fake_broker.h). A tenth of the messages
+// is bad: either their arguments cannot be decoded (poison messages), or
+// their tasks fail. Failed tasks are either moved into the dead-letter queue
+// right away, or retried three times first (with a 1 ms backoff, so retries
+// wait in the consumer, see DelayedTasks). The throughput is computed from
+// the original messages; all of them have been acknowledged when the clock
+// stops.
+//
+// Failures are logged to the standard error, so run the benchmark with
+// 2>/dev/null.
+//
+// Usage: retry-bench [MESSAGES]
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+
+namespace {
+
+enum class Bad {
+	None,
+	Poison,
+	Failing
+};
+
+struct Config {
+	const char* name;
+	Bad bad;
+	unsigned max_retries;
+};
+
+void check(int value) {
+	if (value < 0) {
+		throw std::runtime_error("negative value: " + std::to_string(value));
+	}
+}
+
+void run(const Config& config, std::uint64_t messages) {
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	TaskRegistry registry;
+	registry.add("tasks.check", check);
+	RetryPolicy policy;
+	policy.max_retries = config.max_retries;
+	policy.backoff = std::chrono::milliseconds(1);
+	registry.set_retry_policy(policy);
+
+	ConsumerOptions options;
+	options.prefetch = 64;
+	options.ack_batch = 64;
+
+	std::uint64_t bad = 0;
+	{
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.check")}};
+		for (std::uint64_t i = 0; i < messages; ++i) {
+			auto is_bad = config.bad != Bad::None && i % 10 == 0;
+			if (is_bad && config.bad == Bad::Poison) {
+				encode_celery_body(message.body, "not a number");
+			} else {
+				encode_celery_body(message.body, is_bad ? -1 : static_cast<int>(i % 100));
+			}
+			bad += is_bad;
+			channel->publish("celery", "celery", message);
+		}
+	}
+
+	// Every retry is a new message that gets acknowledged, too.
+	auto expected_acks = messages +
+		(config.bad == Bad::Failing ? bad * config.max_retries : 0);
+	auto start = std::chrono::steady_clock::now();
+	auto& consumer_metrics = metrics.add_consumer();
+	std::thread consumer([&]() {
+		consume(broker, options, registry, consumer_metrics, shutdown);
+	});
+	auto all_acked = broker.wait_for_acks(expected_acks, std::chrono::minutes(10));
+	auto end = std::chrono::steady_clock::now();
+	shutdown.request();
+	consumer.join();
+
+	std::printf("%-22s %12.0f %10llu %14llu%s\n",
+		config.name,
+		messages / std::chrono::duration<double>(end - start).count(),
+		static_cast<unsigned long long>(consumer_metrics.retries.get()),
+		static_cast<unsigned long long>(broker.ready(options.dead_letter_queue)),
+		all_acked ? "" : " (timed out)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 100000ull;
+
+	std::printf("%llu messages, prefetch 64, ack batch 64\n\n",
+		static_cast<unsigned long long>(messages));
+	std::printf("messages                   msgs/sec    retries   dead letters\n");
+	for (const auto& config : {
+			Config{"good", Bad::None, 0},
+			Config{"10% poison", Bad::Poison, 3},
+			Config{"10% failing", Bad::Failing, 0},
+			Config{"10% failing, 3 retries", Bad::Failing, 3}}) {
+		run(config, messages);
+	}
+	return 0;
+}
@@ -0,0 +1,115 @@
+//
+// A micro-benchmark that compares the JSON and MessagePack serializers on
+// typical bodies of task messages: the size of encoded bodies and the time
+// needed to encode them and to decode all their arguments.
+//
+// Usage: serializer-bench [ITERATIONS]
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "../celery_body.h"
+#include "../msgpack_body.h"
+
+namespace {
+
+// Prevents the compiler from optimizing away the benchmarked code.
+volatile std::size_t sink = 0;
+
+// Runs the given function `iterations` times and returns the time per
+// iteration (in nanoseconds).
+template<typename F>
+double run(std::size_t iterations, F f) {
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < iterations; ++i) {
+		f();
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+// Benchmarks both serializers on a body with the given arguments. `decode` is
+// called with a decoder of the body (CeleryBody or MsgpackBody) and has to
+// decode all the arguments.
+template<typename Decode, typename... Args>
+void bench_body(const char* description, std::size_t iterations,
+		Decode decode, const Args&... args) {
+	std::string json_body;
+	std::string msgpack_body;
+	auto json_encode = run(iterations, [&]() {
+		encode_celery_body(json_body, args...);
+		sink = sink + json_body.size();
+	});
+	auto msgpack_encode = run(iterations, [&]() {
+		encode_celery_body_msgpack(msgpack_body, args...);
+		sink = sink + msgpack_body.size();
+	});
+	auto json_decode = run(iterations, [&]() {
+		sink = sink + decode(CeleryBody(json_body));
+	});
+	auto msgpack_decode = run(iterations, [&]() {
+		sink = sink + decode(MsgpackBody(msgpack_body));
+	});
+
+	std::cout << description << ":\n"
+		<< "  json:    " << json_body.size() << " bytes, encode "
+		<< json_encode << " ns/msg, decode " << json_decode << " ns/msg\n"
+		<< "  msgpack: " << msgpack_body.size() << " bytes, encode "
+		<< msgpack_encode << " ns/msg, decode " << msgpack_decode << " ns/msg\n";
+}
+
+}
+
+int main(int argc, char** argv) {
+	std::size_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+	// The body sent by hello.
+	bench_body("hello(name, age)", iterations,
+		[](const auto& body) {
+			return body.template arg<std::string_view>(0).size() +
+				body.template arg<int>(1);
+		},
+		"Fred Flintstone", 42
+	);
+
+	// A typical "business" task: identifiers, a price, flags, and a note.
+	bench_body("order(id, customer, price, qty, express, gift, note)", iterations,
+		[](const auto& body) {
+			return body.template arg<long long>(0) +
+				body.template arg<std::string_view>(1).size() +
+				static_cast<std::size_t>(body.template arg<double>(2)) +
+				body.template arg<int>(3) +
+				body.template arg<bool>(4) +
+				body.template arg<bool>(5) +
+				body.template arg<std::string_view>(6).size();
+		},
+		9007199254740993LL, "c7b1a9e4-53d2-4b7e-9a5c-2f1d0e8c6b34", 1234.5,
+		3, true, false, "Leave at the door, please."
+	);
+
+	// A string that needs escaping in JSON (quotes, newlines, non-ASCII
+	// characters stay as UTF-8). Escapes force CeleryBody to copy the
+	// string, while MessagePack strings are always returned as views.
+	bench_body("log(message)", iterations,
+		[](const auto& body) {
+			return body.template arg<std::string_view>(0).size();
+		},
+		"Request \"GET /\" failed:\n\tconnection reset by peer\n\tretrying in 5 s"
+	);
+
+	// Many numeric arguments (e.g. a sample of measurements).
+	bench_body("record(8 doubles)", iterations,
+		[](const auto& body) {
+			double sum = 0;
+			for (std::size_t i = 0; i < body.arg_count(); ++i) {
+				sum += body.template arg<double>(i);
+			}
+			return static_cast<std::size_t>(sum);
+		},
+		21.5, 21.625, 21.75, 22.0, 22.125, 21.875, 21.5, 21.25
+	);
+}
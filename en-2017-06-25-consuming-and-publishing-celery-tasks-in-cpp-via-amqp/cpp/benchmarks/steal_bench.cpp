@@ -0,0 +1,129 @@
+//
+// A benchmark of sharing tasks between consumers (see work_stealing.h) when
+// durations of tasks are skewed.
+//
+// Several consumers consume from a queue in which most tasks are short, but
+// some take much longer. Tasks are published at a steady rate that the
+// consumers can keep up with. With a prefetch count above 1, the messages
+// prefetched by a consumer that executes a long task wait until it finishes,
+// even when the other consumers are idle. The benchmark runs the consumers
+// with and without work stealing on an in-process fake broker that pushes
+// messages to consumers like RabbitMQ (see fake_broker.h). Tasks sleep instead
+// of computing, so the results do not depend on the number of cores.
+//
+// Usage: steal-bench [MESSAGES] [CONSUMERS] [PREFETCH] [MESSAGES_PER_SEC]
+//
+// Latencies are measured from publishing a message until its acknowledgement
+// reaches the broker. Every 50th task takes 20 ms by itself, so the 99th
+// percentile cannot get below that.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../celery_body.h"
+#include "../consumer.h"
+#include "../fake_broker.h"
+#include "../histogram.h"
+#include "../metrics.h"
+#include "../shutdown.h"
+#include "../task_registry.h"
+#include "../work_stealing.h"
+
+namespace {
+
+void work(int microseconds) {
+	std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+}
+
+void run(bool steal, std::uint64_t messages, unsigned consumer_count,
+		std::uint16_t prefetch, double rate, const TaskRegistry& registry) {
+	FakeBrokerOptions broker_options;
+	broker_options.delivery_latency = std::chrono::microseconds(50);
+	broker_options.push = true;
+	FakeBroker broker(broker_options);
+	Metrics metrics;
+	Shutdown shutdown;
+
+	ConsumerOptions options;
+	options.prefetch = prefetch;
+
+	auto stealing = steal ? std::make_unique<WorkStealing>(consumer_count) : nullptr;
+	std::vector<ConsumerMetrics*> consumer_metrics;
+	std::vector<std::thread> consumers;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < consumer_count; ++i) {
+		auto metrics_of_consumer = &metrics.add_consumer();
+		consumer_metrics.push_back(metrics_of_consumer);
+		consumers.emplace_back([&, metrics_of_consumer, i]() {
+			consume(broker, options, registry, *metrics_of_consumer, shutdown,
+				/*results*/nullptr, stealing.get(), i);
+		});
+	}
+
+	// Every 50th task takes 20 ms, the others 200 us.
+	std::thread publisher([&]() {
+		auto channel = broker.open_channel();
+		Message message;
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+		message.headers = {{"task", std::string("tasks.work")}};
+		auto interval = std::chrono::duration<double>(1 / rate);
+		for (std::uint64_t i = 0; i < messages; ++i) {
+			std::this_thread::sleep_until(start +
+				std::chrono::duration_cast<std::chrono::nanoseconds>(i * interval));
+			encode_celery_body(message.body, i % 50 == 0 ? 20000 : 200);
+			channel->publish("celery", "celery", message);
+		}
+	});
+
+	auto all_acked = broker.wait_for_acks(messages, std::chrono::minutes(10));
+	auto end = std::chrono::steady_clock::now();
+	shutdown.request();
+	publisher.join();
+	for (auto& consumer : consumers) {
+		consumer.join();
+	}
+
+	std::uint64_t stolen = 0;
+	for (auto consumer : consumer_metrics) {
+		stolen += consumer->stolen.get();
+	}
+
+	auto latencies = std::make_unique<Histogram>();
+	broker.collect_ack_latencies(*latencies);
+	std::printf("%-8s %10.2f %10.1f %10.1f %10.1f %10llu%s\n",
+		steal ? "steal" : "no steal",
+		std::chrono::duration<double>(end - start).count(),
+		latencies->percentile(50) / 1e6,
+		latencies->percentile(90) / 1e6,
+		latencies->percentile(99) / 1e6,
+		static_cast<unsigned long long>(stolen),
+		all_acked ? "" : " (timed out)");
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto messages = argc > 1 ? std::stoull(argv[1]) : 4000ull;
+	auto consumers = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 4u;
+	auto prefetch = argc > 3 ? static_cast<std::uint16_t>(std::stoul(argv[3])) : 16;
+	auto rate = argc > 4 ? std::stod(argv[4]) : 2000.0;
+
+	TaskRegistry registry;
+	registry.add("tasks.work", work);
+
+	std::printf("%llu messages (every 50th takes 20 ms, the others 200 us) at "
+		"%.0f msgs/sec, %u consumers, prefetch %u\n\n",
+		static_cast<unsigned long long>(messages), rate, consumers,
+		static_cast<unsigned>(prefetch));
+	std::printf("mode       time (s)   p50 (ms)   p90 (ms)   p99 (ms)     stolen\n");
+	run(false, messages, consumers, prefetch, rate, registry);
+	run(true, messages, consumers, prefetch, rate, registry);
+	return 0;
+}
@@ -0,0 +1,93 @@
+//
+// A benchmark of generation of task IDs (see task_id.h).
+//
+// Compares the generator from task_id.h with a typical generic
+// implementation: a random version 4 UUID from a shared std::mt19937_64
+// protected by a mutex, formatted via snprintf() into a new std::string.
+//
+// Usage: task-id-bench [IDS_PER_THREAD]
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../task_id.h"
+
+namespace {
+
+// Prevents the compiler from optimizing away the generated IDs.
+volatile char sink;
+
+std::mutex generic_mutex;
+std::mt19937_64 generic_random(std::random_device{}());
+
+std::string generic_task_id() {
+	std::uint64_t high, low;
+	{
+		std::lock_guard<std::mutex> lock(generic_mutex);
+		high = generic_random();
+		low = generic_random();
+	}
+	high = (high & ~std::uint64_t(0xf000)) | 0x4000;
+	low = (low & ~(std::uint64_t(3) << 62)) | (std::uint64_t(1) << 63);
+	char buffer[TaskIdSize + 1];
+	std::snprintf(buffer, sizeof(buffer), "%08x-%04x-%04x-%04x-%012llx",
+		static_cast<unsigned>(high >> 32),
+		static_cast<unsigned>((high >> 16) & 0xffff),
+		static_cast<unsigned>(high & 0xffff),
+		static_cast<unsigned>(low >> 48),
+		static_cast<unsigned long long>(low & 0xffffffffffffull));
+	return buffer;
+}
+
+template<typename Generate>
+double ids_per_second(unsigned threads, std::uint64_t ids, Generate generate) {
+	std::vector<std::thread> generators;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < threads; ++i) {
+		generators.emplace_back([&]() {
+			for (std::uint64_t j = 0; j < ids; ++j) {
+				generate();
+			}
+		});
+	}
+	for (auto& generator : generators) {
+		generator.join();
+	}
+	auto seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	return threads * ids / seconds;
+}
+
+}
+
+int main(int argc, char** argv) {
+	auto ids = argc > 1 ? std::stoull(argv[1]) : 1000000ull;
+
+	char example[TaskIdSize];
+	generate_task_id(example);
+	std::printf("%llu IDs per thread, e.g. %.*s\n\n",
+		static_cast<unsigned long long>(ids), static_cast<int>(TaskIdSize),
+		example);
+	std::printf("threads   generic (IDs/sec)   task_id.h (IDs/sec)\n");
+
+	for (unsigned threads : {1u, 2u, 4u, 8u}) {
+		auto generic = ids_per_second(threads, ids, []() {
+			auto id = generic_task_id();
+			sink = id[0];
+		});
+		auto fast = ids_per_second(threads, ids, []() {
+			char id[TaskIdSize];
+			generate_task_id(id);
+			sink = id[0];
+		});
+		std::printf("%7u %19.0f %21.0f\n", threads, generic, fast);
+	}
+	return 0;
+}
@@ -0,0 +1,208 @@
+//
+// An abstraction of a message broker (e.g. RabbitMQ) and of channels to it.
+//
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <variant>
+
+// A value of a message header. AMQP supports more types, but these are the
+// ones that Celery uses.
+using HeaderValue = std::variant<std::string, std::int64_t, double, bool>;
+
+// Headers of a message. The map supports lookups by std::string_view.
+using Headers = std::map<std::string, HeaderValue, std::less<>>;
+
+// Returns the value of the given string header, or nullptr when there is no
+// such header or when it is not a string.
+inline const std::string* find_string_header(const Headers& headers,
+		std::string_view name) {
+	auto it = headers.find(name);
+	return it != headers.end() ? std::get_if<std::string>(&it->second) : nullptr;
+}
+
+// Stores the given string into a header value. When the value already is a
+// string, its buffer is reused.
+inline void assign_header_value(HeaderValue& value, std::string_view string) {
+	if (auto current = std::get_if<std::string>(&value)) {
+		current->assign(string);
+	} else {
+		value.emplace<std::string>(string);
+	}
+}
+
+// Stores the given non-string value into a header value.
+inline void assign_header_value(HeaderValue& value, std::int64_t other) {
+	value = other;
+}
+
+inline void assign_header_value(HeaderValue& value, double other) {
+	value = other;
+}
+
+inline void assign_header_value(HeaderValue& value, bool other) {
+	value = other;
+}
+
+// Makes `headers` equal to the headers from `source`, a map from names to
+// values sorted by names (e.g. Headers or AmqpClient::Table).
+// `assign(value, source_value)` has to store the source value into `value`
+// (see assign_header_value()), or return false when the header should be
+// skipped.
+//
+// Instead of building a new map, entries with the same names are updated in
+// place, so their nodes and the buffers of their strings are reused. Messages
+// of Celery tasks have the same headers, so when a delivery is reused (see
+// Channel::consume_message()), receiving a message does not allocate memory
+// for its headers.
+template<typename Source, typename Assign>
+void assign_headers(Headers& headers, const Source& source, Assign assign) {
+	auto it = headers.begin();
+	for (const auto& [name, source_value] : source) {
+		while (it != headers.end() && it->first < name) {
+			it = headers.erase(it);
+		}
+		if (it == headers.end() || it->first != name) {
+			it = headers.emplace_hint(it, name, HeaderValue());
+		}
+		it = assign(it->second, source_value) ? std::next(it) : headers.erase(it);
+	}
+	headers.erase(it, headers.end());
+}
+
+// A message (its body and properties).
+//
+// The reply_to and correlation_id properties are used for results of tasks:
+// a client that wants the result of a task puts the name of its reply queue
+// into the former and the ID of the task into the latter, and the worker
+// publishes the result into that queue with the same correlation ID (see
+// result_publisher.h). Empty means that the property is not set.
+//
+// The priority property (0 to 255, higher is more urgent) orders messages in
+// queues declared with a maximal priority on the server, and delivered
+// messages in a consumer of several queues (see fair_queue.h). Zero also means
+// that the property is not set, which is how the server treats such messages.
+struct Message {
+	std::string body;
+	std::string content_type;
+	std::string content_encoding;
+	std::string correlation_id;
+	std::string reply_to;
+	std::uint8_t priority = 0;
+	Headers headers;
+};
+
+// Makes `message` a copy of `source`, reusing the buffers of `message` (see
+// assign_headers()). Unlike the copy assignment, it does not allocate memory
+// when the buffers are large enough.
+inline void assign_message(Message& message, const Message& source) {
+	message.body.assign(source.body);
+	message.content_type.assign(source.content_type);
+	message.content_encoding.assign(source.content_encoding);
+	message.correlation_id.assign(source.correlation_id);
+	message.reply_to.assign(source.reply_to);
+	message.priority = source.priority;
+	assign_headers(message.headers, source.headers,
+		[](HeaderValue& value, const HeaderValue& source_value) {
+			std::visit([&](const auto& v) { assign_header_value(value, v); },
+				source_value);
+			return true;
+		});
+}
+
+// Identifies a delivered message when acknowledging it.
+//
+// Delivery tags are only unique per AMQP channel, and a single Channel below
+// may consist of several AMQP channels (the used AMQP library opens one for
+// each consumer), so the AMQP channel is a part of the identification.
+// Acknowledging with the 'multiple' flag acknowledges all unacknowledged
+// messages up to the given tag that were delivered over the same AMQP
+// channel.
+struct DeliveryInfo {
+	std::uint64_t delivery_tag = 0;
+	std::uint16_t delivery_channel = 0;
+};
+
+// A message delivered to a consumer.
+struct Delivery {
+	Message message;
+	std::string consumer_tag;
+	DeliveryInfo info;
+	bool redelivered = false;
+};
+
+// A channel to a broker.
+//
+// Just like AmqpClient::Channel, a channel is not thread-safe, so it should
+// be used by a single thread.
+class Channel {
+public:
+	virtual ~Channel() = default;
+
+	// Publishes the message to the given exchange with the given routing key.
+	// Returns after the broker has confirmed the message.
+	virtual void publish(const std::string& exchange,
+		const std::string& routing_key, const Message& message) = 0;
+
+	// Declares a queue with the given name (when it does not exist yet), so
+	// that messages published into it are not dropped. A durable queue
+	// survives a restart of the server. A temporary one is used only by the
+	// connection of this channel and is deleted when the connection is
+	// closed (e.g. a reply queue of a client).
+	virtual void declare_queue(const std::string& queue, bool temporary) = 0;
+
+	// Starts consuming messages from the given queue with manual
+	// acknowledgements. At most `prefetch` unacknowledged messages are
+	// delivered to the consumer at a time. Returns the consumer tag.
+	virtual std::string consume(const std::string& queue,
+		std::uint16_t prefetch) = 0;
+
+	// Waits for a message for any consumer started on this channel, at most
+	// `timeout` milliseconds (-1 means forever). Returns false when no
+	// message was delivered (the timeout expired or the waiting was
+	// interrupted). The message is stored into the given delivery in place
+	// (see assign_message()), so a delivery reused between calls saves
+	// allocations.
+	virtual bool consume_message(Delivery& delivery, int timeout) = 0;
+
+	// Interrupts consume_message() waiting on this channel, which then
+	// returns false. When nobody is waiting, the next call of
+	// consume_message() returns false right away. Unlike the other methods,
+	// this one can be called from any thread.
+	virtual void interrupt() = 0;
+
+	// Acknowledges the given delivered message (or all messages up to it
+	// when `multiple` is true).
+	virtual void ack(const DeliveryInfo& info, bool multiple) = 0;
+
+	// Changes the prefetch count of the given consumer (see consume()). When
+	// it is lowered below the number of unacknowledged messages, no further
+	// messages are delivered until enough of them have been acknowledged.
+	virtual void qos(const std::string& consumer_tag, std::uint16_t prefetch) = 0;
+
+	// Cancels the given consumer, so no more messages are delivered to it.
+	// Just like with AMQP's basic.cancel, messages that have already been
+	// delivered but not acknowledged stay with the channel: they can still be
+	// acknowledged, and the server returns them to the queue only when the
+	// channel is closed.
+	virtual void cancel(const std::string& consumer_tag) = 0;
+};
+
+// A broker.
+class Broker {
+public:
+	virtual ~Broker() = default;
+
+	// Opens a new channel. Can be called from any thread.
+	virtual std::unique_ptr<Channel> open_channel() = 0;
+};
+
+#endif
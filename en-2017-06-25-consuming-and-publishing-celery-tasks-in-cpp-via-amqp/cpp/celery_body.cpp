@@ -0,0 +1,405 @@
+//
+// Encoding and lazy decoding of bodies of Celery task messages.
+//
+
+#include <charconv>
+#include <cstring>
+
+#include "celery_body.h"
+
+namespace {
+
+[[noreturn]] void fail(const char* reason, std::string_view body, std::size_t pos) {
+	throw CeleryBodyError(
+		std::string(reason) + " at offset " + std::to_string(pos) +
+		" in body: " + std::string(body.substr(0, 64))
+	);
+}
+
+std::size_t skip_ws(std::string_view s, std::size_t pos) {
+	while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' ||
+			s[pos] == '\n' || s[pos] == '\r')) {
+		++pos;
+	}
+	return pos;
+}
+
+// Skips a string starting at `pos` (which points to the opening quote) and
+// returns the position right after its closing quote.
+std::size_t skip_string(std::string_view s, std::size_t pos) {
+	for (++pos; pos < s.size(); ++pos) {
+		if (s[pos] == '\\') {
+			++pos;
+		} else if (s[pos] == '"') {
+			return pos + 1;
+		}
+	}
+	fail("unterminated string", s, pos);
+}
+
+// Skips a JSON value starting at `pos` and returns the position right after
+// it. Arrays and objects are skipped by counting brackets (without
+// recursion), so their contents are not validated.
+std::size_t skip_value(std::string_view s, std::size_t pos) {
+	if (pos >= s.size()) {
+		fail("missing value", s, pos);
+	}
+
+	if (s[pos] == '"') {
+		return skip_string(s, pos);
+	}
+
+	if (s[pos] == '[' || s[pos] == '{') {
+		std::size_t depth = 0;
+		while (pos < s.size()) {
+			auto c = s[pos];
+			if (c == '"') {
+				pos = skip_string(s, pos);
+				continue;
+			}
+			if (c == '[' || c == '{') {
+				++depth;
+			} else if ((c == ']' || c == '}') && --depth == 0) {
+				return pos + 1;
+			}
+			++pos;
+		}
+		fail("unterminated array or object", s, pos);
+	}
+
+	// A number or a literal (true, false, null).
+	auto start = pos;
+	while (pos < s.size() && s[pos] != ',' && s[pos] != ']' &&
+			s[pos] != '}' && s[pos] != ' ' && s[pos] != '\t' &&
+			s[pos] != '\n' && s[pos] != '\r') {
+		++pos;
+	}
+	if (pos == start) {
+		fail("missing value", s, pos);
+	}
+	return pos;
+}
+
+// Reads four hexadecimal digits of a \uXXXX escape sequence.
+unsigned read_hex4(std::string_view s, std::size_t pos) {
+	if (pos + 4 > s.size()) {
+		fail("truncated \\u escape sequence", s, pos);
+	}
+	unsigned value = 0;
+	auto result = std::from_chars(s.data() + pos, s.data() + pos + 4, value, 16);
+	if (result.ec != std::errc() || result.ptr != s.data() + pos + 4) {
+		fail("invalid \\u escape sequence", s, pos);
+	}
+	return value;
+}
+
+// Writes the given code point in UTF-8 to `out` and returns the position
+// after the last written byte.
+char* write_utf8(unsigned cp, char* out) {
+	if (cp < 0x80) {
+		*out++ = static_cast<char>(cp);
+	} else if (cp < 0x800) {
+		*out++ = static_cast<char>(0xC0 | (cp >> 6));
+		*out++ = static_cast<char>(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		*out++ = static_cast<char>(0xE0 | (cp >> 12));
+		*out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		*out++ = static_cast<char>(0x80 | (cp & 0x3F));
+	} else {
+		*out++ = static_cast<char>(0xF0 | (cp >> 18));
+		*out++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+		*out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		*out++ = static_cast<char>(0x80 | (cp & 0x3F));
+	}
+	return out;
+}
+
+// Unescapes the contents of a string (without quotes) into `out` and returns
+// the position after the last written byte. `out` has to have space for at
+// least `s.size()` bytes.
+char* unescape(std::string_view s, char* out) {
+	for (std::size_t pos = 0; pos < s.size(); ++pos) {
+		if (s[pos] != '\\') {
+			*out++ = s[pos];
+			continue;
+		}
+
+		if (++pos >= s.size()) {
+			fail("truncated escape sequence", s, pos);
+		}
+		switch (s[pos]) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '/': *out++ = '/'; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				auto cp = read_hex4(s, pos + 1);
+				pos += 4;
+				// Characters outside of the Basic Multilingual Plane are
+				// encoded as surrogate pairs.
+				if (cp >= 0xD800 && cp <= 0xDBFF) {
+					if (pos + 6 >= s.size() || s[pos + 1] != '\\' || s[pos + 2] != 'u') {
+						fail("unpaired surrogate", s, pos);
+					}
+					auto low = read_hex4(s, pos + 3);
+					if (low < 0xDC00 || low > 0xDFFF) {
+						fail("invalid surrogate pair", s, pos);
+					}
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+					pos += 6;
+				}
+				out = write_utf8(cp, out);
+				break;
+			}
+			default:
+				fail("invalid escape sequence", s, pos);
+		}
+	}
+	return out;
+}
+
+// Checks that `raw` is a string and returns its contents (without quotes).
+std::string_view string_contents(std::string_view raw) {
+	if (raw.size() < 2 || raw.front() != '"' || raw.back() != '"') {
+		throw CeleryBodyError("argument is not a string: " + std::string(raw));
+	}
+	return raw.substr(1, raw.size() - 2);
+}
+
+template<typename T>
+void parse_number(std::string_view raw, T& value, const char* expected) {
+	auto end = raw.data() + raw.size();
+	auto result = std::from_chars(raw.data(), end, value);
+	if (result.ec != std::errc() || result.ptr != end) {
+		throw CeleryBodyError(
+			std::string("argument is not ") + expected + ": " + std::string(raw)
+		);
+	}
+}
+
+}
+
+CeleryBody::CeleryBody(std::string_view body): body(body) {
+	// [
+	auto pos = skip_ws(body, 0);
+	if (pos >= body.size() || body[pos] != '[') {
+		fail("expected '['", body, pos);
+	}
+
+	// args
+	pos = skip_ws(body, pos + 1);
+	if (pos >= body.size() || body[pos] != '[') {
+		fail("expected an array of positional arguments", body, pos);
+	}
+	pos = skip_ws(body, pos + 1);
+	if (pos < body.size() && body[pos] == ']') {
+		++pos;
+	} else {
+		for (;;) {
+			auto end = skip_value(body, pos);
+			auto arg = body.substr(pos, end - pos);
+			if (args_count < InlineArgs) {
+				inline_args[args_count] = arg;
+			} else {
+				extra_args.push_back(arg);
+			}
+			++args_count;
+
+			pos = skip_ws(body, end);
+			if (pos < body.size() && body[pos] == ',') {
+				pos = skip_ws(body, pos + 1);
+			} else if (pos < body.size() && body[pos] == ']') {
+				++pos;
+				break;
+			} else {
+				fail("expected ',' or ']'", body, pos);
+			}
+		}
+	}
+
+	// kwargs and embed (both optional)
+	std::string_view* rest[] = {&kwargs, &embed};
+	for (auto part : rest) {
+		pos = skip_ws(body, pos);
+		if (pos >= body.size() || body[pos] != ',') {
+			break;
+		}
+		pos = skip_ws(body, pos + 1);
+		if (pos >= body.size() || body[pos] != '{') {
+			fail("expected '{'", body, pos);
+		}
+		auto end = skip_value(body, pos);
+		*part = body.substr(pos, end - pos);
+		pos = end;
+	}
+
+	// ]
+	pos = skip_ws(body, pos);
+	if (pos >= body.size() || body[pos] != ']') {
+		fail("expected ']'", body, pos);
+	}
+	if (skip_ws(body, pos + 1) != body.size()) {
+		fail("trailing characters", body, pos + 1);
+	}
+}
+
+std::size_t CeleryBody::arg_count() const {
+	return args_count;
+}
+
+std::string_view CeleryBody::raw_arg(std::size_t i) const {
+	if (i >= args_count) {
+		throw CeleryBodyError(
+			"missing positional argument #" + std::to_string(i) +
+			" (there are " + std::to_string(args_count) + ")"
+		);
+	}
+	return i < InlineArgs ? inline_args[i] : extra_args[i - InlineArgs];
+}
+
+std::string_view CeleryBody::raw_kwargs() const {
+	return kwargs;
+}
+
+std::string_view CeleryBody::raw_embed() const {
+	return embed;
+}
+
+void CeleryBody::decode(std::string_view raw, std::string_view& value) const {
+	auto contents = string_contents(raw);
+	if (contents.find('\\') == std::string_view::npos) {
+		// The most common case: a view into the body.
+		value = contents;
+		return;
+	}
+
+	auto start = allocate_scratch(contents.size());
+	auto end = unescape(contents, start);
+	value = std::string_view(start, end - start);
+}
+
+void CeleryBody::decode(std::string_view raw, std::string& value) const {
+	std::string_view view;
+	decode(raw, view);
+	value.assign(view.data(), view.size());
+}
+
+void CeleryBody::decode(std::string_view raw, bool& value) const {
+	if (raw == "true") {
+		value = true;
+	} else if (raw == "false") {
+		value = false;
+	} else {
+		throw CeleryBodyError("argument is not a bool: " + std::string(raw));
+	}
+}
+
+void CeleryBody::decode(std::string_view raw, long long& value) const {
+	parse_number(raw, value, "an integer");
+}
+
+void CeleryBody::decode(std::string_view raw, unsigned long long& value) const {
+	parse_number(raw, value, "a non-negative integer");
+}
+
+void CeleryBody::decode(std::string_view raw, double& value) const {
+	parse_number(raw, value, "a number");
+}
+
+char* CeleryBody::allocate_scratch(std::size_t size) const {
+	// The scratch space is allocated lazily and at most once: unescaped
+	// forms of all arguments together fit into body.size() bytes.
+	auto capacity = body.size() <= InlineScratchSize ? InlineScratchSize : body.size();
+	if (scratch_used + size > capacity) {
+		// This can only happen when an argument is decoded repeatedly.
+		overflow_scratch.push_back(std::make_unique<char[]>(size));
+		return overflow_scratch.back().get();
+	}
+
+	char* start;
+	if (body.size() <= InlineScratchSize) {
+		start = inline_scratch.data() + scratch_used;
+	} else {
+		if (!heap_scratch) {
+			heap_scratch = std::make_unique<char[]>(body.size());
+		}
+		start = heap_scratch.get() + scratch_used;
+	}
+	scratch_used += size;
+	return start;
+}
+
+void append_json(std::string& out, std::string_view value) {
+	static const char hex[] = "0123456789abcdef";
+
+	out.push_back('"');
+	for (auto c : value) {
+		switch (c) {
+			case '"': out.append("\\\""); break;
+			case '\\': out.append("\\\\"); break;
+			case '\b': out.append("\\b"); break;
+			case '\f': out.append("\\f"); break;
+			case '\n': out.append("\\n"); break;
+			case '\r': out.append("\\r"); break;
+			case '\t': out.append("\\t"); break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20) {
+					out.append("\\u00");
+					out.push_back(hex[(c >> 4) & 0xF]);
+					out.push_back(hex[c & 0xF]);
+				} else {
+					out.push_back(c);
+				}
+		}
+	}
+	out.push_back('"');
+}
+
+void append_json(std::string& out, bool value) {
+	out.append(value ? "true" : "false");
+}
+
+void append_json(std::string& out, double value) {
+	char buffer[32];
+	auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+	out.append(buffer, result.ptr);
+}
+
+std::string_view find_json_member(std::string_view object, std::string_view name) {
+	auto pos = skip_ws(object, 0);
+	if (pos >= object.size() || object[pos] != '{') {
+		fail("expected an object", object, pos);
+	}
+	pos = skip_ws(object, pos + 1);
+	if (pos < object.size() && object[pos] == '}') {
+		return {};
+	}
+	for (;;) {
+		if (pos >= object.size() || object[pos] != '"') {
+			fail("expected a member name", object, pos);
+		}
+		auto name_end = skip_string(object, pos);
+		auto member = object.substr(pos + 1, name_end - pos - 2);
+		pos = skip_ws(object, name_end);
+		if (pos >= object.size() || object[pos] != ':') {
+			fail("expected ':'", object, pos);
+		}
+		pos = skip_ws(object, pos + 1);
+		auto value_end = skip_value(object, pos);
+		if (member == name) {
+			return object.substr(pos, value_end - pos);
+		}
+		pos = skip_ws(object, value_end);
+		if (pos < object.size() && object[pos] == ',') {
+			pos = skip_ws(object, pos + 1);
+		} else if (pos < object.size() && object[pos] == '}') {
+			return {};
+		} else {
+			fail("expected ',' or '}'", object, pos);
+		}
+	}
+}
@@ -0,0 +1,169 @@
+//
+// Encoding and lazy decoding of bodies of Celery task messages.
+//
+
+#ifndef CELERY_BODY_H
+#define CELERY_BODY_H
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// An error that is thrown when a body of a message cannot be decoded.
+class CeleryBodyError: public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// A lazily decoded JSON body of a Celery task message.
+//
+// In the version 2 of the Celery message protocol, the body is a JSON array
+// of the form
+//
+//     [args, kwargs, embed]
+//
+// where `args` is an array of positional arguments, `kwargs` is an object
+// with keyword arguments, and `embed` is an object with additional data (see
+// hello.cpp). Instead of building a DOM of the whole body (like json::parse()
+// does), the constructor only locates the individual positional arguments in
+// the body. The arguments are then decoded on demand, directly from the body
+// bytes, into typed C++ values via arg().
+//
+// The decoding does not allocate memory from the heap for bodies with at most
+// `InlineArgs` positional arguments and `InlineScratchSize` bytes. Strings
+// without escape sequences are returned as views into the body; strings with
+// escape sequences are unescaped into a scratch buffer owned by the decoder.
+// Therefore, the body has to outlive both the decoder and the returned views,
+// and the views are invalidated when the decoder is destroyed.
+//
+// Values nested in arguments, `kwargs`, and `embed` are only skipped, not
+// validated.
+class CeleryBody {
+public:
+	static constexpr std::size_t InlineArgs = 8;
+	static constexpr std::size_t InlineScratchSize = 256;
+
+	// Locates positional arguments in the given body. Throws CeleryBodyError
+	// when the body does not have the expected form.
+	explicit CeleryBody(std::string_view body);
+
+	CeleryBody(const CeleryBody&) = delete;
+	CeleryBody& operator=(const CeleryBody&) = delete;
+
+	// Returns the number of positional arguments.
+	std::size_t arg_count() const;
+
+	// Returns the JSON representation of the i-th positional argument.
+	std::string_view raw_arg(std::size_t i) const;
+
+	// Returns the i-th positional argument, decoded into a value of type T.
+	// Supported types are std::string_view, std::string, bool, integral
+	// types, and floating-point types. Throws CeleryBodyError when there is no
+	// such argument or when it cannot be converted to T.
+	template<typename T>
+	T arg(std::size_t i) const {
+		T value;
+		decode(raw_arg(i), value);
+		return value;
+	}
+
+	// Returns the JSON representations of kwargs and embed, respectively.
+	// When they are missing in the body, "{}" is returned.
+	std::string_view raw_kwargs() const;
+	std::string_view raw_embed() const;
+
+private:
+	void decode(std::string_view raw, std::string_view& value) const;
+	void decode(std::string_view raw, std::string& value) const;
+	void decode(std::string_view raw, bool& value) const;
+	void decode(std::string_view raw, long long& value) const;
+	void decode(std::string_view raw, unsigned long long& value) const;
+	void decode(std::string_view raw, double& value) const;
+
+	// Narrower integral types are decoded via the widest ones (the
+	// non-template overloads above are preferred for exact matches).
+	template<typename T>
+	std::enable_if_t<std::is_integral_v<T>> decode(std::string_view raw, T& value) const {
+		using Wide = std::conditional_t<std::is_signed_v<T>, long long, unsigned long long>;
+		Wide wide;
+		decode(raw, wide);
+		if (wide < static_cast<Wide>(std::numeric_limits<T>::min()) ||
+				wide > static_cast<Wide>(std::numeric_limits<T>::max())) {
+			throw CeleryBodyError("integer argument out of range: " + std::string(raw));
+		}
+		value = static_cast<T>(wide);
+	}
+
+	void decode(std::string_view raw, float& value) const {
+		double wide;
+		decode(raw, wide);
+		value = static_cast<float>(wide);
+	}
+
+	// Returns space for a string of at most `size` bytes.
+	char* allocate_scratch(std::size_t size) const;
+
+	std::string_view body;
+	std::string_view kwargs = "{}";
+	std::string_view embed = "{}";
+
+	// Positional arguments. The first `InlineArgs` of them are stored in
+	// `inline_args`, the remaining ones in `extra_args`.
+	std::array<std::string_view, InlineArgs> inline_args;
+	std::vector<std::string_view> extra_args;
+	std::size_t args_count = 0;
+
+	// Scratch space for unescaped strings. Since an unescaped string is never
+	// longer than its escaped form, the scratch space never needs more bytes
+	// than there are in the body.
+	mutable std::array<char, InlineScratchSize> inline_scratch;
+	mutable std::unique_ptr<char[]> heap_scratch;
+	mutable std::vector<std::unique_ptr<char[]>> overflow_scratch;
+	mutable std::size_t scratch_used = 0;
+};
+
+// Appends the JSON representation of the given value to `out`.
+void append_json(std::string& out, std::string_view value);
+void append_json(std::string& out, bool value);
+void append_json(std::string& out, double value);
+
+inline void append_json(std::string& out, const char* value) {
+	append_json(out, std::string_view(value));
+}
+
+template<typename T>
+std::enable_if_t<std::is_integral_v<T>> append_json(std::string& out, T value) {
+	char buffer[24];
+	auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+	out.append(buffer, result.ptr);
+}
+
+// Encodes a JSON body of a Celery task message with the given positional
+// arguments (and empty kwargs and embed) into `out`, replacing its contents.
+//
+// Since the capacity of `out` is kept, encoding of many messages into the
+// same buffer does not allocate (after the first few messages).
+template<typename... Args>
+void encode_celery_body(std::string& out, const Args&... args) {
+	out.assign("[[");
+	bool first = true;
+	((out.append(first ? "" : ","), append_json(out, args), first = false), ...);
+	out.append("],{},{}]");
+}
+
+// Returns the JSON representation of the member with the given name in the
+// given JSON object (e.g. the result in a result message, see
+// result_publisher.h), or an empty view when there is no such member. Just
+// like in CeleryBody, other members are only skipped, and the name is
+// compared with member names as they are written (without unescaping).
+// Throws CeleryBodyError when the object is malformed.
+std::string_view find_json_member(std::string_view object, std::string_view name);
+
+#endif
@@ -0,0 +1,243 @@
+//
+// A client that sends tasks to Celery workers.
+//
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "celery_client.h"
+#include "eta.h"
+#include "task_id.h"
+
+namespace {
+
+// Sets the content type and encoding of the message to the ones used by Celery
+// for the given serializer ("json" or "msgpack").
+//
+// Celery identifies the serializer of a message by its content type. JSON is
+// the default. MessagePack is a binary format, so its bodies are smaller and
+// faster to encode and decode. To make Celery accept such messages, 'msgpack'
+// has to be listed in its accept_content setting.
+void set_serializer(Message& message, std::string_view serializer) {
+	if (serializer == "msgpack") {
+		message.content_type = "application/x-msgpack";
+		message.content_encoding = "binary";
+	} else {
+		message.content_type = "application/json";
+		message.content_encoding = "utf-8";
+	}
+}
+
+// Sets a string header of the message and returns its value. The value of an
+// existing header is overwritten in place, so its buffer is reused.
+std::string& set_header(Headers& headers, std::string_view name,
+		std::string_view value) {
+	auto it = headers.find(name);
+	if (it == headers.end()) {
+		it = headers.emplace(std::string(name), std::string(value)).first;
+	} else if (auto current = std::get_if<std::string>(&it->second)) {
+		current->assign(value);
+	} else {
+		it->second = std::string(value);
+	}
+	return std::get<std::string>(it->second);
+}
+
+// The slot that the current thread tries first (see CeleryClient::acquire()).
+// Threads get consecutive numbers, so as long as there are no more threads than
+// channels, every thread has a channel of its own.
+std::atomic<std::size_t> next_thread_number(0);
+thread_local std::size_t thread_number = next_thread_number.fetch_add(1);
+
+}
+
+CeleryClient::CeleryClient(Broker& broker, CeleryClientOptions options):
+		broker(broker),
+		options(std::move(options)),
+		use_msgpack(this->options.serializer == "msgpack") {
+	if (this->options.serializer != "json" && !use_msgpack) {
+		throw std::invalid_argument("unsupported serializer: " +
+			this->options.serializer + " (expected json or msgpack)");
+	}
+	if (!this->options.compression.empty()) {
+		compression = compression_from_name(this->options.compression);
+		if (!compression) {
+			throw std::invalid_argument("unsupported compression: " +
+				this->options.compression);
+		}
+	}
+
+	auto size = std::max(this->options.pool_size, 1u);
+	slots = std::make_unique<Slot[]>(size);
+	for (unsigned i = 0; i < size; ++i) {
+		auto pooled = std::make_unique<PooledChannel>();
+		set_serializer(pooled->message, this->options.serializer);
+		slots[i].channel.store(pooled.get(), std::memory_order_relaxed);
+		channels.push_back(std::move(pooled));
+	}
+}
+
+CeleryClient::~CeleryClient() = default;
+
+std::size_t CeleryClient::home_slot() const {
+	return thread_number % channels.size();
+}
+
+CeleryClient::PooledChannel* CeleryClient::acquire() {
+	// Take a channel from the slot of the current thread, or from any other
+	// slot when it is empty. Taking a channel is a single atomic exchange on
+	// a cache line that is usually not touched by other threads.
+	auto size = channels.size();
+	auto home = home_slot();
+	auto try_take = [&]() -> PooledChannel* {
+		for (std::size_t i = 0; i < size; ++i) {
+			auto& slot = slots[(home + i) % size];
+			if (slot.channel.load(std::memory_order_relaxed)) {
+				if (auto channel = slot.channel.exchange(nullptr, std::memory_order_acquire)) {
+					return channel;
+				}
+			}
+		}
+		return nullptr;
+	};
+	if (auto channel = try_take()) {
+		return channel;
+	}
+
+	// All channels are in use, so wait until one of them is returned. We
+	// announce our waiting before we check the slots again, and release()
+	// checks for waiters after it has returned a channel (both with
+	// sequentially consistent operations), so either we see the returned
+	// channel, or release() sees us waiting and wakes us up.
+	waiting.fetch_add(1, std::memory_order_seq_cst);
+	for (;;) {
+		auto generation = released.load(std::memory_order_seq_cst);
+		if (auto channel = try_take()) {
+			waiting.fetch_sub(1, std::memory_order_relaxed);
+			return channel;
+		}
+		released.wait(generation, std::memory_order_seq_cst);
+	}
+}
+
+void CeleryClient::release(PooledChannel* channel) noexcept {
+	// Return the channel to the slot of the current thread (where the thread
+	// looks first the next time), or to any empty slot. There is always one
+	// because the returned channel is not in any slot.
+	auto size = channels.size();
+	auto home = home_slot();
+	for (std::size_t i = 0;; ++i) {
+		auto& slot = slots[(home + i) % size];
+		PooledChannel* empty = nullptr;
+		if (slot.channel.compare_exchange_strong(empty, channel,
+				std::memory_order_seq_cst)) {
+			break;
+		}
+	}
+
+	if (waiting.load(std::memory_order_seq_cst) > 0) {
+		released.fetch_add(1, std::memory_order_seq_cst);
+		released.notify_one();
+	}
+}
+
+ResultReceiver& CeleryClient::result_receiver() {
+	std::call_once(receiver_created, [&]() {
+		receiver = std::make_unique<ResultReceiver>(broker);
+	});
+	return *receiver;
+}
+
+void CeleryClient::publish(PooledChannel& pooled, const TaskOptions& task_options,
+		std::string_view name, AsyncResult* result) {
+	auto& message = pooled.message;
+
+	// Celery requires two headers: id and task. The former can be any unique
+	// string you want
+	// (http://docs.celeryproject.org/en/latest/faq.html#can-i-specify-a-custom-task-id),
+	// although Celery uses UUIDs. The latter has to be the name of the task,
+	// as registered in the Python part.
+	//
+	// The ID is generated directly into the buffer of the header (see
+	// task_id.h). When the task is sent once more after a failure, it keeps
+	// its ID, so the duplicate can be recognized.
+	auto& id = set_header(message.headers, "id", std::string_view());
+	id.resize(TaskIdSize);
+	generate_task_id(id.data());
+	set_header(message.headers, "task", name);
+
+	// The 'eta' header tells the worker when to execute the task. Celery
+	// clients also support a countdown (the number of seconds after which the
+	// task should be executed), but they convert it into an ETA before the
+	// message is sent.
+	if (task_options.eta) {
+		set_header(message.headers, "eta", format_eta(*task_options.eta));
+	} else {
+		message.headers.erase("eta");
+	}
+
+	// Messages with a higher priority overtake the others in queues with
+	// priorities and in workers consuming from several queues.
+	message.priority = task_options.priority;
+
+	// Large bodies are compressed, and the content type of the compression
+	// goes into the 'compression' header (just like in Celery, see
+	// compression.h). The compressed body is swapped into the message, so
+	// the buffers of both bodies are reused for the following tasks. A body
+	// that would not get smaller (e.g. one full of random data) is sent as it
+	// is.
+	auto compressed = false;
+	if (compression && message.body.size() >= options.compression_threshold) {
+		compress(*compression, message.body, pooled.compressed);
+		if (pooled.compressed.size() < message.body.size()) {
+			message.body.swap(pooled.compressed);
+			set_header(message.headers, "compression",
+				compression_content_type(*compression));
+			compressed = true;
+		}
+	}
+	if (!compressed) {
+		message.headers.erase("compression");
+	}
+
+	// When the result of the task is wanted, the worker publishes it into our
+	// reply queue with the ID of the task as the correlation ID (this is what
+	// Celery clients do with the RPC result backend). The handle is created
+	// before the message is sent, so the result cannot arrive before it.
+	ResultReceiver* receiver = nullptr;
+	if (result) {
+		receiver = &result_receiver();
+		message.reply_to.assign(receiver->queue());
+		message.correlation_id.assign(id);
+		*result = receiver->expect(id);
+	} else {
+		message.reply_to.clear();
+		message.correlation_id.clear();
+	}
+
+	// Send the message to the 'celery' exchange (default) with the 'celery'
+	// routing key (default). This effectively sends the message to the
+	// 'celery' queue because 'celery' is a direct exchange
+	// (https://www.rabbitmq.com/tutorials/amqp-concepts.html).
+	//
+	// When the channel is broken (e.g. the server has closed the connection),
+	// replace it with a new one and try once more.
+	for (int attempt = 1;; ++attempt) {
+		try {
+			if (!pooled.channel) {
+				pooled.channel = broker.open_channel();
+			}
+			pooled.channel->publish(options.exchange, options.routing_key, message);
+			return;
+		} catch (const std::exception&) {
+			pooled.channel.reset();
+			if (attempt == 2) {
+				if (receiver) {
+					receiver->forget(id);
+				}
+				throw;
+			}
+		}
+	}
+}
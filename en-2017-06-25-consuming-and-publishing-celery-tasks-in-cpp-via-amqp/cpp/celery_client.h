@@ -0,0 +1,194 @@
+//
+// A client that sends tasks to Celery workers.
+//
+
+#ifndef CELERY_CLIENT_H
+#define CELERY_CLIENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "async_result.h"
+#include "broker.h"
+#include "celery_body.h"
+#include "compression.h"
+#include "msgpack_body.h"
+
+// Options of a Celery client.
+struct CeleryClientOptions {
+	// The exchange and the routing key to which tasks are sent. With the
+	// default configuration of Celery, the 'celery' direct exchange routes
+	// them to the 'celery' queue. The default exchange ("") routes them to
+	// the queue whose name is equal to the routing key.
+	std::string exchange = "celery";
+	std::string routing_key = "celery";
+
+	// The serializer of message bodies: "json" (the default in Celery) or
+	// "msgpack".
+	std::string serializer = "json";
+
+	// The compression of message bodies (see compression.h): "zlib", "zstd"
+	// (when supported by the build), or none (empty). Only bodies of at least
+	// `compression_threshold` bytes are compressed. For smaller bodies,
+	// compressing costs more time than it saves on the wire.
+	std::string compression;
+	std::size_t compression_threshold = 16 * 1024;
+
+	// The maximal number of channels, i.e. of tasks that can be sent in
+	// parallel. Every channel has its own connection (see amqp_broker.cpp).
+	unsigned pool_size = 8;
+};
+
+// Options of a single task.
+struct TaskOptions {
+	// When the task should be executed (right away when not set).
+	std::optional<std::chrono::system_clock::time_point> eta;
+
+	// The priority of the message (see Message). Zero means none.
+	std::uint8_t priority = 0;
+};
+
+// Sends tasks to Celery workers, e.g.
+//
+//     CeleryClient client(broker);
+//     client.send_task("tasks.hello", "Fred Astaire", 42);
+//
+// The client keeps a pool of channels that are shared by all threads, so a
+// thread sending a task does not open a new connection. Channels are opened
+// when they are needed for the first time. When sending over a channel fails
+// (e.g. the connection has been closed by the server), the channel is replaced
+// with a new one and the task is sent once more, so a task may be sent twice
+// when the first attempt actually succeeded.
+//
+// Every channel of the pool has its own message whose buffers are reused, so
+// sending a task does not allocate (after the first few tasks).
+//
+// A task sent via send_task_with_result() has its result sent back by the
+// worker (see result_publisher.h) into a reply queue of the client, from
+// which it is received by a thread of the client (see ResultReceiver). The
+// queue and the thread are set up when the first such task is sent.
+//
+// All methods are thread-safe. The broker has to outlive the client.
+class CeleryClient {
+public:
+	// Throws std::invalid_argument when the options are invalid.
+	explicit CeleryClient(Broker& broker, CeleryClientOptions options = {});
+	~CeleryClient();
+
+	CeleryClient(const CeleryClient&) = delete;
+	CeleryClient& operator=(const CeleryClient&) = delete;
+
+	// Sends a request to execute the given task with the given (positional)
+	// arguments. Returns after the broker has accepted the message (see
+	// Channel::publish()). Waits when all channels are in use.
+	template<typename... Args>
+	void send_task(std::string_view name, const Args&... args) {
+		send_task(TaskOptions(), name, args...);
+	}
+
+	template<typename... Args>
+	void send_task(const TaskOptions& options, std::string_view name,
+			const Args&... args) {
+		Lease lease(*this);
+		if (use_msgpack) {
+			encode_celery_body_msgpack(lease.channel->message.body, args...);
+		} else {
+			encode_celery_body(lease.channel->message.body, args...);
+		}
+		publish(*lease.channel, options, name, nullptr);
+	}
+
+	// Like send_task(), but returns a handle of the result of the task, e.g.
+	//
+	//     auto result = client.send_task_with_result("tasks.add", 1, 2);
+	//     std::cout << result.get().result << '\n'; // 3
+	//
+	// The worker has to publish results (see consumer.h).
+	template<typename... Args>
+	AsyncResult send_task_with_result(std::string_view name, const Args&... args) {
+		return send_task_with_result(TaskOptions(), name, args...);
+	}
+
+	template<typename... Args>
+	AsyncResult send_task_with_result(const TaskOptions& options,
+			std::string_view name, const Args&... args) {
+		Lease lease(*this);
+		if (use_msgpack) {
+			encode_celery_body_msgpack(lease.channel->message.body, args...);
+		} else {
+			encode_celery_body(lease.channel->message.body, args...);
+		}
+		AsyncResult result;
+		publish(*lease.channel, options, name, &result);
+		return result;
+	}
+
+private:
+	// A channel of the pool and the message that is sent over it.
+	struct PooledChannel {
+		std::unique_ptr<Channel> channel;
+		Message message;
+
+		// A buffer for compressing the body of the message (see publish()).
+		std::string compressed;
+	};
+
+	// A slot of the pool. Every slot is on its own cache line, so threads
+	// using different slots do not slow each other down.
+	struct alignas(64) Slot {
+		std::atomic<PooledChannel*> channel{nullptr};
+	};
+
+	// A channel checked out of the pool for the duration of a call.
+	struct Lease {
+		explicit Lease(CeleryClient& client):
+			client(client), channel(client.acquire()) {}
+
+		~Lease() {
+			client.release(channel);
+		}
+
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+
+		CeleryClient& client;
+		PooledChannel* channel;
+	};
+
+	PooledChannel* acquire();
+	void release(PooledChannel* channel) noexcept;
+	std::size_t home_slot() const;
+
+	void publish(PooledChannel& pooled, const TaskOptions& options,
+		std::string_view name, AsyncResult* result);
+	ResultReceiver& result_receiver();
+
+	Broker& broker;
+	CeleryClientOptions options;
+	bool use_msgpack;
+	std::optional<Compression> compression;
+
+	// All channels of the pool, and the slots with the ones that are not in
+	// use.
+	std::vector<std::unique_ptr<PooledChannel>> channels;
+	std::unique_ptr<Slot[]> slots;
+
+	// Threads that wait for a channel (when all of them are in use) wait for
+	// a change of `released`.
+	alignas(64) std::atomic<std::uint32_t> waiting{0};
+	std::atomic<std::uint32_t> released{0};
+
+	// Receives results of tasks (see above).
+	std::once_flag receiver_created;
+	std::unique_ptr<ResultReceiver> receiver;
+};
+
+#endif
@@ -0,0 +1,273 @@
+//
+// Compression of bodies of Celery task messages.
+//
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+#include <zlib.h>
+#ifdef CELERY_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compression.h"
+
+namespace {
+
+// The content types of compressions in the 'compression' header (see
+// kombu/compression.py).
+constexpr std::string_view ZlibContentType = "application/x-gzip";
+constexpr std::string_view ZstdContentType = "application/zstd";
+
+// The compression levels. Zlib's default level (6, used by Celery) makes
+// bodies of JSON records only about a sixth smaller than the fastest level,
+// but it takes about four times longer (see compression-bench). Zstd's
+// default level is fast enough.
+constexpr int ZlibLevel = Z_BEST_SPEED;
+constexpr int ZstdLevel = 3;
+
+// Makes room for more decompressed data after the first `size` bytes of the
+// given buffer. Throws CompressionError when the data would be larger than
+// `max_size` bytes.
+//
+// The buffers are reused, so they usually have enough capacity, and growing
+// them does not allocate. It still fills the new room with zeros, which is
+// why they are not simply resized to their capacity: after a single large
+// body, every small one would pay for zeroing the whole buffer.
+void grow(std::string& buffer, std::size_t size, std::size_t input_size,
+		std::size_t max_size) {
+	if (size >= max_size) {
+		throw CompressionError("the decompressed body is larger than " +
+			std::to_string(max_size) + " bytes");
+	}
+	auto wanted = std::max({size * 2, input_size * 4, std::size_t(4096)});
+	buffer.resize(std::min(wanted, max_size));
+}
+
+// Streams of zlib, one per thread. They are reset before every use instead of
+// being created again, which would allocate their (rather large) state.
+struct Deflater {
+	Deflater() {
+		if (deflateInit(&stream, ZlibLevel) != Z_OK) {
+			throw CompressionError("failed to initialize zlib");
+		}
+	}
+
+	~Deflater() {
+		deflateEnd(&stream);
+	}
+
+	z_stream stream{};
+};
+
+struct Inflater {
+	Inflater() {
+		if (inflateInit(&stream) != Z_OK) {
+			throw CompressionError("failed to initialize zlib");
+		}
+	}
+
+	~Inflater() {
+		inflateEnd(&stream);
+	}
+
+	z_stream stream{};
+};
+
+void check_zlib_size(std::string_view data) {
+	if (data.size() > std::numeric_limits<uInt>::max()) {
+		throw CompressionError("the body is too large for zlib");
+	}
+}
+
+void compress_zlib(std::string_view data, std::string& compressed) {
+	check_zlib_size(data);
+	thread_local Deflater deflater;
+	auto& stream = deflater.stream;
+	deflateReset(&stream);
+
+	// The bound is large enough to compress the data in a single call.
+	compressed.resize(deflateBound(&stream, data.size()));
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	stream.avail_in = data.size();
+	stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+	stream.avail_out = compressed.size();
+	if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+		throw CompressionError("failed to compress the body via zlib");
+	}
+	compressed.resize(stream.total_out);
+}
+
+void decompress_zlib(std::string_view data, std::string& decompressed,
+		std::size_t max_size) {
+	check_zlib_size(data);
+	thread_local Inflater inflater;
+	auto& stream = inflater.stream;
+	inflateReset(&stream);
+
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	stream.avail_in = data.size();
+	decompressed.clear();
+	std::size_t size = 0;
+	for (;;) {
+		if (size == decompressed.size()) {
+			grow(decompressed, size, data.size(), max_size);
+		}
+		auto available = std::min<std::size_t>(decompressed.size() - size,
+			std::numeric_limits<uInt>::max());
+		stream.next_out = reinterpret_cast<Bytef*>(decompressed.data() + size);
+		stream.avail_out = available;
+		auto status = inflate(&stream, Z_NO_FLUSH);
+		size += available - stream.avail_out;
+		if (status == Z_STREAM_END) {
+			break;
+		} else if (status == Z_BUF_ERROR && stream.avail_in == 0) {
+			throw CompressionError("the zlib data are truncated");
+		} else if (status != Z_OK && status != Z_BUF_ERROR) {
+			throw CompressionError(std::string("invalid zlib data: ") +
+				(stream.msg ? stream.msg : "unknown error"));
+		}
+	}
+	decompressed.resize(size);
+}
+
+#ifdef CELERY_HAVE_ZSTD
+// Contexts of zstd, one per thread (see Deflater and Inflater).
+struct ZstdContexts {
+	std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> compression{
+		ZSTD_createCCtx(), ZSTD_freeCCtx};
+	std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> decompression{
+		ZSTD_createDCtx(), ZSTD_freeDCtx};
+};
+
+thread_local ZstdContexts zstd_contexts;
+
+void compress_zstd(std::string_view data, std::string& compressed) {
+	compressed.resize(ZSTD_compressBound(data.size()));
+	// The size of the data is stored in the frame, so the other side knows
+	// how large a buffer it needs.
+	auto size = ZSTD_compressCCtx(zstd_contexts.compression.get(),
+		compressed.data(), compressed.size(), data.data(), data.size(),
+		ZstdLevel);
+	if (ZSTD_isError(size)) {
+		throw CompressionError(std::string("failed to compress the body via "
+			"zstd: ") + ZSTD_getErrorName(size));
+	}
+	compressed.resize(size);
+}
+
+void decompress_zstd(std::string_view data, std::string& decompressed,
+		std::size_t max_size) {
+	auto context = zstd_contexts.decompression.get();
+	ZSTD_DCtx_reset(context, ZSTD_reset_session_only);
+
+	// When the frame says how large the data are, the buffer has the right
+	// size right away. Otherwise (e.g. with frames from streaming
+	// compressors), it grows as needed.
+	decompressed.clear();
+	auto expected = ZSTD_getFrameContentSize(data.data(), data.size());
+	if (expected != ZSTD_CONTENTSIZE_UNKNOWN &&
+			expected != ZSTD_CONTENTSIZE_ERROR && expected <= max_size) {
+		decompressed.resize(expected);
+	}
+
+	ZSTD_inBuffer input{data.data(), data.size(), 0};
+	std::size_t size = 0;
+	for (;;) {
+		if (size == decompressed.size()) {
+			grow(decompressed, size, data.size(), max_size);
+		}
+		ZSTD_outBuffer output{decompressed.data() + size,
+			decompressed.size() - size, 0};
+		auto status = ZSTD_decompressStream(context, &output, &input);
+		if (ZSTD_isError(status)) {
+			throw CompressionError(std::string("invalid zstd data: ") +
+				ZSTD_getErrorName(status));
+		}
+		size += output.pos;
+		if (status == 0 && input.pos == input.size) {
+			break;
+		} else if (input.pos == input.size && output.pos < output.size) {
+			throw CompressionError("the zstd data are truncated");
+		}
+	}
+	decompressed.resize(size);
+}
+#endif
+
+}
+
+std::optional<Compression> compression_from_name(std::string_view name) {
+	// Celery also accepts the content types and some aliases as names.
+	if (name == "zlib" || name == "gzip" || name == ZlibContentType) {
+		return Compression::Zlib;
+	}
+#ifdef CELERY_HAVE_ZSTD
+	if (name == "zstd" || name == ZstdContentType) {
+		return Compression::Zstd;
+	}
+#endif
+	return std::nullopt;
+}
+
+std::optional<Compression> compression_from_content_type(
+		std::string_view content_type) {
+	if (content_type == ZlibContentType) {
+		return Compression::Zlib;
+	}
+#ifdef CELERY_HAVE_ZSTD
+	if (content_type == ZstdContentType) {
+		return Compression::Zstd;
+	}
+#endif
+	return std::nullopt;
+}
+
+std::string_view compression_content_type(Compression compression) {
+	return compression == Compression::Zstd ? ZstdContentType : ZlibContentType;
+}
+
+void compress(Compression compression, std::string_view data,
+		std::string& compressed) {
+	switch (compression) {
+		case Compression::None:
+			compressed.assign(data);
+			return;
+		case Compression::Zlib:
+			compress_zlib(data, compressed);
+			return;
+		case Compression::Zstd:
+#ifdef CELERY_HAVE_ZSTD
+			compress_zstd(data, compressed);
+			return;
+#else
+			break;
+#endif
+	}
+	throw CompressionError("unsupported compression");
+}
+
+void decompress(Compression compression, std::string_view data,
+		std::string& decompressed, std::size_t max_size) {
+	switch (compression) {
+		case Compression::None:
+			if (data.size() > max_size) {
+				throw CompressionError("the body is larger than " +
+					std::to_string(max_size) + " bytes");
+			}
+			decompressed.assign(data);
+			return;
+		case Compression::Zlib:
+			decompress_zlib(data, decompressed, max_size);
+			return;
+		case Compression::Zstd:
+#ifdef CELERY_HAVE_ZSTD
+			decompress_zstd(data, decompressed, max_size);
+			return;
+#else
+			break;
+#endif
+	}
+	throw CompressionError("unsupported compression");
+}
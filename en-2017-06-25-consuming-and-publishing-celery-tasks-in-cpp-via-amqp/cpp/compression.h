@@ -0,0 +1,61 @@
+//
+// Compression of bodies of Celery task messages.
+//
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// A compression of message bodies.
+//
+// Celery (or rather Kombu) compresses the body of a message when the
+// task_compression setting (or the compression argument of apply_async()) is
+// set, and stores the content type of the compression into the 'compression'
+// header of the message. The content type of the message itself stays that
+// of the serializer. Zlib ('application/x-gzip', although the data are in the
+// zlib format, not gzip) is always available in Celery. Zstandard
+// ('application/zstd') needs the zstandard Python package; here, it needs the
+// zstd library (see CMakeLists.txt).
+enum class Compression {
+	None,
+	Zlib,
+	Zstd,
+};
+
+// An error of compressing or decompressing a body.
+class CompressionError: public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Returns the compression with the given name ("zlib" or "zstd", as in
+// Celery), or nothing when it is unknown or not supported by this build.
+std::optional<Compression> compression_from_name(std::string_view name);
+
+// Returns the compression with the given content type (the value of the
+// 'compression' header), or nothing when it is unknown or not supported by
+// this build.
+std::optional<Compression> compression_from_content_type(
+	std::string_view content_type);
+
+// Returns the content type of the given compression (other than None).
+std::string_view compression_content_type(Compression compression);
+
+// Compresses `data` into `compressed` (its buffer is reused). Throws
+// CompressionError when the compression fails.
+void compress(Compression compression, std::string_view data,
+	std::string& compressed);
+
+// Decompresses `data` into `decompressed` (its buffer is reused, so after
+// the first few bodies, decompressing does not allocate memory). Throws
+// CompressionError when the data are corrupted or when they decompress into
+// more than `max_size` bytes.
+void decompress(Compression compression, std::string_view data,
+	std::string& decompressed, std::size_t max_size);
+
+#endif
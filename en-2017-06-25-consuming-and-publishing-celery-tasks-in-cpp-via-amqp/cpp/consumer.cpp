@@ -0,0 +1,1447 @@
+//
+// A consumer that executes Celery tasks from queues.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <cxxabi.h>
+
+#include "ack_coalescer.h"
+#include "async.h"
+#include "celery_body.h"
+#include "compression.h"
+#include "consumer.h"
+#include "eta.h"
+#include "fair_queue.h"
+#include "msgpack_body.h"
+#include "prefetch_controller.h"
+#include "result_publisher.h"
+#include "retry.h"
+#include "timing_wheel.h"
+#include "work_stealing.h"
+
+namespace {
+
+// How much of the time of a consumer a queue with a weight of 1 gets in a
+// single round of the fair queue (see FairQueue).
+constexpr auto SchedulingQuantum = std::chrono::microseconds(500);
+
+// While tasks of a consumer (or their operations) are in flight in other
+// threads, the consumer waits for a message at most this long (in
+// milliseconds) and then picks up the tasks that have finished. The other
+// threads do not interrupt its waiting (see Channel::interrupt()), which
+// would cost a message per task.
+constexpr int InFlightWait = 1;
+
+// The maximal size of a decompressed body. A small compressed body can
+// decompress into a huge one (a "zip bomb"), which would exhaust memory.
+constexpr std::size_t MaxDecompressedBodySize = 256 * 1024 * 1024;
+
+// Returns the serializer that was used to create a body with the given
+// content type.
+Serializer serializer_of(std::string_view content_type) {
+	// Messages without a content type are assumed to be in JSON, which is the
+	// default serializer in Celery.
+	if (content_type == "application/json" || content_type.empty()) {
+		return Serializer::Json;
+	} else if (content_type == "application/x-msgpack") {
+		return Serializer::Msgpack;
+	}
+	return Serializer::Unknown;
+}
+
+// Executes the task with arguments from the given body and records the time
+// spent in decoding (since `decode_start`) and execution. When `result` is
+// not null, the result of the task is stored into it (see Task::invoke()).
+template<typename Body>
+void run_task(const Task& task, const Body& body, ConsumerMetrics& metrics,
+		ConsumerMetrics::Clock::time_point decode_start, std::string* result) {
+	auto execute_start = ConsumerMetrics::Clock::now();
+	metrics.record(Stage::Decode, decode_start, execute_start);
+	task.invoke(body, result);
+	metrics.record(Stage::Execute, execute_start, ConsumerMetrics::Clock::now());
+}
+
+// Decompresses the body of the given message when it is compressed (see
+// compression.h). Returns false when it cannot be decompressed.
+//
+// The body is decompressed into a buffer of the thread, which is then swapped
+// with the body of the message, so the buffer of the compressed body is
+// reused for the next one, and after the first few messages, decompressing
+// does not allocate memory. The 'compression' header is cleared instead of
+// erased (Celery treats an empty one as none) so that its node is reused as
+// well. A failed task is thus retried with an uncompressed body.
+bool decompress_body(Message& message) {
+	auto it = message.headers.find("compression");
+	if (it == message.headers.end()) {
+		return true;
+	}
+	auto content_type = std::get_if<std::string>(&it->second);
+	if (!content_type || content_type->empty()) {
+		return true;
+	}
+	auto compression = compression_from_content_type(*content_type);
+	if (!compression) {
+		std::cerr << "Received a message with an unsupported compression: "
+			<< *content_type
+			<< ". The message has been ignored and discarded.\n";
+		return false;
+	}
+
+	thread_local std::string decompressed;
+	try {
+		decompress(*compression, message.body, decompressed,
+			MaxDecompressedBodySize);
+	} catch (const CompressionError& e) {
+		// Just like a body that cannot be decoded, a body that cannot be
+		// decompressed is not going to get any better.
+		std::cerr << "Received a message whose body cannot be decompressed: "
+			<< e.what() << ". The message has been ignored and discarded.\n";
+		return false;
+	}
+	message.body.swap(decompressed);
+	content_type->clear();
+	return true;
+}
+
+// Finds the task to be executed for the given message and the serializer of
+// its body, and decompresses the body (see decompress_body()). Returns
+// nullptr when the message has to be discarded.
+const Task* find_task(const TaskRegistry& registry, Message& message,
+		Serializer& serializer) {
+	// The name of the task is stored in the 'task' header (see hello.cpp).
+	auto task_name = find_string_header(message.headers, "task");
+	auto task = task_name ? registry.find(*task_name) : nullptr;
+	if (!task) {
+		// Just like Celery, ignore and discard messages for unregistered
+		// tasks.
+		std::cerr << "Received an unregistered task: "
+			<< (task_name ? *task_name : "")
+			<< ". The message has been ignored and discarded.\n";
+		return nullptr;
+	}
+
+	// Celery by default encodes messages via JSON, but it can also use
+	// MessagePack (the 'msgpack' serializer). The serializer is given by the
+	// content type of the message. For a description of the message format,
+	// see hello.cpp.
+	serializer = serializer_of(message.content_type);
+	if (serializer == Serializer::Unknown) {
+		// Celery refuses to decode messages with content types that it does
+		// not accept. There is no point in delivering them again, so we
+		// discard them.
+		std::cerr << "Received a message with an unsupported content type: "
+			<< message.content_type
+			<< ". The message has been ignored and discarded.\n";
+		return nullptr;
+	}
+	return decompress_body(message) ? task : nullptr;
+}
+
+// Returns the earlier of the given timeouts (in milliseconds, -1 means
+// forever).
+int earliest(int timeout1, int timeout2) {
+	if (timeout1 < 0) {
+		return timeout2;
+	} else if (timeout2 < 0) {
+		return timeout1;
+	}
+	return std::min(timeout1, timeout2);
+}
+
+// Returns the index of the queue whose consumer has the given tag (the tags
+// are in the order of ConsumerOptions::queues).
+std::size_t source_of(const std::vector<std::string>& consumer_tags,
+		const std::string& consumer_tag) {
+	if (consumer_tags.size() == 1) {
+		return 0;
+	}
+	auto it = std::find(consumer_tags.begin(), consumer_tags.end(), consumer_tag);
+	return it != consumer_tags.end() ? it - consumer_tags.begin() : 0;
+}
+
+// Returns a description of the given exception thrown from a task. Sets
+// `poison` when the exception says that the arguments of the task cannot be
+// decoded from its message.
+std::string describe_error(std::exception_ptr error, bool& poison) {
+	poison = false;
+	try {
+		std::rethrow_exception(error);
+	} catch (const CeleryBodyError& e) {
+		poison = true;
+		return std::string("invalid arguments: ") + e.what();
+	} catch (const std::exception& e) {
+		return e.what();
+	} catch (...) {
+		return "unknown exception";
+	}
+}
+
+// Returns the name of the type of the given exception (e.g.
+// "std::runtime_error"). A client that waits for the result of the failed
+// task gets it as the type of the error.
+std::string error_type(std::exception_ptr error) {
+	try {
+		std::rethrow_exception(error);
+	} catch (...) {
+		auto type = abi::__cxa_current_exception_type();
+		if (!type) {
+			return "unknown";
+		}
+		auto status = 0;
+		std::unique_ptr<char, decltype(&std::free)> name(
+			abi::__cxa_demangle(type->name(), nullptr, nullptr, &status),
+			std::free);
+		return status == 0 ? name.get() : type->name();
+	}
+}
+
+// Returns how many times the task in the given message has been retried
+// (Celery stores the number in the 'retries' header).
+unsigned retries_of(const Message& message) {
+	auto it = message.headers.find("retries");
+	if (it == message.headers.end()) {
+		return 0;
+	}
+	auto retries = std::get_if<std::int64_t>(&it->second);
+	return retries ? static_cast<unsigned>(std::clamp<std::int64_t>(*retries, 0,
+		std::numeric_limits<unsigned>::max())) : 0;
+}
+
+// Handles tasks that have failed (thrown an exception).
+//
+// A failed task must not end the consumer. Its unacknowledged message would
+// be returned to the queue and delivered again (to us or to another worker),
+// where it would fail again, and so on, while every worker that gets it dies.
+// Instead, just like Celery does with automatic retries, the task is
+// published again (into the queue from which it was delivered) with an
+// incremented 'retries' header and an ETA after a delay given by its retry
+// policy (see retry.h), and the failed message is acknowledged. The consumer
+// that receives the new message parks it until it is due (see DelayedTasks),
+// so no thread sleeps in the meantime.
+//
+// A message whose arguments cannot be decoded (a poison message) would fail
+// every time, so it is not retried at all. Such messages and messages of
+// tasks that have run out of retries are published into the dead-letter
+// queue (with the error in the 'x-error' header), from which they can be
+// inspected and published again by hand. Without a dead-letter queue, they
+// are discarded. Only then does the client waiting for the result of the task
+// (if any) get the failure; a retried task has not finished yet.
+class FailedTasks {
+public:
+	FailedTasks(Channel& channel, const ConsumerOptions& options,
+			AckCoalescer& acks, ResultPublisher* results,
+			ConsumerMetrics& metrics):
+		channel(channel),
+		queues(options.queues),
+		dead_letter_queue(options.dead_letter_queue),
+		acks(acks),
+		results(results),
+		metrics(metrics),
+		random(std::random_device()()) {}
+
+	// Handles a failure of the given task, whose execution with arguments
+	// from the given message (delivered from the queue with the given index)
+	// threw `error`. The message is modified (its headers) and acknowledged.
+	void failed(const Task& task, Message& message, const DeliveryInfo& info,
+			std::size_t source, std::exception_ptr error) {
+		metrics.failures.increment();
+		bool poison;
+		auto reason = describe_error(error, poison);
+		auto retries = retries_of(message);
+		const auto& policy = task.retry_policy();
+
+		// The log line is composed first and written at once. The standard
+		// error is unbuffered, so every << would be a separate write, and a
+		// flood of bad messages should not slow the consumer down.
+		auto log = "Task " + std::string(task.name()) + " failed: " + reason + ". ";
+		if (!poison && retries < policy.max_retries) {
+			auto delay = retry_delay(policy, retries, random);
+			assign_header_value(message.headers["retries"],
+				static_cast<std::int64_t>(retries + 1));
+			assign_header_value(message.headers["eta"],
+				format_eta(std::chrono::system_clock::now() + delay));
+			channel.publish("", queues[source].name, message);
+			metrics.retries.increment();
+			log += "Retrying it in " + std::to_string(delay.count()) +
+				" ms (retry " + std::to_string(retries + 1) + " of " +
+				std::to_string(policy.max_retries) + ").\n";
+		} else if (!dead_letter_queue.empty()) {
+			if (results) {
+				results->failed(message, error_type(error), reason);
+			}
+			assign_header_value(message.headers["x-error"], reason);
+			declare_dead_letter_queue();
+			channel.publish("", dead_letter_queue, message);
+			metrics.dead_letters.increment();
+			log += "The message has been moved into " + dead_letter_queue + ".\n";
+		} else {
+			if (results) {
+				results->failed(message, error_type(error), reason);
+			}
+			log += "The message has been discarded.\n";
+		}
+		std::cerr << log;
+
+		// The message is acknowledged only after its successor has been
+		// published, so it cannot get lost in between.
+		auto ack_start = ConsumerMetrics::Clock::now();
+		acks.ack(info);
+		metrics.record(Stage::Ack, ack_start, ConsumerMetrics::Clock::now());
+	}
+
+private:
+	// The dead-letter queue has to exist, or published messages would be
+	// dropped. It is declared when the first message goes there, so that a
+	// worker whose tasks do not fail does not create it (nor pay for the
+	// declaration on every start of a consumer).
+	void declare_dead_letter_queue() {
+		if (!dead_letter_declared) {
+			channel.declare_queue(dead_letter_queue, /*temporary*/false);
+			dead_letter_declared = true;
+		}
+	}
+
+	Channel& channel;
+	const std::vector<QueueOptions>& queues;
+	const std::string& dead_letter_queue;
+	bool dead_letter_declared = false;
+	AckCoalescer& acks;
+	ResultPublisher* results;
+	ConsumerMetrics& metrics;
+
+	// For the jitter of retry delays.
+	std::minstd_rand random;
+};
+
+// Tasks with an ETA (see hello.cpp) that are held by the consumer until they
+// are due.
+//
+// Celery clients convert a countdown into an ETA, so both end up in the
+// 'eta' header. Instead of executing such a task right away (or returning it
+// to the broker to be delivered again later), the consumer keeps its message
+// unacknowledged and parks it in a timing wheel (see timing_wheel.h) with
+// millisecond ticks, so parking and expiring a task is O(1) even with tens of
+// thousands of delayed tasks. When the task is due, it is executed and
+// acknowledged like any other task.
+//
+// Messages delivered after a parked one cannot be acknowledged together with
+// their predecessors (the 'multiple' flag would acknowledge the parked one,
+// too), so they are acknowledged individually (see AckCoalescer).
+//
+// A parked message still counts against the prefetch count, so a consumer
+// with enough parked tasks would not receive any further messages, not even
+// the ones to be executed right away. Just like Celery, we raise the prefetch
+// count of the consumer by the number of parked tasks (every queue has its
+// own consumer, whose count is raised by the number of tasks parked from that
+// queue). Every change costs a
+// round trip to the server, so the count is not changed with every parked
+// task; it is kept between the number of parked tasks and that number plus
+// some slack (at least the original prefetch count), so only a few changes
+// are needed when many tasks are parked or expire at once.
+class DelayedTasks {
+public:
+	// Creates parked tasks of the consumers with the given tags (one for
+	// every queue, in the order of ConsumerOptions::queues).
+	DelayedTasks(Channel& channel, const std::vector<std::string>& consumer_tags,
+			std::uint16_t prefetch):
+		channel(channel),
+		prefetch(prefetch),
+		origin(Clock::now()) {
+		for (const auto& tag : consumer_tags) {
+			consumers.push_back({tag, prefetch, 0, 0});
+		}
+	}
+
+	// Parks the given task until the given ETA.
+	void park(std::chrono::system_clock::time_point eta, QueuedTask task) {
+		// The wheel uses the steady clock (so that changes of the system
+		// time do not affect it), so the ETA is converted relative to now.
+		// The tick is rounded up so that the task is not executed early.
+		auto delay = eta - std::chrono::system_clock::now();
+		auto tick = std::chrono::ceil<std::chrono::milliseconds>(
+			Clock::now() - origin + delay).count();
+		auto& consumer = consumers[task.source];
+		wheel.insert(static_cast<std::uint64_t>(std::max<decltype(tick)>(tick, 0)),
+			std::move(task));
+		++consumer.parked;
+		adjust_prefetch(consumer);
+	}
+
+	// Returns the number of milliseconds after which run_due() should be
+	// called, or -1 when there are no parked tasks. The result is suitable
+	// as a timeout for Channel::consume_message().
+	int timeout() const {
+		auto next = wheel.next_event();
+		if (next == std::numeric_limits<std::uint64_t>::max()) {
+			return -1;
+		}
+		auto now = current_tick();
+		return next <= now ? 0 : static_cast<int>(std::min<std::uint64_t>(
+			next - now, std::numeric_limits<int>::max()));
+	}
+
+	// Changes the prefetch count of the consumers (without the slots for the
+	// parked tasks).
+	void set_prefetch(std::uint16_t new_prefetch) {
+		prefetch = new_prefetch;
+		for (auto& consumer : consumers) {
+			update_prefetch(consumer);
+		}
+	}
+
+	// Calls `run(task)` for every parked task that is due.
+	template<typename F>
+	void run_due(F run) {
+		if (wheel.empty()) {
+			return;
+		}
+		wheel.advance(current_tick(), [&](QueuedTask&& task) {
+			--consumers[task.source].parked;
+			run(std::move(task));
+		});
+		for (auto& consumer : consumers) {
+			adjust_prefetch(consumer);
+		}
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	std::uint64_t current_tick() const {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			Clock::now() - origin).count();
+	}
+
+	// The consumer of a single queue.
+	struct Consumer {
+		std::string tag;
+		std::size_t current_prefetch;
+		std::size_t extra_slots;
+		std::size_t parked;
+	};
+
+	void adjust_prefetch(Consumer& consumer) {
+		auto parked = consumer.parked;
+		auto slack = std::max<std::size_t>(prefetch, parked / 16);
+		if (consumer.extra_slots >= parked &&
+				consumer.extra_slots <= parked + 2 * slack) {
+			return;
+		}
+		consumer.extra_slots = parked > 0 ? parked + slack : 0;
+		update_prefetch(consumer);
+	}
+
+	void update_prefetch(Consumer& consumer) {
+		// The prefetch count has 16 bits. When there are even more parked
+		// tasks, they take the slots of the other tasks.
+		auto count = std::min<std::size_t>(prefetch + consumer.extra_slots,
+			std::numeric_limits<std::uint16_t>::max());
+		if (count != consumer.current_prefetch) {
+			channel.qos(consumer.tag, static_cast<std::uint16_t>(count));
+			consumer.current_prefetch = count;
+		}
+	}
+
+	Channel& channel;
+	std::vector<Consumer> consumers;
+	std::size_t prefetch;
+	Clock::time_point origin;
+	TimingWheel<QueuedTask> wheel;
+};
+
+// Calls of batch tasks (see TaskRegistry::add_batch()) that wait to be
+// executed together.
+//
+// Every batch task has its own batch, which is executed when it gets full or
+// when its first call has waited for the maximal delay of the task. Decoded
+// arguments may refer to the messages and to their decoders, so the batch
+// keeps both. A delivered message is swapped with a message of an earlier
+// batch, so the buffers of messages are reused.
+//
+// A batch cannot be larger than the prefetch count: the server would stop
+// delivering messages before the batch gets full, so every batch would wait
+// for the whole delay.
+class PendingBatches {
+public:
+	using Clock = ConsumerMetrics::Clock;
+
+	// Calls of a single batch task.
+	struct Batch {
+		const Task* task = nullptr;
+		std::unique_ptr<TaskBatch> calls;
+		std::vector<Message> messages;
+		std::unique_ptr<std::variant<std::monostate, CeleryBody, MsgpackBody>[]> bodies;
+		std::vector<DeliveryInfo> infos;
+		std::vector<std::size_t> sources;
+		std::size_t max_size = 0;
+		std::chrono::milliseconds max_delay{0};
+
+		// When the batch has to be executed at the latest.
+		Clock::time_point deadline;
+
+		// How long the consumer waited for the messages of the calls, and
+		// how long their decoding took (see AdaptivePrefetch).
+		Clock::duration wait{0};
+		Clock::duration decode{0};
+	};
+
+	explicit PendingBatches(std::uint16_t prefetch): prefetch(prefetch) {}
+
+	// Changes the prefetch count (see above).
+	void set_prefetch(std::uint16_t new_prefetch) {
+		prefetch = new_prefetch;
+	}
+
+	// Adds a call of the given batch task with arguments from the given
+	// message (delivered from the queue with the given index). The message is
+	// swapped with a message of an earlier batch. Throws CeleryBodyError when
+	// the arguments cannot be decoded (then the message is left as it was).
+	Batch& add(const Task& task, Serializer serializer, Message& message,
+			const DeliveryInfo& info, std::size_t source) {
+		auto& batch = batches[&task];
+		if (!batch.calls) {
+			batch.task = &task;
+			auto max_size = std::max<std::size_t>(task.batch_options().max_size, 1);
+			batch.calls = task.make_batch();
+			batch.messages.resize(max_size);
+			batch.bodies = std::make_unique<
+				std::variant<std::monostate, CeleryBody, MsgpackBody>[]>(max_size);
+			batch.infos.reserve(max_size);
+			batch.sources.reserve(max_size);
+			batch.max_size = max_size;
+			batch.max_delay = task.batch_options().max_delay;
+		}
+
+		auto i = batch.infos.size();
+		std::swap(batch.messages[i], message);
+		const auto& body = batch.messages[i].body;
+		try {
+			if (serializer == Serializer::Json) {
+				batch.calls->add(batch.bodies[i].emplace<CeleryBody>(body));
+			} else {
+				batch.calls->add(batch.bodies[i].emplace<MsgpackBody>(body));
+			}
+		} catch (...) {
+			batch.bodies[i].emplace<std::monostate>();
+			std::swap(batch.messages[i], message);
+			throw;
+		}
+		if (i == 0) {
+			batch.deadline = Clock::now() + batch.max_delay;
+		}
+		batch.infos.push_back(info);
+		batch.sources.push_back(source);
+		return batch;
+	}
+
+	// Returns the number of milliseconds after which run_due() should be
+	// called, or -1 when there are no pending calls. The result is suitable
+	// as a timeout for Channel::consume_message().
+	int timeout() const {
+		auto timeout = -1;
+		auto now = Clock::now();
+		for (const auto& [task, batch] : batches) {
+			if (!batch.infos.empty()) {
+				auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+					batch.deadline - now).count();
+				timeout = earliest(timeout,
+					static_cast<int>(std::max<decltype(remaining)>(remaining, 0)));
+			}
+		}
+		return timeout;
+	}
+
+	// Calls `run(batch)` when the given batch is full, and then empties it.
+	template<typename F>
+	void run_if_full(Batch& batch, F run) {
+		if (batch.infos.size() >= limit(batch)) {
+			run_and_clear(batch, run);
+		}
+	}
+
+	// Calls `run(batch)` for every batch that is full or due, and then
+	// empties it.
+	template<typename F>
+	void run_due(F run) {
+		auto now = Clock::now();
+		for (auto& [task, batch] : batches) {
+			if (!batch.infos.empty() &&
+					(batch.infos.size() >= limit(batch) || now >= batch.deadline)) {
+				run_and_clear(batch, run);
+			}
+		}
+	}
+
+private:
+	std::size_t limit(const Batch& batch) const {
+		return std::min<std::size_t>(batch.max_size, std::max<std::uint16_t>(prefetch, 1));
+	}
+
+	template<typename F>
+	void run_and_clear(Batch& batch, F& run) {
+		run(batch);
+		batch.calls->clear();
+		for (std::size_t i = 0; i < batch.infos.size(); ++i) {
+			batch.bodies[i].emplace<std::monostate>();
+		}
+		batch.infos.clear();
+		batch.sources.clear();
+		batch.wait = batch.decode = Clock::duration::zero();
+	}
+
+	std::uint16_t prefetch;
+	std::unordered_map<const Task*, Batch> batches;
+};
+
+// What to do with a delivered task.
+enum class Disposition {
+	Execute,
+	Parked,
+	Discard
+};
+
+// Parks the task from the given delivery (from the queue with the given
+// index) when its message has an ETA in the future (the message is moved into
+// the parked task). A message with an invalid ETA has to be discarded.
+Disposition park_if_delayed(DelayedTasks& delayed, const Task& task,
+		Serializer serializer, Delivery& delivery, std::size_t source,
+		ConsumerMetrics& metrics) {
+	auto eta_header = find_string_header(delivery.message.headers, "eta");
+	if (!eta_header) {
+		return Disposition::Execute;
+	}
+	auto eta = parse_eta(*eta_header);
+	if (!eta) {
+		std::cerr << "Received a task with an invalid ETA: " << *eta_header
+			<< ". The message has been ignored and discarded.\n";
+		return Disposition::Discard;
+	}
+	if (*eta <= std::chrono::system_clock::now()) {
+		return Disposition::Execute;
+	}
+	metrics.delayed.increment();
+	delayed.park(*eta, {&task, serializer, std::move(delivery.message),
+		delivery.info, {}, source});
+	return Disposition::Parked;
+}
+
+// Looks up the result of a memoized task (see TaskRegistry::memoize()) with
+// arguments from the given message in its cache. Returns true (and stores the
+// result into `result`) on a hit, in which case the task does not have to be
+// executed.
+bool find_memoized(const Task& task, const Message& message,
+		std::string& result, ConsumerMetrics& metrics) {
+	auto memo = task.memo_cache();
+	if (!memo) {
+		return false;
+	}
+	// The key is the raw body, so a hit costs no decoding at all. Bodies in
+	// JSON start with '[' and bodies in MessagePack with an array marker,
+	// so bodies in different formats cannot be mistaken for each other.
+	if (memo->find(message.body, result)) {
+		metrics.memo_hits.increment();
+		return true;
+	}
+	metrics.memo_misses.increment();
+	return false;
+}
+
+// Queues the result of the given task that has succeeded (see
+// ResultPublisher). Batch and asynchronous tasks do not return anything, so
+// instead of null, the client gets an error saying that there is no result.
+void publish_result(ResultPublisher& results, const Task& task,
+		const Message& message, std::string_view result) {
+	if (task.has_result()) {
+		results.succeeded(message, result);
+	} else {
+		results.failed(message, "NotImplementedError", "task " +
+			std::string(task.name()) + " does not return a result");
+	}
+}
+
+// Executes the task with arguments from the given message. When its result
+// is wanted (see ResultPublisher), it is published. A memoized task is
+// executed only when its result is not cached.
+void run_task(const Task& task, Serializer serializer, const Message& message,
+		ResultPublisher* results, ConsumerMetrics& metrics,
+		ConsumerMetrics::Clock::time_point decode_start) {
+	// The result is encoded into a (reused) string only when somebody
+	// waits for it or when it is going to be cached.
+	thread_local std::string result_buffer;
+	auto wanted = results && ResultPublisher::wanted(message);
+	if (find_memoized(task, message, result_buffer, metrics)) {
+		if (wanted) {
+			publish_result(*results, task, message, result_buffer);
+		}
+		return;
+	}
+	auto result = wanted || task.memo_cache() ? &result_buffer : nullptr;
+
+	// Instead of parsing the whole body, the task only decodes the arguments
+	// that it needs (see task_registry.h).
+	if (serializer == Serializer::Json) {
+		run_task(task, CeleryBody(message.body), metrics, decode_start, result);
+	} else {
+		run_task(task, MsgpackBody(message.body), metrics, decode_start, result);
+	}
+	if (auto memo = task.memo_cache()) {
+		memo->insert(message.body, *result);
+	}
+	if (wanted) {
+		publish_result(*results, task, message, *result);
+	}
+}
+
+// Executes the task with arguments from the given message (delivered from
+// the queue with the given index) and acknowledges the message. When the task
+// fails, it is handed over to `failed`.
+void execute_task(const Task& task, Serializer serializer,
+		Message& message, const DeliveryInfo& info, std::size_t source,
+		AckCoalescer& acks, FailedTasks& failed, ResultPublisher* results,
+		ConsumerMetrics& metrics,
+		ConsumerMetrics::Clock::time_point decode_start) {
+	std::exception_ptr error;
+	try {
+		run_task(task, serializer, message, results, metrics, decode_start);
+	} catch (...) {
+		error = std::current_exception();
+	}
+	if (error) {
+		failed.failed(task, message, info, source, error);
+		return;
+	}
+
+	// Acknowledge the message (we have successfully finished its execution).
+	// The acknowledgement may be coalesced with acknowledgements of other
+	// messages.
+	auto ack_start = ConsumerMetrics::Clock::now();
+	acks.ack(info);
+	metrics.record(Stage::Ack, ack_start, ConsumerMetrics::Clock::now());
+}
+
+// Executes the calls of a batch that has failed one by one (each of them in
+// a batch of its own, see Task::invoke()), so that a single bad call does
+// not make the others fail. Calls that succeed are acknowledged, the others
+// are handed over to `failed`.
+void execute_batch_calls(PendingBatches::Batch& batch, AckCoalescer& acks,
+		FailedTasks& failed, ResultPublisher* results) {
+	for (std::size_t i = 0; i < batch.infos.size(); ++i) {
+		std::exception_ptr error;
+		try {
+			const auto& body = batch.bodies[i];
+			if (auto json_body = std::get_if<CeleryBody>(&body)) {
+				batch.task->invoke(*json_body);
+			} else {
+				batch.task->invoke(std::get<MsgpackBody>(body));
+			}
+		} catch (...) {
+			error = std::current_exception();
+		}
+		if (error) {
+			failed.failed(*batch.task, batch.messages[i], batch.infos[i],
+				batch.sources[i], error);
+			continue;
+		}
+		if (results) {
+			publish_result(*results, *batch.task, batch.messages[i], {});
+		}
+		acks.ack(batch.infos[i]);
+	}
+}
+
+// Executes a batch of calls of a batch task and acknowledges their messages
+// together. When the batch fails, its calls are executed one by one (see
+// execute_batch_calls()).
+void execute_batch(PendingBatches::Batch& batch, AckCoalescer& acks,
+		FailedTasks& failed, ResultPublisher* results, ConsumerMetrics& metrics) {
+	auto execute_start = ConsumerMetrics::Clock::now();
+	try {
+		batch.calls->run();
+	} catch (...) {
+		execute_batch_calls(batch, acks, failed, results);
+		metrics.record(Stage::Execute, execute_start,
+			ConsumerMetrics::Clock::now());
+		return;
+	}
+	// A batch task has no results of its calls (see publish_result()).
+	if (results) {
+		for (std::size_t i = 0; i < batch.infos.size(); ++i) {
+			publish_result(*results, *batch.task, batch.messages[i], {});
+		}
+	}
+	auto ack_start = ConsumerMetrics::Clock::now();
+	metrics.record(Stage::Execute, execute_start, ack_start);
+	metrics.batches.increment();
+	acks.ack_all(batch.infos);
+	metrics.record(Stage::Ack, ack_start, ConsumerMetrics::Clock::now());
+}
+
+// The prefetch count of a consumer tuned from measured durations of its tasks
+// (see PrefetchController).
+class AdaptivePrefetch {
+public:
+	AdaptivePrefetch(const ConsumerOptions& options, DelayedTasks& delayed,
+			AckCoalescer& acks, PendingBatches& batches,
+			ConsumerMetrics& metrics):
+		controller(1, options.max_prefetch, options.prefetch),
+		ack_batch(options.ack_batch),
+		delayed(delayed),
+		acks(acks),
+		batches(batches),
+		metrics(metrics) {}
+
+	// Records processed messages (see PrefetchController::record()) and
+	// changes the prefetch count when the controller says so. Messages
+	// processed together (see PendingBatches) are recorded as if each of them
+	// waited and took its share of the total.
+	void processed(ConsumerMetrics::Clock::duration wait,
+			ConsumerMetrics::Clock::duration service, std::size_t messages = 1) {
+		for (std::size_t i = 0; i < messages; ++i) {
+			controller.record(wait / messages, service / messages);
+		}
+		if (auto prefetch = controller.update()) {
+			// Just like at the start (see consume()), the batch of
+			// acknowledgements cannot be larger than the prefetch count.
+			delayed.set_prefetch(*prefetch);
+			acks.set_max_pending(std::min<unsigned>(ack_batch, *prefetch));
+			batches.set_prefetch(*prefetch);
+			metrics.prefetch.set(*prefetch);
+		}
+	}
+
+private:
+	PrefetchController controller;
+	unsigned ack_batch;
+	DelayedTasks& delayed;
+	AckCoalescer& acks;
+	PendingBatches& batches;
+	ConsumerMetrics& metrics;
+};
+
+// Executes tasks one by one until a stop is requested.
+//
+// Tasks with an ETA are parked until they are due (see DelayedTasks), so
+// they are executed after messages that have been delivered later. Calls of
+// batch tasks wait until their batch gets executed (see PendingBatches).
+// Messages are thus acknowledged out of order, which is why all of them are
+// reported to the coalescer (see AckCoalescer).
+//
+// With several queues (`scheduled` is not null), a delivered task is not
+// executed right away. Instead, all messages that have already been
+// delivered are received first (without waiting), and then, the next task is
+// taken from the fair queue (see FairQueue), which is charged for the time
+// for which the task was executed. The receiving cannot go on forever: the
+// server does not deliver more unacknowledged messages than the prefetch
+// counts of the queues allow.
+//
+// When a stop is requested, calls of batch tasks and tasks that are still
+// waiting are abandoned. Their messages have not been acknowledged, so the
+// server delivers them again.
+void process_messages(Channel& channel, AckCoalescer& acks,
+		FailedTasks& failed, ResultPublisher* results, DelayedTasks& delayed,
+		PendingBatches& batches, FairQueue<QueuedTask>* scheduled,
+		AdaptivePrefetch* adaptive, const std::vector<std::string>& consumer_tags,
+		const TaskRegistry& registry,
+		ConsumerMetrics& metrics, Shutdown& shutdown) {
+	// The delivered message is reused between iterations so that its
+	// buffers do not have to be reallocated. So are the tasks going into and
+	// out of the fair queue (it swaps them with its own, see FairQueue).
+	Delivery delivery;
+	QueuedTask incoming;
+	QueuedTask next;
+
+	// Since when the consumer has been ready to process the next message.
+	// Unlike the recorded waiting below, it is not reset when the waiting is
+	// interrupted (e.g. to send acknowledgements).
+	auto ready_since = ConsumerMetrics::Clock::now();
+
+	auto run_batch = [&](PendingBatches::Batch& batch) {
+		auto start = ConsumerMetrics::Clock::now();
+		execute_batch(batch, acks, failed, results, metrics);
+		auto end = ConsumerMetrics::Clock::now();
+		if (adaptive) {
+			adaptive->processed(batch.wait, batch.decode + (end - start),
+				batch.infos.size());
+		}
+		ready_since = end;
+	};
+
+	// Adds a call of a batch task to its batch (the message is swapped with
+	// a message of an earlier batch), and executes the batch when it is
+	// full. A call whose arguments cannot be decoded fails right away.
+	auto collect = [&](const Task& task, Serializer serializer,
+			Message& message, const DeliveryInfo& info, std::size_t source,
+			ConsumerMetrics::Clock::duration wait,
+			ConsumerMetrics::Clock::time_point decode_start) {
+		PendingBatches::Batch* added = nullptr;
+		std::exception_ptr error;
+		try {
+			added = &batches.add(task, serializer, message, info, source);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		if (error) {
+			failed.failed(task, message, info, source, error);
+			ready_since = ConsumerMetrics::Clock::now();
+			return;
+		}
+		auto& batch = *added;
+		auto decode_end = ConsumerMetrics::Clock::now();
+		metrics.record(Stage::Decode, decode_start, decode_end);
+		batch.wait += wait;
+		batch.decode += decode_end - decode_start;
+		ready_since = decode_end;
+		batches.run_if_full(batch, run_batch);
+	};
+
+	// Puts the given task into the fair queue. The task gets back a task
+	// whose buffers can be reused.
+	auto schedule = [&](QueuedTask& task) {
+		scheduled->push(task.source, task.message.priority, task);
+	};
+
+	// Executes the next task from the fair queue. The time spent in the
+	// queue counts as decoding.
+	auto run_scheduled = [&]() {
+		std::size_t source;
+		scheduled->pop(next, source);
+		auto start = ConsumerMetrics::Clock::now();
+		execute_task(*next.task, next.serializer, next.message, next.info,
+			source, acks, failed, results, metrics, next.ready);
+		ready_since = ConsumerMetrics::Clock::now();
+		scheduled->charge(source, ready_since - start);
+	};
+
+	// Keep trying to consume messages until we are asked to stop (e.g. via
+	// Ctrl-C or by sending the SIGTERM signal to the process).
+	while (!shutdown.requested()) {
+		// Execute parked tasks that are due (or schedule them).
+		delayed.run_due([&](QueuedTask&& parked) {
+			auto now = ConsumerMetrics::Clock::now();
+			if (parked.task->is_batch()) {
+				collect(*parked.task, parked.serializer, parked.message,
+					parked.info, parked.source,
+					ConsumerMetrics::Clock::duration::zero(), now);
+				return;
+			}
+			if (scheduled) {
+				parked.ready = now;
+				schedule(parked);
+				return;
+			}
+			execute_task(*parked.task, parked.serializer, parked.message,
+				parked.info, parked.source, acks, failed, results, metrics, now);
+			ready_since = ConsumerMetrics::Clock::now();
+		});
+
+		// Execute batches that have waited for long enough.
+		batches.run_due(run_batch);
+
+		// Try the receive a message.
+		//
+		// There is no need for a timeout to periodically check whether we
+		// should stop: a stop request interrupts the waiting (see
+		// shutdown.h). Thus, the stop is immediate, and an idle consumer does
+		// not wake up at all. We only use a timeout when there are pending
+		// acknowledgements that have to be sent or parked tasks, and we do
+		// not wait at all when there are scheduled tasks.
+		//
+		// The time spent in waiting is recorded only when a message gets
+		// delivered, so idle periods do not skew the metrics.
+		auto wait_start = ConsumerMetrics::Clock::now();
+		auto message_delivered = channel.consume_message(
+			delivery,
+			/*timeout*/scheduled && !scheduled->empty() ? 0
+				: earliest(earliest(delayed.timeout(), batches.timeout()),
+					acks.flush_timeout())
+		);
+		auto decode_start = ConsumerMetrics::Clock::now();
+		acks.flush_if_due();
+		if (!message_delivered) {
+			// All delivered messages have been received, so it is time to
+			// execute a scheduled task.
+			if (scheduled && !scheduled->empty()) {
+				run_scheduled();
+			}
+			continue;
+		}
+		metrics.record(Stage::Wait, wait_start, decode_start);
+		metrics.messages.increment();
+		if (delivery.redelivered) {
+			metrics.redeliveries.increment();
+		}
+		acks.delivered(delivery.info);
+
+		Serializer serializer;
+		auto task = find_task(registry, delivery.message, serializer);
+		if (!task) {
+			acks.ack(delivery.info);
+			continue;
+		}
+
+		auto source = source_of(consumer_tags, delivery.consumer_tag);
+		switch (park_if_delayed(delayed, *task, serializer, delivery, source,
+				metrics)) {
+			case Disposition::Execute:
+				if (task->is_batch()) {
+					collect(*task, serializer, delivery.message, delivery.info,
+						source, decode_start - ready_since, decode_start);
+					break;
+				}
+				if (scheduled) {
+					// The message goes into the fair queue, and the delivery
+					// gets the message of a task executed earlier.
+					incoming.task = task;
+					incoming.serializer = serializer;
+					std::swap(incoming.message, delivery.message);
+					incoming.info = delivery.info;
+					incoming.ready = decode_start;
+					incoming.source = source;
+					schedule(incoming);
+					std::swap(incoming.message, delivery.message);
+					break;
+				}
+				execute_task(*task, serializer, delivery.message, delivery.info,
+					source, acks, failed, results, metrics, decode_start);
+				if (adaptive) {
+					auto end = ConsumerMetrics::Clock::now();
+					adaptive->processed(decode_start - ready_since,
+						end - decode_start);
+					ready_since = end;
+				}
+				break;
+			case Disposition::Parked:
+				break;
+			case Disposition::Discard:
+				acks.ack(delivery.info);
+				break;
+		}
+	}
+}
+
+// Acknowledges tasks that have finished (and clears `completions`). Just like
+// in the synchronous mode, failed tasks are handed over to `failed`.
+void acknowledge(std::vector<Completion>& completions, AckCoalescer& acks,
+		FailedTasks& failed, ConsumerMetrics& metrics) {
+	for (auto& completion : completions) {
+		if (completion.error) {
+			failed.failed(*completion.task, completion.message, completion.info,
+				completion.source, completion.error);
+			continue;
+		}
+		auto ack_start = ConsumerMetrics::Clock::now();
+		acks.ack(completion.info);
+		metrics.record(Stage::Ack, ack_start, ConsumerMetrics::Clock::now());
+	}
+	completions.clear();
+}
+
+// Executes tasks of the consumer with the given index, and of other consumers
+// when it has none (see WorkStealing), until the executor is stopped.
+void execute_shared(WorkStealing& stealing, std::size_t index,
+		ResultPublisher* results, ConsumerMetrics& metrics) {
+	QueuedTask queued;
+	while (auto owner = stealing.next(index, queued)) {
+		if (*owner != index) {
+			metrics.stolen.increment();
+		}
+
+		// The time spent in the deque counts as decoding.
+		std::exception_ptr error;
+		try {
+			run_task(*queued.task, queued.serializer, queued.message, results,
+				metrics, queued.ready);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		if (error) {
+			// The consumer needs the message to retry the task.
+			stealing.complete(*owner, {queued.info, error, queued.task,
+				std::move(queued.message), queued.source});
+		} else {
+			stealing.complete(*owner, {queued.info, nullptr, nullptr, {}});
+		}
+	}
+}
+
+// Receives messages and puts their tasks into the deque of the consumer (see
+// WorkStealing) until a stop is requested. The tasks are executed by
+// executors running in other threads (see execute_shared()).
+//
+// Messages are moved into the deque as soon as they are delivered, so an idle
+// executor can take them even when the other executors are busy. When a task
+// finishes, the executor hands its completion over to us (channels are not
+// thread-safe) and we acknowledge the message. Tasks are thus finished out of
+// order, which the coalescer of acknowledgements handles (see AckCoalescer).
+//
+// Tasks with an ETA are parked until they are due (see DelayedTasks), and
+// then they are put into the deque like any other task.
+void process_messages_shared(Channel& channel, AckCoalescer& acks,
+		FailedTasks& failed, DelayedTasks& delayed, WorkStealing& stealing,
+		std::size_t index, const std::vector<std::string>& consumer_tags,
+		const TaskRegistry& registry, ConsumerMetrics& metrics,
+		Shutdown& shutdown) {
+	std::vector<Completion> completions;
+	Delivery delivery;
+	while (!shutdown.requested()) {
+		// Acknowledge tasks that have finished and queue parked tasks that
+		// are due.
+		stealing.take_completions(index, completions);
+		acknowledge(completions, acks, failed, metrics);
+		delayed.run_due([&](QueuedTask&& parked) {
+			parked.ready = ConsumerMetrics::Clock::now();
+			stealing.push(index, std::move(parked));
+		});
+
+		// Wait for a message. While our tasks are in flight, the waiting is
+		// short, so that we get to their completions.
+		auto timeout = earliest(delayed.timeout(), acks.flush_timeout());
+		if (stealing.in_flight(index)) {
+			timeout = earliest(timeout, InFlightWait);
+		}
+		auto wait_start = ConsumerMetrics::Clock::now();
+		auto message_delivered = channel.consume_message(delivery, timeout);
+		auto decode_start = ConsumerMetrics::Clock::now();
+		acks.flush_if_due();
+		if (!message_delivered) {
+			continue;
+		}
+		metrics.record(Stage::Wait, wait_start, decode_start);
+		metrics.messages.increment();
+		if (delivery.redelivered) {
+			metrics.redeliveries.increment();
+		}
+		acks.delivered(delivery.info);
+
+		Serializer serializer;
+		auto task = find_task(registry, delivery.message, serializer);
+		if (!task) {
+			acks.ack(delivery.info);
+			continue;
+		}
+
+		auto source = source_of(consumer_tags, delivery.consumer_tag);
+		switch (park_if_delayed(delayed, *task, serializer, delivery, source,
+				metrics)) {
+			case Disposition::Execute:
+				// The deque takes over the message, so the delivery cannot
+				// be reused.
+				stealing.push(index, {task, serializer,
+					std::move(delivery.message), delivery.info, decode_start,
+					source});
+				break;
+			case Disposition::Parked:
+				break;
+			case Disposition::Discard:
+				acks.ack(delivery.info);
+				break;
+		}
+	}
+}
+
+// A coroutine that executes the task with arguments from the given message
+// and reports its completion. The coroutine owns the message (and its decoded
+// body), so arguments that refer to them stay valid until the task finishes.
+template<typename Body>
+Async execute_async(const Task& task, Message message, DeliveryInfo info,
+		std::size_t source, ResultPublisher* results, ConsumerMetrics& metrics,
+		ConsumerMetrics::Clock::time_point decode_start,
+		std::vector<Completion>& completions) {
+	std::exception_ptr error;
+	try {
+		std::string result;
+		auto wants_result = results && ResultPublisher::wanted(message);
+		if (!find_memoized(task, message, result, metrics)) {
+			Body body(message.body);
+			auto execution = task.invoke_async(body,
+				wants_result || task.memo_cache() ? &result : nullptr);
+			auto execute_start = ConsumerMetrics::Clock::now();
+			metrics.record(Stage::Decode, decode_start, execute_start);
+			co_await execution;
+			metrics.record(Stage::Execute, execute_start,
+				ConsumerMetrics::Clock::now());
+			if (auto memo = task.memo_cache()) {
+				memo->insert(message.body, result);
+			}
+		}
+		if (wants_result) {
+			publish_result(*results, task, message, result);
+		}
+	} catch (...) {
+		error = std::current_exception();
+	}
+	if (error) {
+		completions.push_back({info, error, &task, std::move(message), source});
+	} else {
+		completions.push_back({info, nullptr, nullptr, {}});
+	}
+}
+
+// Starts a coroutine that executes the task with arguments from the given
+// message (see execute_async()).
+void spawn_task(EventLoop& loop, const Task& task, Serializer serializer,
+		Message message, const DeliveryInfo& info, std::size_t source,
+		ResultPublisher* results, ConsumerMetrics& metrics,
+		ConsumerMetrics::Clock::time_point decode_start,
+		std::vector<Completion>& completions) {
+	if (serializer == Serializer::Json) {
+		loop.spawn(execute_async<CeleryBody>(task, std::move(message), info,
+			source, results, metrics, decode_start, completions));
+	} else {
+		loop.spawn(execute_async<MsgpackBody>(task, std::move(message), info,
+			source, results, metrics, decode_start, completions));
+	}
+}
+
+// Executes tasks as coroutines on an event loop (see async.h) until a stop is
+// requested.
+//
+// Every delivered message starts a coroutine. When the task suspends itself
+// (e.g. to wait for a timer or a file read), we go on receiving further
+// messages and starting their tasks, so a single thread can have many tasks
+// in flight. Their number is limited by the prefetch count: the server does
+// not deliver more unacknowledged messages. Tasks may finish in a different
+// order than in which they were delivered, so they are acknowledged out of
+// order (see AckCoalescer).
+//
+// Tasks with an ETA are parked until they are due (see DelayedTasks), and
+// then they are started like the other tasks.
+//
+// When a stop is requested, tasks that are still in flight (or parked) are
+// abandoned. Their messages have not been acknowledged, so the server
+// delivers them again (to us or to another worker).
+void process_messages_async(Channel& channel, AckCoalescer& acks,
+		FailedTasks& failed, ResultPublisher* results, DelayedTasks& delayed,
+		const std::vector<std::string>& consumer_tags,
+		const TaskRegistry& registry, ConsumerMetrics& metrics,
+		Shutdown& shutdown) {
+	// We wait for messages and for coroutines at the same time: the timeout
+	// of the waiting for a message is the time of the nearest timer, and
+	// while operations in other threads (e.g. file reads) are in flight, the
+	// waiting is short, so that we get to their coroutines.
+	EventLoop loop;
+
+	// Tasks that have finished.
+	std::vector<Completion> completions;
+	auto acknowledge_completed = [&]() {
+		acknowledge(completions, acks, failed, metrics);
+	};
+
+	Delivery delivery;
+	while (!shutdown.requested()) {
+		// Start parked tasks that are due and continue the tasks that are
+		// ready.
+		delayed.run_due([&](QueuedTask&& parked) {
+			spawn_task(loop, *parked.task, parked.serializer,
+				std::move(parked.message), parked.info, parked.source, results,
+				metrics, ConsumerMetrics::Clock::now(), completions);
+		});
+		loop.run_ready();
+		acknowledge_completed();
+
+		auto timeout = earliest(earliest(loop.next_timeout(),
+			delayed.timeout()), acks.flush_timeout());
+		if (loop.remote_operations() > 0) {
+			timeout = earliest(timeout, InFlightWait);
+		}
+		auto wait_start = ConsumerMetrics::Clock::now();
+		auto message_delivered = channel.consume_message(delivery, timeout);
+		auto decode_start = ConsumerMetrics::Clock::now();
+		acks.flush_if_due();
+		if (!message_delivered) {
+			continue;
+		}
+		metrics.record(Stage::Wait, wait_start, decode_start);
+		metrics.messages.increment();
+		if (delivery.redelivered) {
+			metrics.redeliveries.increment();
+		}
+		acks.delivered(delivery.info);
+
+		Serializer serializer;
+		auto task = find_task(registry, delivery.message, serializer);
+		if (!task) {
+			acks.ack(delivery.info);
+			continue;
+		}
+
+		auto source = source_of(consumer_tags, delivery.consumer_tag);
+		switch (park_if_delayed(delayed, *task, serializer, delivery, source,
+				metrics)) {
+			case Disposition::Execute:
+				// The coroutine takes over the message, so the delivery
+				// cannot be reused. A synchronous task is executed right
+				// away.
+				spawn_task(loop, *task, serializer, std::move(delivery.message),
+					delivery.info, source, results, metrics, decode_start,
+					completions);
+				break;
+			case Disposition::Parked:
+				break;
+			case Disposition::Discard:
+				acks.ack(delivery.info);
+				break;
+		}
+	}
+
+	// Synchronous tasks started right before the stop request have already
+	// finished.
+	acknowledge_completed();
+}
+
+}
+
+void consume(Broker& broker, const ConsumerOptions& options,
+		const TaskRegistry& registry, ConsumerMetrics& metrics,
+		Shutdown& shutdown, ResultPublisher* results, WorkStealing* stealing,
+		std::size_t index) {
+	auto channel = broker.open_channel();
+
+	// Let a stop request interrupt our waiting for messages.
+	ShutdownGuard shutdown_guard(shutdown, *channel);
+
+	// Start consuming messages from the queues.
+	//
+	// This method has to be called before we start consuming messages from a
+	// queue. It generates a consumer tag for us. The returned tag identifies
+	// the consumer, and every queue has its own one, so we know from which
+	// queue a delivered message comes.
+	//
+	// Automatic acknowledgements are disabled. Instead, we acknowledge
+	// messages manually after we have successfully processed the task.
+	// Otherwise, a message would be acknowledged right after it was received,
+	// even if its execution later fails. Also, the consumer is not exclusive,
+	// which allows other workers to consume messages from the queue (we may
+	// not be the only worker running).
+	//
+	// Finally, the prefetch count is the maximal number of unacknowledged
+	// messages that the server will deliver to us. With the default of 1, we
+	// always receive just a single message (i.e. no buffering), so every
+	// message costs a full round trip to the server. Larger values let the
+	// server push further messages while we are still processing the current
+	// one. Every consumer has its own prefetch count, so a busy queue cannot
+	// take the slots of the other queues.
+	std::vector<std::string> consumer_tags;
+	for (const auto& queue : options.queues) {
+		consumer_tags.push_back(channel->consume(queue.name, options.prefetch));
+	}
+	auto cancel_all = [&]() {
+		for (const auto& consumer_tag : consumer_tags) {
+			channel->cancel(consumer_tag);
+		}
+	};
+
+	// Acknowledge processed messages in batches to save frames. The batch
+	// cannot be larger than the prefetch count: the server would stop
+	// delivering messages before the batch gets full, so every batch would be
+	// delayed by the whole ack interval.
+	AckCoalescer acks(
+		*channel,
+		/*max_pending*/std::min<unsigned>(options.ack_batch, options.prefetch),
+		/*max_delay*/std::chrono::milliseconds(options.ack_interval)
+	);
+
+	// Failed tasks are retried or moved into the dead-letter queue.
+	FailedTasks failed(*channel, options, acks, results, metrics);
+
+	// Tasks with an ETA wait in the consumer until they are due.
+	DelayedTasks delayed(*channel, consumer_tags, options.prefetch);
+
+	// Calls of batch tasks wait in the consumer until their batch is
+	// executed.
+	PendingBatches batches(options.prefetch);
+
+	// With several queues, tasks executed one by one take turns via a fair
+	// queue. The quantum is short enough for a queue of short tasks not to
+	// wait long behind a queue of long ones, and long enough for several
+	// short tasks to be executed in a row.
+	std::optional<FairQueue<QueuedTask>> scheduled;
+	if (options.queues.size() > 1 && !options.async && !stealing) {
+		scheduled.emplace(SchedulingQuantum);
+		for (const auto& queue : options.queues) {
+			scheduled->add_source(queue.weight);
+		}
+	}
+
+	metrics.prefetch.set(options.prefetch);
+	std::optional<AdaptivePrefetch> adaptive;
+	if (options.adaptive_prefetch && !options.async && !stealing &&
+			options.queues.size() == 1) {
+		adaptive.emplace(options, delayed, acks, batches, metrics);
+	}
+
+	// When the consumer shares its tasks with other consumers, its tasks are
+	// executed by a separate thread (or by the threads of the other
+	// consumers). Before the consumer ends, it has to wait for its tasks that
+	// are being executed. Otherwise, it could not acknowledge them.
+	std::thread executor;
+	if (stealing) {
+		executor = std::thread(execute_shared, std::ref(*stealing), index,
+			results, std::ref(metrics));
+	}
+	auto leave = [&]() {
+		if (!stealing) {
+			return;
+		}
+		auto completions = stealing->leave(index);
+		if (executor.joinable()) {
+			executor.join();
+		}
+		acknowledge(completions, acks, failed, metrics);
+	};
+
+	try {
+		if (options.async) {
+			process_messages_async(*channel, acks, failed, results, delayed,
+				consumer_tags, registry, metrics, shutdown);
+		} else if (stealing) {
+			process_messages_shared(*channel, acks, failed, delayed, *stealing,
+				index, consumer_tags, registry, metrics, shutdown);
+		} else {
+			process_messages(*channel, acks, failed, results, delayed, batches,
+				scheduled ? &*scheduled : nullptr,
+				adaptive ? &*adaptive : nullptr, consumer_tags, registry,
+				metrics, shutdown);
+		}
+		leave();
+
+		// Acknowledge messages that we have processed but not acknowledged
+		// yet. Otherwise, the server would deliver them again.
+		acks.flush();
+	} catch (...) {
+		// Poor man's finally block. Acknowledge messages that were
+		// successfully processed before the failure, cancel consuming from
+		// the queues (see the note below this try-catch block), and re-throw
+		// the exception. When the channel itself is broken, the flush fails
+		// as well, but we want to propagate the original exception.
+		try {
+			leave();
+		} catch (...) {}
+		try {
+			acks.flush();
+		} catch (...) {}
+		cancel_all();
+		throw;
+	}
+	// When the consumer ends, we have to cancel consuming from the queues,
+	// which we started when we called channel->consume(). Messages that have
+	// not been acknowledged are returned to the queues when the channel is
+	// closed (right after this).
+	cancel_all();
+}
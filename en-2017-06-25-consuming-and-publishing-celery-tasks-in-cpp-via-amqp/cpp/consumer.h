@@ -0,0 +1,120 @@
+//
+// A consumer that executes Celery tasks from queues.
+//
+
+#ifndef CONSUMER_H
+#define CONSUMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "broker.h"
+#include "metrics.h"
+#include "shutdown.h"
+#include "task_registry.h"
+
+class ResultPublisher;
+class WorkStealing;
+
+// A queue from which a consumer consumes messages.
+struct QueueOptions {
+	std::string name;
+
+	// The share of the time of the consumer that tasks from the queue get
+	// while tasks from the other queues are waiting, too (see fair_queue.h).
+	unsigned weight = 1;
+};
+
+// Options of a consumer.
+struct ConsumerOptions {
+	// The queues to consume messages from. Every queue has its own consumer
+	// (with its own consumer tag and prefetch count), so a busy queue cannot
+	// take the prefetched messages of another queue.
+	std::vector<QueueOptions> queues = {{"celery", 1}};
+
+	// The queue into which messages that cannot be processed are published:
+	// messages that cannot be decoded and messages of tasks that have failed
+	// more times than their retry policy allows (see RetryPolicy). The
+	// queue is declared when the first message goes there. Empty means that
+	// such messages are discarded.
+	std::string dead_letter_queue = "celery.dead_letter";
+
+	// The maximal number of unacknowledged messages that the server delivers
+	// to the consumer (of every queue).
+	std::uint16_t prefetch = 1;
+
+	// Tune the prefetch count from measured durations of tasks (see
+	// prefetch_controller.h), between 1 and `max_prefetch`. The count above
+	// is the initial one. Supported only when tasks are executed one by one
+	// by the consumer (neither asynchronously nor with work stealing) from a
+	// single queue.
+	bool adaptive_prefetch = false;
+	std::uint16_t max_prefetch = 1024;
+
+	// The maximal number of processed messages that are acknowledged
+	// together (in a single frame).
+	unsigned ack_batch = 1;
+
+	// The maximal time (in milliseconds) for which an acknowledgement of a
+	// processed message can be delayed.
+	unsigned ack_interval = 100;
+
+	// Execute tasks as coroutines on an event loop, so that a single consumer
+	// can have many (asynchronous) tasks in flight at once. Otherwise, tasks
+	// are executed one by one.
+	bool async = false;
+};
+
+// Consumes and executes tasks from the queues until a stop is requested via
+// `shutdown`.
+//
+// The consumer opens its own channel because channels are not thread-safe,
+// so several consumers can run in parallel, each in its own thread.
+//
+// When `stealing` is given, the consumer only receives messages, and their
+// tasks are executed by an executor thread that the consumer starts. The
+// executors of consumers running in parallel with the same `stealing` (each
+// with a different `index`) take tasks of each other, so idle executors help
+// busy ones (see work_stealing.h). This is supported only when tasks are not
+// executed asynchronously.
+//
+// With several queues, delivered messages wait in the consumer, and the next
+// task to be executed is chosen via weighted-fair scheduling (see
+// fair_queue.h): every queue gets a share of the time of the consumer given
+// by its weight, so a queue of long tasks cannot starve a queue of short
+// ones, and tasks from the same queue are executed in the order of the
+// priorities of their messages. This is supported only when tasks are
+// executed one by one (neither asynchronously nor with work stealing).
+// Otherwise, tasks are executed in the order in which their messages were
+// delivered.
+//
+// A task that fails (throws an exception) does not end the consumer. The
+// task is published again (into the queue from which it was delivered) to be
+// retried later, according to its retry policy (see
+// TaskRegistry::set_retry_policy()), or its message is published into the
+// dead-letter queue. Either way, the failed message is acknowledged.
+// Only errors of the channel itself (e.g. a lost connection) end the
+// consumer, with an exception.
+//
+// When `results` is given, results of tasks are published into reply queues
+// of clients that want them (see result_publisher.h). Consumers running in
+// parallel share a single publisher, so its senders (and their connections)
+// are not multiplied by the number of consumers. The result of a task is
+// queued before its message is acknowledged, but it is published (and
+// confirmed) later. Batch tasks and asynchronous tasks do not return
+// anything, so their clients get a NotImplementedError instead of a result.
+// A client of a failed task gets the type of the thrown exception (e.g.
+// std::runtime_error) and its message.
+//
+// Calls of batch tasks (see TaskRegistry::add_batch()) are collected and
+// executed in batches only when tasks are executed one by one by the consumer
+// (neither asynchronously nor with work stealing). Otherwise, batch tasks are
+// executed with a single call at a time.
+void consume(Broker& broker, const ConsumerOptions& options,
+	const TaskRegistry& registry, ConsumerMetrics& metrics,
+	Shutdown& shutdown, ResultPublisher* results = nullptr,
+	WorkStealing* stealing = nullptr, std::size_t index = 0);
+
+#endif
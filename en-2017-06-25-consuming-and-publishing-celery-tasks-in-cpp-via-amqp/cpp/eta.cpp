@@ -0,0 +1,109 @@
+//
+// ETAs of Celery tasks (times at which the tasks should be executed).
+//
+
+#include <charconv>
+#include <cstdio>
+
+#include "eta.h"
+
+namespace {
+
+// Parses a number consisting of exactly `digits` digits from the beginning of
+// the given text and removes it from there.
+bool parse_digits(std::string_view& text, std::size_t digits, int& value) {
+	if (text.size() < digits) {
+		return false;
+	}
+	auto end = text.data() + digits;
+	auto [ptr, ec] = std::from_chars(text.data(), end, value);
+	if (ec != std::errc() || ptr != end || text[0] == '-' || text[0] == '+') {
+		return false;
+	}
+	text.remove_prefix(digits);
+	return true;
+}
+
+// Removes the given separator from the beginning of the text.
+bool skip(std::string_view& text, char separator) {
+	if (text.empty() || text[0] != separator) {
+		return false;
+	}
+	text.remove_prefix(1);
+	return true;
+}
+
+}
+
+std::optional<std::chrono::system_clock::time_point> parse_eta(std::string_view eta) {
+	using namespace std::chrono;
+
+	int y, mo, d, h, mi, s;
+	if (!parse_digits(eta, 4, y) || !skip(eta, '-') ||
+			!parse_digits(eta, 2, mo) || !skip(eta, '-') ||
+			!parse_digits(eta, 2, d) || !(skip(eta, 'T') || skip(eta, ' ')) ||
+			!parse_digits(eta, 2, h) || !skip(eta, ':') ||
+			!parse_digits(eta, 2, mi) || !skip(eta, ':') ||
+			!parse_digits(eta, 2, s)) {
+		return std::nullopt;
+	}
+	year_month_day date{year(y), month(mo), day(d)};
+	if (!date.ok() || h > 23 || mi > 59 || s > 59) {
+		return std::nullopt;
+	}
+	sys_time<microseconds> time = sys_days(date) + hours(h) + minutes(mi) + seconds(s);
+
+	// The fraction of a second (datetime.isoformat() produces microseconds,
+	// but any number of digits is fine).
+	if (skip(eta, '.')) {
+		if (eta.empty() || eta[0] < '0' || eta[0] > '9') {
+			return std::nullopt;
+		}
+		microseconds::rep fraction = 0;
+		microseconds::rep scale = 100000;
+		while (!eta.empty() && eta[0] >= '0' && eta[0] <= '9') {
+			fraction += (eta[0] - '0') * scale;
+			scale /= 10;
+			eta.remove_prefix(1);
+		}
+		time += microseconds(fraction);
+	}
+
+	// The UTC offset.
+	if (eta.empty() || eta == "Z") {
+		return time_point_cast<system_clock::duration>(time);
+	}
+	auto sign = eta[0];
+	if (sign != '+' && sign != '-') {
+		return std::nullopt;
+	}
+	eta.remove_prefix(1);
+	int offset_h, offset_m;
+	if (!parse_digits(eta, 2, offset_h) || !skip(eta, ':') ||
+			!parse_digits(eta, 2, offset_m) || !eta.empty() ||
+			offset_h > 23 || offset_m > 59) {
+		return std::nullopt;
+	}
+	auto offset = hours(offset_h) + minutes(offset_m);
+	time += sign == '+' ? -offset : offset;
+	return time_point_cast<system_clock::duration>(time);
+}
+
+std::string format_eta(std::chrono::system_clock::time_point eta) {
+	using namespace std::chrono;
+
+	auto time = floor<microseconds>(eta);
+	auto days = floor<std::chrono::days>(time);
+	year_month_day date(days);
+	hh_mm_ss<microseconds> tod(time - days);
+
+	char buffer[64];
+	std::snprintf(buffer, sizeof(buffer),
+		"%04d-%02u-%02uT%02d:%02d:%02d.%06lld+00:00",
+		static_cast<int>(date.year()), static_cast<unsigned>(date.month()),
+		static_cast<unsigned>(date.day()), static_cast<int>(tod.hours().count()),
+		static_cast<int>(tod.minutes().count()),
+		static_cast<int>(tod.seconds().count()),
+		static_cast<long long>(tod.subseconds().count()));
+	return buffer;
+}
@@ -0,0 +1,26 @@
+//
+// ETAs of Celery tasks (times at which the tasks should be executed).
+//
+
+#ifndef ETA_H
+#define ETA_H
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Parses an ETA from the 'eta' header of a Celery task message.
+//
+// Celery stores ETAs in the ISO 8601 format produced by Python's
+// datetime.isoformat(), e.g. "2017-06-25T10:30:00.250000+00:00". The
+// fractional part and the UTC offset are optional (a 'Z' suffix is accepted,
+// too). Times without an offset are taken to be in UTC, which is what Celery
+// does with its default configuration (enable_utc). Returns an empty optional
+// when the ETA is invalid.
+std::optional<std::chrono::system_clock::time_point> parse_eta(std::string_view eta);
+
+// Formats the given time as an ETA in UTC (see parse_eta()).
+std::string format_eta(std::chrono::system_clock::time_point eta);
+
+#endif
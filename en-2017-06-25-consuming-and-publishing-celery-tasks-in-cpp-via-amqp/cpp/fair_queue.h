@@ -0,0 +1,184 @@
+//
+// A weighted-fair queue of items from several sources (e.g. delivered tasks
+// from several queues of a broker).
+//
+
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Items from several sources, taken out in a weighted-fair order via deficit
+// round-robin (DRR).
+//
+// Every source has a weight and a deficit, which is the time that its items
+// can still take in the current round. The sources are visited in a round
+// (skipping the ones without items), and every visited source gets a quantum
+// proportional to its weight added to its deficit. Items are taken from the
+// visited source while its deficit is positive. How long an item takes (e.g.
+// how long its task was executed) is not known up front, so it is charged
+// afterwards (see charge()), and a source whose item took longer than its
+// deficit owes the difference and is skipped until later rounds pay it off.
+// Over time, every source that keeps having items thus gets its weighted
+// share of the time, no matter whether its items are long or short, and no
+// source waits for more than a round of the others.
+//
+// Within a source, items with a higher priority are taken first (like the
+// priority property of AMQP messages), and items with the same priority in
+// the order in which they were added.
+//
+// Items are kept in slots that are reused: push() and pop() swap the given
+// item with the one in a slot, so the caller gets back an item whose buffers
+// (e.g. of a message) can be filled again without allocating memory.
+//
+// The queue is not thread-safe.
+template<typename T>
+class FairQueue {
+public:
+	using Duration = std::chrono::steady_clock::duration;
+
+	// Creates an empty queue whose sources get `quantum` multiplied by their
+	// weight in every round. Smaller quanta make the sources take turns more
+	// often.
+	explicit FairQueue(Duration quantum): quantum(quantum) {}
+
+	// Adds a source with the given weight (at least 1). Returns its index.
+	std::size_t add_source(unsigned weight) {
+		sources.emplace_back();
+		sources.back().quantum = quantum * std::max(weight, 1u);
+		return sources.size() - 1;
+	}
+
+	// Returns the number of items (of all sources).
+	std::size_t size() const {
+		return item_count;
+	}
+
+	bool empty() const {
+		return item_count == 0;
+	}
+
+	// Adds the given item from the given source with the given priority. The
+	// item is swapped with the one in a free slot.
+	void push(std::size_t source, std::uint8_t priority, T& item) {
+		std::size_t slot;
+		if (free_slots.empty()) {
+			slot = slots.size();
+			slots.emplace_back();
+		} else {
+			slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		std::swap(slots[slot], item);
+		auto& heap = sources[source].heap;
+		heap.push_back({priority, next_sequence++, slot});
+		std::push_heap(heap.begin(), heap.end(), Entry::later);
+		++item_count;
+	}
+
+	// Takes out the next item (it is swapped with `item`) and stores its
+	// source into `source`. Returns false when there are no items.
+	bool pop(T& item, std::size_t& source) {
+		if (item_count == 0) {
+			return false;
+		}
+
+		// Every full round without a source that may go on means that all
+		// sources with items owe time, so the rounds that would pass until
+		// the first of them has paid off its debt are skipped at once.
+		std::size_t visited = 0;
+		while (sources[current].heap.empty() ||
+				sources[current].deficit <= Duration::zero()) {
+			if (++visited > sources.size()) {
+				skip_rounds();
+				visited = 0;
+			}
+			next_source();
+		}
+
+		auto& from = sources[current];
+		std::pop_heap(from.heap.begin(), from.heap.end(), Entry::later);
+		auto slot = from.heap.back().slot;
+		from.heap.pop_back();
+		std::swap(item, slots[slot]);
+		free_slots.push_back(slot);
+		--item_count;
+		source = current;
+
+		// A source without items does not save its remaining deficit for
+		// later (otherwise, a source that is mostly idle could take a long
+		// turn afterwards). Its debt stays.
+		if (from.heap.empty()) {
+			from.deficit = std::min(from.deficit, Duration::zero());
+		}
+		return true;
+	}
+
+	// Charges the given source for an item that it has taken (e.g. for the
+	// time for which the task was executed).
+	void charge(std::size_t source, Duration cost) {
+		sources[source].deficit -= cost;
+	}
+
+private:
+	struct Entry {
+		std::uint8_t priority;
+		std::uint64_t sequence;
+		std::size_t slot;
+
+		// The order of the heap (its top is the entry to be taken first).
+		static bool later(const Entry& a, const Entry& b) {
+			return a.priority != b.priority
+				? a.priority < b.priority
+				: a.sequence > b.sequence;
+		}
+	};
+
+	struct Source {
+		Duration quantum{0};
+		Duration deficit{0};
+		std::vector<Entry> heap;
+	};
+
+	// Moves to the next source in the round. A source with items gets its
+	// quantum.
+	void next_source() {
+		current = (current + 1) % sources.size();
+		auto& source = sources[current];
+		if (!source.heap.empty()) {
+			source.deficit += source.quantum;
+		}
+	}
+
+	void skip_rounds() {
+		// The number of rounds after which the first source with items has a
+		// positive deficit (minus the one that is going to be visited).
+		auto rounds = std::numeric_limits<Duration::rep>::max();
+		for (const auto& source : sources) {
+			if (!source.heap.empty()) {
+				rounds = std::min(rounds, -source.deficit / source.quantum + 1);
+			}
+		}
+		for (auto& source : sources) {
+			if (!source.heap.empty()) {
+				source.deficit += (rounds - 1) * source.quantum;
+			}
+		}
+	}
+
+	Duration quantum;
+	std::vector<Source> sources;
+	std::size_t current = 0;
+	std::vector<T> slots;
+	std::vector<std::size_t> free_slots;
+	std::uint64_t next_sequence = 0;
+	std::size_t item_count = 0;
+};
+
+#endif
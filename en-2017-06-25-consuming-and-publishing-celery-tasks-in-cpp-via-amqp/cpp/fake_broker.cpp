@@ -0,0 +1,402 @@
+//
+// An in-process broker for benchmarks (no network or RabbitMQ needed).
+//
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fake_broker.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+class FakeChannel;
+
+// A message waiting in a queue (or for an acknowledgement).
+struct StoredMessage {
+	Message message;
+	Clock::time_point published;
+	Clock::time_point available;
+	bool redelivered = false;
+};
+
+struct Consumer {
+	std::string tag;
+	std::string queue;
+	std::uint16_t prefetch = 1;
+	FakeChannel* channel = nullptr;
+
+	// Every consumer has its own "AMQP channel" with its own sequence of
+	// delivery tags, like in the used AMQP library.
+	std::uint16_t delivery_channel = 0;
+	std::uint64_t last_delivery_tag = 0;
+	std::map<std::uint64_t, StoredMessage> unacked;
+
+	// Times since which the individual prefetch slots can be used (in
+	// ascending order). A slot is taken by a delivery and returned by an
+	// acknowledgement.
+	std::deque<Clock::time_point> free_slots;
+
+	// The number of slots that acknowledgements drop instead of returning
+	// them (after the prefetch count has been lowered below the number of
+	// taken slots).
+	std::uint16_t excess_slots = 0;
+
+	// Messages pushed to the consumer (see FakeBrokerOptions::push) that it
+	// has not received yet. Each of them has taken a slot.
+	std::deque<StoredMessage> pushed;
+};
+
+struct Queue {
+	std::deque<StoredMessage> ready;
+	std::vector<Consumer*> consumers;
+
+	// The consumer to which the next message is pushed (round-robin).
+	std::size_t next_consumer = 0;
+};
+
+}
+
+struct FakeBroker::State {
+	explicit State(FakeBrokerOptions options): options(options) {}
+
+	// Wakes up all channels that consume from the given queue.
+	void notify_consumers(const Queue& queue);
+
+	// Pushes messages from the given queue to its consumers with free slots
+	// (only with FakeBrokerOptions::push).
+	void push_messages(Queue& queue);
+
+	FakeBrokerOptions options;
+
+	mutable std::mutex mutex;
+	mutable std::condition_variable acked_cv;
+	std::map<std::string, Queue, std::less<>> queues;
+	std::uint64_t consumer_count = 0;
+	std::uint64_t published = 0;
+	std::uint64_t acked = 0;
+	Histogram ack_latencies;
+};
+
+namespace {
+
+class FakeChannel: public Channel {
+public:
+	explicit FakeChannel(FakeBroker::State& state): state(state) {}
+
+	~FakeChannel() override {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		while (!consumers.empty()) {
+			cancel_locked(consumers.front()->tag);
+		}
+	}
+
+	void publish(const std::string&, const std::string& routing_key,
+			const Message& message) override {
+		auto now = Clock::now();
+		{
+			std::lock_guard<std::mutex> lock(state.mutex);
+			auto& queue = state.queues[routing_key];
+			queue.ready.push_back(
+				StoredMessage{message, now, now + state.options.delivery_latency}
+			);
+			++state.published;
+			state.push_messages(queue);
+			state.notify_consumers(queue);
+		}
+
+		// Simulate waiting for a publisher confirm.
+		if (state.options.publish_latency.count() > 0) {
+			std::this_thread::sleep_for(state.options.publish_latency);
+		}
+	}
+
+	void declare_queue(const std::string& queue_name, bool) override {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.queues[queue_name];
+	}
+
+	std::string consume(const std::string& queue_name, std::uint16_t prefetch) override {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		auto consumer = std::make_unique<Consumer>();
+		consumer->tag = "fake.ctag-" + std::to_string(++state.consumer_count);
+		consumer->queue = queue_name;
+		consumer->prefetch = std::max<std::uint16_t>(prefetch, 1);
+		consumer->free_slots.assign(consumer->prefetch, Clock::time_point::min());
+		consumer->channel = this;
+		consumer->delivery_channel = static_cast<std::uint16_t>(consumers.size() + 1);
+		auto& queue = state.queues[queue_name];
+		queue.consumers.push_back(consumer.get());
+		consumers.push_back(std::move(consumer));
+		state.push_messages(queue);
+		return consumers.back()->tag;
+	}
+
+	bool consume_message(Delivery& delivery, int timeout) override {
+		auto deadline = timeout >= 0
+			? Clock::now() + std::chrono::milliseconds(timeout)
+			: Clock::time_point::max();
+
+		std::unique_lock<std::mutex> lock(state.mutex);
+		for (;;) {
+			if (interrupted) {
+				interrupted = false;
+				return false;
+			}
+
+			// Round-robin over consumers of this channel so that one busy
+			// queue does not starve the others.
+			auto now = Clock::now();
+			auto next_available = Clock::time_point::max();
+			for (std::size_t i = 0; i < consumers.size(); ++i) {
+				auto& consumer = *consumers[(next_consumer + i) % consumers.size()];
+				auto& queue = state.queues[consumer.queue];
+				auto& source = state.options.push ? consumer.pushed : queue.ready;
+				if (source.empty() ||
+						(!state.options.push && consumer.free_slots.empty())) {
+					continue;
+				}
+				auto& front = source.front();
+				auto available = state.options.push ? front.available
+					: std::max(front.available, consumer.free_slots.front());
+				if (available > now) {
+					next_available = std::min(next_available, available);
+					continue;
+				}
+
+				next_consumer = (next_consumer + i + 1) % consumers.size();
+				auto tag = ++consumer.last_delivery_tag;
+				assign_message(delivery.message, front.message);
+				delivery.consumer_tag = consumer.tag;
+				delivery.info.delivery_tag = tag;
+				delivery.info.delivery_channel = consumer.delivery_channel;
+				delivery.redelivered = front.redelivered;
+				consumer.unacked.emplace(tag, std::move(front));
+				source.pop_front();
+				if (!state.options.push) {
+					consumer.free_slots.pop_front();
+				}
+				return true;
+			}
+
+			if (now >= deadline) {
+				return false;
+			}
+			cv.wait_until(lock, std::min(deadline, next_available));
+		}
+	}
+
+	void ack(const DeliveryInfo& info, bool multiple) override {
+		{
+			std::lock_guard<std::mutex> lock(state.mutex);
+			auto consumer = find_consumer(info.delivery_channel);
+			if (consumer) {
+				auto& unacked = consumer->unacked;
+				auto first = multiple ? unacked.begin() : unacked.find(info.delivery_tag);
+				auto last = unacked.upper_bound(info.delivery_tag);
+				auto now = Clock::now();
+				auto slot_free = now + 2 * state.options.delivery_latency;
+				for (auto it = first; it != last && it != unacked.end(); ++it) {
+					if (consumer->excess_slots > 0) {
+						--consumer->excess_slots;
+					} else {
+						consumer->free_slots.push_back(slot_free);
+					}
+					state.ack_latencies.record(
+						std::chrono::duration_cast<std::chrono::nanoseconds>(
+							now - it->second.published
+						).count()
+					);
+					++state.acked;
+				}
+				if (first != unacked.end()) {
+					unacked.erase(first, last);
+				}
+				state.push_messages(state.queues[consumer->queue]);
+				state.acked_cv.notify_all();
+			}
+		}
+
+		if (state.options.ack_latency.count() > 0) {
+			std::this_thread::sleep_for(state.options.ack_latency);
+		}
+	}
+
+	void qos(const std::string& consumer_tag, std::uint16_t prefetch) override {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		auto it = std::find_if(consumers.begin(), consumers.end(),
+			[&](const auto& c) { return c->tag == consumer_tag; });
+		if (it == consumers.end()) {
+			return;
+		}
+
+		// Add or remove free slots (new slots can be used right away, so
+		// they go to the front). Slots that are taken are removed when they
+		// are returned.
+		auto& consumer = **it;
+		prefetch = std::max<std::uint16_t>(prefetch, 1);
+		for (; consumer.prefetch < prefetch; ++consumer.prefetch) {
+			if (consumer.excess_slots > 0) {
+				--consumer.excess_slots;
+			} else {
+				consumer.free_slots.push_front(Clock::time_point::min());
+			}
+		}
+		for (; consumer.prefetch > prefetch; --consumer.prefetch) {
+			if (!consumer.free_slots.empty()) {
+				consumer.free_slots.pop_back();
+			} else {
+				++consumer.excess_slots;
+			}
+		}
+		state.push_messages(state.queues[consumer.queue]);
+		cv.notify_one();
+	}
+
+	void cancel(const std::string& consumer_tag) override {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		cancel_locked(consumer_tag);
+	}
+
+	void interrupt() override {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		interrupted = true;
+		cv.notify_one();
+	}
+
+	// Wakes up the thread waiting in consume_message() (if any).
+	void notify() {
+		cv.notify_one();
+	}
+
+private:
+	Consumer* find_consumer(std::uint16_t delivery_channel) {
+		for (auto& consumer : consumers) {
+			if (consumer->delivery_channel == delivery_channel) {
+				return consumer.get();
+			}
+		}
+		return nullptr;
+	}
+
+	void cancel_locked(const std::string& consumer_tag) {
+		auto it = std::find_if(consumers.begin(), consumers.end(),
+			[&](const auto& c) { return c->tag == consumer_tag; });
+		if (it == consumers.end()) {
+			return;
+		}
+
+		// Return unacknowledged messages (and messages pushed to the
+		// consumer) to the front of the queue, in their original order. A
+		// real server does so only when the channel is closed (see
+		// Channel::cancel()), but consumers close their channels right after
+		// cancelling, so the fake one does it right away.
+		auto& consumer = **it;
+		auto& queue = state.queues[consumer.queue];
+		for (auto m = consumer.pushed.rbegin(); m != consumer.pushed.rend(); ++m) {
+			m->redelivered = true;
+			queue.ready.push_front(std::move(*m));
+		}
+		for (auto m = consumer.unacked.rbegin(); m != consumer.unacked.rend(); ++m) {
+			m->second.redelivered = true;
+			queue.ready.push_front(std::move(m->second));
+		}
+		queue.consumers.erase(
+			std::find(queue.consumers.begin(), queue.consumers.end(), &consumer)
+		);
+		consumers.erase(it);
+		next_consumer = 0;
+		queue.next_consumer = 0;
+		state.push_messages(queue);
+		state.notify_consumers(queue);
+	}
+
+	FakeBroker::State& state;
+	std::condition_variable cv;
+	std::vector<std::unique_ptr<Consumer>> consumers;
+	std::size_t next_consumer = 0;
+	bool interrupted = false;
+};
+
+}
+
+void FakeBroker::State::notify_consumers(const Queue& queue) {
+	for (auto consumer : queue.consumers) {
+		consumer->channel->notify();
+	}
+}
+
+void FakeBroker::State::push_messages(Queue& queue) {
+	if (!options.push) {
+		return;
+	}
+	while (!queue.ready.empty()) {
+		Consumer* consumer = nullptr;
+		for (std::size_t i = 0; i < queue.consumers.size(); ++i) {
+			auto index = (queue.next_consumer + i) % queue.consumers.size();
+			if (!queue.consumers[index]->free_slots.empty()) {
+				consumer = queue.consumers[index];
+				queue.next_consumer = index + 1;
+				break;
+			}
+		}
+		if (!consumer) {
+			return;
+		}
+
+		// The message reaches the consumer after its slot is free.
+		auto& message = queue.ready.front();
+		message.available = std::max(message.available,
+			consumer->free_slots.front());
+		consumer->free_slots.pop_front();
+		consumer->pushed.push_back(std::move(message));
+		queue.ready.pop_front();
+		consumer->channel->notify();
+	}
+}
+
+FakeBroker::FakeBroker(FakeBrokerOptions options):
+	state(std::make_unique<State>(options)) {}
+
+FakeBroker::~FakeBroker() = default;
+
+std::unique_ptr<Channel> FakeBroker::open_channel() {
+	if (state->options.connect_latency.count() > 0) {
+		std::this_thread::sleep_for(state->options.connect_latency);
+	}
+	return std::make_unique<FakeChannel>(*state);
+}
+
+std::uint64_t FakeBroker::published() const {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	return state->published;
+}
+
+std::uint64_t FakeBroker::acked() const {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	return state->acked;
+}
+
+std::size_t FakeBroker::ready(const std::string& queue) const {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	auto it = state->queues.find(queue);
+	return it != state->queues.end() ? it->second.ready.size() : 0;
+}
+
+bool FakeBroker::wait_for_acks(std::uint64_t count,
+		std::chrono::milliseconds timeout) const {
+	std::unique_lock<std::mutex> lock(state->mutex);
+	return state->acked_cv.wait_for(lock, timeout,
+		[&]() { return state->acked >= count; });
+}
+
+void FakeBroker::collect_ack_latencies(Histogram& into) const {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	into.add(state->ack_latencies);
+}
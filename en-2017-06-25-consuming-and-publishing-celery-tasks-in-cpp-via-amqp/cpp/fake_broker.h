@@ -0,0 +1,85 @@
+//
+// An in-process broker for benchmarks (no network or RabbitMQ needed).
+//
+
+#ifndef FAKE_BROKER_H
+#define FAKE_BROKER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "broker.h"
+#include "histogram.h"
+
+// Latencies that the fake broker injects to simulate a real one.
+struct FakeBrokerOptions {
+	// How long open_channel() takes (opening a connection to RabbitMQ takes
+	// several round trips).
+	std::chrono::microseconds connect_latency{0};
+
+	// How long publish() waits for a "confirm".
+	std::chrono::microseconds publish_latency{0};
+
+	// The one-way latency between the broker and a consumer. A published
+	// message can be delivered after this time (the publisher does not wait
+	// for it). After a consumer acknowledges a message, it takes twice this
+	// time before the freed prefetch slot can be used for another message
+	// (the acknowledgement has to reach the broker and the next message has
+	// to reach the consumer), which is why larger prefetch counts help.
+	std::chrono::microseconds delivery_latency{0};
+
+	// How long ack() takes.
+	std::chrono::microseconds ack_latency{0};
+
+	// Assign messages to consumers as soon as they have free prefetch slots,
+	// like RabbitMQ does (it pushes messages to consumers). Otherwise, a
+	// message is assigned to a consumer when the consumer asks for it, so
+	// messages that a busy consumer would have prefetched are left to the
+	// other consumers.
+	bool push = false;
+};
+
+// A broker that keeps all queues in memory of the current process.
+//
+// Messages are routed to the queue with the same name as the routing key (the
+// exchange is ignored), which is how the 'celery' direct exchange works with
+// the default configuration. Queues are created on demand. Just like in
+// RabbitMQ, every consumer receives at most its prefetch count of
+// unacknowledged messages, and unacknowledged messages are returned to the
+// queue (marked as redelivered) when their consumer is cancelled.
+//
+// The broker is thread-safe. It has to outlive all channels opened to it.
+class FakeBroker: public Broker {
+public:
+	explicit FakeBroker(FakeBrokerOptions options = {});
+	~FakeBroker() override;
+
+	std::unique_ptr<Channel> open_channel() override;
+
+	// Returns the number of published messages.
+	std::uint64_t published() const;
+
+	// Returns the number of acknowledged messages.
+	std::uint64_t acked() const;
+
+	// Returns the number of messages waiting in the given queue (not
+	// delivered to any consumer).
+	std::size_t ready(const std::string& queue) const;
+
+	// Waits until at least `count` messages have been acknowledged or until
+	// the timeout expires. Returns true in the former case.
+	bool wait_for_acks(std::uint64_t count, std::chrono::milliseconds timeout) const;
+
+	// Adds times from publishing to acknowledgement of all acknowledged
+	// messages (in nanoseconds) into the given histogram.
+	void collect_ack_latencies(Histogram& into) const;
+
+	struct State;
+
+private:
+	std::unique_ptr<State> state;
+};
+
+#endif
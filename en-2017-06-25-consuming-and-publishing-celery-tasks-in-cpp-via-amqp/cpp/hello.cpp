@@ -1,87 +1,341 @@
 //
 // Sends a request to call hello() from within a worker.
 //
-// Uses SimpleAmqpClient (https://github.com/alanxz/SimpleAmqpClient) to
-// connect to RabbitMQ and nlohmann/json (https://github.com/nlohmann/json) to
-// create JSON.
+// Uses the Celery client from celery_client.h, which connects to RabbitMQ via
+// SimpleAmqpClient (https://github.com/alanxz/SimpleAmqpClient). See
+// celery_client.cpp for a description of the sent messages.
+//
+// In the bulk mode (--bulk), it sends a request for every NAME AGE record
+// read from a file or the standard input (see bulk_publish() below).
+//
+// With --serializer msgpack, message bodies are serialized via MessagePack
+// instead of JSON (see set_serializer() in celery_client.cpp).
+//
+// With --compression zlib|zstd, message bodies above a threshold are
+// compressed (see compression.h). The bodies of hello() are far below it, so
+// the option mainly shows how to turn compression on (see
+// CeleryClientOptions).
+//
+// With --countdown S, the tasks are executed S seconds after they have been
+// sent (see task_options() below).
+//
+// With --queue NAME, the tasks are sent to the given queue instead of the
+// 'celery' queue, and with --priority P, their messages have the given
+// priority (see consumer.h for a worker consuming from several queues).
+//
+// With --wait, it waits for the results of the tasks, which the worker sends
+// back when it is started with --results (see async_result.h).
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "amqp_broker.h"
+#include "celery_client.h"
+#include "histogram.h"
+
+namespace {
+
+// Returns options of a task that should be executed after the given number of
+// seconds from now (or right away when the countdown is not positive), with
+// the given priority.
+//
+// Celery clients support both an ETA (the time at which the task should be
+// executed) and a countdown (the number of seconds after which it should be
+// executed), but the countdown is converted into an ETA before the message is
+// sent, so workers only see the 'eta' header.
+TaskOptions task_options(double countdown, int priority) {
+	TaskOptions options;
+	options.priority = static_cast<std::uint8_t>(std::clamp(priority, 0, 255));
+	if (countdown > 0) {
+		options.eta = std::chrono::system_clock::now() +
+			std::chrono::duration_cast<std::chrono::system_clock::duration>(
+				std::chrono::duration<double>(countdown));
+	}
+	return options;
+}
+
+// Splits a NAME AGE record into its parts. The name is everything before the
+// last space, so it may contain spaces. Returns false when the record is
+// invalid.
+bool parse_record(std::string_view line, std::string_view& name, int& age) {
+	// Ignore surrounding whitespace (including '\r' from Windows line ends).
+	const auto ws = " \t\r";
+	auto first = line.find_first_not_of(ws);
+	if (first == std::string_view::npos) {
+		return false;
+	}
+	line = line.substr(first, line.find_last_not_of(ws) - first + 1);
 
-// Access to https://github.com/alanxz/SimpleAmqpClient
-#include <SimpleAmqpClient/SimpleAmqpClient.h>
+	auto sep = line.find_last_of(' ');
+	if (sep == std::string_view::npos) {
+		return false;
+	}
+	name = line.substr(0, line.find_last_not_of(' ', sep) + 1);
+	try {
+		std::size_t end = 0;
+		auto age_str = std::string(line.substr(sep + 1));
+		age = std::stoi(age_str, &end);
+		return end == age_str.size();
+	} catch (const std::exception&) {
+		return false;
+	}
+}
 
-// Access to https://github.com/nlohmann/json
-#include <json.hpp>
+// Sends a request to call hello() for every NAME AGE record (one per line) in
+// the given input.
+//
+// Instead of launching a new process (and opening a new connection) for each
+// request, all requests are sent via a single client, which reuses its
+// channels and the buffers of their messages (see celery_client.h).
+//
+// The used AMQP library puts channels into the publisher-confirms mode and
+// BasicPublish() waits until the server confirms the message (see
+// Channel::publish() in broker.h), so a single channel can only have one
+// unconfirmed message in flight. To avoid waiting
+// for a full round trip after every message, we publish from `window` threads
+// in parallel over a pool of `window` channels, so up to `window` messages
+// are waiting for their confirms at any time.
+//
+// With `wait`, the results of all tasks are waited for after all of them have
+// been sent. Every result goes to the handle of its task as soon as it
+// arrives, so by then, most of them are usually there already.
+//
+// At the end, statistics (throughput and latency) are printed.
+int bulk_publish(CeleryClient& client, std::istream& input, unsigned window,
+		double countdown, int priority, bool wait) {
+	std::mutex input_mutex;
+	std::size_t line_number = 0;
+	std::vector<Histogram> latencies(window);
+	std::vector<std::vector<AsyncResult>> results(window);
+	std::vector<std::thread> publishers;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < window; ++i) {
+		publishers.emplace_back([&, i]() {
+			std::string line;
+			for (;;) {
+				std::size_t current_line;
+				{
+					std::lock_guard<std::mutex> lock(input_mutex);
+					if (!std::getline(input, line)) {
+						break;
+					}
+					current_line = ++line_number;
+				}
+				if (line.empty()) {
+					continue;
+				}
+
+				std::string_view name;
+				int age;
+				if (!parse_record(line, name, age)) {
+					std::lock_guard<std::mutex> lock(input_mutex);
+					std::cerr << "line " << current_line
+						<< ": invalid record (expected NAME AGE): " << line << '\n';
+					continue;
+				}
 
-// A convenience type alias.
-using json = nlohmann::json;
+				auto publish_start = std::chrono::steady_clock::now();
+				if (wait) {
+					results[i].push_back(client.send_task_with_result(
+						task_options(countdown, priority), "tasks.hello",
+						name, age));
+				} else {
+					client.send_task(task_options(countdown, priority),
+						"tasks.hello", name, age);
+				}
+				auto publish_end = std::chrono::steady_clock::now();
+				latencies[i].record(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(
+						publish_end - publish_start
+					).count()
+				);
+			}
+		});
+	}
+	for (auto& publisher : publishers) {
+		publisher.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	Histogram all;
+	for (const auto& latency : latencies) {
+		all.add(latency);
+	}
+	auto seconds = std::chrono::duration<double>(end - start).count();
+	std::cout << "Sent " << all.count() << " messages in " << seconds
+		<< " s (" << (seconds > 0 ? all.count() / seconds : 0.0)
+		<< " msgs/sec).\n"
+		<< "Publish latency: p50 = " << all.percentile(50) / 1000.0
+		<< " us, p99 = " << all.percentile(99) / 1000.0 << " us.\n";
+	if (!wait) {
+		return 0;
+	}
+
+	// When the worker does not publish results, nothing ever arrives, so we
+	// do not wait forever.
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30) +
+		std::chrono::seconds(static_cast<long>(std::max(countdown, 0.0)));
+	std::size_t received = 0;
+	std::size_t failed = 0;
+	for (const auto& thread_results : results) {
+		for (const auto& result : thread_results) {
+			auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now());
+			if (auto task_result = result.wait_for(
+					std::max(remaining, std::chrono::milliseconds(0)))) {
+				++received;
+				failed += !task_result->successful();
+			}
+		}
+	}
+	auto results_end = std::chrono::steady_clock::now();
+	std::cout << "Received " << received << " of " << all.count()
+		<< " results (" << failed << " failed) in "
+		<< std::chrono::duration<double>(results_end - start).count()
+		<< " s since the start.\n";
+	return received == all.count() && failed == 0 ? 0 : 1;
+}
+
+}
 
 int main(int argc, char** argv) {
-	// Two arguments are required: name (string) and age (int).
-	if (argc != 3) {
-		std::cout << "usage: " << argv[0] << " NAME AGE\n";
+	// Both modes accept --serializer json|msgpack, --compression zlib|zstd,
+	// --countdown S, --queue NAME, --priority P, and --wait. Strip them from
+	// the arguments so that the rest of them can be parsed as before.
+	std::vector<std::string> args(argv + 1, argv + argc);
+	std::string serializer = "json";
+	std::string compression;
+	double countdown = 0;
+	std::string queue;
+	int priority = 0;
+	bool wait = false;
+	for (auto it = args.begin(); it != args.end();) {
+		if (*it == "--serializer" && it + 1 != args.end()) {
+			serializer = *(it + 1);
+			it = args.erase(it, it + 2);
+		} else if (*it == "--compression" && it + 1 != args.end()) {
+			compression = *(it + 1);
+			it = args.erase(it, it + 2);
+		} else if (*it == "--countdown" && it + 1 != args.end()) {
+			countdown = std::atof((it + 1)->c_str());
+			it = args.erase(it, it + 2);
+		} else if (*it == "--queue" && it + 1 != args.end()) {
+			queue = *(it + 1);
+			it = args.erase(it, it + 2);
+		} else if (*it == "--priority" && it + 1 != args.end()) {
+			priority = std::atoi((it + 1)->c_str());
+			it = args.erase(it, it + 2);
+		} else if (*it == "--wait") {
+			wait = true;
+			it = args.erase(it);
+		} else {
+			++it;
+		}
+	}
+	if (serializer != "json" && serializer != "msgpack") {
+		std::cerr << "unsupported serializer: " << serializer
+			<< " (expected json or msgpack)\n";
+		return 1;
+	}
+	if (!compression.empty() && !compression_from_name(compression)) {
+		std::cerr << "unsupported compression: " << compression
+			<< " (expected zlib or zstd, if supported by the build)\n";
 		return 1;
 	}
 
-	// Parse the arguments.
-	auto name = std::string(argv[1]);
-	auto age = std::stoi(argv[2]);
-
-	// Create a connection to our AMQP server (RabbitMQ).
-	//
-	// Technically, in AMQP, a single connection can contain multiple channels,
-	// where channels that can be thought of as "lightweight connections that
-	// share a single TCP connection"
-	// (https://www.rabbitmq.com/tutorials/amqp-concepts.html).
-	// However, the used AMQP library only allows creation of channels, not
-	// connections.
-	auto channel = AmqpClient::Channel::Create(
+	// Create a connection to our AMQP server (RabbitMQ). Channels (and their
+	// connections) are opened by the client when they are needed.
+	AmqpBroker broker(
 		/*host*/"localhost",
 		/*port*/5672,
 		/*username*/"guest",
 		/*password*/"guest",
 		/*vhost*/"/"
 	);
+	CeleryClientOptions options;
+	options.serializer = serializer;
+	options.compression = compression;
+	if (!queue.empty()) {
+		// Send the tasks directly to the queue via the default exchange, so
+		// the queue does not have to be bound to the 'celery' exchange.
+		options.exchange = "";
+		options.routing_key = queue;
+	}
+
+	// The bulk mode: hello --bulk [FILE] [--window W]
+	if (!args.empty() && args[0] == "--bulk") {
+		std::string file = "-";
+		unsigned window = 8;
+		for (std::size_t i = 1; i < args.size(); ++i) {
+			if (args[i] == "--window" && i + 1 < args.size()) {
+				window = std::clamp(std::atoi(args[++i].c_str()), 1, 1024);
+			} else {
+				file = args[i];
+			}
+		}
 
-	// Create a body of the message.
-	//
-	// This assumes that Celery uses JSON as a way of serializing and
-	// de-serializing messages, which is the default.
-	auto body = json{
-		{name, age},    // args
-		json::object(), // kwargs
-		json::object()  // other data
-	};
-
-	// Create a message with the above body, serialized into a string.
-	auto msg = AmqpClient::BasicMessage::Create(body.dump());
-
-	// As said above, Celery by default uses JSON to serialize and de-serialize
-	// message bodies.
-	msg->ContentType("application/json");
-
-	// Assume UTF-8.
-	msg->ContentEncoding("utf-8");
-
-	// Celery requires two headers: id and task. The former can be any unique
-	// string you want
-	// (http://docs.celeryproject.org/en/latest/faq.html#can-i-specify-a-custom-task-id),
-	// although Celery uses UUIDs. The latter has to be the name of the task,
-	// as registered in the Python part.
-	//
-	// In a real-world scenario, you would probably want generate a random ID ;-).
-	msg->HeaderTable({
-		{"id", "3149beef-be66-4b0e-ba47-2fc46e4edac3"},
-		{"task", "tasks.hello"}
-	});
-
-	// Send the message to the 'celery' exchange (default) with the 'celery'
-	// routing key (default). This effectively sends the message to the
-	// 'celery' queue because 'celery' is a direct exchange
-	// (https://www.rabbitmq.com/tutorials/amqp-concepts.html).
-	channel->BasicPublish("celery", "celery", msg);
-
-	return 0;
+		options.pool_size = window;
+		CeleryClient client(broker, options);
+		if (file == "-") {
+			return bulk_publish(client, std::cin, window, countdown, priority,
+				wait);
+		}
+		std::ifstream input(file);
+		if (!input) {
+			std::cerr << "cannot open " << file << '\n';
+			return 1;
+		}
+		return bulk_publish(client, input, window, countdown, priority, wait);
+	}
+
+	// Two arguments are required: name (string) and age (int).
+	if (args.size() != 2) {
+		std::cout << "usage: " << argv[0]
+			<< " [--serializer S] [--compression C] [--countdown S]"
+			<< " [--queue NAME] [--priority P] [--wait] NAME AGE\n"
+			<< "       " << argv[0]
+			<< " --bulk [FILE] [--window W] [--serializer S] [--compression C]"
+			<< " [--countdown S] [--queue NAME] [--priority P] [--wait]\n";
+		return 1;
+	}
+
+	// Parse the arguments.
+	auto name = args[0];
+	auto age = std::stoi(args[1]);
+
+	// Send the request. The client creates a body of the message with the
+	// given arguments (see celery_body.h), adds the headers required by
+	// Celery, and sends the message to the 'celery' queue.
+	options.pool_size = 1;
+	CeleryClient client(broker, options);
+	if (!wait) {
+		client.send_task(task_options(countdown, priority), "tasks.hello",
+			name, age);
+		return 0;
+	}
+
+	// The handle gets the result as soon as the worker publishes it. When
+	// the worker does not publish results, nothing ever arrives, so we do
+	// not wait forever.
+	auto handle = client.send_task_with_result(
+		task_options(countdown, priority), "tasks.hello", name, age);
+	auto timeout = std::chrono::seconds(30) +
+		std::chrono::seconds(static_cast<long>(std::max(countdown, 0.0)));
+	auto result = handle.wait_for(timeout);
+	if (!result) {
+		std::cerr << "no result of task " << handle.id() << " arrived (is the"
+			" worker publishing results?)\n";
+		return 1;
+	}
+	std::cout << result->status << ": " << result->result << '\n';
+	return result->successful() ? 0 : 1;
 }
@@ -0,0 +1,82 @@
+//
+// A histogram of latencies (or other non-negative integral values).
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "histogram.h"
+
+void Histogram::add(const Histogram& other) noexcept {
+	for (std::size_t i = 0; i < BucketCount; ++i) {
+		auto n = other.counters[i].load(std::memory_order_relaxed);
+		if (n != 0) {
+			counters[i].store(counters[i].load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
+		}
+	}
+	total_count.store(total_count.load(std::memory_order_relaxed) +
+		other.total_count.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+	total_sum.store(total_sum.load(std::memory_order_relaxed) +
+		other.total_sum.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::count() const noexcept {
+	return total_count.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::sum() const noexcept {
+	return total_sum.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::count_at_or_below(std::uint64_t value) const noexcept {
+	std::uint64_t n = 0;
+	auto last = bucket_index(value);
+	for (std::size_t i = 0; i <= last; ++i) {
+		n += counters[i].load(std::memory_order_relaxed);
+	}
+	return n;
+}
+
+std::uint64_t Histogram::percentile(double p) const noexcept {
+	// We cannot use count() because other threads may be recording values
+	// while we are computing the percentile.
+	std::uint64_t total = 0;
+	for (const auto& counter : counters) {
+		total += counter.load(std::memory_order_relaxed);
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	auto rank = static_cast<std::uint64_t>(
+		std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * total)
+	);
+	rank = std::max<std::uint64_t>(rank, 1);
+	std::uint64_t seen = 0;
+	for (std::size_t i = 0; i < BucketCount; ++i) {
+		seen += counters[i].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			return bucket_highest_value(i);
+		}
+	}
+	return bucket_highest_value(BucketCount - 1);
+}
+
+std::uint64_t Histogram::bucket_lowest_value(std::size_t index) noexcept {
+	if (index < 2 * SubBuckets) {
+		return index;
+	}
+	auto shift = index / SubBuckets - 1;
+	auto top = index - SubBuckets * shift;
+	return static_cast<std::uint64_t>(top) << shift;
+}
+
+std::uint64_t Histogram::bucket_highest_value(std::size_t index) noexcept {
+	if (index + 1 >= BucketCount) {
+		return UINT64_MAX;
+	}
+	return bucket_lowest_value(index + 1) - 1;
+}
@@ -0,0 +1,87 @@
+//
+// A histogram of latencies (or other non-negative integral values).
+//
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// A histogram with log-linear buckets, similar to HdrHistogram
+// (http://hdrhistogram.org/).
+//
+// Values below 2 * SubBuckets are stored exactly. Larger values are stored in
+// buckets whose width is proportional to the value, so the relative error of
+// every recorded value is below 1 / SubBuckets (~3%) while the whole range of
+// std::uint64_t fits into less than two thousand counters. Recording a value
+// is a constant-time operation that never allocates.
+//
+// A histogram is meant to be written by a single thread (e.g. a consumer
+// thread), but it can be read by other threads at the same time: all counters
+// are atomics that are updated without read-modify-write operations, so
+// recording does not need any locks or expensive atomic instructions.
+class Histogram {
+public:
+	static constexpr unsigned SubBucketBits = 5;
+	static constexpr std::uint64_t SubBuckets = 1u << SubBucketBits;
+	static constexpr std::size_t BucketCount = SubBuckets * (64 - SubBucketBits + 1);
+
+	// Records the given value. Only a single thread may record values into a
+	// histogram at a time.
+	void record(std::uint64_t value) noexcept {
+		auto& counter = counters[bucket_index(value)];
+		counter.store(counter.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+		total_count.store(total_count.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+		total_sum.store(total_sum.load(std::memory_order_relaxed) + value,
+			std::memory_order_relaxed);
+	}
+
+	// Adds all values from the other histogram into this one.
+	void add(const Histogram& other) noexcept;
+
+	// Returns the number of recorded values.
+	std::uint64_t count() const noexcept;
+
+	// Returns the sum of all recorded values.
+	std::uint64_t sum() const noexcept;
+
+	// Returns the number of recorded values that are lower than or equal to
+	// the given value (up to the precision of the histogram).
+	std::uint64_t count_at_or_below(std::uint64_t value) const noexcept;
+
+	// Returns an (approximate) value below which the given percentage (in
+	// [0, 100]) of recorded values falls. Returns 0 for an empty histogram.
+	std::uint64_t percentile(double p) const noexcept;
+
+	// Returns the index of the bucket into which the given value falls.
+	static std::size_t bucket_index(std::uint64_t value) noexcept {
+		if (value < 2 * SubBuckets) {
+			return static_cast<std::size_t>(value);
+		}
+		// The position of the most significant bit determines the width of
+		// the bucket, the next SubBucketBits bits the bucket itself.
+		unsigned msb = 63 - __builtin_clzll(value);
+		unsigned shift = msb - SubBucketBits;
+		return static_cast<std::size_t>(SubBuckets * shift + (value >> shift));
+	}
+
+	// Returns the lowest value that falls into the bucket with the given
+	// index.
+	static std::uint64_t bucket_lowest_value(std::size_t index) noexcept;
+
+	// Returns the highest value that falls into the bucket with the given
+	// index.
+	static std::uint64_t bucket_highest_value(std::size_t index) noexcept;
+
+private:
+	std::array<std::atomic<std::uint64_t>, BucketCount> counters{};
+	std::atomic<std::uint64_t> total_count{0};
+	std::atomic<std::uint64_t> total_sum{0};
+};
+
+#endif
@@ -0,0 +1,113 @@
+//
+// A cache of results of tasks that are pure functions of their arguments.
+//
+
+#include <algorithm>
+#include <functional>
+
+#include "memo_cache.h"
+
+namespace {
+
+// The maximal number of shards (see MemoCache).
+constexpr std::size_t MaxShards = 16;
+
+// Hashes a key. std::hash of a string view is a fast non-cryptographic hash
+// (MurmurHash2 in libstdc++), which processes eight bytes at a time.
+std::uint64_t hash_of(std::string_view key) {
+	return std::hash<std::string_view>()(key);
+}
+
+}
+
+MemoCache::MemoCache(const MemoOptions& options):
+		ttl(options.ttl),
+		shard_count(std::clamp<std::size_t>(options.capacity, 1, MaxShards)) {
+	shard_capacity = (std::max<std::size_t>(options.capacity, 1) +
+		shard_count - 1) / shard_count;
+	shards = std::make_unique<Shard[]>(shard_count);
+	for (std::size_t i = 0; i < shard_count; ++i) {
+		shards[i].entries.reserve(shard_capacity);
+		shards[i].index.reserve(shard_capacity);
+	}
+}
+
+MemoCache::~MemoCache() = default;
+
+bool MemoCache::find(std::string_view key, std::string& result) {
+	auto hash = hash_of(key);
+	auto& shard = shard_of(hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.index.find(hash);
+	if (it == shard.index.end()) {
+		return false;
+	}
+	auto& entry = shard.entries[it->second];
+	if (entry.key != key || entry.expires <= Clock::now()) {
+		return false;
+	}
+	entry.referenced = true;
+	result.assign(entry.result);
+	return true;
+}
+
+void MemoCache::insert(std::string_view key, std::string_view result) {
+	auto hash = hash_of(key);
+	auto& shard = shard_of(hash);
+	auto now = Clock::now();
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	// An entry with the same hash (the same key, or a colliding one) is
+	// replaced. Otherwise, the new entry takes a free position, or the
+	// position of an evicted entry.
+	std::size_t pos;
+	if (auto it = shard.index.find(hash); it != shard.index.end()) {
+		pos = it->second;
+	} else {
+		if (shard.entries.size() < shard_capacity) {
+			pos = shard.entries.size();
+			shard.entries.emplace_back();
+		} else {
+			pos = evict(shard, now);
+			shard.index.erase(shard.entries[pos].hash);
+		}
+		shard.index.emplace(hash, pos);
+	}
+
+	// The buffers of the previous entry at the position are reused.
+	auto& entry = shard.entries[pos];
+	entry.hash = hash;
+	entry.key.assign(key);
+	entry.result.assign(result);
+	entry.expires = now + ttl;
+	entry.referenced = false;
+}
+
+std::size_t MemoCache::size() const {
+	std::size_t size = 0;
+	for (std::size_t i = 0; i < shard_count; ++i) {
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		size += shards[i].entries.size();
+	}
+	return size;
+}
+
+MemoCache::Shard& MemoCache::shard_of(std::uint64_t hash) {
+	// The low bits of the hash select buckets in the index, so the shard is
+	// selected by the high bits.
+	return shards[(hash >> 32) % shard_count];
+}
+
+std::size_t MemoCache::evict(Shard& shard, Clock::time_point now) {
+	// Every entry passed by the hand loses its reference bit, so the hand
+	// finds a victim in at most one full sweep.
+	for (;;) {
+		auto pos = shard.hand;
+		auto& entry = shard.entries[pos];
+		shard.hand = (shard.hand + 1) % shard.entries.size();
+		if (!entry.referenced || entry.expires <= now) {
+			return pos;
+		}
+		entry.referenced = false;
+	}
+}
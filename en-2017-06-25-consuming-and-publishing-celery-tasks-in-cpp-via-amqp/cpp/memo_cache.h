@@ -0,0 +1,96 @@
+//
+// A cache of results of tasks that are pure functions of their arguments.
+//
+
+#ifndef MEMO_CACHE_H
+#define MEMO_CACHE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Options of a memoized task (see TaskRegistry::memoize()).
+struct MemoOptions {
+	// The maximal number of cached results.
+	std::size_t capacity = 10000;
+
+	// How long a cached result can be used.
+	std::chrono::milliseconds ttl{60 * 1000};
+};
+
+// A bounded cache of results of a task, keyed by the raw bytes of the bodies
+// of its messages (i.e. by its arguments, without decoding them).
+//
+// When the same task with the same arguments arrives in a burst (e.g. a
+// client sends duplicates), only the first message is executed. The others
+// get the cached result right away.
+//
+// The cache is shared by all consumers, so it is divided into shards, each
+// with its own mutex, and a key goes to the shard given by its hash, so
+// consumers looking up different keys rarely wait for each other. A shard
+// keeps its entries in a fixed array (allocated up front, so the buffers of
+// evicted entries are reused) and an index from hashes to positions in the
+// array. Keys are compared in full, so colliding hashes cannot return a wrong
+// result.
+//
+// When a shard is full, an entry is evicted via the CLOCK algorithm (an
+// approximation of LRU): every entry has a reference bit that is set when the
+// entry is used, and a hand sweeps over the array, clearing the bits, until
+// it finds an entry whose bit is clear (or that has expired). Unlike LRU, a
+// hit only sets a bit instead of moving the entry to the front of a list.
+//
+// All methods are thread-safe.
+class MemoCache {
+public:
+	explicit MemoCache(const MemoOptions& options);
+	~MemoCache();
+
+	MemoCache(const MemoCache&) = delete;
+	MemoCache& operator=(const MemoCache&) = delete;
+
+	// Stores the cached result for the given key into `result` and returns
+	// true, or returns false when there is no such result (or it has
+	// expired).
+	bool find(std::string_view key, std::string& result);
+
+	// Caches the given result for the given key.
+	void insert(std::string_view key, std::string_view result);
+
+	// Returns the number of cached results (including the expired ones that
+	// have not been evicted yet).
+	std::size_t size() const;
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Entry {
+		std::uint64_t hash = 0;
+		std::string key;
+		std::string result;
+		Clock::time_point expires;
+		bool referenced = false;
+	};
+
+	struct alignas(64) Shard {
+		mutable std::mutex mutex;
+		std::vector<Entry> entries;
+		std::unordered_map<std::uint64_t, std::size_t> index;
+		std::size_t hand = 0;
+	};
+
+	Shard& shard_of(std::uint64_t hash);
+	static std::size_t evict(Shard& shard, Clock::time_point now);
+
+	std::chrono::milliseconds ttl;
+	std::size_t shard_capacity;
+	std::size_t shard_count;
+	std::unique_ptr<Shard[]> shards;
+};
+
+#endif
@@ -0,0 +1,145 @@
+//
+// Metrics of the worker (latencies of processing stages and counters).
+//
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+
+#include "ack_coalescer.h"
+#include "metrics.h"
+#include "result_publisher.h"
+
+namespace {
+
+const char* const StageNames[StageCount] = {"wait", "decode", "execute", "ack"};
+
+// Upper bounds of buckets in the exported histograms (in nanoseconds). The
+// internal histograms are much finer, but that many buckets would be
+// impractical in Prometheus.
+const std::uint64_t BucketBounds[] = {
+	1'000, 2'500, 5'000,
+	10'000, 25'000, 50'000,
+	100'000, 250'000, 500'000,
+	1'000'000, 2'500'000, 5'000'000,
+	10'000'000, 25'000'000, 50'000'000,
+	100'000'000, 250'000'000, 500'000'000,
+	1'000'000'000, 2'500'000'000, 5'000'000'000, 10'000'000'000,
+};
+
+void write_counter(std::ostream& out, const char* name, const char* help,
+		std::uint64_t value) {
+	out << "# HELP " << name << ' ' << help << '\n'
+		<< "# TYPE " << name << " counter\n"
+		<< name << ' ' << value << '\n';
+}
+
+void write_gauge(std::ostream& out, const char* name, const char* help,
+		std::int64_t value) {
+	out << "# HELP " << name << ' ' << help << '\n'
+		<< "# TYPE " << name << " gauge\n"
+		<< name << ' ' << value << '\n';
+}
+
+}
+
+ConsumerMetrics& Metrics::add_consumer() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return consumers.emplace_back();
+}
+
+void Metrics::write_prometheus(std::ostream& out) const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::uint64_t messages = 0;
+	std::uint64_t failures = 0;
+	std::uint64_t retries = 0;
+	std::uint64_t dead_letters = 0;
+	std::uint64_t redeliveries = 0;
+	std::uint64_t delayed = 0;
+	std::uint64_t stolen = 0;
+	std::uint64_t batches = 0;
+	std::uint64_t memo_hits = 0;
+	std::uint64_t memo_misses = 0;
+	std::int64_t prefetch = 0;
+	for (const auto& consumer : consumers) {
+		messages += consumer.messages.get();
+		failures += consumer.failures.get();
+		retries += consumer.retries.get();
+		dead_letters += consumer.dead_letters.get();
+		redeliveries += consumer.redeliveries.get();
+		delayed += consumer.delayed.get();
+		stolen += consumer.stolen.get();
+		batches += consumer.batches.get();
+		memo_hits += consumer.memo_hits.get();
+		memo_misses += consumer.memo_misses.get();
+		prefetch += consumer.prefetch.get();
+	}
+	write_counter(out, "celery_worker_messages_total",
+		"Messages received by the worker.", messages);
+	write_counter(out, "celery_worker_failures_total",
+		"Messages whose processing failed.", failures);
+	write_counter(out, "celery_worker_retries_total",
+		"Failed tasks published again to be retried.", retries);
+	write_counter(out, "celery_worker_dead_letters_total",
+		"Messages published into the dead-letter queue.", dead_letters);
+	write_counter(out, "celery_worker_redeliveries_total",
+		"Received messages that had been delivered before.", redeliveries);
+	write_counter(out, "celery_worker_delayed_messages_total",
+		"Received messages with an ETA in the future.", delayed);
+	write_counter(out, "celery_worker_stolen_tasks_total",
+		"Tasks taken from other consumers.", stolen);
+	write_counter(out, "celery_worker_batches_total",
+		"Executed batches of batch tasks.", batches);
+	write_counter(out, "celery_worker_memo_hits_total",
+		"Messages of memoized tasks answered from the cache.", memo_hits);
+	write_counter(out, "celery_worker_memo_misses_total",
+		"Messages of memoized tasks that had to be executed.", memo_misses);
+	write_gauge(out, "celery_worker_prefetch",
+		"Prefetch counts of all consumers (summed).", prefetch);
+	write_counter(out, "celery_worker_acked_messages_total",
+		"Acknowledged messages.", AckCoalescer::acked_messages());
+	write_counter(out, "celery_worker_ack_frames_total",
+		"Sent basic.ack frames.", AckCoalescer::ack_frames());
+	write_counter(out, "celery_worker_published_results_total",
+		"Results of tasks published into reply queues.",
+		ResultPublisher::published_results());
+	write_counter(out, "celery_worker_result_batches_total",
+		"Batches of results taken by result senders.",
+		ResultPublisher::result_batches());
+
+	const char* name = "celery_worker_stage_duration_seconds";
+	out << "# HELP " << name << " Time spent in stages of processing of messages.\n"
+		<< "# TYPE " << name << " histogram\n";
+	for (std::size_t stage = 0; stage < StageCount; ++stage) {
+		// Aggregate histograms of all consumers. A histogram is too large
+		// for the stack.
+		auto all = std::make_unique<Histogram>();
+		for (const auto& consumer : consumers) {
+			all->add(consumer.stages[stage]);
+		}
+
+		auto labels = std::string("stage=\"") + StageNames[stage] + '"';
+		for (auto bound : BucketBounds) {
+			out << name << "_bucket{" << labels << ",le=\"" << bound / 1e9
+				<< "\"} " << all->count_at_or_below(bound) << '\n';
+		}
+		out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << all->count() << '\n'
+			<< name << "_sum{" << labels << "} " << all->sum() / 1e9 << '\n'
+			<< name << "_count{" << labels << "} " << all->count() << '\n';
+	}
+}
+
+bool Metrics::write_prometheus_file(const std::string& path) const {
+	// Write into a temporary file and then rename it so that readers never
+	// see a partially written file.
+	auto tmp_path = path + ".tmp";
+	{
+		std::ofstream out(tmp_path);
+		write_prometheus(out);
+		if (!out.flush()) {
+			return false;
+		}
+	}
+	return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,141 @@
+//
+// Metrics of the worker (latencies of processing stages and counters).
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include "histogram.h"
+
+// Stages of processing of a message by a consumer.
+enum class Stage {
+	Wait,    // Waiting for the message in BasicConsumeMessage().
+	Decode,  // Finding the task and decoding the body of the message.
+	Execute, // Executing the task.
+	Ack,     // Acknowledging the message.
+};
+
+constexpr std::size_t StageCount = 4;
+
+// A monotonically increasing counter that is written by a single thread and
+// can be read by any thread.
+class Counter {
+public:
+	void increment(std::uint64_t n = 1) noexcept {
+		value.store(value.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+
+	std::uint64_t get() const noexcept {
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::uint64_t> value{0};
+};
+
+// A value that can go up and down, written by a single thread and readable by
+// any thread.
+class Gauge {
+public:
+	void set(std::int64_t new_value) noexcept {
+		value.store(new_value, std::memory_order_relaxed);
+	}
+
+	std::int64_t get() const noexcept {
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::int64_t> value{0};
+};
+
+// Metrics of a single consumer (thread).
+//
+// Only the consumer thread updates its metrics, so updates are cheap: no
+// locks and no read-modify-write atomic instructions (see Histogram).
+class ConsumerMetrics {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Records that the given stage took from `start` to `end`.
+	void record(Stage stage, Clock::time_point start, Clock::time_point end) noexcept {
+		stages[static_cast<std::size_t>(stage)].record(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()
+		);
+	}
+
+	// Latencies of the individual stages (in nanoseconds).
+	std::array<Histogram, StageCount> stages;
+
+	// The number of received messages.
+	Counter messages;
+
+	// The number of messages whose processing failed.
+	Counter failures;
+
+	// The number of failed tasks that were published again to be retried,
+	// and of messages that were published into the dead-letter queue (see
+	// consumer.h).
+	Counter retries;
+	Counter dead_letters;
+
+	// The number of received messages that had been delivered before (to us
+	// or to another consumer).
+	Counter redeliveries;
+
+	// The number of received messages with an ETA in the future (they were
+	// held until they were due).
+	Counter delayed;
+
+	// The number of tasks taken from other consumers (see work_stealing.h).
+	Counter stolen;
+
+	// The number of messages of memoized tasks whose results were found in
+	// the cache (so the tasks were not executed) and of the other ones (see
+	// TaskRegistry::memoize()).
+	Counter memo_hits;
+	Counter memo_misses;
+
+	// The number of executed batches of batch tasks (see
+	// TaskRegistry::add_batch()). The execution of a batch is recorded as a
+	// single execution in the stage latencies.
+	Counter batches;
+
+	// The current prefetch count of the consumer (without the slots for
+	// tasks with an ETA, see consumer.cpp).
+	Gauge prefetch;
+};
+
+// Metrics of the whole worker.
+class Metrics {
+public:
+	// Creates metrics for a new consumer. The returned reference is valid
+	// for the whole lifetime of this object.
+	ConsumerMetrics& add_consumer();
+
+	// Writes metrics of all consumers (aggregated) in the Prometheus text
+	// exposition format.
+	// https://prometheus.io/docs/instrumenting/exposition_formats/
+	void write_prometheus(std::ostream& out) const;
+
+	// Atomically rewrites the given file with metrics in the Prometheus
+	// format (see write_prometheus()). Returns false on failure.
+	bool write_prometheus_file(const std::string& path) const;
+
+private:
+	mutable std::mutex mutex;
+	std::deque<ConsumerMetrics> consumers;
+};
+
+#endif
@@ -0,0 +1,359 @@
+//
+// Encoding and lazy decoding of MessagePack bodies of Celery task messages.
+//
+
+#include <cstring>
+
+#include "msgpack_body.h"
+
+namespace {
+
+// See https://github.com/msgpack/msgpack/blob/master/spec.md for a
+// description of the format.
+
+[[noreturn]] void fail(const char* reason, std::size_t pos) {
+	throw CeleryBodyError(
+		std::string(reason) + " at offset " + std::to_string(pos) +
+		" in a msgpack body"
+	);
+}
+
+std::uint8_t byte_at(std::string_view s, std::size_t pos) {
+	if (pos >= s.size()) {
+		fail("unexpected end of body", pos);
+	}
+	return static_cast<std::uint8_t>(s[pos]);
+}
+
+// Reads a big-endian unsigned integer of N bytes at `pos`.
+template<std::size_t N>
+std::uint64_t read_be(std::string_view s, std::size_t pos) {
+	if (pos + N > s.size()) {
+		fail("unexpected end of body", pos);
+	}
+	std::uint64_t value = 0;
+	for (std::size_t i = 0; i < N; ++i) {
+		value = (value << 8) | static_cast<std::uint8_t>(s[pos + i]);
+	}
+	return value;
+}
+
+// Information about a value at a given position.
+struct Header {
+	// The size of the header (the type byte and length/value bytes).
+	std::size_t header_size;
+
+	// The number of bytes of the payload after the header (e.g. bytes of a
+	// string).
+	std::uint64_t payload_size;
+
+	// The number of nested values (items of an array, keys and values of a
+	// map).
+	std::uint64_t nested;
+};
+
+Header read_header(std::string_view s, std::size_t pos) {
+	auto b = byte_at(s, pos);
+	if (b <= 0x7f || b >= 0xe0) { // positive/negative fixint
+		return {1, 0, 0};
+	}
+	if ((b & 0xe0) == 0xa0) { // fixstr
+		return {1, b & 0x1fu, 0};
+	}
+	if ((b & 0xf0) == 0x90) { // fixarray
+		return {1, 0, b & 0x0fu};
+	}
+	if ((b & 0xf0) == 0x80) { // fixmap
+		return {1, 0, 2u * (b & 0x0fu)};
+	}
+	switch (b) {
+		case 0xc0: case 0xc2: case 0xc3: // nil, false, true
+			return {1, 0, 0};
+		case 0xcc: case 0xd0: return {2, 0, 0}; // uint8, int8
+		case 0xcd: case 0xd1: return {3, 0, 0}; // uint16, int16
+		case 0xce: case 0xd2: case 0xca: return {5, 0, 0}; // uint32, int32, float32
+		case 0xcf: case 0xd3: case 0xcb: return {9, 0, 0}; // uint64, int64, float64
+		case 0xd9: case 0xc4: return {2, read_be<1>(s, pos + 1), 0}; // str8, bin8
+		case 0xda: case 0xc5: return {3, read_be<2>(s, pos + 1), 0}; // str16, bin16
+		case 0xdb: case 0xc6: return {5, read_be<4>(s, pos + 1), 0}; // str32, bin32
+		case 0xdc: return {3, 0, read_be<2>(s, pos + 1)}; // array16
+		case 0xdd: return {5, 0, read_be<4>(s, pos + 1)}; // array32
+		case 0xde: return {3, 0, 2 * read_be<2>(s, pos + 1)}; // map16
+		case 0xdf: return {5, 0, 2 * read_be<4>(s, pos + 1)}; // map32
+		case 0xd4: return {2, 1, 0}; // fixext1
+		case 0xd5: return {2, 2, 0}; // fixext2
+		case 0xd6: return {2, 4, 0}; // fixext4
+		case 0xd7: return {2, 8, 0}; // fixext8
+		case 0xd8: return {2, 16, 0}; // fixext16
+		case 0xc7: return {3, read_be<1>(s, pos + 1), 0}; // ext8
+		case 0xc8: return {4, read_be<2>(s, pos + 1), 0}; // ext16
+		case 0xc9: return {6, read_be<4>(s, pos + 1), 0}; // ext32
+		default:
+			fail("invalid type byte", pos);
+	}
+}
+
+// Skips a value (including all nested values) starting at `pos` and returns
+// the position right after it. Nested values are skipped iteratively (by
+// counting how many of them remain), so deeply nested values cannot overflow
+// the stack.
+std::size_t skip_value(std::string_view s, std::size_t pos) {
+	std::uint64_t remaining = 1;
+	while (remaining > 0) {
+		auto header = read_header(s, pos);
+		auto size = header.header_size + header.payload_size;
+		if (size > s.size() - pos) {
+			fail("value exceeds the body", pos);
+		}
+		pos += size;
+		remaining += header.nested - 1;
+	}
+	return pos;
+}
+
+// Returns the number of items of an array starting at `pos` and moves `pos`
+// to its first item.
+std::uint64_t read_array_header(std::string_view s, std::size_t& pos) {
+	auto b = byte_at(s, pos);
+	if ((b & 0xf0) != 0x90 && b != 0xdc && b != 0xdd) {
+		fail("expected an array", pos);
+	}
+	auto header = read_header(s, pos);
+	pos += header.header_size;
+	return header.nested;
+}
+
+[[noreturn]] void wrong_type(const char* expected) {
+	throw CeleryBodyError(std::string("argument is not ") + expected);
+}
+
+void append_be(std::string& out, std::uint64_t value, std::size_t bytes) {
+	for (auto i = bytes; i > 0; --i) {
+		out.push_back(static_cast<char>((value >> (8 * (i - 1))) & 0xff));
+	}
+}
+
+}
+
+MsgpackBody::MsgpackBody(std::string_view body) {
+	std::size_t pos = 0;
+	auto parts = read_array_header(body, pos);
+	if (parts == 0) {
+		fail("expected an array of positional arguments", pos);
+	}
+
+	// args
+	auto count = read_array_header(body, pos);
+	for (std::uint64_t i = 0; i < count; ++i) {
+		auto end = skip_value(body, pos);
+		auto arg = body.substr(pos, end - pos);
+		if (args_count < InlineArgs) {
+			inline_args[args_count] = arg;
+		} else {
+			extra_args.push_back(arg);
+		}
+		++args_count;
+		pos = end;
+	}
+
+	// kwargs and embed (optional)
+	for (std::uint64_t i = 1; i < parts; ++i) {
+		pos = skip_value(body, pos);
+	}
+	if (pos != body.size()) {
+		fail("trailing bytes", pos);
+	}
+}
+
+std::size_t MsgpackBody::arg_count() const {
+	return args_count;
+}
+
+std::string_view MsgpackBody::raw_arg(std::size_t i) const {
+	if (i >= args_count) {
+		throw CeleryBodyError(
+			"missing positional argument #" + std::to_string(i) +
+			" (there are " + std::to_string(args_count) + ")"
+		);
+	}
+	return i < InlineArgs ? inline_args[i] : extra_args[i - InlineArgs];
+}
+
+void MsgpackBody::decode(std::string_view raw, std::string_view& value) {
+	auto b = byte_at(raw, 0);
+	if ((b & 0xe0) != 0xa0 && b != 0xd9 && b != 0xda && b != 0xdb) {
+		wrong_type("a string");
+	}
+	auto header = read_header(raw, 0);
+	value = raw.substr(header.header_size, header.payload_size);
+}
+
+void MsgpackBody::decode(std::string_view raw, std::string& value) {
+	std::string_view view;
+	decode(raw, view);
+	value.assign(view.data(), view.size());
+}
+
+void MsgpackBody::decode(std::string_view raw, bool& value) {
+	switch (byte_at(raw, 0)) {
+		case 0xc2: value = false; break;
+		case 0xc3: value = true; break;
+		default: wrong_type("a bool");
+	}
+}
+
+void MsgpackBody::decode(std::string_view raw, long long& value) {
+	auto b = byte_at(raw, 0);
+	if (b <= 0x7f) {
+		value = b;
+		return;
+	}
+	if (b >= 0xe0) {
+		value = static_cast<std::int8_t>(b);
+		return;
+	}
+	switch (b) {
+		case 0xd0: value = static_cast<std::int8_t>(read_be<1>(raw, 1)); return;
+		case 0xd1: value = static_cast<std::int16_t>(read_be<2>(raw, 1)); return;
+		case 0xd2: value = static_cast<std::int32_t>(read_be<4>(raw, 1)); return;
+		case 0xd3: value = static_cast<std::int64_t>(read_be<8>(raw, 1)); return;
+		case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+			unsigned long long unsigned_value;
+			decode(raw, unsigned_value);
+			if (unsigned_value > static_cast<unsigned long long>(
+					std::numeric_limits<long long>::max())) {
+				throw CeleryBodyError("integer argument out of range");
+			}
+			value = static_cast<long long>(unsigned_value);
+			return;
+		}
+		default:
+			wrong_type("an integer");
+	}
+}
+
+void MsgpackBody::decode(std::string_view raw, unsigned long long& value) {
+	auto b = byte_at(raw, 0);
+	if (b <= 0x7f) {
+		value = b;
+		return;
+	}
+	switch (b) {
+		case 0xcc: value = read_be<1>(raw, 1); return;
+		case 0xcd: value = read_be<2>(raw, 1); return;
+		case 0xce: value = read_be<4>(raw, 1); return;
+		case 0xcf: value = read_be<8>(raw, 1); return;
+		case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+			long long signed_value;
+			decode(raw, signed_value);
+			if (signed_value < 0) {
+				wrong_type("a non-negative integer");
+			}
+			value = static_cast<unsigned long long>(signed_value);
+			return;
+		}
+		default:
+			wrong_type("a non-negative integer");
+	}
+}
+
+void MsgpackBody::decode(std::string_view raw, double& value) {
+	switch (byte_at(raw, 0)) {
+		case 0xca: {
+			auto bits = static_cast<std::uint32_t>(read_be<4>(raw, 1));
+			float f;
+			std::memcpy(&f, &bits, sizeof(f));
+			value = f;
+			return;
+		}
+		case 0xcb: {
+			auto bits = read_be<8>(raw, 1);
+			std::memcpy(&value, &bits, sizeof(value));
+			return;
+		}
+		default: {
+			// Integers are numbers, too.
+			long long integer;
+			decode(raw, integer);
+			value = static_cast<double>(integer);
+		}
+	}
+}
+
+void append_msgpack(std::string& out, std::string_view value) {
+	auto size = value.size();
+	if (size <= 31) {
+		out.push_back(static_cast<char>(0xa0 | size));
+	} else if (size <= 0xff) {
+		out.push_back('\xd9');
+		append_be(out, size, 1);
+	} else if (size <= 0xffff) {
+		out.push_back('\xda');
+		append_be(out, size, 2);
+	} else {
+		out.push_back('\xdb');
+		append_be(out, size, 4);
+	}
+	out.append(value);
+}
+
+void append_msgpack(std::string& out, bool value) {
+	out.push_back(value ? '\xc3' : '\xc2');
+}
+
+void append_msgpack(std::string& out, double value) {
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	out.push_back('\xcb');
+	append_be(out, bits, 8);
+}
+
+void append_msgpack(std::string& out, long long value) {
+	if (value >= 0) {
+		append_msgpack(out, static_cast<unsigned long long>(value));
+	} else if (value >= -32) {
+		out.push_back(static_cast<char>(value)); // negative fixint
+	} else if (value >= INT8_MIN) {
+		out.push_back('\xd0');
+		append_be(out, static_cast<std::uint8_t>(value), 1);
+	} else if (value >= INT16_MIN) {
+		out.push_back('\xd1');
+		append_be(out, static_cast<std::uint16_t>(value), 2);
+	} else if (value >= INT32_MIN) {
+		out.push_back('\xd2');
+		append_be(out, static_cast<std::uint32_t>(value), 4);
+	} else {
+		out.push_back('\xd3');
+		append_be(out, static_cast<std::uint64_t>(value), 8);
+	}
+}
+
+void append_msgpack(std::string& out, unsigned long long value) {
+	if (value <= 0x7f) {
+		out.push_back(static_cast<char>(value)); // positive fixint
+	} else if (value <= UINT8_MAX) {
+		out.push_back('\xcc');
+		append_be(out, value, 1);
+	} else if (value <= UINT16_MAX) {
+		out.push_back('\xcd');
+		append_be(out, value, 2);
+	} else if (value <= UINT32_MAX) {
+		out.push_back('\xce');
+		append_be(out, value, 4);
+	} else {
+		out.push_back('\xcf');
+		append_be(out, value, 8);
+	}
+}
+
+void append_msgpack_array_header(std::string& out, std::size_t size) {
+	if (size <= 15) {
+		out.push_back(static_cast<char>(0x90 | size));
+	} else if (size <= 0xffff) {
+		out.push_back('\xdc');
+		append_be(out, size, 2);
+	} else {
+		out.push_back('\xdd');
+		append_be(out, size, 4);
+	}
+}
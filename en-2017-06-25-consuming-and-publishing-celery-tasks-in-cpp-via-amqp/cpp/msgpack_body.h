@@ -0,0 +1,133 @@
+//
+// Encoding and lazy decoding of MessagePack bodies of Celery task messages.
+//
+
+#ifndef MSGPACK_BODY_H
+#define MSGPACK_BODY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "celery_body.h"
+
+// A lazily decoded MessagePack (https://msgpack.org/) body of a Celery task
+// message, i.e. a message with the 'application/x-msgpack' content type.
+//
+// The body has the same structure as a JSON body (see CeleryBody), i.e.
+//
+//     [args, kwargs, embed]
+//
+// only encoded in MessagePack. Just like CeleryBody, the constructor only
+// locates positional arguments, which are then decoded on demand via arg().
+// Since MessagePack strings do not contain escape sequences, strings are
+// always returned as views into the body, and the decoding never allocates
+// memory from the heap for bodies with at most `InlineArgs` positional
+// arguments. The body has to outlive the decoder and the returned views.
+//
+// Values nested in arguments, `kwargs`, and `embed` are only skipped, not
+// validated.
+class MsgpackBody {
+public:
+	static constexpr std::size_t InlineArgs = 8;
+
+	// Locates positional arguments in the given body. Throws CeleryBodyError
+	// when the body does not have the expected form.
+	explicit MsgpackBody(std::string_view body);
+
+	MsgpackBody(const MsgpackBody&) = delete;
+	MsgpackBody& operator=(const MsgpackBody&) = delete;
+
+	// Returns the number of positional arguments.
+	std::size_t arg_count() const;
+
+	// Returns the MessagePack representation of the i-th positional
+	// argument.
+	std::string_view raw_arg(std::size_t i) const;
+
+	// Returns the i-th positional argument, decoded into a value of type T.
+	// Supported types are the same as in CeleryBody::arg(). Throws
+	// CeleryBodyError when there is no such argument or when it cannot be
+	// converted to T.
+	template<typename T>
+	T arg(std::size_t i) const {
+		T value;
+		decode(raw_arg(i), value);
+		return value;
+	}
+
+private:
+	static void decode(std::string_view raw, std::string_view& value);
+	static void decode(std::string_view raw, std::string& value);
+	static void decode(std::string_view raw, bool& value);
+	static void decode(std::string_view raw, long long& value);
+	static void decode(std::string_view raw, unsigned long long& value);
+	static void decode(std::string_view raw, double& value);
+
+	// Narrower integral types are decoded via the widest ones.
+	template<typename T>
+	static std::enable_if_t<std::is_integral_v<T>> decode(std::string_view raw, T& value) {
+		using Wide = std::conditional_t<std::is_signed_v<T>, long long, unsigned long long>;
+		Wide wide;
+		decode(raw, wide);
+		if (wide < static_cast<Wide>(std::numeric_limits<T>::min()) ||
+				wide > static_cast<Wide>(std::numeric_limits<T>::max())) {
+			throw CeleryBodyError("integer argument out of range");
+		}
+		value = static_cast<T>(wide);
+	}
+
+	static void decode(std::string_view raw, float& value) {
+		double wide;
+		decode(raw, wide);
+		value = static_cast<float>(wide);
+	}
+
+	std::array<std::string_view, InlineArgs> inline_args;
+	std::vector<std::string_view> extra_args;
+	std::size_t args_count = 0;
+};
+
+// Appends the MessagePack representation of the given value to `out`.
+void append_msgpack(std::string& out, std::string_view value);
+void append_msgpack(std::string& out, bool value);
+void append_msgpack(std::string& out, double value);
+void append_msgpack(std::string& out, long long value);
+void append_msgpack(std::string& out, unsigned long long value);
+
+inline void append_msgpack(std::string& out, const char* value) {
+	append_msgpack(out, std::string_view(value));
+}
+
+template<typename T>
+std::enable_if_t<std::is_integral_v<T>> append_msgpack(std::string& out, T value) {
+	if constexpr (std::is_signed_v<T>) {
+		append_msgpack(out, static_cast<long long>(value));
+	} else {
+		append_msgpack(out, static_cast<unsigned long long>(value));
+	}
+}
+
+// Appends a header of a MessagePack array with the given number of items.
+void append_msgpack_array_header(std::string& out, std::size_t size);
+
+// Encodes a MessagePack body of a Celery task message with the given
+// positional arguments (and empty kwargs and embed) into `out`, replacing its
+// contents. Just like encode_celery_body(), it reuses the capacity of `out`.
+template<typename... Args>
+void encode_celery_body_msgpack(std::string& out, const Args&... args) {
+	out.clear();
+	append_msgpack_array_header(out, 3);
+	append_msgpack_array_header(out, sizeof...(Args));
+	(append_msgpack(out, args), ...);
+	// Two empty maps (fixmap with 0 items): kwargs and embed.
+	out.push_back('\x80');
+	out.push_back('\x80');
+}
+
+#endif
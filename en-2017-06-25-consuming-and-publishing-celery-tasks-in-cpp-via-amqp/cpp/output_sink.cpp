@@ -0,0 +1,268 @@
+//
+// Asynchronous buffered output (e.g. of tasks) via a lock-free ring buffer.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output_sink.h"
+
+namespace {
+
+// The maximal number of iovecs passed to a single writev() call.
+#ifdef IOV_MAX
+constexpr std::size_t MaxIov = IOV_MAX;
+#else
+constexpr std::size_t MaxIov = 1024;
+#endif
+
+// Writes all the given buffers into the file descriptor (writev() may write
+// only a part of them). Returns false on an error.
+bool write_all(int fd, iovec* iov, std::size_t count) {
+	while (count > 0) {
+		auto written = ::writev(fd, iov, static_cast<int>(std::min(count, MaxIov)));
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		// Skip the written buffers and adjust the partially written one.
+		auto remaining = static_cast<std::size_t>(written);
+		while (count > 0 && remaining >= iov->iov_len) {
+			remaining -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+			iov->iov_len -= remaining;
+		}
+	}
+	return true;
+}
+
+}
+
+// A slot of the ring buffer. Its data are stored separately (in `data`), so
+// the data of consecutive slots are contiguous.
+struct OutputSink::Slot {
+	// The position for which the slot is free (the position itself) or
+	// published (position + 1). See write().
+	std::atomic<std::uint64_t> sequence;
+
+	// The size of the record (in bytes) and the number of slots that it
+	// occupies. Only valid in the first slot of a record.
+	std::uint32_t size;
+	std::uint32_t slots;
+};
+
+OutputSink::OutputSink(int fd, OutputSinkOptions options):
+		fd(fd),
+		overflow(options.overflow) {
+	slot_count = 1;
+	while (slot_count * SlotSize < options.capacity) {
+		slot_count *= 2;
+	}
+	mask = slot_count - 1;
+	slots = std::make_unique<Slot[]>(slot_count);
+	for (std::size_t i = 0; i < slot_count; ++i) {
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	data = std::make_unique<char[]>(slot_count * SlotSize);
+	drainer = std::thread([this]() { drain(); });
+}
+
+OutputSink::~OutputSink() {
+	stopping.store(true);
+	wake_drainer();
+	drainer.join();
+}
+
+bool OutputSink::write(std::initializer_list<std::string_view> parts) {
+	std::size_t size = 0;
+	for (auto part : parts) {
+		size += part.size();
+	}
+	std::uint64_t needed = std::max<std::size_t>((size + SlotSize - 1) / SlotSize, 1);
+	if (needed > slot_count) {
+		write_directly(parts, size);
+		return true;
+	}
+
+	// Claim `needed` consecutive slots. Slots are released by the drainer in
+	// order, so when the last one is free, all the previous ones are free as
+	// well.
+	auto pos = enqueue_pos.load(std::memory_order_relaxed);
+	for (;;) {
+		auto seen_released = released.load(std::memory_order_acquire);
+		auto last = pos + needed - 1;
+		auto sequence = slots[last & mask].sequence.load(std::memory_order_acquire);
+		auto diff = static_cast<std::int64_t>(sequence - last);
+		if (diff == 0) {
+			if (enqueue_pos.compare_exchange_weak(pos, pos + needed,
+					std::memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// The buffer is full.
+			if (overflow != OverflowPolicy::Block) {
+				dropped_records.fetch_add(1, std::memory_order_relaxed);
+				if (overflow == OverflowPolicy::Count) {
+					// Make sure that the drainer reports the drop.
+					wake_drainer();
+				}
+				return false;
+			}
+			wake_drainer();
+			released.wait(seen_released, std::memory_order_acquire);
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		} else {
+			// Another writer has claimed the slot.
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Copy the record into the claimed slots (their data may wrap around the
+	// end of the buffer).
+	auto capacity = slot_count * SlotSize;
+	auto offset = (pos & mask) * SlotSize;
+	for (auto part : parts) {
+		auto first = std::min(part.size(), capacity - offset);
+		std::memcpy(&data[offset], part.data(), first);
+		std::memcpy(&data[0], part.data() + first, part.size() - first);
+		offset = (offset + part.size()) % capacity;
+	}
+
+	// Publish the record.
+	auto& slot = slots[pos & mask];
+	slot.size = static_cast<std::uint32_t>(size);
+	slot.slots = static_cast<std::uint32_t>(needed);
+	slot.sequence.store(pos + 1, std::memory_order_release);
+
+	// The fence orders the above publication before the check of the flag
+	// (the drainer does the opposite), so either the drainer sees the record,
+	// or we see that it sleeps and wake it up.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (drainer_sleeping.load(std::memory_order_relaxed)) {
+		wake_drainer();
+	}
+	return true;
+}
+
+void OutputSink::flush() {
+	auto target = enqueue_pos.load(std::memory_order_acquire);
+	wake_drainer();
+	for (;;) {
+		auto seen_released = released.load(std::memory_order_acquire);
+		if (drained_pos.load(std::memory_order_acquire) >= target) {
+			return;
+		}
+		released.wait(seen_released, std::memory_order_acquire);
+	}
+}
+
+void OutputSink::wake_drainer() {
+	wakeups.fetch_add(1, std::memory_order_release);
+	wakeups.notify_one();
+}
+
+void OutputSink::write_directly(std::initializer_list<std::string_view> parts,
+		std::size_t size) {
+	std::lock_guard<std::mutex> lock(direct_mutex);
+	flush();
+	std::string record;
+	record.reserve(size);
+	for (auto part : parts) {
+		record.append(part);
+	}
+	iovec iov{record.data(), record.size()};
+	if (!write_all(fd, &iov, 1)) {
+		dropped_records.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void OutputSink::drain() {
+	auto capacity = slot_count * SlotSize;
+	std::vector<iovec> iov;
+	iov.reserve(MaxIov);
+	std::uint64_t reported_dropped = 0;
+	std::string drop_report;
+	auto pos = drained_pos.load(std::memory_order_relaxed);
+	for (;;) {
+		auto seen_wakeups = wakeups.load(std::memory_order_acquire);
+
+		// Report dropped records (before the records that follow them).
+		iov.clear();
+		auto dropped_now = dropped_records.load(std::memory_order_relaxed);
+		if (overflow == OverflowPolicy::Count && dropped_now > reported_dropped) {
+			drop_report = "[output sink: " +
+				std::to_string(dropped_now - reported_dropped) +
+				" records dropped]\n";
+			iov.push_back({drop_report.data(), drop_report.size()});
+			reported_dropped = dropped_now;
+		}
+
+		// Gather all published records (at most a single writev() worth of
+		// them).
+		auto batch_end = pos;
+		while (iov.size() + 2 <= MaxIov) {
+			auto& slot = slots[batch_end & mask];
+			if (slot.sequence.load(std::memory_order_acquire) != batch_end + 1) {
+				break;
+			}
+			auto offset = (batch_end & mask) * SlotSize;
+			auto first = std::min<std::size_t>(slot.size, capacity - offset);
+			if (first > 0) {
+				iov.push_back({&data[offset], first});
+			}
+			if (slot.size > first) {
+				iov.push_back({&data[0], slot.size - first});
+			}
+			batch_end += slot.slots;
+		}
+
+		if (!iov.empty() && !write_all(fd, iov.data(), iov.size())) {
+			// The output is broken (e.g. the reader of the pipe has ended).
+			// There is nothing better to do than to discard the records.
+			for (auto p = pos; p != batch_end; p += slots[p & mask].slots) {
+				dropped_records.fetch_add(1, std::memory_order_relaxed);
+			}
+			reported_dropped = dropped_records.load(std::memory_order_relaxed);
+		}
+
+		if (batch_end != pos) {
+			// Release the slots to writers.
+			for (auto p = pos; p != batch_end; ++p) {
+				slots[p & mask].sequence.store(p + slot_count, std::memory_order_release);
+			}
+			pos = batch_end;
+			drained_pos.store(pos, std::memory_order_release);
+			released.fetch_add(1, std::memory_order_release);
+			released.notify_all();
+			continue;
+		}
+
+		if (stopping.load(std::memory_order_acquire) &&
+				enqueue_pos.load(std::memory_order_acquire) == pos) {
+			return;
+		}
+
+		// Sleep until a writer wakes us up. See write() for the fence.
+		drainer_sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		auto ready = slots[pos & mask].sequence.load(std::memory_order_acquire) == pos + 1;
+		if (!ready && !stopping.load(std::memory_order_acquire)) {
+			wakeups.wait(seen_wakeups, std::memory_order_acquire);
+		}
+		drainer_sleeping.store(false, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,128 @@
+//
+// Asynchronous buffered output (e.g. of tasks) via a lock-free ring buffer.
+//
+
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+// What to do with a record when the ring buffer of an output sink is full.
+enum class OverflowPolicy {
+	// Wait until there is enough space (no output is lost).
+	Block,
+
+	// Discard the record. The number of discarded records is available via
+	// OutputSink::dropped().
+	Drop,
+
+	// Discard the record and write a line with the number of discarded
+	// records into the output once there is space again.
+	Count
+};
+
+// Options of an output sink.
+struct OutputSinkOptions {
+	// The size of the ring buffer (in bytes). It is rounded up to a power of
+	// two.
+	std::size_t capacity = 1 << 20;
+
+	OverflowPolicy overflow = OverflowPolicy::Block;
+};
+
+// Writes records (e.g. lines) into a file descriptor (e.g. the standard
+// output) from a dedicated thread.
+//
+// Writing into std::cout from several consumers means locking the stream for
+// every record and a write() system call for every flush, and when the output
+// is a slow pipe, the consumer stalls until the reader catches up. Instead,
+// write() only copies the record into a ring buffer shared by all threads,
+// and a drainer thread writes everything that has accumulated in the buffer
+// with a single writev() system call.
+//
+// The ring buffer is lock-free for writers: it is divided into slots, and a
+// writer claims enough consecutive slots for its record with a single
+// compare-and-swap, copies the record into them, and publishes them (this is
+// a multi-slot variant of the bounded queue by Dmitry Vyukov). Records from a
+// single thread are written in the order in which they were written into the
+// sink, and a record is never interleaved with other records.
+//
+// All methods are thread-safe. The destructor writes all remaining records.
+class OutputSink {
+public:
+	// The number of bytes of a record stored in a single slot.
+	static constexpr std::size_t SlotSize = 64;
+
+	OutputSink(int fd, OutputSinkOptions options = {});
+	~OutputSink();
+
+	OutputSink(const OutputSink&) = delete;
+	OutputSink& operator=(const OutputSink&) = delete;
+
+	// Writes a record consisting of the given parts (they are concatenated,
+	// so there is no need to build the record in a temporary string). Returns
+	// false when the record has been discarded because the buffer was full
+	// (see OverflowPolicy).
+	//
+	// Records that do not fit into the buffer at all are written directly
+	// (after all the buffered records).
+	bool write(std::initializer_list<std::string_view> parts);
+
+	bool write(std::string_view record) {
+		return write({record});
+	}
+
+	// Waits until all records written before the call have been written into
+	// the file descriptor.
+	void flush();
+
+	// Returns the number of records discarded because of a full buffer (or
+	// because of an error while writing them).
+	std::uint64_t dropped() const {
+		return dropped_records.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Slot;
+
+	void drain();
+	void wake_drainer();
+	void write_directly(std::initializer_list<std::string_view> parts,
+		std::size_t size);
+
+	int fd;
+	OverflowPolicy overflow;
+	std::size_t slot_count;
+	std::size_t mask;
+	std::unique_ptr<Slot[]> slots;
+	std::unique_ptr<char[]> data;
+
+	// The next position to be claimed by a writer.
+	alignas(64) std::atomic<std::uint64_t> enqueue_pos{0};
+
+	// The next position to be written by the drainer, and the number of
+	// released batches (writers waiting for space and flush() wait on it).
+	alignas(64) std::atomic<std::uint64_t> drained_pos{0};
+	std::atomic<std::uint32_t> released{0};
+
+	// Wakes up the drainer when it sleeps.
+	alignas(64) std::atomic<bool> drainer_sleeping{false};
+	std::atomic<std::uint32_t> wakeups{0};
+	std::atomic<bool> stopping{false};
+
+	std::atomic<std::uint64_t> dropped_records{0};
+
+	// Serializes records that are written directly (see write()).
+	std::mutex direct_mutex;
+
+	std::thread drainer;
+};
+
+#endif
@@ -0,0 +1,112 @@
+//
+// Adaptive tuning of the prefetch count of a consumer.
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "prefetch_controller.h"
+
+namespace {
+
+// A window ends after at least this many tasks and as many tasks as the
+// prefetch count (so that a whole round of prefetched messages is seen), or
+// after the maximal duration (so that the count reacts to slow tasks, too).
+constexpr std::uint64_t MinWindowTasks = 8;
+constexpr auto MaxWindowDuration = std::chrono::seconds(1);
+
+// A wait longer than this is not a consequence of the prefetch count; the
+// queue was empty.
+constexpr auto IdleWait = std::chrono::milliseconds(500);
+
+// The consumer waits for messages when the average wait is above this
+// fraction of the service time, and it does not wait when it is below the
+// other one. Between them, the count is kept as it is.
+constexpr double WaitingFraction = 1.0 / 16;
+constexpr double CalmFraction = 1.0 / 64;
+
+// A raise has helped when it has cut the wait by at least this fraction.
+constexpr double HelpfulCut = 0.25;
+
+// For how many windows the count is held after a raise has not helped.
+constexpr unsigned HoldWindows = 8;
+
+}
+
+PrefetchController::PrefetchController(std::uint16_t min, std::uint16_t max,
+		std::uint16_t initial, Clock::time_point now):
+	min(std::max<std::uint16_t>(min, 1)),
+	max(std::max(max, this->min)),
+	current(std::clamp(initial, this->min, this->max)),
+	window_start(now) {}
+
+void PrefetchController::record(Clock::duration wait, Clock::duration service) {
+	if (wait > IdleWait) {
+		idle = true;
+		wait = Clock::duration::zero();
+	}
+	++tasks;
+	total_wait += wait;
+	total_service += service;
+}
+
+std::optional<std::uint16_t> PrefetchController::update(Clock::time_point now) {
+	if (tasks == 0 || (tasks < std::max<std::uint64_t>(current, MinWindowTasks) &&
+			now - window_start < MaxWindowDuration)) {
+		return std::nullopt;
+	}
+
+	auto service = std::chrono::duration<double>(total_service).count() / tasks;
+	auto wait = std::chrono::duration<double>(total_wait).count() / tasks;
+	auto was_idle = idle;
+	window_start = now;
+	tasks = 0;
+	total_wait = total_service = Clock::duration::zero();
+	idle = false;
+	service = std::max(service, 1e-9);
+
+	// Judge the last raise.
+	if (wait_before_raise) {
+		auto before = *wait_before_raise;
+		wait_before_raise.reset();
+		if (wait > before * (1 - HelpfulCut)) {
+			hold_windows = HoldWindows;
+			return change_to(count_before_raise);
+		}
+	}
+	if (hold_windows > 0) {
+		--hold_windows;
+		return std::nullopt;
+	}
+
+	if (wait > service * WaitingFraction) {
+		calm_windows = 0;
+		if (was_idle || current == max) {
+			return std::nullopt;
+		}
+		// Little's law (see the description of the class), but at most
+		// double the count at once.
+		auto needed = std::ceil(current * (service + wait) / service);
+		wait_before_raise = wait;
+		count_before_raise = current;
+		return change_to(std::min(needed, 2.0 * current));
+	}
+
+	if (wait >= service * CalmFraction) {
+		calm_windows = 0;
+	} else if (++calm_windows >= 2) {
+		calm_windows = 0;
+		return change_to(current - std::max(1, current / 8));
+	}
+	return std::nullopt;
+}
+
+std::optional<std::uint16_t> PrefetchController::change_to(double count) {
+	auto clamped = static_cast<std::uint16_t>(
+		std::clamp(count, static_cast<double>(min), static_cast<double>(max)));
+	if (clamped == current) {
+		return std::nullopt;
+	}
+	current = clamped;
+	return current;
+}
@@ -0,0 +1,92 @@
+//
+// Adaptive tuning of the prefetch count of a consumer.
+//
+
+#ifndef PREFETCH_CONTROLLER_H
+#define PREFETCH_CONTROLLER_H
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+// Chooses the prefetch count of a consumer from measured durations of its
+// tasks.
+//
+// A consumer that executes tasks one by one needs enough prefetched messages
+// to keep executing while acknowledgements travel to the server and further
+// messages travel back. Too few, and the consumer waits for messages although
+// the queue is full; too many, and messages wait behind slow tasks in one
+// consumer while other consumers are idle. The right count depends on how
+// long tasks take, so no constant suits both tasks taking microseconds and
+// tasks taking seconds.
+//
+// The controller measures how long the consumer waits for a message and how
+// long it then processes the message (the service time), and every window of
+// tasks it:
+//
+//  - Raises the count when the consumer waits for messages. By Little's law,
+//    the number of messages in flight is the throughput times the time a
+//    message spends in flight. When the consumer waits for `W` per message
+//    with `P` messages in flight and the service time `S`, a message spends
+//    `P * (S + W)` in flight, so to process a message every `S`, it needs
+//    `P * (S + W) / S` messages in flight.
+//  - Takes the raise back when it has not shortened the waiting. Then the
+//    consumer waits because the queue is empty, not because of the prefetch
+//    count.
+//  - Lowers the count by an eighth when the consumer has not waited for two
+//    windows in a row, so that the count does not stay higher than needed
+//    (e.g. after tasks got slower). This is like the additive-increase,
+//    multiplicative-decrease control of TCP, only with the increase derived
+//    from the measurements.
+//
+// The controller is not thread-safe; it is meant to be used by the consumer.
+class PrefetchController {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Creates a controller choosing counts in [min, max], starting with
+	// `initial`.
+	PrefetchController(std::uint16_t min, std::uint16_t max,
+		std::uint16_t initial, Clock::time_point now = Clock::now());
+
+	// Returns the current prefetch count.
+	std::uint16_t prefetch() const {
+		return current;
+	}
+
+	// Records a processed message: how long the consumer waited for it and
+	// how long its processing took.
+	void record(Clock::duration wait, Clock::duration service);
+
+	// Returns a new prefetch count when it should be changed (at the end of a
+	// window of tasks), or nothing.
+	std::optional<std::uint16_t> update(Clock::time_point now = Clock::now());
+
+private:
+	// Sets the count and returns it when it has changed.
+	std::optional<std::uint16_t> change_to(double count);
+
+	std::uint16_t min;
+	std::uint16_t max;
+	std::uint16_t current;
+
+	// Measurements in the current window.
+	Clock::time_point window_start;
+	std::uint64_t tasks = 0;
+	Clock::duration total_wait{0};
+	Clock::duration total_service{0};
+	bool idle = false;
+
+	// The average wait before the last raise (when it has not been judged
+	// yet), and the count before it.
+	std::optional<double> wait_before_raise;
+	std::uint16_t count_before_raise = 0;
+
+	// The number of windows in a row in which the consumer has not waited,
+	// and the number of windows for which the count is held after a raise
+	// has been taken back.
+	unsigned calm_windows = 0;
+	unsigned hold_windows = 0;
+};
+
+#endif
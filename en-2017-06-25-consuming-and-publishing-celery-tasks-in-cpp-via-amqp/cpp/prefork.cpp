@@ -0,0 +1,251 @@
+//
+// Running the worker in several processes (a pre-fork pool).
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "prefork.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// A slot for a child process in the pool.
+struct Child {
+	// The process ID (0 when the child is not running).
+	pid_t pid = 0;
+
+	// When the child was started.
+	Clock::time_point started;
+
+	// When the child is to be started again (when it is not running).
+	Clock::time_point restart_at;
+
+	// The number of exits in a row that came shortly after the start.
+	unsigned quick_exits = 0;
+};
+
+[[noreturn]] void throw_errno(const char* what) {
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+// Returns the CPUs that the current process may run on.
+std::vector<int> allowed_cpus() {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	std::vector<int> cpus;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &set)) {
+				cpus.push_back(cpu);
+			}
+		}
+	}
+	return cpus;
+}
+
+// Runs the child function in a freshly forked child process and ends the
+// process.
+[[noreturn]] void run_child(const std::function<int(unsigned)>& child,
+		unsigned index, int cpu) {
+	// The supervised signals stay blocked (see run_prefork()), except for
+	// SIGCHLD, which the worker does not handle.
+	sigset_t child_signals;
+	sigemptyset(&child_signals);
+	sigaddset(&child_signals, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &child_signals, nullptr);
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			std::perror("sched_setaffinity");
+		}
+	}
+
+	auto status = 1;
+	try {
+		status = child(index);
+	} catch (const std::exception& e) {
+		std::cerr << "Worker process " << index << " failed: " << e.what()
+			<< '\n';
+	}
+
+	// The child has a copy of everything in the supervisor, including
+	// destructors of objects on the stack of run_prefork() and functions
+	// registered via atexit(). None of them should run in the child, so it
+	// flushes its output and ends right away.
+	std::cout.flush();
+	std::cerr.flush();
+	std::_Exit(status);
+}
+
+// Describes how a child process ended (based on its status from waitpid()).
+std::string describe_exit(int status) {
+	if (WIFEXITED(status)) {
+		return "exited with status " + std::to_string(WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		return "was killed by signal " + std::to_string(WTERMSIG(status)) +
+			" (" + strsignal(WTERMSIG(status)) + ")";
+	}
+	return "ended";
+}
+
+}
+
+int run_prefork(const PreforkOptions& options,
+		const std::function<int(unsigned)>& child) {
+	// Signals are blocked, so instead of interrupting the supervisor, they
+	// wait until it asks for them via sigtimedwait(). There is no need for
+	// signal handlers and their restrictions.
+	sigset_t supervised;
+	sigemptyset(&supervised);
+	for (auto signal : {SIGINT, SIGTERM, SIGUSR1, SIGCHLD}) {
+		sigaddset(&supervised, signal);
+	}
+	sigset_t original_mask;
+	if (sigprocmask(SIG_BLOCK, &supervised, &original_mask) != 0) {
+		throw_errno("sigprocmask");
+	}
+
+	auto cpus = options.pin_cpus ? allowed_cpus() : std::vector<int>();
+	std::vector<Child> children(options.processes);
+	auto start = [&](unsigned index) {
+		// Buffered output would be written by both processes.
+		std::cout.flush();
+		std::cerr.flush();
+
+		auto& slot = children[index];
+		auto pid = fork();
+		if (pid < 0) {
+			std::perror("fork");
+			slot.restart_at = Clock::now() + options.max_restart_delay;
+			return;
+		}
+		if (pid == 0) {
+			run_child(child, index,
+				cpus.empty() ? -1 : cpus[index % cpus.size()]);
+		}
+		slot.pid = pid;
+		slot.started = Clock::now();
+	};
+	for (unsigned i = 0; i < children.size(); ++i) {
+		start(i);
+	}
+
+	auto stopping = false;
+	for (;;) {
+		// Reap children that have exited. Several of them may exit before we
+		// get to it, but SIGCHLD is delivered only once.
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			auto slot = std::find_if(children.begin(), children.end(),
+				[&](const Child& c) { return c.pid == pid; });
+			if (slot == children.end()) {
+				continue;
+			}
+			slot->pid = 0;
+			if (stopping) {
+				continue;
+			}
+
+			auto now = Clock::now();
+			slot->quick_exits = now - slot->started < options.stable_after
+				? slot->quick_exits + 1 : 1;
+			auto delay = options.min_restart_delay;
+			for (unsigned i = 1; i < slot->quick_exits &&
+					delay < options.max_restart_delay; ++i) {
+				delay *= 2;
+			}
+			delay = std::min(delay, options.max_restart_delay);
+			slot->restart_at = now + delay;
+			std::cerr << "Worker process " << slot - children.begin()
+				<< " (PID " << pid << ") " << describe_exit(status)
+				<< ". Starting it again in " << delay.count() << " ms.\n";
+		}
+
+		auto running = std::any_of(children.begin(), children.end(),
+			[](const Child& c) { return c.pid != 0; });
+		if (stopping && !running) {
+			break;
+		}
+
+		// Start children whose delay has passed, and find out how long we
+		// can wait for the remaining ones.
+		auto next_start = Clock::time_point::max();
+		if (!stopping) {
+			for (unsigned i = 0; i < children.size(); ++i) {
+				if (children[i].pid != 0) {
+					continue;
+				}
+				if (children[i].restart_at <= Clock::now()) {
+					start(i);
+				}
+				if (children[i].pid == 0) {
+					next_start = std::min(next_start, children[i].restart_at);
+				}
+			}
+		}
+
+		// Wait for a signal (including SIGCHLD when a child exits) or until
+		// the next start.
+		int signal;
+		if (next_start == Clock::time_point::max()) {
+			signal = sigwaitinfo(&supervised, nullptr);
+		} else {
+			auto timeout = std::max(next_start - Clock::now(),
+				Clock::duration::zero());
+			auto seconds =
+				std::chrono::duration_cast<std::chrono::seconds>(timeout);
+			auto nanoseconds =
+				std::chrono::nanoseconds(timeout - seconds).count();
+			timespec ts = {static_cast<time_t>(seconds.count()),
+				static_cast<long>(nanoseconds)};
+			signal = sigtimedwait(&supervised, nullptr, &ts);
+		}
+		if (signal < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			throw_errno("sigtimedwait");
+		}
+
+		if (signal == SIGINT || signal == SIGTERM) {
+			// Ask the children to stop, just like the worker itself is asked
+			// to. When they are asked again, they are probably stuck in a
+			// task, so they are killed.
+			auto forwarded = stopping ? SIGKILL : SIGTERM;
+			stopping = true;
+			for (const auto& c : children) {
+				if (c.pid != 0) {
+					kill(c.pid, forwarded);
+				}
+			}
+		} else if (signal == SIGUSR1) {
+			for (const auto& c : children) {
+				if (c.pid != 0) {
+					kill(c.pid, SIGUSR1);
+				}
+			}
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &original_mask, nullptr);
+	return 0;
+}
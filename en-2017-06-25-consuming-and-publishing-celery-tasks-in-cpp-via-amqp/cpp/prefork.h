@@ -0,0 +1,58 @@
+//
+// Running the worker in several processes (a pre-fork pool).
+//
+
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <chrono>
+#include <functional>
+
+// Options of a pool of worker processes.
+struct PreforkOptions {
+	// The number of child processes.
+	unsigned processes = 1;
+
+	// Pin every child to a single CPU: the i-th child to the i-th CPU that
+	// the supervisor may run on (wrapping around when there are more
+	// children than CPUs).
+	bool pin_cpus = false;
+
+	// The delay before a child that has exited on its own (e.g. crashed) is
+	// started again. It doubles with every exit that comes sooner than
+	// `stable_after` after the start of the child, up to `max_restart_delay`.
+	std::chrono::milliseconds min_restart_delay{100};
+	std::chrono::milliseconds max_restart_delay{10000};
+	std::chrono::milliseconds stable_after{10000};
+};
+
+// Runs `child(index)` in `options.processes` forked child processes (with
+// indexes from 0 to N - 1) and supervises them until SIGINT or SIGTERM is
+// received. Returns the exit status for the supervisor.
+//
+// Threads of a single process share all memory, so tasks that are not
+// thread-safe cannot run in parallel in them. Processes share nothing, so
+// such tasks can use all CPUs when every child runs its own consumer (with
+// its own connection to the server), just like in the prefork pool of Celery.
+//
+// The supervisor:
+//
+//  - Forwards SIGTERM to all children when it receives SIGINT or SIGTERM, and
+//    waits until they exit. When the signal comes again, it kills them
+//    (SIGKILL).
+//  - Forwards SIGUSR1 to all children.
+//  - Starts a child that has exited on its own (e.g. crashed) again, after a
+//    delay (see PreforkOptions), so a child that keeps crashing right after
+//    its start does not keep the CPU busy.
+//
+// The supervisor does not start any threads; it waits for signals via
+// sigtimedwait(), with the signals blocked. It has to be called before the
+// process starts any threads because fork() copies only the calling thread.
+// `child` is called in the child process with SIGINT, SIGTERM, and SIGUSR1
+// still blocked, so the child does not miss them before it is ready to
+// handle them (SignalPipe unblocks them). The value returned by `child` is
+// the exit status of the child; an exception makes it 1.
+int run_prefork(const PreforkOptions& options,
+	const std::function<int(unsigned)>& child);
+
+#endif
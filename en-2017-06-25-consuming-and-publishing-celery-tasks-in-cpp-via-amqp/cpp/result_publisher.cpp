@@ -0,0 +1,188 @@
+//
+// Publishing of results of tasks into reply queues of clients.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <utility>
+
+#include "celery_body.h"
+#include "eta.h"
+#include "result_publisher.h"
+
+namespace {
+
+// The maximal number of queued results. When the server cannot keep up, the
+// consumers wait instead of queueing results without limit.
+constexpr std::size_t MaxQueued = 4096;
+
+std::atomic<std::uint64_t> total_published_results(0);
+std::atomic<std::uint64_t> total_result_batches(0);
+
+// Returns the ID of the task from the given message. Celery clients put it
+// into both the correlation_id property and the 'id' header.
+std::string_view task_id_of(const Message& message) {
+	if (!message.correlation_id.empty()) {
+		return message.correlation_id;
+	}
+	auto id = find_string_header(message.headers, "id");
+	return id ? std::string_view(*id) : std::string_view();
+}
+
+// Encodes a result message of the given task (see result_publisher.h).
+void encode_result(std::string& out, std::string_view task_id,
+		std::string_view status, std::string_view result) {
+	out.append("{\"task_id\":");
+	append_json(out, task_id);
+	out.append(",\"status\":");
+	append_json(out, status);
+	out.append(",\"result\":").append(result);
+	out.append(",\"traceback\":null,\"children\":[],\"date_done\":");
+	append_json(out, format_eta(std::chrono::system_clock::now()));
+	out.append("}");
+}
+
+}
+
+ResultPublisher::ResultPublisher(Broker& broker, unsigned window):
+		broker(broker) {
+	window = std::max(window, 1u);
+	for (unsigned i = 0; i < window; ++i) {
+		senders.emplace_back(&ResultPublisher::send, this, window);
+	}
+}
+
+ResultPublisher::~ResultPublisher() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	ready.notify_all();
+	for (auto& sender : senders) {
+		sender.join();
+	}
+}
+
+void ResultPublisher::succeeded(const Message& task_message,
+		std::string_view result) {
+	if (wanted(task_message)) {
+		queue(task_message, "SUCCESS", result);
+	}
+}
+
+void ResultPublisher::failed(const Message& task_message,
+		std::string_view type, std::string_view reason) {
+	if (!wanted(task_message)) {
+		return;
+	}
+	// A Celery client turns this into an exception of the given type (when
+	// there is no such exception in Python, it creates one).
+	std::string result = "{\"exc_type\":";
+	append_json(result, type);
+	result.append(",\"exc_message\":[");
+	append_json(result, reason);
+	result.append("],\"exc_module\":\"builtins\"}");
+	queue(task_message, "FAILURE", result);
+}
+
+void ResultPublisher::flush() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [&]() { return queued.empty() && in_flight == 0; });
+}
+
+std::uint64_t ResultPublisher::published_results() {
+	return total_published_results.load(std::memory_order_relaxed);
+}
+
+std::uint64_t ResultPublisher::result_batches() {
+	return total_result_batches.load(std::memory_order_relaxed);
+}
+
+void ResultPublisher::queue(const Message& task_message,
+		std::string_view status, std::string_view result) {
+	// The message is composed before the lock is taken, so the consumers
+	// only hold it for the push.
+	Result queued_result;
+	queued_result.reply_to = task_message.reply_to;
+	auto& message = queued_result.message;
+	auto task_id = task_id_of(task_message);
+	encode_result(message.body, task_id, status, result);
+	message.content_type = "application/json";
+	message.content_encoding = "utf-8";
+	message.correlation_id = task_id;
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		space.wait(lock, [&]() { return queued.size() < MaxQueued; });
+		queued.push_back(std::move(queued_result));
+	}
+	ready.notify_one();
+}
+
+void ResultPublisher::send(unsigned window) {
+	// The channel is opened when the first result is published, so idle
+	// senders do not hold connections.
+	std::unique_ptr<Channel> channel;
+	std::vector<Result> batch;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		ready.wait(lock, [&]() { return stopping || !queued.empty(); });
+		if (queued.empty()) {
+			return;
+		}
+
+		// Take our share of the queued results, and leave the rest to the
+		// other senders, so that all of them have results in flight.
+		auto share = (queued.size() + window - 1) / window;
+		for (std::size_t i = 0; i < share; ++i) {
+			batch.push_back(std::move(queued.front()));
+			queued.pop_front();
+		}
+		++in_flight;
+		bool more = !queued.empty();
+		lock.unlock();
+		space.notify_all();
+		if (more) {
+			ready.notify_one();
+		}
+
+		std::uint64_t published = 0;
+		for (const auto& result : batch) {
+			published += publish(channel, result);
+		}
+		total_published_results.fetch_add(published, std::memory_order_relaxed);
+		total_result_batches.fetch_add(1, std::memory_order_relaxed);
+		batch.clear();
+
+		lock.lock();
+		--in_flight;
+		if (queued.empty() && in_flight == 0) {
+			idle.notify_all();
+		}
+	}
+}
+
+bool ResultPublisher::publish(std::unique_ptr<Channel>& channel,
+		const Result& result) {
+	// When the channel is broken (e.g. the server has closed the connection),
+	// replace it with a new one and try once more.
+	for (int attempt = 1;; ++attempt) {
+		try {
+			if (!channel) {
+				channel = broker.open_channel();
+			}
+			channel->publish("", result.reply_to, result.message);
+			return true;
+		} catch (const std::exception& e) {
+			channel.reset();
+			if (attempt == 2) {
+				std::cerr << "Failed to publish the result of task " +
+					result.message.correlation_id + ": " + e.what() + "\n";
+				return false;
+			}
+		}
+	}
+}
@@ -0,0 +1,115 @@
+//
+// Publishing of results of tasks into reply queues of clients.
+//
+
+#ifndef RESULT_PUBLISHER_H
+#define RESULT_PUBLISHER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "broker.h"
+
+// Publishes results of tasks in the same way as the RPC result backend of
+// Celery (result_backend = 'rpc://').
+//
+// A client that wants the result of a task puts the name of its reply queue
+// into the reply_to property of the task message and the ID of the task into
+// its correlation_id property (see async_result.h). When the task finishes,
+// the worker publishes a message with the result into the reply queue (via
+// the default exchange, which routes messages to the queue whose name is
+// equal to the routing key), with the same correlation ID. Its body is a JSON
+// object like
+//
+//     {"task_id": "...", "status": "SUCCESS", "result": 42,
+//      "traceback": null, "children": [], "date_done": "..."}
+//
+// which is what a Celery client expects. Tasks without a reply queue have no
+// result to publish.
+//
+// Publishing a result costs a round trip to the server (every publish waits
+// for a publisher confirm, see Channel::publish()), so the consumer does not
+// publish results itself. It only queues them, and they are published by
+// `window` sender threads, each with its own channel, so up to `window`
+// results are waiting for their confirms at once (the used AMQP library does
+// not support several unconfirmed messages per channel). A sender takes its
+// share of all results queued so far (results that have completed together)
+// at once, so a burst of results costs a single wake-up of each sender.
+//
+// The message of a task is acknowledged without waiting for the confirm of
+// its result. Just like with the RPC backend of Celery, results are
+// transient: a result that cannot be published (e.g. because the connection
+// has been lost twice in a row) is dropped and logged, and the client does
+// not get it.
+//
+// All methods are thread-safe. The destructor publishes all queued results.
+class ResultPublisher {
+public:
+	ResultPublisher(Broker& broker, unsigned window);
+	~ResultPublisher();
+
+	ResultPublisher(const ResultPublisher&) = delete;
+	ResultPublisher& operator=(const ResultPublisher&) = delete;
+
+	// Is there anybody waiting for the result of the task from the given
+	// message?
+	static bool wanted(const Message& task_message) {
+		return !task_message.reply_to.empty();
+	}
+
+	// Queues the result (encoded in JSON) of the task from the given message
+	// that has succeeded. Does nothing when the result is not wanted. Waits
+	// when too many results are queued already (the server is too slow).
+	void succeeded(const Message& task_message, std::string_view result);
+
+	// Queues a failure of the task from the given message (see succeeded()).
+	// The client gets the type and the reason in the same form as an
+	// exception raised in a Python task.
+	void failed(const Message& task_message, std::string_view type,
+		std::string_view reason);
+
+	// Waits until all results queued so far have been published.
+	void flush();
+
+	// Returns the number of results published by all publishers so far
+	// (without the dropped ones).
+	static std::uint64_t published_results();
+
+	// Returns the number of batches in which the above results were taken by
+	// the senders.
+	static std::uint64_t result_batches();
+
+private:
+	// A result to be published into the given reply queue.
+	struct Result {
+		std::string reply_to;
+		Message message;
+	};
+
+	void queue(const Message& task_message, std::string_view status,
+		std::string_view result);
+	void send(unsigned window);
+	bool publish(std::unique_ptr<Channel>& channel, const Result& result);
+
+	Broker& broker;
+
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::condition_variable space;
+	std::condition_variable idle;
+	std::deque<Result> queued;
+	unsigned in_flight = 0;
+	bool stopping = false;
+
+	std::vector<std::thread> senders;
+};
+
+#endif
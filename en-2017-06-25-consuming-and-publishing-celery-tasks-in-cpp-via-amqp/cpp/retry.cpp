@@ -0,0 +1,23 @@
+//
+// Retrying of failed tasks.
+//
+
+#include <algorithm>
+
+#include "retry.h"
+
+std::chrono::milliseconds retry_delay(const RetryPolicy& policy,
+		unsigned retries, std::minstd_rand& random) {
+	// Doubling stops at the maximum, so large retry counts do not overflow.
+	auto delay = std::max(policy.backoff, std::chrono::milliseconds(0));
+	for (unsigned i = 0; i < retries && delay < policy.backoff_max; ++i) {
+		delay *= 2;
+	}
+	delay = std::min(delay, policy.backoff_max);
+	if (!policy.jitter || delay.count() <= 0) {
+		return delay;
+	}
+	std::uniform_int_distribution<std::chrono::milliseconds::rep> jitter(
+		0, delay.count());
+	return std::chrono::milliseconds(jitter(random));
+}
@@ -0,0 +1,34 @@
+//
+// Retrying of failed tasks.
+//
+
+#ifndef RETRY_H
+#define RETRY_H
+
+#include <chrono>
+#include <random>
+
+// How a task is retried when it fails.
+//
+// The meaning is the same as of the options of automatic retries in Celery
+// (max_retries, retry_backoff, retry_backoff_max, and retry_jitter): the n-th
+// retry (counting from 0) comes `backoff * 2^n` after the failure, at most
+// `backoff_max`. With jitter, the delay is random between zero and that, so
+// tasks that failed together (e.g. because a database was down) are not all
+// retried at the same moment again.
+struct RetryPolicy {
+	// The maximal number of retries of a message (0 means that a failed task
+	// is not retried).
+	unsigned max_retries = 0;
+
+	std::chrono::milliseconds backoff{1000};
+	std::chrono::milliseconds backoff_max{600 * 1000};
+	bool jitter = true;
+};
+
+// Returns the delay before the retry of a task that has already been retried
+// `retries` times (see RetryPolicy).
+std::chrono::milliseconds retry_delay(const RetryPolicy& policy,
+	unsigned retries, std::minstd_rand& random);
+
+#endif
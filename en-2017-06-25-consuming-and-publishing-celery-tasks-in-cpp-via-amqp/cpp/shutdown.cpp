@@ -0,0 +1,39 @@
+//
+// Coordination of a graceful stop of consumers.
+//
+
+#include <algorithm>
+#include <exception>
+#include <iostream>
+
+#include "shutdown.h"
+
+void Shutdown::request() {
+	// The flag is set under the lock, so a channel is either registered
+	// before the request (and gets interrupted) or after it (and its consumer
+	// sees the flag before it starts waiting).
+	std::lock_guard<std::mutex> lock(mutex);
+	stop.store(true, std::memory_order_release);
+	for (auto channel : channels) {
+		// Interrupting may fail (e.g. when the broker is down). The flag is
+		// already set, so the consumer stops when it wakes up anyway, and the
+		// other consumers still have to be interrupted.
+		try {
+			channel->interrupt();
+		} catch (const std::exception& e) {
+			std::cerr << "Failed to interrupt a consumer: " << e.what()
+				<< ". It stops when it receives a message.\n";
+		}
+	}
+}
+
+void Shutdown::add(Channel& channel) {
+	std::lock_guard<std::mutex> lock(mutex);
+	channels.push_back(&channel);
+}
+
+void Shutdown::remove(Channel& channel) {
+	std::lock_guard<std::mutex> lock(mutex);
+	channels.erase(std::remove(channels.begin(), channels.end(), &channel),
+		channels.end());
+}
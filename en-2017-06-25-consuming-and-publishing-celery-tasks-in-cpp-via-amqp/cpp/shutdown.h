@@ -0,0 +1,63 @@
+//
+// Coordination of a graceful stop of consumers.
+//
+
+#ifndef SHUTDOWN_H
+#define SHUTDOWN_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "broker.h"
+
+// A request to stop consumers, shared by all of them.
+//
+// Consumers wait for messages without any timeout, so checking a flag is not
+// enough to stop them: a consumer that waits for a message would not notice
+// the flag until the next message arrives. Therefore, consumers register
+// their channels here, and a stop request interrupts the waiting on all of
+// them.
+class Shutdown {
+public:
+	// Returns true when a stop has been requested.
+	bool requested() const noexcept {
+		return stop.load(std::memory_order_acquire);
+	}
+
+	// Requests a stop and wakes up all consumers. Can be called from any
+	// thread (but not from a signal handler; see signals.h). Does not throw:
+	// a consumer that cannot be woken up is logged and stops later.
+	void request();
+
+	// Registers/unregisters a channel to be interrupted by request().
+	void add(Channel& channel);
+	void remove(Channel& channel);
+
+private:
+	std::atomic<bool> stop{false};
+	std::mutex mutex;
+	std::vector<Channel*> channels;
+};
+
+// Registers a channel in Shutdown for the lifetime of the guard.
+class ShutdownGuard {
+public:
+	ShutdownGuard(Shutdown& shutdown, Channel& channel):
+			shutdown(shutdown), channel(channel) {
+		shutdown.add(channel);
+	}
+
+	~ShutdownGuard() {
+		shutdown.remove(channel);
+	}
+
+	ShutdownGuard(const ShutdownGuard&) = delete;
+	ShutdownGuard& operator=(const ShutdownGuard&) = delete;
+
+private:
+	Shutdown& shutdown;
+	Channel& channel;
+};
+
+#endif
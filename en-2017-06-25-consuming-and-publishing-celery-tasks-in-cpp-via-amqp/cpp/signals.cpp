@@ -0,0 +1,118 @@
+//
+// Synchronous handling of signals via a self-pipe.
+//
+
+#include <cerrno>
+#include <csignal>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "signals.h"
+
+namespace {
+
+// The write end of the pipe, used by the signal handler. An atomic would be
+// more appropriate, but the descriptor is set before the handler is
+// installed and reset after it is uninstalled, so a plain int suffices.
+int signal_write_fd = -1;
+
+// A signal handler. It writes the number of the received signal into the
+// pipe. The pipe is non-blocking, so when it is full (i.e. when nobody reads
+// it), the signal is dropped instead of blocking the handler.
+//
+// As a side note, `extern "C"` is needed because signal handlers are expected
+// to have C linkage and, in general, only use the features from the common
+// subset of C and C++. It is implementation-defined if a function with C++
+// linkage can be used as a signal handler.
+// http://en.cppreference.com/w/cpp/utility/program/signal#Notes
+extern "C" void signal_handler(int signal) {
+	// write() may change errno, which the interrupted code may be about to
+	// read.
+	auto saved_errno = errno;
+	auto byte = static_cast<unsigned char>(signal);
+	[[maybe_unused]] auto written = write(signal_write_fd, &byte, 1);
+	errno = saved_errno;
+}
+
+[[noreturn]] void throw_errno(const char* what) {
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+}
+
+SignalPipe::SignalPipe(std::initializer_list<int> signals): signals(signals) {
+	if (signal_write_fd != -1) {
+		throw std::logic_error("only a single SignalPipe can exist at a time");
+	}
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+		throw_errno("pipe2");
+	}
+	read_fd = fds[0];
+	write_fd = fds[1];
+	signal_write_fd = write_fd;
+
+	// Unlike std::signal(), sigaction() allows us to restart system calls
+	// interrupted by the signal (e.g. reading from a socket in the AMQP
+	// library), so the rest of the program does not have to care.
+	struct sigaction action = {};
+	action.sa_handler = signal_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigset_t set;
+	sigemptyset(&set);
+	for (auto signal : signals) {
+		sigaction(signal, &action, nullptr);
+		sigaddset(&set, signal);
+	}
+
+	// The signals may have been blocked (e.g. in a worker process started by
+	// the supervisor, see prefork.h). Now that they are handled, let them in.
+	// Threads started afterwards inherit the mask.
+	pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+}
+
+SignalPipe::~SignalPipe() {
+	for (auto signal : signals) {
+		std::signal(signal, SIG_DFL);
+	}
+	signal_write_fd = -1;
+	close(read_fd);
+	close(write_fd);
+}
+
+int SignalPipe::wait(int timeout) {
+	pollfd fd = {read_fd, POLLIN, 0};
+	for (;;) {
+		auto ready = poll(&fd, 1, timeout);
+		if (ready < 0 && errno == EINTR) {
+			// Interrupted by a signal, which is now in the pipe.
+			continue;
+		}
+		if (ready < 0) {
+			throw_errno("poll");
+		}
+		if (ready == 0) {
+			return -1;
+		}
+
+		unsigned char byte;
+		auto n = read(read_fd, &byte, 1);
+		if (n == 1) {
+			return byte;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			throw_errno("read");
+		}
+	}
+}
+
+void SignalPipe::wake() {
+	unsigned char byte = 0;
+	[[maybe_unused]] auto written = write(write_fd, &byte, 1);
+}
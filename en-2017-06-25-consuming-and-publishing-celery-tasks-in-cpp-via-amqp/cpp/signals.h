@@ -0,0 +1,46 @@
+//
+// Synchronous handling of signals via a self-pipe.
+//
+
+#ifndef SIGNALS_H
+#define SIGNALS_H
+
+#include <initializer_list>
+#include <vector>
+
+// Turns the given signals into bytes written into a pipe (the self-pipe
+// trick), so they can be waited for and handled by an ordinary thread.
+//
+// In a signal handler, only async-signal-safe functions can be called, which
+// rules out almost everything (e.g. locking a mutex or writing to std::cerr).
+// The only thing our handler does is writing the number of the signal into a
+// pipe, which is safe. A thread waiting in wait() then reads the number and
+// can handle the signal without any restrictions.
+//
+// The signals are unblocked in the calling thread, so it should be created
+// before the threads that are started by the program.
+//
+// Only a single instance can exist at a time.
+class SignalPipe {
+public:
+	explicit SignalPipe(std::initializer_list<int> signals);
+	~SignalPipe();
+
+	SignalPipe(const SignalPipe&) = delete;
+	SignalPipe& operator=(const SignalPipe&) = delete;
+
+	// Waits for a signal for at most `timeout` milliseconds (-1 means
+	// forever). Returns the number of the received signal, 0 when woken up
+	// via wake(), and -1 when the timeout expired.
+	int wait(int timeout);
+
+	// Wakes up a thread waiting in wait(). Can be called from any thread.
+	void wake();
+
+private:
+	int read_fd = -1;
+	int write_fd = -1;
+	std::vector<int> signals;
+};
+
+#endif
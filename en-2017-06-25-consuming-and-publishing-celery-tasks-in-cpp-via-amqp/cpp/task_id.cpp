@@ -0,0 +1,121 @@
+//
+// Generation of unique IDs of tasks.
+//
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "task_id.h"
+
+namespace {
+
+// A 64-bit mixing function (SplitMix64), used to turn seed material into
+// well-distributed initial states.
+std::uint64_t splitmix64(std::uint64_t& state) {
+	auto z = (state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+// A fast random number generator (xoshiro256** by David Blackman and
+// Sebastiano Vigna, https://prng.di.unimi.it/). It is not cryptographically
+// secure, which is fine for IDs that only need to be unique.
+class Xoshiro256 {
+public:
+	Xoshiro256() {
+		// Seed from std::random_device (a system call, but only once per
+		// thread), and mix in the time and the thread, so threads get
+		// different sequences even when the random device is deterministic.
+		std::random_device device;
+		std::uint64_t seed = (std::uint64_t(device()) << 32) ^ device();
+		seed ^= static_cast<std::uint64_t>(
+			std::chrono::high_resolution_clock::now().time_since_epoch().count());
+		seed ^= std::hash<std::thread::id>()(std::this_thread::get_id()) << 1;
+		for (auto& word : state) {
+			word = splitmix64(seed);
+		}
+	}
+
+	std::uint64_t next() {
+		auto result = rotl(state[1] * 5, 7) * 9;
+		auto t = state[1] << 17;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = rotl(state[3], 45);
+		return result;
+	}
+
+private:
+	static std::uint64_t rotl(std::uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+
+	std::array<std::uint64_t, 4> state;
+};
+
+// Two hexadecimal digits of every byte, so a byte is encoded with a single
+// lookup (instead of two, with shifting and masking in between).
+constexpr auto hex_pairs = []() {
+	constexpr char digits[] = "0123456789abcdef";
+	std::array<char, 512> pairs{};
+	for (std::size_t i = 0; i < 256; ++i) {
+		pairs[2 * i] = digits[i >> 4];
+		pairs[2 * i + 1] = digits[i & 0xf];
+	}
+	return pairs;
+}();
+
+// Writes the given bytes of `value` (from the most significant one) as
+// hexadecimal digits into `out` and returns the position after them.
+char* append_hex(char* out, std::uint64_t value, int bytes) {
+	for (int i = bytes - 1; i >= 0; --i) {
+		auto byte = (value >> (8 * i)) & 0xff;
+		*out++ = hex_pairs[2 * byte];
+		*out++ = hex_pairs[2 * byte + 1];
+	}
+	return out;
+}
+
+}
+
+void generate_task_id(char* out) {
+	thread_local Xoshiro256 random;
+
+	// The layout of a version 7 UUID:
+	//
+	//     unix_ts_ms (48 bits) | ver (4) | rand_a (12) | var (2) | rand_b (62)
+	//
+	auto ms = static_cast<std::uint64_t>(
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch()
+		).count()
+	);
+	auto bits = random.next();
+	auto high = (ms << 16) | 0x7000 | (bits >> 52);
+	auto low = (random.next() >> 2) | (std::uint64_t(1) << 63);
+
+	// xxxxxxxx-xxxx-7xxx-yxxx-xxxxxxxxxxxx
+	out = append_hex(out, high >> 32, 4);
+	*out++ = '-';
+	out = append_hex(out, high >> 16, 2);
+	*out++ = '-';
+	out = append_hex(out, high, 2);
+	*out++ = '-';
+	out = append_hex(out, low >> 48, 2);
+	*out++ = '-';
+	append_hex(out, low, 6);
+}
+
+std::string generate_task_id() {
+	std::string id(TaskIdSize, '\0');
+	generate_task_id(id.data());
+	return id;
+}
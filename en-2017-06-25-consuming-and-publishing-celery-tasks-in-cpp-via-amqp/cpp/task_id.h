@@ -0,0 +1,35 @@
+//
+// Generation of unique IDs of tasks.
+//
+
+#ifndef TASK_ID_H
+#define TASK_ID_H
+
+#include <cstddef>
+#include <string>
+
+// The length of a task ID (a UUID in its textual form, without a terminating
+// null character).
+constexpr std::size_t TaskIdSize = 36;
+
+// Writes a new unique task ID into `out`, which has to have room for
+// TaskIdSize characters (no terminating null character is written).
+//
+// The ID is a version 7 UUID (RFC 9562), e.g.
+// "0190b6a3-5c1e-7d2a-9f3b-6c0d8e1f2a3b". Its first 48 bits are the current
+// Unix time in milliseconds, so IDs are ordered by the time of their
+// generation (which makes them friendly to database indexes), and the
+// remaining 74 bits (except for the version and variant) are random.
+//
+// Unlike generic UUID libraries, the generation does not allocate, lock, or
+// make a system call: every thread has its own random number generator, which
+// is seeded only once, and the current time comes from
+// std::chrono::system_clock (which does not make a system call on Linux).
+// Thus, it can be called from any number of threads without them slowing each
+// other down.
+void generate_task_id(char* out);
+
+// Returns a new unique task ID (see above).
+std::string generate_task_id();
+
+#endif
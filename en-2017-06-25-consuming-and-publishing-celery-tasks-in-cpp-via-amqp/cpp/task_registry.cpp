@@ -0,0 +1,137 @@
+//
+// A registry of tasks that the worker can execute.
+//
+
+#include <stdexcept>
+#include <utility>
+
+#include "task_registry.h"
+
+namespace {
+
+// A coroutine that executes a synchronous task when it starts.
+template<typename Handler, typename Body>
+Async invoke_sync(const Handler& handler, const Body& body, std::string* result) {
+	handler(body, result);
+	co_return;
+}
+
+// A coroutine that executes a batch task with a single call when it starts.
+template<typename Body>
+Async invoke_batch(const Task& task, const Body& body, std::string* result) {
+	task.invoke(body, result);
+	co_return;
+}
+
+// Stores the result of a task that does not return anything.
+void set_null_result(std::string* result) {
+	if (result) {
+		result->assign("null");
+	}
+}
+
+// Runs an asynchronous task to completion on a temporary event loop.
+void run_async(Async task, std::string* result) {
+	EventLoop().run(std::move(task));
+	set_null_result(result);
+}
+
+// Executes a batch task with a batch of a single call.
+template<typename Body>
+void invoke_alone(const Task& task, const Body& body) {
+	auto batch = task.make_batch();
+	batch->add(body);
+	batch->run();
+}
+
+}
+
+void Task::invoke(const CeleryBody& body, std::string* result) const {
+	if (is_async()) {
+		run_async(async_json_handler(body), result);
+	} else if (is_batch()) {
+		invoke_alone(*this, body);
+		set_null_result(result);
+	} else {
+		json_handler(body, result);
+	}
+}
+
+void Task::invoke(const MsgpackBody& body, std::string* result) const {
+	if (is_async()) {
+		run_async(async_msgpack_handler(body), result);
+	} else if (is_batch()) {
+		invoke_alone(*this, body);
+		set_null_result(result);
+	} else {
+		msgpack_handler(body, result);
+	}
+}
+
+Async Task::invoke_async(const CeleryBody& body, std::string* result) const {
+	if (is_batch()) {
+		return invoke_batch(*this, body, result);
+	}
+	if (is_async()) {
+		set_null_result(result);
+		return async_json_handler(body);
+	}
+	return invoke_sync(json_handler, body, result);
+}
+
+Async Task::invoke_async(const MsgpackBody& body, std::string* result) const {
+	if (is_batch()) {
+		return invoke_batch(*this, body, result);
+	}
+	if (is_async()) {
+		set_null_result(result);
+		return async_msgpack_handler(body);
+	}
+	return invoke_sync(msgpack_handler, body, result);
+}
+
+void TaskRegistry::set_retry_policy(std::string_view name,
+		const RetryPolicy& policy) {
+	auto it = tasks.find(name);
+	if (it == tasks.end()) {
+		throw std::invalid_argument(
+			"task " + std::string(name) + " is not registered"
+		);
+	}
+	it->second->set_retry_policy(policy);
+}
+
+void TaskRegistry::set_retry_policy(const RetryPolicy& policy) {
+	for (auto& [name, task] : tasks) {
+		task->set_retry_policy(policy);
+	}
+}
+
+void TaskRegistry::memoize(std::string_view name, const MemoOptions& options) {
+	auto it = tasks.find(name);
+	if (it == tasks.end()) {
+		throw std::invalid_argument(
+			"task " + std::string(name) + " is not registered"
+		);
+	}
+	if (it->second->is_batch()) {
+		throw std::invalid_argument(
+			"batch task " + std::string(name) + " cannot be memoized"
+		);
+	}
+	it->second->set_memo_cache(std::make_unique<MemoCache>(options));
+}
+
+const Task* TaskRegistry::find(std::string_view name) const {
+	auto it = tasks.find(name);
+	return it != tasks.end() ? it->second.get() : nullptr;
+}
+
+void TaskRegistry::add_task(std::unique_ptr<Task> task) {
+	auto key = task->name();
+	if (!tasks.try_emplace(key, std::move(task)).second) {
+		throw std::invalid_argument(
+			"task " + std::string(key) + " is already registered"
+		);
+	}
+}
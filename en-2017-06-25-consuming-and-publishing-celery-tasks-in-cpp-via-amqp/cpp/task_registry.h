@@ -0,0 +1,453 @@
+//
+// A registry of tasks that the worker can execute.
+//
+
+#ifndef TASK_REGISTRY_H
+#define TASK_REGISTRY_H
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "async.h"
+#include "celery_body.h"
+#include "memo_cache.h"
+#include "msgpack_body.h"
+#include "retry.h"
+
+namespace detail {
+
+// Provides the types of parameters of a function or a callable object
+// (e.g. a lambda) with a non-overloaded function-call operator.
+template<typename F>
+struct Signature: Signature<decltype(&F::operator())> {};
+
+template<typename R, typename... Args>
+struct Signature<R(*)(Args...)> {
+	using Params = std::tuple<Args...>;
+};
+
+template<typename R, typename C, typename... Args>
+struct Signature<R(C::*)(Args...)> {
+	using Params = std::tuple<Args...>;
+};
+
+template<typename R, typename C, typename... Args>
+struct Signature<R(C::*)(Args...) const> {
+	using Params = std::tuple<Args...>;
+};
+
+// Throws CeleryBodyError when the body does not have the given number of
+// positional arguments.
+template<typename Body>
+void check_arg_count(const Body& body, std::size_t count) {
+	if (body.arg_count() != count) {
+		throw CeleryBodyError(
+			"task takes " + std::to_string(count) +
+			" positional arguments but " + std::to_string(body.arg_count()) +
+			" were given"
+		);
+	}
+}
+
+// Calls `f` with positional arguments from the body, decoded into types of
+// the parameters of `f`. The list of decoding calls is generated at compile
+// time from the signature of `f`, e.g. for `void hello(std::string_view name,
+// int age)`, it is
+//
+//     f(body.arg<std::string_view>(0), body.arg<int>(1))
+//
+// The body is either CeleryBody (JSON) or MsgpackBody (MessagePack).
+template<typename F, typename Body, typename... Params, std::size_t... I>
+decltype(auto) invoke_with_args(F& f, const Body& body, std::tuple<Params...>*,
+		std::index_sequence<I...>) {
+	check_arg_count(body, sizeof...(Params));
+	return f(body.template arg<std::decay_t<Params>>(I)...);
+}
+
+// Calls `f` with positional arguments from the body (see invoke_with_args())
+// and, when `result` is not null, stores the return value of `f` encoded in
+// JSON into it ("null" when `f` returns void). The result is encoded only when
+// somebody wants it, so tasks whose results are ignored do not pay for it.
+template<typename F, typename Body, typename Params>
+void invoke_for_result(F& f, const Body& body, std::string* result,
+		Params* params) {
+	auto call = [&]() -> decltype(auto) {
+		return invoke_with_args(f, body, params,
+			std::make_index_sequence<std::tuple_size_v<Params>>());
+	};
+	if constexpr (std::is_void_v<decltype(call())>) {
+		call();
+		if (result) {
+			result->assign("null");
+		}
+	} else {
+		auto value = call();
+		if (result) {
+			result->clear();
+			append_json(*result, value);
+		}
+	}
+}
+
+// Decodes positional arguments from the body into a tuple of the given type,
+// e.g. std::tuple<std::string_view, int>.
+template<typename Args, typename Body, std::size_t... I>
+Args decode_args(const Body& body, std::index_sequence<I...>) {
+	check_arg_count(body, sizeof...(I));
+	return Args(body.template arg<std::tuple_element_t<I, Args>>(I)...);
+}
+
+}
+
+// Options of a batch task (see TaskRegistry::add_batch()).
+struct BatchOptions {
+	// The maximal number of calls executed at once.
+	std::size_t max_size = 64;
+
+	// The maximal time for which a call waits for further calls to be
+	// executed with.
+	std::chrono::milliseconds max_delay{10};
+};
+
+// Calls of a batch task collected to be executed at once (see
+// TaskRegistry::add_batch()).
+class TaskBatch {
+public:
+	virtual ~TaskBatch() = default;
+
+	// Decodes arguments of a call from the given body and adds them to the
+	// batch. The arguments may refer to the body (and to its message), so
+	// the body has to outlive the execution of the batch. Throws
+	// CeleryBodyError when the arguments cannot be decoded.
+	virtual void add(const CeleryBody& body) = 0;
+	virtual void add(const MsgpackBody& body) = 0;
+
+	// Returns the number of calls in the batch.
+	virtual std::size_t size() const = 0;
+
+	// Executes the task with all calls in the batch.
+	virtual void run() = 0;
+
+	// Removes all calls from the batch. The memory for them is kept for the
+	// next batch.
+	virtual void clear() = 0;
+};
+
+namespace detail {
+
+// Calls of a batch task whose function takes a span of argument tuples of
+// type Args.
+template<typename F, typename Args>
+class Batch: public TaskBatch {
+public:
+	Batch(F f, std::size_t capacity): f(std::move(f)) {
+		calls.reserve(capacity);
+	}
+
+	void add(const CeleryBody& body) override {
+		calls.push_back(decode(body));
+	}
+
+	void add(const MsgpackBody& body) override {
+		calls.push_back(decode(body));
+	}
+
+	std::size_t size() const override {
+		return calls.size();
+	}
+
+	void run() override {
+		f(std::span<const Args>(calls));
+	}
+
+	void clear() override {
+		calls.clear();
+	}
+
+private:
+	template<typename Body>
+	static Args decode(const Body& body) {
+		return decode_args<Args>(body,
+			std::make_index_sequence<std::tuple_size_v<Args>>());
+	}
+
+	F f;
+	std::vector<Args> calls;
+};
+
+}
+
+// A task that can be executed by the worker.
+//
+// There is one handler per supported serializer. Both are generated from the
+// same function (see TaskRegistry::add()), so arguments are decoded directly
+// from the body, whatever its format.
+//
+// A task is either synchronous (an ordinary function), asynchronous (a
+// coroutine, see TaskRegistry::add_async()), or a batch task (a function
+// executing several calls at once, see TaskRegistry::add_batch()).
+class Task {
+public:
+	using JsonHandler = std::function<void(const CeleryBody&, std::string*)>;
+	using MsgpackHandler = std::function<void(const MsgpackBody&, std::string*)>;
+	using AsyncJsonHandler = std::function<Async(const CeleryBody&)>;
+	using AsyncMsgpackHandler = std::function<Async(const MsgpackBody&)>;
+	using BatchFactory = std::function<std::unique_ptr<TaskBatch>()>;
+
+	// Creates a synchronous task.
+	Task(std::string name, JsonHandler json_handler,
+			MsgpackHandler msgpack_handler):
+		task_name(std::move(name)),
+		json_handler(std::move(json_handler)),
+		msgpack_handler(std::move(msgpack_handler)) {}
+
+	// Creates an asynchronous task.
+	Task(std::string name, AsyncJsonHandler json_handler,
+			AsyncMsgpackHandler msgpack_handler):
+		task_name(std::move(name)),
+		async_json_handler(std::move(json_handler)),
+		async_msgpack_handler(std::move(msgpack_handler)) {}
+
+	// Creates a batch task.
+	Task(std::string name, BatchFactory batch_factory, BatchOptions options):
+		task_name(std::move(name)),
+		batch_factory(std::move(batch_factory)),
+		options(options) {}
+
+	// Returns the name of the task, as registered in Celery.
+	std::string_view name() const {
+		return task_name;
+	}
+
+	// Is the task asynchronous?
+	bool is_async() const {
+		return static_cast<bool>(async_json_handler);
+	}
+
+	// Is it a batch task?
+	bool is_batch() const {
+		return static_cast<bool>(batch_factory);
+	}
+
+	// Does the task return a result? Only synchronous tasks do (see
+	// TaskRegistry::add()).
+	bool has_result() const {
+		return static_cast<bool>(json_handler);
+	}
+
+	// Returns options of a batch task.
+	const BatchOptions& batch_options() const {
+		return options;
+	}
+
+	// Creates an empty batch of calls of a batch task, to be filled and
+	// executed by the caller.
+	std::unique_ptr<TaskBatch> make_batch() const {
+		return batch_factory();
+	}
+
+	// Returns how the task is retried when it fails (see consumer.h).
+	const RetryPolicy& retry_policy() const {
+		return retry;
+	}
+
+	void set_retry_policy(const RetryPolicy& policy) {
+		retry = policy;
+	}
+
+	// Returns the cache of results of the task, or nullptr when the task is
+	// not memoized (see TaskRegistry::memoize()). The cache is thread-safe.
+	MemoCache* memo_cache() const {
+		return memo.get();
+	}
+
+	void set_memo_cache(std::unique_ptr<MemoCache> cache) {
+		memo = std::move(cache);
+	}
+
+	// Executes the task with arguments from the given JSON body. An
+	// asynchronous task is run to completion on a temporary event loop, so
+	// the call blocks until the task finishes. A batch task is executed with
+	// a batch of a single call.
+	//
+	// When `result` is not null, the result of the task encoded in JSON is
+	// stored into it: the return value of a synchronous task (see
+	// TaskRegistry::add()), and "null" for the other tasks.
+	void invoke(const CeleryBody& body, std::string* result = nullptr) const;
+
+	// Executes the task with arguments from the given MessagePack body (see
+	// above).
+	void invoke(const MsgpackBody& body, std::string* result = nullptr) const;
+
+	// Returns a coroutine that executes the task with arguments from the
+	// given JSON body. Arguments are decoded right away, but they may refer
+	// to the body, so the body has to outlive the coroutine. A synchronous
+	// task (or a batch task, with a single call) is executed when the
+	// coroutine starts. The result is stored like in invoke(), so `result`
+	// has to outlive the coroutine as well.
+	Async invoke_async(const CeleryBody& body, std::string* result = nullptr) const;
+
+	// Returns a coroutine that executes the task with arguments from the
+	// given MessagePack body (see above).
+	Async invoke_async(const MsgpackBody& body, std::string* result = nullptr) const;
+
+private:
+	std::string task_name;
+	JsonHandler json_handler;
+	MsgpackHandler msgpack_handler;
+	AsyncJsonHandler async_json_handler;
+	AsyncMsgpackHandler async_msgpack_handler;
+	BatchFactory batch_factory;
+	BatchOptions options;
+	RetryPolicy retry;
+	std::unique_ptr<MemoCache> memo;
+};
+
+// A registry of tasks, identified by their Celery names.
+//
+// Tasks are registered before the worker starts, so the registry can be
+// shared by all consumer threads without any locking.
+class TaskRegistry {
+public:
+	// Registers the given function (or a callable object) as a task with the
+	// given name. Arguments of the task are decoded from the body of a
+	// message into types of parameters of the function, e.g.
+	//
+	//     void hello(std::string_view name, int age);
+	//     registry.add("tasks.hello", hello);
+	//
+	// The function may return a result of the task (a string, a number, or
+	// a boolean), which is sent to clients that want it (see
+	// result_publisher.h). The function may be called from several consumer
+	// threads at once. Throws std::invalid_argument when a task with the same
+	// name has already been registered.
+	template<typename F>
+	void add(std::string name, F f) {
+		using Params = typename detail::Signature<std::decay_t<F>>::Params;
+		auto handler = [f = std::move(f)](const auto& body,
+				std::string* result) mutable {
+			detail::invoke_for_result(f, body, result,
+				static_cast<Params*>(nullptr));
+		};
+		// The function is copied into both handlers. Tasks are usually plain
+		// functions or lambdas without captures, so the copies are cheap.
+		add_task(std::make_unique<Task>(
+			std::move(name),
+			Task::JsonHandler(handler),
+			Task::MsgpackHandler(handler)
+		));
+	}
+
+	// Registers the given coroutine function as an asynchronous task with
+	// the given name, e.g.
+	//
+	//     Async slow_hello(std::string_view name, int age) {
+	//         co_await sleep_for(std::chrono::seconds(1));
+	//         hello(name, age);
+	//     }
+	//     registry.add_async("tasks.slow_hello", slow_hello);
+	//
+	// Arguments are decoded in the same way as in add(). Arguments that refer
+	// to the message (e.g. std::string_view) stay valid until the task
+	// finishes. In the asynchronous mode of the worker (see consumer.h), the
+	// task runs on the event loop of its consumer, so while it is suspended
+	// (e.g. waiting for a timer or a file read), the consumer can execute
+	// other tasks.
+	template<typename F>
+	void add_async(std::string name, F f) {
+		using Params = typename detail::Signature<std::decay_t<F>>::Params;
+		auto handler = [f = std::move(f)](const auto& body) mutable -> Async {
+			return detail::invoke_with_args(
+				f,
+				body,
+				static_cast<Params*>(nullptr),
+				std::make_index_sequence<std::tuple_size_v<Params>>()
+			);
+		};
+		add_task(std::make_unique<Task>(
+			std::move(name),
+			Task::AsyncJsonHandler(handler),
+			Task::AsyncMsgpackHandler(handler)
+		));
+	}
+
+	// Registers the given function as a batch task with the given name.
+	// Instead of a call per message, the function gets the arguments of up
+	// to `options.max_size` messages at once, decoded into a contiguous array
+	// of tuples, e.g.
+	//
+	//     void hello_batch(std::span<const std::tuple<std::string_view, int>> calls);
+	//     registry.add_batch("tasks.hello", hello_batch);
+	//
+	// For tiny tasks, the overhead of every message (e.g. writing the output
+	// or acknowledging the message) can be much larger than the task itself.
+	// A batch task can spread it over many messages (e.g. write the output of
+	// all calls at once), and the consumer acknowledges all messages of the
+	// batch with a single frame.
+	//
+	// The consumer collects calls until there are `options.max_size` of
+	// them or the first of them has waited for `options.max_delay` (see
+	// consumer.h). Arguments that refer to the message (e.g.
+	// std::string_view) stay valid until the function returns. When the
+	// function throws, the consumer calls it again for every call of the
+	// batch on its own, so only the calls that fail by themselves fail. In
+	// other contexts (e.g. in the asynchronous mode of the worker), the
+	// function is called with a single call at a time.
+	template<typename F>
+	void add_batch(std::string name, F f, BatchOptions options = {}) {
+		using Params = typename detail::Signature<std::decay_t<F>>::Params;
+		static_assert(std::tuple_size_v<Params> == 1,
+			"a batch task takes a single span of calls");
+		using Calls = std::decay_t<std::tuple_element_t<0, Params>>;
+		using Args = std::remove_const_t<typename Calls::element_type>;
+		auto capacity = options.max_size;
+		add_task(std::make_unique<Task>(
+			std::move(name),
+			Task::BatchFactory([f = std::move(f), capacity]() {
+				return std::make_unique<detail::Batch<std::decay_t<F>, Args>>(
+					f, capacity);
+			}),
+			options
+		));
+	}
+
+	// Sets the retry policy of the task with the given name (see
+	// RetryPolicy). By default, failed tasks are not retried. Throws
+	// std::invalid_argument when there is no such task.
+	void set_retry_policy(std::string_view name, const RetryPolicy& policy);
+
+	// Sets the retry policy of all tasks registered so far.
+	void set_retry_policy(const RetryPolicy& policy);
+
+	// Makes the consumers cache results of the task with the given name (see
+	// MemoCache). When a message of the task has the same body as a message
+	// whose task has succeeded less than `options.ttl` ago, the task is not
+	// executed; the message is acknowledged right away and the client gets
+	// the cached result. Use it only for tasks that are pure functions of
+	// their arguments. Throws std::invalid_argument when there is no such
+	// task or when it is a batch task.
+	void memoize(std::string_view name, const MemoOptions& options = {});
+
+	// Returns the task with the given name, or nullptr when there is no such
+	// task.
+	const Task* find(std::string_view name) const;
+
+private:
+	void add_task(std::unique_ptr<Task> task);
+
+	// The keys are views of names owned by the tasks, so the names are
+	// stored only once and lookups do not need to create strings.
+	std::unordered_map<std::string_view, std::unique_ptr<Task>> tasks;
+};
+
+#endif
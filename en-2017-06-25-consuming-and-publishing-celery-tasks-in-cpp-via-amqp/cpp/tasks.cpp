@@ -0,0 +1,95 @@
+//
+// Tasks that the worker can execute.
+//
+
+#include <charconv>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "tasks.h"
+
+namespace {
+
+// Where the tasks write their output (nullptr means std::cout).
+OutputSink* task_output = nullptr;
+
+// Appends the greeting printed by hello() to the given string.
+void append_greeting(std::string& out, std::string_view name, int age) {
+	char age_str[16];
+	auto age_end = std::to_chars(std::begin(age_str), std::end(age_str), age).ptr;
+	out.append("Hello ").append(name).append(". You are ")
+		.append(age_str, age_end).append(" years old.\n");
+}
+
+}
+
+void hello(std::string_view name, int age) {
+	// Process the message in the same way it is processed in the Python part
+	// (see python/tasks.py). The greeting is formatted into a (reused)
+	// string and written at once so that lines from concurrently running
+	// consumers do not get interleaved.
+	thread_local std::string line;
+	line.clear();
+	append_greeting(line, name, age);
+
+	// The output sink copies the line into its buffer and writes it later
+	// from its own thread, so the consumer does not wait for the output.
+	if (task_output) {
+		task_output->write(line);
+		return;
+	}
+	std::cout << line << std::flush;
+}
+
+void hello_batch(std::span<const std::tuple<std::string_view, int>> calls) {
+	// The greetings are formatted into a single (reused) string and written
+	// at once, so the whole batch costs a single write (and a single record
+	// in the output sink).
+	thread_local std::string lines;
+	lines.clear();
+	for (const auto& [name, age] : calls) {
+		append_greeting(lines, name, age);
+	}
+	if (task_output) {
+		task_output->write(lines);
+		return;
+	}
+	std::cout << lines << std::flush;
+}
+
+Async slow_hello(std::string_view name, int age, double delay) {
+	// The name refers to the message, which stays valid until the task
+	// finishes (see TaskRegistry::add_async()).
+	co_await sleep_for(std::chrono::duration<double>(delay));
+	hello(name, age);
+}
+
+std::int64_t add(std::int64_t x, std::int64_t y) {
+	// The numbers come from the message, so the sum may not fit (Python
+	// integers do not overflow, but ours do, and signed overflow is undefined
+	// behavior). Such a task fails instead.
+	std::int64_t sum;
+	if (__builtin_add_overflow(x, y, &sum)) {
+		throw std::overflow_error("the sum of " + std::to_string(x) + " and " +
+			std::to_string(y) + " does not fit into a 64b integer");
+	}
+	return sum;
+}
+
+void set_task_output(OutputSink* sink) {
+	task_output = sink;
+}
+
+void register_tasks(TaskRegistry& registry,
+		std::optional<BatchOptions> hello_batch_options) {
+	if (hello_batch_options) {
+		registry.add_batch("tasks.hello", hello_batch, *hello_batch_options);
+	} else {
+		registry.add("tasks.hello", hello);
+	}
+	registry.add_async("tasks.slow_hello", slow_hello);
+	registry.add("tasks.add", add);
+}
@@ -0,0 +1,49 @@
+//
+// Tasks that the worker can execute.
+//
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <tuple>
+
+#include "async.h"
+#include "output_sink.h"
+#include "task_registry.h"
+
+// Prints a greeting. The same task is implemented in the Python part (see
+// python/tasks.py).
+void hello(std::string_view name, int age);
+
+// Prints greetings for a batch of calls of hello() at once (see
+// TaskRegistry::add_batch()).
+void hello_batch(std::span<const std::tuple<std::string_view, int>> calls);
+
+// Prints a greeting after the given number of seconds. The task is
+// asynchronous (see async.h), so in the asynchronous mode of the worker, the
+// waiting does not block other tasks. The same task is implemented in the
+// Python part (see python/tasks.py).
+Async slow_hello(std::string_view name, int age, double delay);
+
+// Returns the sum of the given numbers. Unlike the tasks above, the task has
+// a result, which the worker sends to the client when asked to (see
+// result_publisher.h). The same task is implemented in the Python part (see
+// python/tasks.py). Throws std::overflow_error when the sum does not fit.
+std::int64_t add(std::int64_t x, std::int64_t y);
+
+// Makes the above tasks write their output into the given sink instead of the
+// standard output (std::cout). Pass nullptr to write into the standard output
+// again. Has to be called before any task is executed.
+void set_task_output(OutputSink* sink);
+
+// Registers all the above tasks (under their Celery names) into the given
+// registry. When `hello_batch_options` are given, tasks.hello is executed in
+// batches via hello_batch().
+void register_tasks(TaskRegistry& registry,
+	std::optional<BatchOptions> hello_batch_options = std::nullopt);
+
+#endif
@@ -0,0 +1,241 @@
+//
+// A hierarchical timing wheel for scheduling items (e.g. delayed tasks).
+//
+
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Items scheduled to expire at given ticks (e.g. milliseconds).
+//
+// The wheel consists of `Levels` levels of 256 slots each. A slot of the
+// lowest level holds items expiring at a single tick, a slot of the next level
+// items expiring in a range of 256 ticks, and so on. An item is inserted
+// directly into the slot of the lowest level that covers its expiration
+// relative to the current tick, so insertion is O(1). When the current tick
+// enters the range of a slot of a higher level, the items of the slot are
+// redistributed to the lower levels (they cascade). Every item cascades at
+// most `Levels - 1` times, so expiration is O(1) per item, too.
+//
+// Empty slots are skipped via bitmaps of occupied slots, so advancing the
+// wheel over a long idle period is cheap.
+//
+// With 4 levels, items can be scheduled up to 2^32 ticks ahead (about 49 days
+// with millisecond ticks). Items scheduled further ahead are kept aside and
+// re-inserted when the wheel gets to them.
+//
+// The wheel is not thread-safe.
+template<typename T, std::size_t Levels = 4>
+class TimingWheel {
+public:
+	static constexpr unsigned SlotBits = 8;
+	static constexpr std::size_t SlotCount = std::size_t(1) << SlotBits;
+
+	// Creates an empty wheel whose current tick is `now`.
+	explicit TimingWheel(std::uint64_t now = 0): current(now) {}
+
+	// Returns the number of scheduled items.
+	std::size_t size() const {
+		return item_count;
+	}
+
+	bool empty() const {
+		return item_count == 0;
+	}
+
+	// Schedules the given item to expire at the given tick. Items scheduled
+	// for a tick that has already passed expire in the next call of
+	// advance() (before all other items).
+	void insert(std::uint64_t expiration, T item) {
+		++item_count;
+		if (expiration < current) {
+			overdue.push_back(std::move(item));
+		} else {
+			place(expiration, std::move(item));
+		}
+	}
+
+	// Moves the wheel to the tick `now` and calls `expire(item)` for every
+	// item that expires at or before it (in the order of their expiration;
+	// items expiring at the same tick are in an unspecified order). Items
+	// may be inserted from `expire`.
+	template<typename F>
+	void advance(std::uint64_t now, F expire) {
+		while (!overdue.empty()) {
+			auto items = std::move(overdue);
+			overdue.clear();
+			item_count -= items.size();
+			for (auto& item : items) {
+				expire(std::move(item));
+			}
+		}
+
+		while (current <= now) {
+			auto index = slot_index(current, 0);
+			if (levels[0].is_occupied(index)) {
+				// Take the items out of the slot first: `expire` may insert
+				// items into it.
+				auto items = std::move(levels[0].slots[index]);
+				levels[0].slots[index].clear();
+				levels[0].set_occupied(index, false);
+				item_count -= items.size();
+				for (auto& [expiration, item] : items) {
+					expire(std::move(item));
+				}
+				// Items inserted from `expire` for the current tick.
+				if (levels[0].is_occupied(index)) {
+					continue;
+				}
+			}
+
+			if (next_due <= current) {
+				next_due = next_event_after(current);
+			}
+			move_to(std::min(next_due, now + 1));
+		}
+	}
+
+	// Returns the next tick at which advance() has something to do (an item
+	// may expire or items of a higher level may cascade), or the maximal
+	// tick when the wheel is empty.
+	std::uint64_t next_event() const {
+		if (empty()) {
+			return std::numeric_limits<std::uint64_t>::max();
+		}
+		if (!overdue.empty()) {
+			return current - 1;
+		}
+		if (levels[0].is_occupied(slot_index(current, 0))) {
+			return current;
+		}
+		return next_event_after(current);
+	}
+
+private:
+	struct Level {
+		std::array<std::vector<std::pair<std::uint64_t, T>>, SlotCount> slots;
+		std::array<std::uint64_t, SlotCount / 64> occupied{};
+
+		bool is_occupied(std::size_t index) const {
+			return (occupied[index / 64] >> (index % 64)) & 1;
+		}
+
+		void set_occupied(std::size_t index, bool value) {
+			auto bit = std::uint64_t(1) << (index % 64);
+			occupied[index / 64] = value
+				? occupied[index / 64] | bit
+				: occupied[index / 64] & ~bit;
+		}
+
+		// Returns the first occupied slot with an index greater than
+		// `index`, or SlotCount when there is none.
+		std::size_t next_occupied(std::size_t index) const {
+			for (auto i = index + 1; i < SlotCount; i = (i / 64 + 1) * 64) {
+				auto word = occupied[i / 64] >> (i % 64);
+				if (word != 0) {
+					return i + std::countr_zero(word);
+				}
+			}
+			return SlotCount;
+		}
+	};
+
+	static std::uint64_t low_bits(std::uint64_t tick, std::size_t level) {
+		auto bits = SlotBits * level;
+		return bits >= 64 ? tick : tick & ((std::uint64_t(1) << bits) - 1);
+	}
+
+	static std::size_t slot_index(std::uint64_t tick, std::size_t level) {
+		return (tick >> (SlotBits * level)) & (SlotCount - 1);
+	}
+
+	// Puts the item into the slot of the lowest level whose range (relative
+	// to the current tick) covers the expiration.
+	void place(std::uint64_t expiration, T&& item) {
+		for (std::size_t level = 0; level < Levels; ++level) {
+			auto shift = SlotBits * (level + 1);
+			if (shift >= 64 || (expiration >> shift) == (current >> shift)) {
+				auto index = slot_index(expiration, level);
+				levels[level].slots[index].emplace_back(expiration, std::move(item));
+				levels[level].set_occupied(index, true);
+				next_due = std::min(next_due, expiration - low_bits(expiration, level));
+				return;
+			}
+		}
+		overflow.emplace_back(expiration, std::move(item));
+		next_due = std::min(next_due, current - low_bits(current, Levels) +
+			(std::uint64_t(1) << (SlotBits * Levels)));
+	}
+
+	// Moves the current tick forward. When it enters a slot of a higher level,
+	// the items of the slot cascade to the lower levels (from the highest
+	// level so that they can cascade further). Doing this right away keeps the
+	// slots of the current tick at the higher levels empty.
+	void move_to(std::uint64_t tick) {
+		current = tick;
+		if (low_bits(current, Levels) == 0 && !overflow.empty()) {
+			auto items = std::move(overflow);
+			overflow.clear();
+			for (auto& [expiration, item] : items) {
+				place(expiration, std::move(item));
+			}
+		}
+		for (auto level = Levels - 1; level > 0; --level) {
+			if (low_bits(current, level) == 0) {
+				cascade(level, slot_index(current, level));
+			}
+		}
+	}
+
+	void cascade(std::size_t level, std::size_t index) {
+		if (!levels[level].is_occupied(index)) {
+			return;
+		}
+		auto items = std::move(levels[level].slots[index]);
+		levels[level].slots[index].clear();
+		levels[level].set_occupied(index, false);
+		for (auto& [expiration, item] : items) {
+			place(expiration, std::move(item));
+		}
+	}
+
+	// Returns the first tick after `tick` at which a slot of any level is
+	// occupied (or the overflow has to be re-inserted).
+	std::uint64_t next_event_after(std::uint64_t tick) const {
+		auto next = std::numeric_limits<std::uint64_t>::max();
+		for (std::size_t level = 0; level < Levels; ++level) {
+			auto index = levels[level].next_occupied(slot_index(tick, level));
+			if (index < SlotCount) {
+				auto shift = SlotBits * level;
+				auto block_start = tick - low_bits(tick, level + 1);
+				next = std::min(next, block_start + (std::uint64_t(index) << shift));
+			}
+		}
+		if (!overflow.empty()) {
+			next = std::min(next, tick - low_bits(tick, Levels) +
+				(std::uint64_t(1) << (SlotBits * Levels)));
+		}
+		return next;
+	}
+
+	std::uint64_t current;
+	std::size_t item_count = 0;
+
+	// A lower bound of the next tick at which advance() has something to do
+	// (see next_event_after()), so that advancing the wheel tick by tick does
+	// not have to look for the next occupied slot every time.
+	std::uint64_t next_due = std::numeric_limits<std::uint64_t>::max();
+	std::array<Level, Levels> levels;
+	std::vector<std::pair<std::uint64_t, T>> overflow;
+	std::vector<T> overdue;
+};
+
+#endif
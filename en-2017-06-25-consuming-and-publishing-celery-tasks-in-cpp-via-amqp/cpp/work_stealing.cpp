@@ -0,0 +1,158 @@
+//
+// Sharing of delivered tasks between consumers (work stealing).
+//
+
+#include <utility>
+
+#include "work_stealing.h"
+
+WorkStealing::WorkStealing(std::size_t consumers):
+	count(consumers),
+	deques(std::make_unique<Deque[]>(consumers)) {}
+
+WorkStealing::~WorkStealing() = default;
+
+std::vector<Completion> WorkStealing::leave(std::size_t consumer) {
+	auto& deque = deques[consumer];
+	{
+		std::lock_guard<std::mutex> lock(idle_mutex);
+		deque.stopped = true;
+		if (deque.asleep) {
+			deque.asleep = false;
+			sleeping.fetch_sub(1, std::memory_order_seq_cst);
+		}
+		deque.work_available.notify_one();
+	}
+
+	std::unique_lock<std::mutex> lock(deque.mutex);
+	deque.tasks.clear();
+	deque.size.store(0, std::memory_order_relaxed);
+
+	// Running tasks cannot be interrupted, so all we can do is wait. The
+	// executors never wait for us.
+	deque.executed.wait(lock, [&]() { return deque.executing == 0; });
+	return std::move(deque.completions);
+}
+
+void WorkStealing::push(std::size_t consumer, QueuedTask task) {
+	auto& deque = deques[consumer];
+	{
+		std::lock_guard<std::mutex> lock(deque.mutex);
+		deque.tasks.push_back(std::move(task));
+		deque.size.store(deque.tasks.size(), std::memory_order_seq_cst);
+	}
+	wake_executor(consumer);
+}
+
+void WorkStealing::take_completions(std::size_t consumer,
+		std::vector<Completion>& completions) {
+	auto& deque = deques[consumer];
+	std::lock_guard<std::mutex> lock(deque.mutex);
+	for (auto& completion : deque.completions) {
+		completions.push_back(std::move(completion));
+	}
+	deque.completions.clear();
+}
+
+bool WorkStealing::in_flight(std::size_t consumer) {
+	auto& deque = deques[consumer];
+	std::lock_guard<std::mutex> lock(deque.mutex);
+	return !deque.tasks.empty() || deque.executing > 0 ||
+		!deque.completions.empty();
+}
+
+std::optional<std::size_t> WorkStealing::next(std::size_t executor, QueuedTask& task) {
+	auto& own = deques[executor];
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			if (own.stopped) {
+				return std::nullopt;
+			}
+		}
+
+		// Our consumer's tasks first, then the others (starting with the
+		// next one so that the executors do not all go after the same
+		// deque).
+		for (std::size_t i = 0; i < count; ++i) {
+			auto owner = (executor + i) % count;
+			if (take(deques[owner], task)) {
+				return owner;
+			}
+		}
+
+		// There is nothing to do, so wait. We announce our waiting before we
+		// check the deques once more, and push() checks for waiting executors
+		// after it has added a task (both with sequentially consistent
+		// operations), so either we see the task, or push() sees us waiting.
+		std::unique_lock<std::mutex> lock(idle_mutex);
+		if (own.stopped) {
+			return std::nullopt;
+		}
+		own.asleep = true;
+		sleeping.fetch_add(1, std::memory_order_seq_cst);
+		auto idle = true;
+		for (std::size_t i = 0; idle && i < count; ++i) {
+			idle = deques[i].size.load(std::memory_order_seq_cst) == 0;
+		}
+		if (!idle) {
+			own.asleep = false;
+			sleeping.fetch_sub(1, std::memory_order_seq_cst);
+			continue;
+		}
+		own.work_available.wait(lock, [&]() { return !own.asleep; });
+	}
+}
+
+void WorkStealing::complete(std::size_t owner, Completion completion) {
+	// The consumer picks the completion up the next time it stops waiting
+	// for a message (see in_flight()).
+	auto& deque = deques[owner];
+	std::lock_guard<std::mutex> lock(deque.mutex);
+	deque.completions.push_back(std::move(completion));
+	--deque.executing;
+	deque.executed.notify_all();
+}
+
+bool WorkStealing::take(Deque& deque, QueuedTask& task) {
+	if (deque.size.load(std::memory_order_seq_cst) == 0) {
+		return false;
+	}
+
+	std::size_t remaining;
+	{
+		std::lock_guard<std::mutex> lock(deque.mutex);
+		if (deque.tasks.empty()) {
+			return false;
+		}
+		task = std::move(deque.tasks.front());
+		deque.tasks.pop_front();
+		remaining = deque.tasks.size();
+		deque.size.store(remaining, std::memory_order_seq_cst);
+		++deque.executing;
+	}
+
+	// We are going to execute the task, so let another executor take care of
+	// the remaining ones.
+	if (remaining > 0) {
+		wake_executor(static_cast<std::size_t>(&deque - deques.get()));
+	}
+	return true;
+}
+
+void WorkStealing::wake_executor(std::size_t preferred) {
+	if (sleeping.load(std::memory_order_seq_cst) == 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(idle_mutex);
+	for (std::size_t i = 0; i < count; ++i) {
+		auto& deque = deques[(preferred + i) % count];
+		if (deque.asleep) {
+			deque.asleep = false;
+			sleeping.fetch_sub(1, std::memory_order_seq_cst);
+			deque.work_available.notify_one();
+			return;
+		}
+	}
+}
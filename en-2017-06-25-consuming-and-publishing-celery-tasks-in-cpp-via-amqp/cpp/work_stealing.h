@@ -0,0 +1,157 @@
+//
+// Sharing of delivered tasks between consumers (work stealing).
+//
+
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "broker.h"
+#include "task_registry.h"
+
+// Serializers (formats of message bodies) supported by the worker.
+enum class Serializer {
+	Json,
+	Msgpack,
+	Unknown
+};
+
+// A delivered task that waits for its execution.
+struct QueuedTask {
+	const Task* task = nullptr;
+	Serializer serializer = Serializer::Json;
+	Message message;
+	DeliveryInfo info;
+
+	// Since when the task has been ready to be executed (when its message was
+	// delivered or when it became due).
+	std::chrono::steady_clock::time_point ready;
+
+	// The index of the queue from which the message was delivered (see
+	// ConsumerOptions::queues).
+	std::size_t source = 0;
+};
+
+// A finished task whose message has to be acknowledged.
+struct Completion {
+	DeliveryInfo info;
+
+	// An exception thrown from the task (if it failed).
+	std::exception_ptr error;
+
+	// The failed task and its message, so that the consumer can retry it
+	// (see consumer.cpp). Empty when the task has not failed.
+	const Task* task = nullptr;
+	Message message;
+	std::size_t source = 0;
+};
+
+// Deques of delivered tasks of consumers running in parallel, from which
+// executor threads take tasks.
+//
+// With a prefetch count above 1, a consumer receives several messages at
+// once. When a consumer executes its tasks by itself and the first of them
+// takes long, the others wait behind it, even when the other consumers have
+// nothing to do. Moreover, messages delivered in the meantime wait in the
+// channel, where nobody else can get to them. Therefore, the thread of every
+// consumer only receives messages and moves them into its deque right away.
+// Every consumer has an executor thread that executes tasks from the deque of
+// the consumer, and when the deque is empty, it takes (steals) the oldest task
+// from the deque of another consumer.
+//
+// Channels are not thread-safe, so the message of a task has to be
+// acknowledged by the consumer that received it. When an executor finishes a
+// task, it hands the completion over to the consumer (see complete()). A
+// consumer waiting for a message cannot wait for anything else (see Channel),
+// so while it has tasks in flight (see in_flight()), it waits for a message
+// only for a short time and then picks up the completions. Interrupting the
+// waiting after every completion would cost a message (see amqp_broker.cpp),
+// which does not scale with the number of completed tasks.
+//
+// The deques are protected by mutexes. A lock-free deque would be faster, but
+// a deque is locked once or twice per message, which is negligible compared
+// with receiving and acknowledging the message.
+//
+// All methods are thread-safe. Every consumer and executor may only call them
+// with its own index.
+class WorkStealing {
+public:
+	// Creates deques for the given number of consumers.
+	explicit WorkStealing(std::size_t consumers);
+	~WorkStealing();
+
+	WorkStealing(const WorkStealing&) = delete;
+	WorkStealing& operator=(const WorkStealing&) = delete;
+
+	// Leaves: drops the tasks that are still in the deque of the consumer
+	// (their messages are not acknowledged, so the server delivers them
+	// again), stops its executor (see next()), waits until the tasks of the
+	// consumer that are being executed finish, and returns their
+	// completions. May be called more than once.
+	std::vector<Completion> leave(std::size_t consumer);
+
+	// Puts a task into the deque of the consumer.
+	void push(std::size_t consumer, QueuedTask task);
+
+	// Moves completions of the consumer's tasks into `completions`.
+	void take_completions(std::size_t consumer, std::vector<Completion>& completions);
+
+	// Does the consumer have tasks that are waiting or being executed, or
+	// completions that it has not taken yet?
+	bool in_flight(std::size_t consumer);
+
+	// Takes the next task to be executed by the given executor: the oldest
+	// task of its consumer, or the oldest task of another consumer. Waits
+	// when there is none. Returns the index of the consumer whose task it is
+	// (the owner), or nothing when the executor has been stopped. The
+	// completion of the task has to be handed over via complete().
+	std::optional<std::size_t> next(std::size_t executor, QueuedTask& task);
+
+	// Hands the completion of a task over to its owner.
+	void complete(std::size_t owner, Completion completion);
+
+private:
+	struct alignas(64) Deque {
+		std::mutex mutex;
+		std::deque<QueuedTask> tasks;
+
+		// The number of tasks, readable without locking the mutex.
+		std::atomic<std::size_t> size{0};
+
+		// Completions of the tasks of the consumer, and the number of its
+		// tasks that are being executed.
+		std::vector<Completion> completions;
+		std::size_t executing = 0;
+		std::condition_variable executed;
+
+		// The state of the executor (protected by `idle_mutex`).
+		bool asleep = false;
+		bool stopped = false;
+		std::condition_variable work_available;
+	};
+
+	// Takes the oldest task from the given deque.
+	bool take(Deque& deque, QueuedTask& task);
+
+	// Wakes up an executor waiting for a task, preferably the given one.
+	void wake_executor(std::size_t preferred);
+
+	std::size_t count;
+	std::unique_ptr<Deque[]> deques;
+
+	// Executors that wait for a task.
+	std::mutex idle_mutex;
+	std::atomic<std::size_t> sleeping{0};
+};
+
+#endif
@@ -1,69 +1,329 @@
 //
-// Starts a C++ worker that can execute the hello() Celery task.
+// Starts a C++ worker that can execute Celery tasks from tasks.h.
+//
+// The consumers are implemented in consumer.cpp. Run the worker with --help
+// to see its options; README.md describes them.
 //
 // Uses SimpleAmqpClient (https://github.com/alanxz/SimpleAmqpClient) to
-// connect to RabbitMQ and nlohmann/json (https://github.com/nlohmann/json) to
-// parse JSON.
+// connect to RabbitMQ (see amqp_broker.cpp).
 //
 
+#include <chrono>
 #include <csignal>
+#include <cstdint>
+#include <exception>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
-// Access to https://github.com/alanxz/SimpleAmqpClient
-#include <SimpleAmqpClient/SimpleAmqpClient.h>
-
-// Access to https://github.com/nlohmann/json
-#include <json.hpp>
+#include <unistd.h>
 
-// A convenience type alias.
-using json = nlohmann::json;
+#include "ack_coalescer.h"
+#include "amqp_broker.h"
+#include "consumer.h"
+#include "metrics.h"
+#include "output_sink.h"
+#include "prefork.h"
+#include "result_publisher.h"
+#include "shutdown.h"
+#include "signals.h"
+#include "task_registry.h"
+#include "tasks.h"
+#include "work_stealing.h"
 
 namespace {
 
-// A flag that allows us to gracefully stop the worker by sending a signal to
-// it, just like with the Celery worker in Python.
-// http://en.cppreference.com/w/cpp/utility/program/sig_atomic_t
-volatile std::sig_atomic_t keep_running = 1;
+// Options of the worker, parsed from command-line arguments.
+struct Options {
+	// The number of consumers (threads) to run in parallel.
+	unsigned concurrency = 1;
 
-// A signal handler. When it receives either SIGINT (sent when you press
-// Ctrl-C) or SIGTERM, it signalizes to the worker that it should stop running.
-//
-// As a side note, `extern "C"` is needed because signal handlers are expected
-// to have C linkage and, in general, only use the features from the common
-// subset of C and C++. It is implementation-defined if a function with C++
-// linkage can be used as a signal handler.
-// http://en.cppreference.com/w/cpp/utility/program/signal#Notes
-extern "C" void signal_handler(int signal) {
-	if (signal == SIGINT || signal == SIGTERM) {
-		keep_running = 0;
+	// Options of every consumer.
+	ConsumerOptions consumer;
+
+	// Let idle consumers take tasks that have been delivered to busy ones.
+	bool steal = false;
+
+	// Publish results of tasks into reply queues of clients that want them
+	// (see result_publisher.h), with up to `result_window` results waiting
+	// for their confirms at once. The publisher is shared by all consumers.
+	bool results = false;
+	unsigned result_window = 4;
+
+	// Execute tasks.hello in batches (see hello_batch()) with the given
+	// options. Nothing means one call per message.
+	std::optional<BatchOptions> hello_batch;
+
+	// The retry policy of all tasks. Nothing means that the policies from
+	// register_tasks() are kept (by default, failed tasks are not retried).
+	std::optional<RetryPolicy> retry;
+
+	// Names of tasks whose results are cached (see TaskRegistry::memoize()),
+	// and options of their caches.
+	std::vector<std::string> memoize;
+	MemoOptions memo;
+
+	// A file that is periodically rewritten with metrics of the worker (in
+	// the Prometheus format). Empty means no file.
+	std::string metrics_file;
+
+	// How often (in seconds) the metrics file is rewritten.
+	unsigned metrics_interval = 10;
+
+	// Options of the sink into which tasks write their output.
+	OutputSinkOptions output;
+
+	// The number of worker processes, each of them running `concurrency`
+	// consumers. Zero means that the consumers run in this process.
+	unsigned processes = 0;
+
+	// Pin every worker process to a single CPU.
+	bool pin_cpus = false;
+
+	// Print the usage and exit.
+	bool help = false;
+};
+
+// Parses a positive integer from the given command-line argument. Throws
+// std::invalid_argument or std::out_of_range when the argument is not a
+// number in [1, max].
+unsigned long parse_positive(const std::string& arg, unsigned long max) {
+	std::size_t end = 0;
+	auto value = std::stoul(arg, &end);
+	if (end != arg.size() || value == 0 || value > max) {
+		throw std::out_of_range(arg);
 	}
+	return value;
 }
 
+// Parses a queue from the given command-line argument (NAME or NAME:WEIGHT).
+// Throws std::invalid_argument or std::out_of_range when the argument is
+// invalid.
+QueueOptions parse_queue(const std::string& arg) {
+	QueueOptions queue;
+	auto colon = arg.rfind(':');
+	queue.name = arg.substr(0, colon);
+	if (colon != std::string::npos) {
+		queue.weight = parse_positive(arg.substr(colon + 1), 1000);
+	}
+	if (queue.name.empty()) {
+		throw std::invalid_argument(arg);
+	}
+	return queue;
 }
 
-int main(int argc, char** argv) {
-	// The worker does not accept any arguments.
-	if (argc != 1) {
-		std::cout << "usage: " << argv[0] << '\n';
-		return 1;
+// Prints the usage of the worker.
+void print_usage(const char* program) {
+	std::cout << "usage: " << program << " [--help]\n"
+		"       [--concurrency N] [--prefetch M|auto] [--max-prefetch M]\n"
+		"       [--ack-batch K] [--ack-interval T] [--async | --steal]\n"
+		"       [--queue NAME[:WEIGHT]]...\n"
+		"       [--batch N] [--batch-delay T]\n"
+		"       [--max-retries N] [--retry-backoff T]\n"
+		"       [--dead-letter-queue NAME]\n"
+		"       [--results] [--result-window W]\n"
+		"       [--memoize TASK]... [--memo-capacity N] [--memo-ttl T]\n"
+		"       [--processes N] [--pin-cpus]\n"
+		"       [--metrics-file PATH] [--metrics-interval S]\n"
+		"       [--output-buffer BYTES]\n"
+		"       [--output-overflow block|drop|count]\n";
+}
+
+// Parses the given command-line arguments into `options`. Returns false when
+// the arguments are invalid.
+bool parse_options(int argc, char** argv, Options& options) {
+	// The first --queue replaces the default queue.
+	auto default_queues = true;
+	try {
+		for (int i = 1; i < argc; ++i) {
+			auto arg = std::string(argv[i]);
+			if (arg == "--async") {
+				options.consumer.async = true;
+				continue;
+			} else if (arg == "--steal") {
+				options.steal = true;
+				continue;
+			} else if (arg == "--pin-cpus") {
+				options.pin_cpus = true;
+				continue;
+			} else if (arg == "--results") {
+				options.results = true;
+				continue;
+			} else if (arg == "--help") {
+				options.help = true;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				return false;
+			}
+			auto value = std::string(argv[++i]);
+			if (arg == "--concurrency") {
+				options.concurrency = parse_positive(value, 1024);
+			} else if (arg == "--processes") {
+				options.processes = parse_positive(value, 1024);
+			} else if (arg == "--prefetch") {
+				// With "auto", the consumers start with a single message
+				// and tune the count from measured durations of tasks.
+				options.consumer.adaptive_prefetch = value == "auto";
+				options.consumer.prefetch = options.consumer.adaptive_prefetch
+					? 1 : parse_positive(value, UINT16_MAX);
+			} else if (arg == "--batch") {
+				if (!options.hello_batch) {
+					options.hello_batch.emplace();
+				}
+				options.hello_batch->max_size =
+					parse_positive(value, UINT16_MAX);
+			} else if (arg == "--batch-delay") {
+				if (!options.hello_batch) {
+					options.hello_batch.emplace();
+				}
+				options.hello_batch->max_delay = std::chrono::milliseconds(
+					parse_positive(value, 60 * 1000));
+			} else if (arg == "--max-retries") {
+				if (!options.retry) {
+					options.retry.emplace();
+				}
+				options.retry->max_retries = parse_positive(value, 1000);
+			} else if (arg == "--retry-backoff") {
+				if (!options.retry) {
+					options.retry.emplace();
+				}
+				options.retry->backoff = std::chrono::milliseconds(
+					parse_positive(value, 60 * 60 * 1000));
+			} else if (arg == "--queue") {
+				if (default_queues) {
+					options.consumer.queues.clear();
+					default_queues = false;
+				}
+				options.consumer.queues.push_back(parse_queue(value));
+			} else if (arg == "--dead-letter-queue") {
+				options.consumer.dead_letter_queue = value;
+			} else if (arg == "--memoize") {
+				options.memoize.push_back(value);
+			} else if (arg == "--memo-capacity") {
+				options.memo.capacity = parse_positive(value, 1 << 24);
+			} else if (arg == "--memo-ttl") {
+				options.memo.ttl = std::chrono::milliseconds(
+					parse_positive(value, 24 * 60 * 60 * 1000));
+			} else if (arg == "--result-window") {
+				options.result_window = parse_positive(value, 64);
+			} else if (arg == "--max-prefetch") {
+				options.consumer.max_prefetch =
+					parse_positive(value, UINT16_MAX);
+			} else if (arg == "--ack-batch") {
+				options.consumer.ack_batch = parse_positive(value, UINT16_MAX);
+			} else if (arg == "--ack-interval") {
+				options.consumer.ack_interval =
+					parse_positive(value, 60 * 1000);
+			} else if (arg == "--metrics-file") {
+				options.metrics_file = value;
+			} else if (arg == "--metrics-interval") {
+				options.metrics_interval = parse_positive(value, 24 * 60 * 60);
+			} else if (arg == "--output-buffer") {
+				options.output.capacity = parse_positive(value, 1 << 30);
+			} else if (arg == "--output-overflow") {
+				if (value == "block") {
+					options.output.overflow = OverflowPolicy::Block;
+				} else if (value == "drop") {
+					options.output.overflow = OverflowPolicy::Drop;
+				} else if (value == "count") {
+					options.output.overflow = OverflowPolicy::Count;
+				} else {
+					return false;
+				}
+			} else {
+				return false;
+			}
+		}
+	} catch (const std::exception&) {
+		return false;
 	}
 
+	// An asynchronous consumer does not wait behind a slow task, so there is
+	// nothing to steal. Only a consumer that executes its tasks one by one
+	// lets queues take turns (see fair_queue.h), collects batches, and tunes
+	// its prefetch count (the latter only with a single queue). CPUs can be
+	// pinned only to worker processes.
+	auto one_by_one = !options.steal && !options.consumer.async;
+	auto several_queues = options.consumer.queues.size() > 1;
+	return !(options.steal && options.consumer.async) &&
+		!(several_queues && !one_by_one) &&
+		!(options.consumer.adaptive_prefetch &&
+			(!one_by_one || several_queues)) &&
+		!(options.hello_batch && !one_by_one) &&
+		!(options.pin_cpus && options.processes == 0);
+}
+
+// Returns the metrics file of the worker process with the given index. The
+// index is inserted before the extension (e.g. metrics.prom becomes
+// metrics.1.prom), so the processes do not overwrite the files of each other.
+std::string metrics_file_of_process(const std::string& path, unsigned index) {
+	auto name = path.find_last_of('/');
+	auto dot = path.find_last_of('.');
+	if (dot == std::string::npos || dot == 0 ||
+			(name != std::string::npos && dot <= name + 1)) {
+		return path + '.' + std::to_string(index);
+	}
+	return path.substr(0, dot) + '.' + std::to_string(index) + path.substr(dot);
+}
+
+// Handles signals until the worker is stopped.
+//
+// When SIGINT (sent when you press Ctrl-C) or SIGTERM is received, the
+// consumers are asked to stop, just like with the Celery worker in Python.
+// When SIGUSR1 is received, metrics are written to the standard error. When a
+// metrics file is set, the file is also rewritten every `metrics_interval`
+// seconds (and when the worker ends).
+//
+// Signals are received via a self-pipe (see signals.h), so they are handled
+// in this thread without the restrictions of signal handlers.
+void handle_signals(SignalPipe& signals, Shutdown& shutdown,
+		const Options& options, const Metrics& metrics) {
+	auto timeout = options.metrics_file.empty()
+		? -1 : static_cast<int>(options.metrics_interval * 1000);
+	while (!shutdown.requested()) {
+		auto signal = signals.wait(timeout);
+		if (signal == SIGINT || signal == SIGTERM) {
+			shutdown.request();
+		} else if (signal == SIGUSR1) {
+			metrics.write_prometheus(std::cerr);
+		}
+		if (!options.metrics_file.empty()) {
+			metrics.write_prometheus_file(options.metrics_file);
+		}
+	}
+}
+
+// Runs the consumers until the worker is stopped. Returns the exit status.
+int run_worker(const Options& options) {
 	// Setup signal handling. When any of the below signals are sent to the
-	// program, our signal handler gets called.
-	// http://en.cppreference.com/w/cpp/utility/program/signal
-	std::signal(SIGINT, signal_handler);
-	std::signal(SIGTERM, signal_handler);
-
-	// Create a connection to our AMQP server (RabbitMQ).
-	//
-	// Technically, in AMQP, a single connection can contain multiple channels,
-	// where channels that can be thought of as "lightweight connections that
-	// share a single TCP connection"
-	// (https://www.rabbitmq.com/tutorials/amqp-concepts.html).
-	// However, the used AMQP library only allows creation of channels, not
-	// connections.
-	auto channel = AmqpClient::Channel::Create(
+	// program, they are handled by handle_signals() in a separate thread.
+	SignalPipe signals({SIGINT, SIGTERM, SIGUSR1});
+	Shutdown shutdown;
+
+	// Register the tasks that the worker can execute. This is done before
+	// any thread is started, so an invalid task name can end the worker
+	// right away.
+	TaskRegistry registry;
+	register_tasks(registry, options.hello_batch);
+	if (options.retry) {
+		registry.set_retry_policy(*options.retry);
+	}
+	for (const auto& name : options.memoize) {
+		try {
+			registry.memoize(name, options.memo);
+		} catch (const std::invalid_argument& e) {
+			std::cerr << "--memoize: " << e.what() << '\n';
+			return 1;
+		}
+	}
+
+	// Our AMQP server (RabbitMQ).
+	AmqpBroker broker(
 		/*host*/"localhost",
 		/*port*/5672,
 		/*username*/"guest",
@@ -71,79 +331,118 @@ int main(int argc, char** argv) {
 		/*vhost*/"/"
 	);
 
-	// Start consuming messages from the 'celery' queue.
-	//
-	// This method has to be called before we start consuming messages from the
-	// queue. We pass an empty 'consumer_tag', which causes the method to
-	// generate a consumer tag for us. The returned tag identifies the consumer
-	// and is used later when receiving messages.
-	//
-	// Setting 'no_ack' to false disables automatic acknowledgements. Instead,
-	// we acknowledge them manually after we have successfully processed the
-	// task. Otherwise, a message would be acknowledged right after it was
-	// received, even if its execution later fails.
-	//
-	// Setting 'exclusive' to false allows other workers to consume messages
-	// from the queue (we may not be the only worker running).
-	//
-	// Finally, 'message_prefetch_count' is the maximal number of
-	// unacknowledged messages that the server will deliver to us. We want to
-	// always receive just a single message (i.e. no buffering).
-	auto consumer_tag = channel->BasicConsume(
-		/*queue*/"celery",
-		/*consumer_tag*/"",
-		/*no_local*/true,
-		/*no_ack*/false,
-		/*exclusive*/false,
-		/*message_prefetch_count*/1
+	Metrics metrics;
+	std::thread signal_handler(
+		handle_signals,
+		std::ref(signals),
+		std::ref(shutdown),
+		std::cref(options),
+		std::cref(metrics)
 	);
-	try {
-		// Keep trying to consume messages until the user signalizes we should
-		// stop (either via Ctrl-C or by sending the SIGTERM signal to the
-		// process).
-		while (keep_running) {
-			// Try the receive a message.
-			//
-			// To enable stopping of the worker, we use a 1-second timeout.
-			// When no message is delivered within the timeout, we check
-			// whether we should keep running, and if so, we repeat the
-			// receiving.
-			AmqpClient::Envelope::ptr_t envelope;
-			auto message_delivered = channel->BasicConsumeMessage(
-				consumer_tag,
-				envelope,
-				/*timeout*/1000/*ms*/
-			);
-			if (!message_delivered) {
-				continue;
+
+	// Tasks write their output into a buffer, from which it is written into
+	// the standard output by a separate thread (see output_sink.h).
+	OutputSink output(STDOUT_FILENO, options.output);
+	set_task_output(&output);
+
+	// With --steal, the consumers share their delivered tasks. With a
+	// prefetch count of 1, there is nothing to share: every consumer has at
+	// most a single message.
+	std::unique_ptr<WorkStealing> stealing;
+	if (options.steal) {
+		stealing = std::make_unique<WorkStealing>(options.concurrency);
+	}
+
+	// With --results, results of tasks are published by separate threads
+	// (see ResultPublisher). It outlives the consumers, so its destructor
+	// publishes the results that they have queued.
+	std::optional<ResultPublisher> results;
+	if (options.results) {
+		results.emplace(broker, options.result_window);
+	}
+
+	// Run the consumers. When a consumer fails, we store the exception, stop
+	// the remaining consumers, and re-throw the exception after all of them
+	// have finished. This mirrors the behavior of the single-threaded worker,
+	// where an exception ends the whole program.
+	std::vector<std::exception_ptr> errors(options.concurrency);
+	std::vector<std::thread> consumers;
+	for (unsigned i = 0; i < options.concurrency; ++i) {
+		auto consumer_metrics = &metrics.add_consumer();
+		consumers.emplace_back([&, consumer_metrics, i]() {
+			try {
+				consume(broker, options.consumer, registry, *consumer_metrics,
+					shutdown, results ? &*results : nullptr, stealing.get(), i);
+			} catch (...) {
+				errors[i] = std::current_exception();
+				shutdown.request();
 			}
+		});
+	}
+	for (auto& consumer : consumers) {
+		consumer.join();
+	}
+
+	// All consumers have ended (e.g. after SIGTERM), so no more output will be
+	// written. Write out everything that is still buffered.
+	set_task_output(nullptr);
+	output.flush();
+	if (auto dropped = output.dropped()) {
+		std::cerr << "Dropped " << dropped << " output records (the output"
+			" buffer was full).\n";
+	}
 
-			// Parse task arguments from the body of the message.
-			//
-			// Celery by default encodes messages via JSON. For a description
-			// of the message format, see hello.cpp.
-			auto message = envelope->Message();
-			auto body = json::parse(message->Body());
-			auto name = body[0][0].get<std::string>();
-			auto age = body[0][1].get<int>();
-
-			// Process the message in the same way it is processed in the
-			// Python part (see python/tasks.py).
-			std::cout << "Hello " << name << ". You are " << age << " years old.\n";
-
-			// Acknowledge the message (we have successfully finished its
-			// execution).
-			channel->BasicAck(envelope);
+	// Stop handling signals.
+	shutdown.request();
+	signals.wake();
+	signal_handler.join();
+	if (!options.metrics_file.empty()) {
+		metrics.write_prometheus_file(options.metrics_file);
+	}
+
+	// Report how many frames the coalescing of acknowledgements saved.
+	auto acked_messages = AckCoalescer::acked_messages();
+	auto ack_frames = AckCoalescer::ack_frames();
+	std::cerr << "Acknowledged " << acked_messages << " messages in "
+		<< ack_frames << " frames (" << acked_messages - ack_frames
+		<< " frames saved).\n";
+	for (auto& error : errors) {
+		if (error) {
+			std::rethrow_exception(error);
 		}
-	} catch (...) {
-		// Poor man's finally block. Cancel consuming from the queue (see the
-		// note below this try-catch block) and re-throw the exception.
-		channel->BasicCancel(consumer_tag);
-		throw;
 	}
-	// When the worker ends, we have to cancel consuming from the queue, which
-	// we started when we called channel->BasicConsume().
-	channel->BasicCancel(consumer_tag);
 
 	return 0;
 }
+
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	if (!parse_options(argc, argv, options)) {
+		print_usage(argv[0]);
+		return 1;
+	} else if (options.help) {
+		print_usage(argv[0]);
+		return 0;
+	}
+
+	if (options.processes == 0) {
+		return run_worker(options);
+	}
+
+	// Every worker process creates its own connection, threads, and signal
+	// handling in run_worker(), so nothing of that may exist before the
+	// processes are forked.
+	PreforkOptions prefork;
+	prefork.processes = options.processes;
+	prefork.pin_cpus = options.pin_cpus;
+	return run_prefork(prefork, [&](unsigned index) {
+		auto process_options = options;
+		if (!process_options.metrics_file.empty()) {
+			process_options.metrics_file = metrics_file_of_process(
+				options.metrics_file, index);
+		}
+		return run_worker(process_options);
+	});
+}